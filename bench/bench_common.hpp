@@ -0,0 +1,37 @@
+#pragma once
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include <backend_cpu.hpp>
+
+/*
+ * Small helpers shared by the native benchmarks.
+ */
+
+// Median wall time in seconds of fn() over reps runs, after one warmup run.
+template <typename F>
+double time_median(F &&fn, int reps = 5)
+{
+    fn();
+    std::vector<double> times;
+    for (int i = 0; i < reps; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        auto end = std::chrono::steady_clock::now();
+        times.push_back(std::chrono::duration<double>(end - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+inline std::vector<float> random_data(size_t n, unsigned seed = 0, float lo = -1.0f, float hi = 1.0f)
+{
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<float> dist(lo, hi);
+    std::vector<float> data(n);
+    for (auto &x : data)
+        x = dist(gen);
+    return data;
+}
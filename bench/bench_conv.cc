@@ -0,0 +1,92 @@
+#include <cstdio>
+#include <vector>
+#include <bench_common.hpp>
+
+/*
+ * GFLOP/s of conv2d forward, input gradient and weight gradient on typical CNN layers, in both
+ * layouts, against a naive direct NCHW loop nest for the forward pass.
+ */
+
+struct Layer
+{
+    const char *name;
+    size_t N, C, H, W, K, KH, KW, stride, pad, groups;
+};
+
+static void naive_conv2d(const Layer &l, size_t OH, size_t OW, const float *x, const float *w, float *out)
+{
+    const size_t Cg = l.C / l.groups, Kg = l.K / l.groups;
+    for (size_t n = 0; n < l.N; n++)
+        for (size_t k = 0; k < l.K; k++)
+            for (size_t oh = 0; oh < OH; oh++)
+                for (size_t ow = 0; ow < OW; ow++)
+                {
+                    float acc = 0.0f;
+                    for (size_t c = 0; c < Cg; c++)
+                        for (size_t kh = 0; kh < l.KH; kh++)
+                            for (size_t kw = 0; kw < l.KW; kw++)
+                            {
+                                const long ih = long(oh * l.stride + kh) - long(l.pad);
+                                const long iw = long(ow * l.stride + kw) - long(l.pad);
+                                if (ih < 0 || iw < 0 || ih >= long(l.H) || iw >= long(l.W))
+                                    continue;
+                                acc += x[((n * l.C + k / Kg * Cg + c) * l.H + ih) * l.W + iw] *
+                                       w[((k * Cg + c) * l.KH + kh) * l.KW + kw];
+                            }
+                    out[((n * l.K + k) * OH + oh) * OW + ow] = acc;
+                }
+}
+
+int main()
+{
+    const Layer layers[] = {
+        {"stem 7x7/2", 1, 3, 224, 224, 64, 7, 7, 2, 3, 1},
+        {"3x3 64", 1, 64, 56, 56, 64, 3, 3, 1, 1, 1},
+        {"3x3 256 /2", 1, 256, 28, 28, 256, 3, 3, 2, 1, 1},
+        {"1x1 256->64", 1, 256, 56, 56, 64, 1, 1, 1, 0, 1},
+        {"3x3 64 b8", 8, 64, 56, 56, 64, 3, 3, 1, 1, 1},
+        {"dw 3x3 128", 1, 128, 56, 56, 128, 3, 3, 1, 1, 128},
+    };
+
+    std::printf("%d threads\n", static_cast<int>(get_num_threads()));
+    std::printf("%14s %8s %8s %8s %8s %8s %8s %8s   (GFLOP/s)\n", "layer", "naive", "fwd", "bwd_x", "bwd_w", "nhwc",
+                "bwd_x", "bwd_w");
+    for (const auto &l : layers)
+    {
+        const size_t OH = (l.H + 2 * l.pad - l.KH) / l.stride + 1, OW = (l.W + 2 * l.pad - l.KW) / l.stride + 1;
+        const size_t Cg = l.C / l.groups;
+        const double flops = 2.0 * l.N * l.K * OH * OW * Cg * l.KH * l.KW;
+        const int reps = flops > 2e9 ? 3 : 5;
+
+        const auto x = random_data(l.N * l.C * l.H * l.W, 1);
+        const auto w = random_data(l.K * Cg * l.KH * l.KW, 2);
+        std::vector<float> out(l.N * l.K * OH * OW);
+        double t_naive = time_median([&]
+                                     { naive_conv2d(l, OH, OW, x.data(), w.data(), out.data()); }, 1);
+        std::printf("%14s %8.2f", l.name, flops / t_naive * 1e-9);
+
+        const NDArray<float> wa(w, {l.K, Cg, l.KH, l.KW});
+        for (bool channels_last : {false, true})
+        {
+            const DimVec x_shape = channels_last ? DimVec{l.N, l.H, l.W, l.C} : DimVec{l.N, l.C, l.H, l.W};
+            const DimVec out_shape = channels_last ? DimVec{l.N, OH, OW, l.K} : DimVec{l.N, l.K, OH, OW};
+            const NDArray<float> xa(x, x_shape);
+            const NDArray<float> grad(random_data(out.size(), 3), out_shape);
+            Conv2dParams p;
+            p.stride_h = p.stride_w = l.stride;
+            p.pad_h = p.pad_w = l.pad;
+            p.groups = l.groups;
+            p.channels_last = channels_last;
+
+            double t_fwd = time_median([&]
+                                       { conv2d(xa, wa, nullptr, p); }, reps);
+            double t_bx = time_median([&]
+                                      { conv2d_backward_input(grad, wa, x_shape, p); }, reps);
+            double t_bw = time_median([&]
+                                      { conv2d_backward_weight(grad, xa, wa.get_shape(), p); }, reps);
+            std::printf(" %8.2f %8.2f %8.2f", flops / t_fwd * 1e-9, flops / t_bx * 1e-9, flops / t_bw * 1e-9);
+        }
+        std::printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <cstdio>
+#include <vector>
+#include <bench_common.hpp>
+
+/*
+ * GFLOP/s of the packed sgemm against the previous naive i-k-j kernel, for square matrices and
+ * each micro-kernel the host supports. Then matmul on transposed operands, read in place against
+ * compacting them first, and activations @ shared weights, folded into one GEMM against one GEMM per
+ * batch.
+ */
+
+static void naive_matmul(const float *a, const float *b, float *out, size_t M, size_t K, size_t P)
+{
+    for (size_t i = 0; i < M; i++)
+        for (size_t k = 0; k < K; k++)
+        {
+            float a_val = a[i * K + k];
+            for (size_t j = 0; j < P; j++)
+                out[i * P + j] += a_val * b[k * P + j];
+        }
+}
+
+int main()
+{
+    std::vector<CpuIsa> isas{CpuIsa::Scalar};
+    if (detect_isa() >= CpuIsa::AVX2)
+        isas.push_back(CpuIsa::AVX2);
+    if (detect_isa() >= CpuIsa::AVX512)
+        isas.push_back(CpuIsa::AVX512);
+
+    std::printf("%8s %12s", "n", "naive");
+    for (auto isa : isas)
+        std::printf(" %12s", isa_name(isa));
+    std::printf("   (GFLOP/s)\n");
+
+    for (size_t n : {64, 128, 256, 512, 1024, 2048})
+    {
+        auto a = random_data(n * n, 1);
+        auto b = random_data(n * n, 2);
+        std::vector<float> c(n * n);
+        double flops = 2.0 * n * n * n;
+        int reps = n >= 1024 ? 3 : 10;
+
+        // naive kernel is too slow to be worth timing at the largest size
+        if (n <= 1024)
+        {
+            double t = time_median([&]
+                                   { std::fill(c.begin(), c.end(), 0.0f); naive_matmul(a.data(), b.data(), c.data(), n, n, n); }, reps);
+            std::printf("%8zu %12.2f", n, flops / t * 1e-9);
+        }
+        else
+        {
+            std::printf("%8zu %12s", n, "-");
+        }
+
+        for (auto isa : isas)
+        {
+            const auto &kern = gemm::kernel_for(isa);
+            double t = time_median([&]
+                                   { gemm::sgemm(n, n, n, a.data(), n, b.data(), n, c.data(), n, kern); }, reps);
+            std::printf(" %12.2f", flops / t * 1e-9);
+        }
+        std::printf("\n");
+    }
+
+    struct Layout
+    {
+        const char *name;
+        DimVec a_shape, b_shape;
+        bool transpose_a, transpose_b;
+    };
+    // shapes are as stored, the transposed operand is a view over its last two dims
+    const Layout layouts[] = {
+        {"x @ W.T", {256, 1024}, {4096, 1024}, false, true},
+        {"A.T @ B", {1024, 1024}, {1024, 1024}, true, false},
+        {"q @ k^T", {8, 16, 256, 64}, {8, 16, 256, 64}, false, true},
+    };
+    std::printf("\n%10s %12s %12s   (GFLOP/s)\n", "layout", "in place", "compacted");
+    for (const auto &l : layouts)
+    {
+        auto numel = [](const DimVec &s)
+        { size_t n = 1; for (size_t d : s) n *= d; return n; };
+        auto last_two_swapped = [](NDArray<float> x)
+        {
+            DimVec axes(x.get_shape().size());
+            for (size_t d = 0; d < axes.size(); d++)
+                axes[d] = d;
+            std::swap(axes[axes.size() - 1], axes[axes.size() - 2]);
+            return x.transpose(axes);
+        };
+        NDArray<float> a(random_data(numel(l.a_shape), 1), l.a_shape);
+        NDArray<float> b(random_data(numel(l.b_shape), 2), l.b_shape);
+        if (l.transpose_a)
+            a = last_two_swapped(a);
+        if (l.transpose_b)
+            b = last_two_swapped(b);
+        const DimVec out_shape = matmul(a, b).get_shape();
+        const double flops = 2.0 * numel(out_shape) * a.get_shape().back();
+
+        double t_view = time_median([&]
+                                    { matmul(a, b); }, 5);
+        double t_compact = time_median([&]
+                                       { matmul(a.make_compact(), b.make_compact()); }, 5);
+        std::printf("%10s %12.2f %12.2f\n", l.name, flops / t_view * 1e-9, flops / t_compact * 1e-9);
+    }
+
+    struct Folded
+    {
+        size_t B, T, K, N;
+    };
+    const Folded folded[] = {{32, 16, 1024, 1024}, {8, 1, 4096, 4096}, {64, 64, 256, 256}};
+    std::printf("\n%22s %12s %12s   (GFLOP/s)\n", "[B, T, K] @ [K, N]", "folded", "per batch");
+    for (const auto &f : folded)
+    {
+        NDArray<float> x(random_data(f.B * f.T * f.K, 1), {f.B, f.T, f.K});
+        NDArray<float> w(random_data(f.K * f.N, 2), {f.K, f.N});
+        std::vector<float> c(f.B * f.T * f.N);
+        std::vector<size_t> x_offsets(f.B), w_offsets(f.B, 0);
+        for (size_t b = 0; b < f.B; b++)
+            x_offsets[b] = b * f.T * f.K;
+        const double flops = 2.0 * f.B * f.T * f.K * f.N;
+
+        double t_folded = time_median([&]
+                                      { matmul(x, w); }, 5);
+        double t_batched = time_median([&]
+                                       { gemm::sgemm_batched(f.B, f.T, f.N, f.K, x.get_handle()->ptr(), x_offsets.data(), f.K, 1,
+                                                             w.get_handle()->ptr(), w_offsets.data(), f.N, 1, c.data(), f.N); },
+                                       5);
+        std::printf("%6zu x%5zu x%5zu x%5zu %12.2f %12.2f\n", f.B, f.T, f.K, f.N, flops / t_folded * 1e-9,
+                    flops / t_batched * 1e-9);
+    }
+    return 0;
+}
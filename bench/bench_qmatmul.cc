@@ -0,0 +1,57 @@
+#include <cstdio>
+#include <vector>
+#include <bench_common.hpp>
+
+/*
+ * Int8 GEMM throughput on inference shapes [M, K] @ [K, N]: float matmul and the end-to-end
+ * qmatmul (per-row quantization of x included) in GFLOP/s, then the raw int8 kernel for each ISA
+ * the host supports in GOP/s.
+ */
+
+int main()
+{
+    struct Shape
+    {
+        size_t M, K, N;
+    };
+    const Shape shapes[] = {{1, 4096, 4096}, {16, 4096, 4096}, {256, 1024, 4096}, {1024, 1024, 1024}};
+    const auto isas = qgemm::available_qisas();
+
+    std::printf("%d threads\n", static_cast<int>(get_num_threads()));
+    std::printf("%18s %10s %10s %8s", "M x K x N", "float", "qmatmul", "speedup");
+    for (auto isa : isas)
+        std::printf(" %12s", qgemm::qisa_name(isa));
+    std::printf("\n");
+
+    for (const auto &s : shapes)
+    {
+        NDArray<float> x(random_data(s.M * s.K, 1), {s.M, s.K});
+        NDArray<float> w(random_data(s.K * s.N, 2), {s.K, s.N});
+        auto [w_q, w_scales] = quantize_per_channel(w, -1);
+        const double ops = 2.0 * s.M * s.K * s.N;
+        const int reps = ops > 4e9 ? 3 : 10;
+
+        double t_float = time_median([&]
+                                     { matmul(x, w); }, reps);
+        double t_q = time_median([&]
+                                 { qmatmul(x, w_q, w_scales); }, reps);
+        std::printf("%6zux%5zux%5zu %10.2f %10.2f %7.2fx", s.M, s.K, s.N, ops / t_float * 1e-9, ops / t_q * 1e-9,
+                    t_float / t_q);
+
+        const auto x_q = quantize_per_channel(x, -1).first.make_compact();
+        const int8_t *x_data = x_q.get_handle()->ptr();
+        const int8_t *w_data = w_q.get_handle()->ptr();
+        std::vector<int32_t> c(s.M * s.N);
+        for (auto isa : isas)
+        {
+            const auto &kern = qgemm::kernel_for(isa);
+            double t = time_median([&]
+                                   { qgemm::qgemm(s.M, s.N, s.K, x_data, s.K, w_data, s.N, c.data(), s.N,
+                                                  [](size_t, size_t, size_t, size_t) {}, kern); },
+                                   reps);
+            std::printf(" %12.2f", ops / t * 1e-9);
+        }
+        std::printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <bench_common.hpp>
+
+/*
+ * Throughput of sum/max/min over each axis layout of a 4096 x 4096 float array (64 MiB), using the
+ * whole thread pool: the contiguous inner axis, the outer axis, both, and the same on a transposed
+ * view.
+ */
+
+struct ReduceCase
+{
+    const char *name;
+    bool transposed;
+    DimVec axes;
+};
+
+int main()
+{
+    const size_t n = 4096;
+    NDArray<float> a(random_data(n * n, 1), {n, n});
+    const NDArray<float> at = a.transpose({1, 0});
+
+    const ReduceCase cases[] = {
+        {"inner axis", false, {1}},
+        {"outer axis", false, {0}},
+        {"all axes", false, {0, 1}},
+        {"T inner axis", true, {1}},
+        {"T outer axis", true, {0}},
+        {"T all axes", true, {0, 1}},
+    };
+
+    std::printf("%d threads\n", static_cast<int>(get_num_threads()));
+    std::printf("%14s %10s %10s %10s   (GB/s)\n", "layout", "sum", "max", "min");
+    for (const auto &c : cases)
+    {
+        const NDArray<float> &x = c.transposed ? at : a;
+        const double bytes = double(n) * n * sizeof(float);
+        double t_sum = time_median([&]
+                                   { x.sum(c.axes); });
+        double t_max = time_median([&]
+                                   { x.max(c.axes); });
+        double t_min = time_median([&]
+                                   { x.min(c.axes); });
+        std::printf("%14s %10.2f %10.2f %10.2f\n", c.name, bytes / t_sum * 1e-9, bytes / t_max * 1e-9, bytes / t_min * 1e-9);
+    }
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include <cstdio>
+#include <random>
+#include <vector>
+#include <bench_common.hpp>
+
+/*
+ * spmm against dense matmul for A [M, K] @ B [K, N] as the share of non zeros in A falls, with the
+ * bytes A takes in each form. Sparse GFLOP/s count only the products with non zeros, so the speedup
+ * column is the one to compare.
+ */
+
+int main()
+{
+    const size_t M = 2048, K = 2048, N = 256;
+    const double densities[] = {0.5, 0.1, 0.01, 0.001};
+
+    std::printf("%d threads, %zu x %zu @ %zu x %zu\n", static_cast<int>(get_num_threads()), M, K, K, N);
+    std::printf("%9s %10s %10s %10s %12s %12s %8s %10s %10s\n", "density", "nnz", "dense ms", "spmm ms", "dense GF/s",
+                "spmm GF/s", "speedup", "dense MB", "sparse MB");
+
+    NDArray<float> b(random_data(K * N, 2), {K, N});
+    for (double density : densities)
+    {
+        std::vector<float> data = random_data(M * K, 1);
+        std::mt19937 gen(3);
+        std::bernoulli_distribution keep(density);
+        for (auto &x : data)
+            if (!keep(gen))
+                x = 0.0f;
+        NDArray<float> a(data, {M, K});
+        const SparseNDArray<float> s = SparseNDArray<float>::from_dense(a);
+
+        double t_dense = time_median([&]
+                                     { matmul(a, b); });
+        double t_sparse = time_median([&]
+                                      { spmm(s, b); });
+        const double nnz = static_cast<double>(s.nnz());
+        const double sparse_bytes = (M + 1) * sizeof(int64_t) + nnz * (sizeof(int64_t) + sizeof(float));
+        std::printf("%8.1f%% %10zu %10.3f %10.3f %12.2f %12.2f %7.2fx %10.2f %10.2f\n", density * 100, s.nnz(),
+                    t_dense * 1e3, t_sparse * 1e3, 2.0 * M * K * N / t_dense * 1e-9, 2.0 * nnz * N / t_sparse * 1e-9,
+                    t_dense / t_sparse, M * K * sizeof(float) / 1e6, sparse_bytes / 1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <bench_common.hpp>
+
+/*
+ * make_compact bandwidth on permuted views (GB/s counting one read and one write per element),
+ * against a plain strided copy of the same view and memcpy of the same bytes.
+ */
+
+struct Case
+{
+    const char *name;
+    DimVec shape;
+    DimVec axes;
+};
+
+// Row major walk of the view, one element at a time, what make_compact did before the blocked path
+static void strided_copy(const NDArray<float> &v, float *dst)
+{
+    const DimVec &shape = v.get_shape(), &strides = v.get_strides();
+    const float *src = v.get_handle()->ptr() + v.get_offset();
+    DimVec idx(shape.size(), 0);
+    size_t n = 1;
+    for (size_t s : shape)
+        n *= s;
+    size_t off = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        dst[i] = src[off];
+        for (size_t d = shape.size(); d-- > 0;)
+        {
+            off += strides[d];
+            if (++idx[d] < shape[d])
+                break;
+            off -= shape[d] * strides[d];
+            idx[d] = 0;
+        }
+    }
+}
+
+int main()
+{
+    const Case cases[] = {
+        {"4096x4096 T", {4096, 4096}, {1, 0}},
+        {"1000x1000 T", {1000, 1000}, {1, 0}},
+        {"attn K^T", {8, 16, 512, 64}, {0, 1, 3, 2}},
+        {"attn heads", {8, 512, 16, 64}, {0, 2, 1, 3}},
+        {"NCHW->NHWC", {8, 64, 56, 56}, {0, 2, 3, 1}},
+    };
+
+    std::printf("%d threads\n", static_cast<int>(get_num_threads()));
+    std::printf("%14s %10s %10s %10s   (GB/s)\n", "view", "memcpy", "strided", "compact");
+    for (const auto &c : cases)
+    {
+        size_t n = 1;
+        for (size_t s : c.shape)
+            n *= s;
+        const NDArray<float> a(random_data(n, 1), c.shape);
+        const NDArray<float> v = a.transpose(c.axes);
+        std::vector<float> out(n);
+        const float *src = a.get_handle()->ptr();
+        const double bytes = 2.0 * n * sizeof(float);
+        const int reps = n > (1u << 22) ? 5 : 10;
+
+        double t_memcpy = time_median([&]
+                                      { std::memcpy(out.data(), src, n * sizeof(float)); }, reps);
+        double t_strided = time_median([&]
+                                       { strided_copy(v, out.data()); }, reps);
+        double t_compact = time_median([&]
+                                       { v.make_compact(); }, reps);
+        std::printf("%14s %10.2f %10.2f %10.2f\n", c.name, bytes / t_memcpy * 1e-9, bytes / t_strided * 1e-9,
+                    bytes / t_compact * 1e-9);
+    }
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include <bench_common.hpp>
+
+/*
+ * Elements per second of the float transcendental kernels, single threaded on one contiguous
+ * array, for a plain std:: loop and each ISA the host supports.
+ */
+
+struct MathCase
+{
+    const char *name;
+    float lo, hi;
+    float (*reference)(float);
+    void (*simd_math::MathKernels::*kernel)(const float *, float *, size_t);
+};
+
+int main()
+{
+    const size_t n = size_t(1) << 20;
+    const MathCase cases[] = {
+        {"exp", -80.0f, 80.0f, [](float x) { return std::exp(x); }, &simd_math::MathKernels::exp},
+        {"log", 1e-30f, 1e30f, [](float x) { return std::log(x); }, &simd_math::MathKernels::log},
+        {"sin", -100.0f, 100.0f, [](float x) { return std::sin(x); }, &simd_math::MathKernels::sin},
+        {"cos", -100.0f, 100.0f, [](float x) { return std::cos(x); }, &simd_math::MathKernels::cos},
+        {"tanh", -10.0f, 10.0f, [](float x) { return std::tanh(x); }, &simd_math::MathKernels::tanh},
+    };
+    const auto isas = simd_math::available_isas();
+
+    std::printf("%8s %12s", "fn", "std");
+    for (auto isa : isas)
+        std::printf(" %12s", isa_name(isa));
+    std::printf("   (Melem/s)\n");
+
+    std::vector<float> y(n);
+    for (const auto &c : cases)
+    {
+        auto x = random_data(n, 1, c.lo, c.hi);
+        double t = time_median([&]
+                               { for (size_t i = 0; i < n; i++) y[i] = c.reference(x[i]); });
+        std::printf("%8s %12.1f", c.name, n / t * 1e-6);
+        for (auto isa : isas)
+        {
+            auto fn = simd_math::kernels_for(isa).*c.kernel;
+            t = time_median([&]
+                            { fn(x.data(), y.data(), n); });
+            std::printf(" %12.1f", n / t * 1e-6);
+        }
+        std::printf("\n");
+    }
+
+    // pow with an elementwise exponent
+    auto base = random_data(n, 2, 0.0f, 100.0f);
+    auto expo = random_data(n, 3, -4.0f, 4.0f);
+    double t = time_median([&]
+                           { for (size_t i = 0; i < n; i++) y[i] = std::pow(base[i], expo[i]); });
+    std::printf("%8s %12.1f", "pow", n / t * 1e-6);
+    for (auto isa : isas)
+    {
+        auto fn = simd_math::kernels_for(isa).pow;
+        t = time_median([&]
+                        { fn(base.data(), expo.data(), y.data(), n); });
+        std::printf(" %12.1f", n / t * 1e-6);
+    }
+    std::printf("\n");
+    return 0;
+}
@@ -0,0 +1,638 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <bench_common.hpp>
+
+/*
+ * Benchmark suite over the ops in backend_cpu.hpp, across shapes, operand layouts (contiguous,
+ * transposed, broadcast, sliced) and thread counts.
+ *
+ *   photon_bench [--threads 1,8] [--size small|large|all] [--filter text] [--min-time 0.2]
+ *                [--json results.json] [--list]
+ *
+ * Every case is timed as the median of repeated calls after a warmup, repeated until the timed
+ * calls take about --min-time seconds. ns/op is that median. GB/s counts each logical operand and
+ * output element once, so a broadcast or sliced operand is charged for the elements the op sees
+ * rather than the memory behind it. GFLOP/s counts 2 per multiply-add for matmul and convolution
+ * and one op per element for elementwise math and reductions. Data movement ops report no GFLOP/s.
+ * --json writes one record per case and thread count, for tracking regressions between releases.
+ */
+
+namespace
+{
+    enum class Layout
+    {
+        Contiguous,
+        Transposed,
+        Broadcast,
+        Sliced,
+    };
+
+    const char *layout_name(Layout l)
+    {
+        switch (l)
+        {
+        case Layout::Transposed:
+            return "transposed";
+        case Layout::Broadcast:
+            return "broadcast";
+        case Layout::Sliced:
+            return "sliced";
+        default:
+            return "contiguous";
+        }
+    }
+
+    constexpr Layout kAllLayouts[] = {Layout::Contiguous, Layout::Transposed, Layout::Broadcast, Layout::Sliced};
+
+    size_t numel(const DimVec &shape)
+    {
+        size_t n = 1;
+        for (size_t d : shape)
+            n *= d;
+        return n;
+    }
+
+    std::string shape_str(const DimVec &shape)
+    {
+        std::string s;
+        for (size_t d = 0; d < shape.size(); d++)
+            s += (d ? "x" : "") + std::to_string(shape[d]);
+        return s;
+    }
+
+    template <typename T>
+    NDArray<T> filled(const DimVec &shape, unsigned seed, float lo = -1.0f, float hi = 1.0f)
+    {
+        const auto data = random_data(numel(shape), seed, lo, hi);
+        return NDArray<T>(std::vector<T>(data.begin(), data.end()), shape);
+    }
+
+    /**
+     * @brief A view of the given logical shape in the given layout: transposed swaps the storage of the
+     * last two dims, broadcast repeats a size 1 leading dim (stride 0) and sliced takes every other
+     * element of a last dim twice as long.
+     */
+    template <typename T>
+    NDArray<T> operand(const DimVec &shape, Layout layout, unsigned seed, float lo = -1.0f, float hi = 1.0f)
+    {
+        DimVec storage = shape;
+        const size_t r = shape.size();
+        switch (layout)
+        {
+        case Layout::Transposed:
+        {
+            std::swap(storage[r - 1], storage[r - 2]);
+            DimVec axes(r);
+            for (size_t d = 0; d < r; d++)
+                axes[d] = d;
+            std::swap(axes[r - 1], axes[r - 2]);
+            return filled<T>(storage, seed, lo, hi).transpose(axes);
+        }
+        case Layout::Broadcast:
+            storage[0] = 1;
+            return filled<T>(storage, seed, lo, hi).broadcast(shape);
+        case Layout::Sliced:
+        {
+            storage[r - 1] *= 2;
+            std::vector<typename NDArray<T>::Slice> ranges;
+            for (size_t d = 0; d < r; d++)
+                ranges.push_back({0, static_cast<int64_t>(storage[d]), d + 1 == r ? 2 : 1});
+            return filled<T>(storage, seed, lo, hi).slice(ranges);
+        }
+        default:
+            return filled<T>(storage, seed, lo, hi);
+        }
+    }
+
+    struct Case
+    {
+        std::string op, dtype, layout, shape;
+        double bytes;
+        double flops;
+        std::function<void()> run;
+    };
+
+    struct Options
+    {
+        std::vector<size_t> threads;
+        std::string filter;
+        std::string json_path;
+        double min_time = 0.2;
+        bool small = true, large = true, list = false;
+    };
+
+    class Suite
+    {
+    public:
+        explicit Suite(const Options &opts) : opts(opts) {}
+
+        void add(std::string op, std::string dtype, std::string layout, std::string shape, double bytes, double flops,
+                 std::function<void()> run)
+        {
+            const std::string key = op + " " + dtype + " " + layout + " " + shape;
+            if (!opts.filter.empty() && key.find(opts.filter) == std::string::npos)
+                return;
+            cases.push_back({std::move(op), std::move(dtype), std::move(layout), std::move(shape), bytes, flops,
+                             std::move(run)});
+        }
+
+        std::vector<Case> cases;
+        const Options &opts;
+    };
+
+    /** Views, copies and casts */
+    void add_view_cases(Suite &s, size_t n)
+    {
+        const DimVec shape{n, n};
+        const double bytes = 2.0 * n * n * sizeof(float);
+        for (Layout l : kAllLayouts)
+        {
+            const auto a = operand<float>(shape, l, 1);
+            s.add("make_compact", "float32", layout_name(l), shape_str(shape), bytes, 0, [a]
+                  { a.make_compact(); });
+        }
+        const auto a = operand<float>(shape, Layout::Contiguous, 1);
+        const auto at = operand<float>(shape, Layout::Transposed, 1);
+        s.add("reshape", "float32", "transposed", shape_str(shape), bytes, 0, [at, n]
+              { at.reshape({n * n}); });
+        s.add("transpose", "float32", "contiguous", shape_str(shape), 0, 0, [a]
+              { a.transpose({1, 0}); });
+        s.add("astype_bfloat16", "float32", "contiguous", shape_str(shape), n * n * 6.0, n * n, [a]
+              { a.astype<bfloat16>(); });
+        s.add("astype_int32", "float32", "contiguous", shape_str(shape), bytes, n * n, [a]
+              { a.astype<int32_t>(); });
+
+        using S = NDArray<float>::Slice;
+        const std::vector<S> half{{0, static_cast<int64_t>(n), 1}, {0, static_cast<int64_t>(n), 2}};
+        auto dst = operand<float>(shape, Layout::Contiguous, 2);
+        const auto src = operand<float>({n, n / 2}, Layout::Contiguous, 3);
+        s.add("setitem_scalar", "float32", "sliced", shape_str(shape), bytes / 4, 0, [dst, half]() mutable
+              { dst.setitem_scalar(half, 1.0f); });
+        s.add("setitem_ewise", "float32", "sliced", shape_str(shape), bytes / 2, 0, [dst, half, src]() mutable
+              { dst.setitem_ewise(half, src); });
+    }
+
+    /** Unary math, eager, in place and into an existing output */
+    void add_unary_cases(Suite &s, size_t n)
+    {
+        const DimVec shape{n, n};
+        const double bytes = 2.0 * n * n * sizeof(float), flops = double(n) * n;
+        using Fn = NDArray<float> (NDArray<float>::*)() const;
+        const std::pair<const char *, Fn> ops[] = {
+            {"neg", &NDArray<float>::neg}, {"exp", &NDArray<float>::exp}, {"log", &NDArray<float>::log},
+            {"sqrt", &NDArray<float>::sqrt}, {"sin", &NDArray<float>::sin}, {"cos", &NDArray<float>::cos},
+            {"tanh", &NDArray<float>::tanh},
+        };
+        for (Layout l : kAllLayouts)
+        {
+            // positive inputs keep log and sqrt on their fast paths
+            const auto a = operand<float>(shape, l, 1, 0.1f, 2.0f);
+            for (const auto &[name, fn] : ops)
+                s.add(name, "float32", layout_name(l), shape_str(shape), bytes, flops, [a, fn = fn]
+                      { (a.*fn)(); });
+        }
+        auto a = operand<float>(shape, Layout::Contiguous, 1, 0.1f, 2.0f);
+        auto out = NDArray<float>::empty(shape);
+        s.add("exp_inplace", "float32", "contiguous", shape_str(shape), bytes, flops, [a]() mutable
+              { a.exp_().neg_(); });
+        s.add("exp_out", "float32", "contiguous", shape_str(shape), bytes, flops, [a, out]() mutable
+              { a.exp(out); });
+    }
+
+    /** Elementwise binary and scalar ops, the second operand in every layout */
+    void add_ewise_cases(Suite &s, size_t n)
+    {
+        const DimVec shape{n, n};
+        const double bytes = 3.0 * n * n * sizeof(float), flops = double(n) * n;
+        using Fn = NDArray<float> (*)(const NDArray<float> &, const NDArray<float> &);
+        const std::pair<const char *, Fn> ops[] = {
+            {"ewise_add", &ewise_add<float>}, {"ewise_sub", &ewise_sub<float>}, {"ewise_mul", &ewise_mul<float>},
+            {"ewise_div", &ewise_div<float>}, {"ewise_pow", &ewise_pow<float>},
+        };
+        const auto a = operand<float>(shape, Layout::Contiguous, 1, 0.1f, 2.0f);
+        for (Layout l : kAllLayouts)
+        {
+            const auto b = operand<float>(shape, l, 2, 0.1f, 2.0f);
+            for (const auto &[name, fn] : ops)
+                s.add(name, "float32", layout_name(l), shape_str(shape), bytes, flops, [a, b, fn = fn]
+                      { fn(a, b); });
+        }
+
+        auto out = NDArray<float>::empty(shape);
+        auto acc = operand<float>(shape, Layout::Contiguous, 3);
+        const auto b = operand<float>(shape, Layout::Contiguous, 2);
+        s.add("ewise_add_out", "float32", "contiguous", shape_str(shape), bytes, flops, [a, b, out]() mutable
+              { ewise_add(a, b, out); });
+        s.add("add_inplace", "float32", "contiguous", shape_str(shape), bytes, flops, [acc, b]() mutable
+              { acc.add_(b); });
+
+        using ScalarFn = NDArray<float> (*)(const NDArray<float> &, float);
+        const std::pair<const char *, ScalarFn> scalar_ops[] = {
+            {"scalar_add", &scalar_add<float>}, {"scalar_sub", &scalar_sub<float>},
+            {"scalar_rsub", &scalar_rsub<float>}, {"scalar_mul", &scalar_mul<float>},
+            {"scalar_div", &scalar_div<float>}, {"scalar_rdiv", &scalar_rdiv<float>},
+            {"scalar_pow", &scalar_pow<float>},
+        };
+        for (Layout l : kAllLayouts)
+        {
+            const auto x = operand<float>(shape, l, 4, 0.1f, 2.0f);
+            for (const auto &[name, fn] : scalar_ops)
+                s.add(name, "float32", layout_name(l), shape_str(shape), 2.0 * n * n * sizeof(float), flops,
+                      [x, fn = fn]
+                      { fn(x, 1.5f); });
+        }
+
+        // other dtypes on the generic kernels
+        const auto ad = operand<double>(shape, Layout::Contiguous, 1), bd = operand<double>(shape, Layout::Contiguous, 2);
+        s.add("ewise_add", "float64", "contiguous", shape_str(shape), 3.0 * n * n * sizeof(double), flops, [ad, bd]
+              { ewise_add(ad, bd); });
+        const auto ai = operand<int32_t>(shape, Layout::Contiguous, 1, -100, 100),
+                   bi = operand<int32_t>(shape, Layout::Contiguous, 2, -100, 100);
+        s.add("ewise_mul", "int32", "contiguous", shape_str(shape), 3.0 * n * n * sizeof(int32_t), flops, [ai, bi]
+              { ewise_mul(ai, bi); });
+
+        // one fused pass against the same expression eager
+        const auto c = operand<float>(shape, Layout::Contiguous, 5);
+        s.add("lazy_fused", "float32", "contiguous", shape_str(shape), 4.0 * n * n * sizeof(float), 4.0 * n * n,
+              [a, b, c]
+              { a.lazy().mul(LazyArray<float>(b)).add(LazyArray<float>(c)).tanh().mul(0.5f).eval(); });
+        s.add("eager_chain", "float32", "contiguous", shape_str(shape), 4.0 * n * n * sizeof(float), 4.0 * n * n,
+              [a, b, c]
+              { scalar_mul(ewise_add(ewise_mul(a, b), c).tanh(), 0.5f); });
+    }
+
+    /** Reductions, normalisations and index ops over each axis */
+    void add_reduction_cases(Suite &s, size_t n)
+    {
+        const DimVec shape{n, n};
+        const double bytes = double(n) * n * sizeof(float), flops = double(n) * n;
+        const std::pair<const char *, DimVec> axes[] = {{"axis1", {1}}, {"axis0", {0}}, {"all", {0, 1}}};
+        for (Layout l : {Layout::Contiguous, Layout::Transposed, Layout::Sliced})
+        {
+            const auto a = operand<float>(shape, l, 1);
+            const std::string layout = layout_name(l);
+            for (const auto &[axes_name, ax] : axes)
+            {
+                const std::string suffix = std::string("_") + axes_name;
+                s.add("sum" + suffix, "float32", layout, shape_str(shape), bytes, flops, [a, ax = ax]
+                      { a.sum(ax); });
+                s.add("max" + suffix, "float32", layout, shape_str(shape), bytes, flops, [a, ax = ax]
+                      { a.max(ax); });
+                s.add("min" + suffix, "float32", layout, shape_str(shape), bytes, flops, [a, ax = ax]
+                      { a.min(ax); });
+            }
+            s.add("mean_axis1", "float32", layout, shape_str(shape), bytes, flops, [a]
+                  { a.mean({1}); });
+            s.add("var_axis1", "float32", layout, shape_str(shape), bytes, 2 * flops, [a]
+                  { a.var({1}); });
+            s.add("std_axis0", "float32", layout, shape_str(shape), bytes, 2 * flops, [a]
+                  { a.std({0}); });
+            s.add("mean_var_axis1", "float32", layout, shape_str(shape), bytes, 2 * flops, [a]
+                  { a.mean_var({1}); });
+            s.add("softmax", "float32", layout, shape_str(shape), 2 * bytes, 3 * flops, [a]
+                  { a.softmax(-1); });
+            s.add("log_softmax", "float32", layout, shape_str(shape), 2 * bytes, 3 * flops, [a]
+                  { a.log_softmax(-1); });
+            s.add("logsumexp_axis1", "float32", layout, shape_str(shape), bytes, 2 * flops, [a]
+                  { a.logsumexp({1}); });
+            s.add("argmax", "float32", layout, shape_str(shape), bytes, flops, [a]
+                  { a.argmax(-1); });
+            s.add("argmin_axis0", "float32", layout, shape_str(shape), bytes, flops, [a]
+                  { a.argmin(0); });
+            s.add("topk8", "float32", layout, shape_str(shape), bytes, flops, [a]
+                  { a.topk(8, -1); });
+        }
+        const auto ad = operand<double>(shape, Layout::Contiguous, 1);
+        s.add("sum_axis1", "float64", "contiguous", shape_str(shape), 2 * bytes, flops, [ad]
+              { ad.sum({1}); });
+        const auto ah = operand<float>(shape, Layout::Contiguous, 1).astype<bfloat16>();
+        s.add("sum_axis1", "bfloat16", "contiguous", shape_str(shape), bytes / 2, flops, [ah]
+              { ah.sum({1}); });
+    }
+
+    /** Matmul over operand layouts, batches and dtypes, and the int8 path */
+    void add_matmul_cases(Suite &s, size_t n)
+    {
+        auto add = [&](const std::string &name, const std::string &layout, const NDArray<float> &a, const NDArray<float> &b)
+        {
+            const DimVec as = a.get_shape(), bs = b.get_shape();
+            const size_t M = as[as.size() - 2], K = as.back(), N = bs.back();
+            const size_t batch = std::max(numel(as) / (M * K), numel(bs) / (K * N));
+            const double flops = 2.0 * batch * M * K * N;
+            const double bytes = double(numel(as) + numel(bs) + batch * M * N) * sizeof(float);
+            s.add(name, "float32", layout, shape_str(as) + "@" + shape_str(bs), bytes, flops, [a, b]
+                  { matmul(a, b); });
+        };
+        for (Layout l : kAllLayouts)
+            add("matmul", layout_name(l), operand<float>({n, n}, Layout::Contiguous, 1), operand<float>({n, n}, l, 2));
+        add("matmul", "transposed_a", operand<float>({n, n}, Layout::Transposed, 1), operand<float>({n, n}, Layout::Contiguous, 2));
+
+        // activations @ shared weights (folded into one GEMM) and attention scores
+        const size_t t = std::max<size_t>(n / 8, 1);
+        add("matmul_linear", "contiguous", operand<float>({8, t, n}, Layout::Contiguous, 3),
+            operand<float>({n, n}, Layout::Contiguous, 4));
+        add("matmul_linear", "transposed", operand<float>({8, t, n}, Layout::Contiguous, 3),
+            operand<float>({n, n}, Layout::Transposed, 4));
+        add("matmul_attn_qk", "transposed", operand<float>({4, 8, n / 2, 64}, Layout::Contiguous, 5),
+            operand<float>({4, 8, 64, n / 2}, Layout::Transposed, 6));
+
+        const size_t nd = n / 2;
+        const auto ad = operand<double>({nd, nd}, Layout::Contiguous, 1), bd = operand<double>({nd, nd}, Layout::Contiguous, 2);
+        s.add("matmul", "float64", "contiguous", shape_str({nd, nd}) + "@" + shape_str({nd, nd}),
+              3.0 * nd * nd * sizeof(double), 2.0 * nd * nd * nd, [ad, bd]
+              { matmul(ad, bd); });
+        const auto ah = operand<float>({n, n}, Layout::Contiguous, 1).astype<bfloat16>();
+        s.add("matmul", "bfloat16", "contiguous", shape_str({n, n}) + "@" + shape_str({n, n}), 3.0 * n * n * 2,
+              2.0 * n * n * n, [ah]
+              { matmul(ah, ah); });
+
+        const auto x = operand<float>({n / 4, n}, Layout::Contiguous, 7), w = operand<float>({n, n}, Layout::Contiguous, 8);
+        const auto [w_q, w_scales] = quantize_per_channel(w, -1);
+        s.add("quantize_per_channel", "float32", "contiguous", shape_str({n, n}), 5.0 * n * n, 0, [w]
+              { quantize_per_channel(w, -1); });
+        s.add("dequantize", "int8", "contiguous", shape_str({n, n}), 5.0 * n * n, n * n, [w_q = w_q, w_scales = w_scales]
+              { dequantize(w_q, w_scales, -1); });
+        s.add("qmatmul", "int8", "contiguous", shape_str({n / 4, n}) + "@" + shape_str({n, n}),
+              n / 4.0 * n * 8 + double(n) * n, 2.0 * n / 4 * n * n, [x, w_q = w_q, w_scales = w_scales]
+              { qmatmul(x, w_q, w_scales); });
+        const auto [x_q, x_scales] = quantize_per_channel(x, 0);
+        s.add("qmatmul_int8_x", "int8", "contiguous", shape_str({n / 4, n}) + "@" + shape_str({n, n}),
+              n / 4.0 * n * 5 + double(n) * n, 2.0 * n / 4 * n * n,
+              [x_q = x_q, x_scales = x_scales, w_q = w_q, w_scales = w_scales]
+              { qmatmul(x_q, x_scales, w_q, w_scales); });
+        s.add("qmatmul_requantize", "int8", "contiguous", shape_str({n / 4, n}) + "@" + shape_str({n, n}),
+              n / 4.0 * n * 2 + double(n) * n, 2.0 * n / 4 * n * n,
+              [x_q = x_q, x_scales = x_scales, w_q = w_q, w_scales = w_scales]
+              { qmatmul_requantize(x_q, x_scales, w_q, w_scales, 0.05f); });
+    }
+
+    /** Sparse [n, n] matrices with 1% non zeros, in CSR */
+    void add_sparse_cases(Suite &s, size_t n)
+    {
+        std::vector<float> data = random_data(n * n, 9);
+        for (size_t i = 0; i < data.size(); i++)
+            if (i % 100 != 0)
+                data[i] = 0.0f;
+        const NDArray<float> dense(data, {n, n});
+        const auto a = SparseNDArray<float>::from_dense(dense);
+        const auto b = operand<float>({n, n / 4}, Layout::Contiguous, 10);
+        const double nnz = static_cast<double>(a.nnz());
+        // values, column indices and row offsets
+        const double a_bytes = nnz * (sizeof(float) + sizeof(int64_t)) + (n + 1) * sizeof(int64_t);
+        s.add("spmm", "float32", "csr", shape_str({n, n}) + "@" + shape_str({n, n / 4}),
+              a_bytes + 2.0 * n * n / 4 * sizeof(float), 2.0 * nnz * n / 4, [a, b]
+              { spmm(a, b); });
+        s.add("sparse_multiply", "float32", "csr", shape_str({n, n}), a_bytes + nnz * 2 * sizeof(float), nnz, [a, dense]
+              { a.multiply(dense); });
+        s.add("sparse_sum", "float32", "csr", shape_str({n, n}), a_bytes + n * sizeof(float), nnz, [a]
+              { a.sum(1); });
+        s.add("sparse_from_dense", "float32", "contiguous", shape_str({n, n}), n * n * sizeof(float) + a_bytes, 0, [dense]
+              { SparseNDArray<float>::from_dense(dense); });
+    }
+
+    /** Convolution and pooling on a ResNet style layer in both layouts */
+    void add_conv_cases(Suite &s, size_t hw)
+    {
+        const size_t N = 2, C = 64, K = 64;
+        for (bool channels_last : {false, true})
+        {
+            const std::string layout = channels_last ? "nhwc" : "nchw";
+            const DimVec x_shape = channels_last ? DimVec{N, hw, hw, C} : DimVec{N, C, hw, hw};
+            const auto x = operand<float>(x_shape, Layout::Contiguous, 1);
+            const auto w = operand<float>({K, C, 3, 3}, Layout::Contiguous, 2);
+            const auto dw = operand<float>({C, 1, 3, 3}, Layout::Contiguous, 3);
+            const auto grad = operand<float>(x_shape, Layout::Contiguous, 4);
+            Conv2dParams p;
+            p.pad_h = p.pad_w = 1;
+            p.channels_last = channels_last;
+            Conv2dParams pd = p;
+            pd.groups = C;
+
+            const double act = double(N) * C * hw * hw * sizeof(float);
+            const double flops = 2.0 * N * K * hw * hw * C * 9;
+            const std::string shape = shape_str(x_shape) + "*3x3";
+            s.add("conv2d", "float32", layout, shape, 2 * act, flops, [x, w, p]
+                  { conv2d(x, w, nullptr, p); });
+            s.add("conv2d_backward_input", "float32", layout, shape, 2 * act, flops, [grad, w, x_shape, p]
+                  { conv2d_backward_input(grad, w, x_shape, p); });
+            s.add("conv2d_backward_weight", "float32", layout, shape, 2 * act, flops, [grad, x, p]
+                  { conv2d_backward_weight(grad, x, {K, C, 3, 3}, p); });
+            s.add("conv2d_depthwise", "float32", layout, shape, 2 * act, flops / K, [x, dw, pd]
+                  { conv2d(x, dw, nullptr, pd); });
+
+            Pool2dParams pool;
+            pool.kernel_h = pool.kernel_w = 3;
+            pool.stride_h = pool.stride_w = 2;
+            pool.pad_h = pool.pad_w = 1;
+            pool.channels_last = channels_last;
+            const auto [pooled, indices] = max_pool2d_with_indices(x, pool);
+            s.add("max_pool2d", "float32", layout, shape_str(x_shape), 1.25 * act, 0, [x, pool]
+                  { max_pool2d(x, pool); });
+            s.add("max_pool2d_indices", "float32", layout, shape_str(x_shape), 1.75 * act, 0, [x, pool]
+                  { max_pool2d_with_indices(x, pool); });
+            s.add("max_pool2d_backward", "float32", layout, shape_str(x_shape), 1.75 * act, 0,
+                  [pooled = pooled, indices = indices, x_shape, channels_last]
+                  { max_pool2d_backward(pooled, indices, x_shape, channels_last); });
+            s.add("avg_pool2d", "float32", layout, shape_str(x_shape), 1.25 * act, act / sizeof(float), [x, pool]
+                  { avg_pool2d(x, pool); });
+            s.add("avg_pool2d_backward", "float32", layout, shape_str(x_shape), 1.25 * act, act / sizeof(float),
+                  [pooled = pooled, x_shape, pool]
+                  { avg_pool2d_backward(pooled, x_shape, pool); });
+            s.add("adaptive_avg_pool2d", "float32", layout, shape_str(x_shape), act, act / sizeof(float),
+                  [x, channels_last]
+                  { adaptive_avg_pool2d(x, 1, 1, channels_last); });
+            const auto pooled_1x1 = adaptive_avg_pool2d(x, 1, 1, channels_last);
+            s.add("adaptive_avg_pool2d_backward", "float32", layout, shape_str(x_shape), act, act / sizeof(float),
+                  [pooled_1x1, x_shape, channels_last]
+                  { adaptive_avg_pool2d_backward(pooled_1x1, x_shape, channels_last); });
+        }
+
+        const auto x1 = operand<float>({N, C, hw * hw}, Layout::Contiguous, 5);
+        const auto w1 = operand<float>({K, C, 3}, Layout::Contiguous, 6);
+        Conv1dParams p1;
+        p1.padding = 1;
+        s.add("conv1d", "float32", "ncl", shape_str({N, C, hw * hw}) + "*3", 2.0 * N * C * hw * hw * sizeof(float),
+              2.0 * N * K * hw * hw * C * 3, [x1, w1, p1]
+              { conv1d(x1, w1, nullptr, p1); });
+        s.add("conv1d_backward_input", "float32", "ncl", shape_str({N, C, hw * hw}) + "*3",
+              2.0 * N * C * hw * hw * sizeof(float), 2.0 * N * K * hw * hw * C * 3, [x1, w1, p1]
+              { conv1d_backward_input(x1, w1, x1.get_shape(), p1); });
+        s.add("conv1d_backward_weight", "float32", "ncl", shape_str({N, C, hw * hw}) + "*3",
+              2.0 * N * C * hw * hw * sizeof(float), 2.0 * N * K * hw * hw * C * 3, [x1, p1]
+              { conv1d_backward_weight(x1, x1, {K, C, 3}, p1); });
+    }
+
+    // Median seconds per call, with the repetitions sized from a first timed call
+    double time_case(const std::function<void()> &run, double min_time)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        run();
+        const double first = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const int reps = static_cast<int>(std::clamp(min_time / std::max(first, 1e-9), 3.0, 1000.0));
+        return time_median(run, reps);
+    }
+
+    std::vector<size_t> parse_list(const char *text)
+    {
+        std::vector<size_t> values;
+        for (const char *p = text; *p;)
+        {
+            char *end = nullptr;
+            const unsigned long v = std::strtoul(p, &end, 10);
+            if (end == p || v == 0)
+                throw std::invalid_argument(std::string("bad thread list: ") + text);
+            values.push_back(v);
+            p = *end == ',' ? end + 1 : end;
+        }
+        return values;
+    }
+
+    Options parse_args(int argc, char **argv)
+    {
+        Options opts;
+        for (int i = 1; i < argc; i++)
+        {
+            const std::string arg = argv[i];
+            auto value = [&]() -> const char *
+            {
+                if (i + 1 >= argc)
+                    throw std::invalid_argument("missing value for " + arg);
+                return argv[++i];
+            };
+            if (arg == "--threads")
+                opts.threads = parse_list(value());
+            else if (arg == "--filter")
+                opts.filter = value();
+            else if (arg == "--json")
+                opts.json_path = value();
+            else if (arg == "--min-time")
+                opts.min_time = std::atof(value());
+            else if (arg == "--size")
+            {
+                const std::string size = value();
+                opts.small = size != "large";
+                opts.large = size != "small";
+            }
+            else if (arg == "--list")
+                opts.list = true;
+            else
+                throw std::invalid_argument("unknown argument " + arg + ", see the header of bench/photon_bench.cc");
+        }
+        if (opts.threads.empty())
+        {
+            opts.threads.push_back(1);
+            if (get_num_threads() > 1)
+                opts.threads.push_back(get_num_threads());
+        }
+        return opts;
+    }
+
+    struct Result
+    {
+        const Case *c;
+        size_t threads;
+        double seconds;
+    };
+
+    void write_json(const std::string &path, const Options &opts, const std::vector<Result> &results)
+    {
+        FILE *f = std::fopen(path.c_str(), "w");
+        if (!f)
+            throw std::runtime_error("cannot open " + path);
+        std::fprintf(f, "{\n  \"schema\": 1,\n  \"isa\": \"%s\",\n  \"hardware_threads\": %u,\n  \"min_time\": %g,\n",
+                     isa_name(detect_isa()), std::thread::hardware_concurrency(), opts.min_time);
+        std::fprintf(f, "  \"results\": [\n");
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const Result &r = results[i];
+            std::fprintf(f,
+                         "    {\"op\": \"%s\", \"dtype\": \"%s\", \"layout\": \"%s\", \"shape\": \"%s\", \"threads\": %zu, "
+                         "\"ns_per_op\": %.1f, \"gb_per_s\": %.4f, \"gflop_per_s\": %.4f}%s\n",
+                         r.c->op.c_str(), r.c->dtype.c_str(), r.c->layout.c_str(), r.c->shape.c_str(), r.threads,
+                         r.seconds * 1e9, r.c->bytes / r.seconds * 1e-9, r.c->flops / r.seconds * 1e-9,
+                         i + 1 < results.size() ? "," : "");
+        }
+        std::fprintf(f, "  ]\n}\n");
+        std::fclose(f);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options opts;
+    try
+    {
+        opts = parse_args(argc, argv);
+    }
+    catch (const std::exception &e)
+    {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 2;
+    }
+
+    Suite suite(opts);
+    // small sizes stay in cache, large ones stream from memory
+    if (opts.small)
+    {
+        add_view_cases(suite, 256);
+        add_unary_cases(suite, 256);
+        add_ewise_cases(suite, 256);
+        add_reduction_cases(suite, 256);
+        add_matmul_cases(suite, 128);
+        add_sparse_cases(suite, 256);
+        add_conv_cases(suite, 14);
+    }
+    if (opts.large)
+    {
+        add_view_cases(suite, 2048);
+        add_unary_cases(suite, 2048);
+        add_ewise_cases(suite, 2048);
+        add_reduction_cases(suite, 2048);
+        add_matmul_cases(suite, 1024);
+        add_sparse_cases(suite, 2048);
+        add_conv_cases(suite, 56);
+    }
+
+    if (opts.list)
+    {
+        for (const auto &c : suite.cases)
+            std::printf("%s %s %s %s\n", c.op.c_str(), c.dtype.c_str(), c.layout.c_str(), c.shape.c_str());
+        return 0;
+    }
+
+    std::vector<Result> results;
+    const size_t original_threads = get_num_threads();
+    std::printf("%-24s %-8s %-12s %-22s %7s %14s %10s %10s\n", "op", "dtype", "layout", "shape", "threads", "ns/op",
+                "GB/s", "GFLOP/s");
+    for (size_t threads : opts.threads)
+    {
+        set_num_threads(threads);
+        for (const auto &c : suite.cases)
+        {
+            const double t = time_case(c.run, opts.min_time);
+            results.push_back({&c, threads, t});
+            std::printf("%-24s %-8s %-12s %-22s %7zu %14.0f %10.2f", c.op.c_str(), c.dtype.c_str(), c.layout.c_str(),
+                        c.shape.c_str(), threads, t * 1e9, c.bytes / t * 1e-9);
+            if (c.flops > 0)
+                std::printf(" %10.2f\n", c.flops / t * 1e-9);
+            else
+                std::printf(" %10s\n", "-");
+            std::fflush(stdout);
+        }
+    }
+    set_num_threads(original_threads);
+
+    if (!opts.json_path.empty())
+    {
+        write_json(opts.json_path, opts, results);
+        std::printf("wrote %zu results to %s\n", results.size(), opts.json_path.c_str());
+    }
+    return 0;
+}
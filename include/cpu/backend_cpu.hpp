@@ -1,30 +1,59 @@
 #pragma once
 #include <vector>
 #include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <iostream>
+#include <utility>
 
 using DimVec = std::vector<size_t>;
 
+class Allocator;
+template <typename T>
+class LazyArray;
+
+// Tag for constructors that leave the elements uninitialised, for outputs a kernel fully overwrites
+struct Uninitialized
+{
+};
+inline constexpr Uninitialized uninitialized{};
+
 /**
  * @brief A compact array class that manages contiguous block of memory for a single data type. This is the underlying storage for NDArray.
- * Just a std::vector wrapper for now, but can be extended to support GPU memory in the future.
+ * The block is 64 byte aligned and comes from the process wide Allocator (see allocator.inl), which it is returned to on destruction.
+ * Alternatively it wraps memory owned elsewhere (e.g. a NumPy array), kept alive by an owner handle that is released on
+ * destruction instead. Such memory is only guaranteed the alignment of T.
  *
  * @tparam T The numeric data type of the array elements.
  */
 template <typename T>
 class CompactArray
 {
-public:
-    std::vector<T> data;
+private:
+    T *_ptr = nullptr;
+    size_t _size = 0;
+    std::shared_ptr<Allocator> _allocator;
+    // Set for wrapped external memory, which is never handed to the allocator
+    std::shared_ptr<void> _owner;
 
+public:
     CompactArray() = default;
+    // Zeroed array of size elements
     explicit CompactArray(size_t size);
+    CompactArray(size_t size, Uninitialized);
     explicit CompactArray(const std::vector<T> &input);
-    explicit CompactArray(std::vector<T> &&input);
+    // Wraps size elements at ptr without copying, owner keeps them alive for the array's lifetime
+    CompactArray(T *ptr, size_t size, std::shared_ptr<void> owner);
+    // Deleted copy ops to prevent double frees.
+    CompactArray(const CompactArray &) = delete;
+    CompactArray &operator=(const CompactArray &) = delete;
+    ~CompactArray();
 
     size_t size() const;
     void print() const;
+    // Copy of the elements, for the bindings and tests
+    std::vector<T> to_vector() const;
+    bool is_external() const;
 
     T *ptr();
     const T *ptr() const;
@@ -67,6 +96,8 @@ public:
 
     // Zeroed NDArray of shape
     explicit NDArray(const DimVec &shape);
+    // Uninitialised NDArray of shape, for outputs that are overwritten in full
+    static NDArray<T> empty(const DimVec &shape);
     // Create ndarray from existing vector + shape
     NDArray(std::vector<T> data, DimVec shape);
     // 1D array
@@ -84,6 +115,9 @@ public:
     NDArray<T> slice(const std::vector<Slice> &slice_ranges) const;
     NDArray<T> transpose(const DimVec &axes) const;
     NDArray<T> broadcast(const DimVec &new_shape) const;
+    // Compact copy converted to element type U (see cast_ops.inl)
+    template <typename U>
+    NDArray<U> astype() const;
     void setitem_scalar(const std::vector<Slice> &slice_ranges, T scalar);
     void setitem_ewise(const std::vector<Slice> &slice_ranges, const NDArray<T> &source);
 
@@ -95,10 +129,52 @@ public:
     NDArray<T> sin() const;
     NDArray<T> cos() const;
     NDArray<T> tanh() const;
+    // Unary ops writing into an existing (possibly strided) view of the same shape
+    void neg(NDArray<T> &out) const;
+    void exp(NDArray<T> &out) const;
+    void log(NDArray<T> &out) const;
+    void sqrt(NDArray<T> &out) const;
+    void sin(NDArray<T> &out) const;
+    void cos(NDArray<T> &out) const;
+    void tanh(NDArray<T> &out) const;
+    // In place ops, write through this view and return it
+    NDArray<T> &neg_();
+    NDArray<T> &exp_();
+    NDArray<T> &log_();
+    NDArray<T> &sqrt_();
+    NDArray<T> &sin_();
+    NDArray<T> &cos_();
+    NDArray<T> &tanh_();
+    NDArray<T> &add_(const NDArray<T> &other);
+    NDArray<T> &add_(T scalar);
+    NDArray<T> &sub_(const NDArray<T> &other);
+    NDArray<T> &sub_(T scalar);
+    NDArray<T> &mul_(const NDArray<T> &other);
+    NDArray<T> &mul_(T scalar);
+    NDArray<T> &div_(const NDArray<T> &other);
+    NDArray<T> &div_(T scalar);
+    NDArray<T> &pow_(const NDArray<T> &other);
+    NDArray<T> &pow_(T scalar);
+    // Deferred view of this array, ops on it fuse into one pass when evaluated (see lazy_ops.inl)
+    LazyArray<T> lazy() const;
     // Reductions
     NDArray<T> sum(const DimVec& axes, bool keepdims = false) const;
     NDArray<T> max(const DimVec& axes, bool keepdims = false) const;
     NDArray<T> min(const DimVec& axes, bool keepdims = false) const;
+    // Numerically stable softmax family, axis may be negative to count from the end
+    NDArray<T> softmax(int64_t axis = -1) const;
+    NDArray<T> log_softmax(int64_t axis = -1) const;
+    NDArray<T> logsumexp(const DimVec& axes, bool keepdims = false) const;
+    // Moments from one read of the source, var/std divide by n - correction (numpy's ddof)
+    NDArray<T> mean(const DimVec& axes, bool keepdims = false) const;
+    NDArray<T> var(const DimVec& axes, double correction = 0, bool keepdims = false) const;
+    NDArray<T> std(const DimVec& axes, double correction = 0, bool keepdims = false) const;
+    std::pair<NDArray<T>, NDArray<T>> mean_var(const DimVec& axes, double correction = 0, bool keepdims = false) const;
+    // Index of the max/min along axis, ties resolve to the first. topk gives the k largest (or
+    // smallest) values along axis with their indices, best first when sorted, else in index order
+    NDArray<int64_t> argmax(int64_t axis = -1, bool keepdims = false) const;
+    NDArray<int64_t> argmin(int64_t axis = -1, bool keepdims = false) const;
+    std::pair<NDArray<T>, NDArray<int64_t>> topk(size_t k, int64_t axis = -1, bool largest = true, bool sorted = true) const;
 
     DimVec get_shape() const;
     DimVec get_strides() const;
@@ -151,18 +227,243 @@ NDArray<T> scalar_pow(const NDArray<T> &a, T b);
 template <typename T>
 NDArray<T> matmul(const NDArray<T>& a, const NDArray<T>& b);
 
+// Int8 inference (quant_ops.inl). Symmetric quantization with one scale per channel along axis, and
+// x [..., K] @ w [K, N] on the int8 GEMM with per output channel w_scales and an optional bias. Float
+// x is quantized per row on the fly, int8 x comes with per row (or single) x_scales.
+inline std::pair<NDArray<int8_t>, NDArray<float>> quantize_per_channel(const NDArray<float> &x, int64_t axis);
+inline NDArray<float> dequantize(const NDArray<int8_t> &q, const NDArray<float> &scales, int64_t axis);
+inline NDArray<float> qmatmul(const NDArray<float> &x, const NDArray<int8_t> &w, const NDArray<float> &w_scales,
+                              const NDArray<float> *bias = nullptr);
+inline NDArray<float> qmatmul(const NDArray<int8_t> &x, const NDArray<float> &x_scales, const NDArray<int8_t> &w,
+                              const NDArray<float> &w_scales, const NDArray<float> *bias = nullptr);
+// As qmatmul on int8 x, with the result requantized to int8 at out_scale
+inline NDArray<int8_t> qmatmul_requantize(const NDArray<int8_t> &x, const NDArray<float> &x_scales,
+                                          const NDArray<int8_t> &w, const NDArray<float> &w_scales, float out_scale,
+                                          const NDArray<float> *bias = nullptr);
+
+// Convolution (conv_ops.inl). x is [N, C, H, W], or [N, H, W, C] with channels_last, and w is
+// [C_out, C_in / groups, KH, KW] in both layouts. conv1d is the same without H: x [N, C, L] or
+// [N, L, C], w [C_out, C_in / groups, K]. The backward functions give the input and weight gradients
+// from the output gradient.
+struct Conv2dParams
+{
+    size_t stride_h = 1, stride_w = 1;
+    size_t pad_h = 0, pad_w = 0;
+    size_t dilation_h = 1, dilation_w = 1;
+    size_t groups = 1;
+    bool channels_last = false;
+};
+
+struct Conv1dParams
+{
+    size_t stride = 1, padding = 0, dilation = 1, groups = 1;
+    bool channels_last = false;
+};
+
+inline NDArray<float> conv2d(const NDArray<float> &x, const NDArray<float> &w, const NDArray<float> *bias = nullptr,
+                             const Conv2dParams &p = Conv2dParams{});
+inline NDArray<float> conv2d_backward_input(const NDArray<float> &grad_out, const NDArray<float> &w,
+                                            const DimVec &x_shape, const Conv2dParams &p = Conv2dParams{});
+inline NDArray<float> conv2d_backward_weight(const NDArray<float> &grad_out, const NDArray<float> &x,
+                                             const DimVec &w_shape, const Conv2dParams &p = Conv2dParams{});
+inline NDArray<float> conv1d(const NDArray<float> &x, const NDArray<float> &w, const NDArray<float> *bias = nullptr,
+                             const Conv1dParams &p = Conv1dParams{});
+inline NDArray<float> conv1d_backward_input(const NDArray<float> &grad_out, const NDArray<float> &w,
+                                            const DimVec &x_shape, const Conv1dParams &p = Conv1dParams{});
+inline NDArray<float> conv1d_backward_weight(const NDArray<float> &grad_out, const NDArray<float> &x,
+                                             const DimVec &w_shape, const Conv1dParams &p = Conv1dParams{});
+
+// Pooling (pool_ops.inl) over x [N, C, H, W], or [N, H, W, C] with channels_last. Padding is at most half
+// the kernel, padded elements are skipped by max pooling and, unless count_include_pad, not counted
+// by average pooling. Max pooling can also return the flat index ih * W + iw of each max within its
+// input plane, which max_pool2d_backward scatters the gradient to.
+struct Pool2dParams
+{
+    size_t kernel_h = 1, kernel_w = 1;
+    size_t stride_h = 1, stride_w = 1;
+    size_t pad_h = 0, pad_w = 0;
+    bool ceil_mode = false;
+    bool count_include_pad = true;
+    bool channels_last = false;
+};
+
+inline NDArray<float> max_pool2d(const NDArray<float> &x, const Pool2dParams &p);
+inline std::pair<NDArray<float>, NDArray<int64_t>> max_pool2d_with_indices(const NDArray<float> &x, const Pool2dParams &p);
+inline NDArray<float> max_pool2d_backward(const NDArray<float> &grad_out, const NDArray<int64_t> &indices,
+                                          const DimVec &x_shape, bool channels_last = false);
+inline NDArray<float> avg_pool2d(const NDArray<float> &x, const Pool2dParams &p);
+inline NDArray<float> avg_pool2d_backward(const NDArray<float> &grad_out, const DimVec &x_shape, const Pool2dParams &p);
+inline NDArray<float> adaptive_avg_pool2d(const NDArray<float> &x, size_t out_h, size_t out_w, bool channels_last = false);
+inline NDArray<float> adaptive_avg_pool2d_backward(const NDArray<float> &grad_out, const DimVec &x_shape,
+                                                   bool channels_last = false);
+
+// out= variants, write the result into an existing view whose shape is the broadcast result shape.
+// Inputs may alias out.
+template <typename T>
+void ewise_add(const NDArray<T> &a, const NDArray<T> &b, NDArray<T> &out);
+template <typename T>
+void ewise_sub(const NDArray<T> &a, const NDArray<T> &b, NDArray<T> &out);
+template <typename T>
+void ewise_mul(const NDArray<T> &a, const NDArray<T> &b, NDArray<T> &out);
+template <typename T>
+void ewise_div(const NDArray<T> &a, const NDArray<T> &b, NDArray<T> &out);
+template <typename T>
+void ewise_pow(const NDArray<T> &a, const NDArray<T> &b, NDArray<T> &out);
+
+template <typename T>
+void scalar_add(const NDArray<T> &a, T b, NDArray<T> &out);
+template <typename T>
+void scalar_sub(const NDArray<T> &a, T b, NDArray<T> &out);
+template <typename T>
+void scalar_rsub(const NDArray<T> &a, T b, NDArray<T> &out);
+template <typename T>
+void scalar_mul(const NDArray<T> &a, T b, NDArray<T> &out);
+template <typename T>
+void scalar_div(const NDArray<T> &a, T b, NDArray<T> &out);
+template <typename T>
+void scalar_rdiv(const NDArray<T> &a, T b, NDArray<T> &out);
+template <typename T>
+void scalar_pow(const NDArray<T> &a, T b, NDArray<T> &out);
+
+enum class LazyOp : uint8_t;
+template <typename T>
+struct LazyNode;
+
+/**
+ * @brief Elementwise expression over NDArrays that is only computed when eval() is called.
+ *
+ * Unary, scalar and elementwise ops on a LazyArray record a node instead of running a kernel, eval()
+ * then computes the whole expression in one fused pass without materialising the intermediates.
+ *
+ * @tparam T The numeric data type of the array elements.
+ */
+template <typename T>
+class LazyArray
+{
+    std::shared_ptr<const LazyNode<T>> node;
+
+    explicit LazyArray(std::shared_ptr<const LazyNode<T>> node);
+    static LazyArray<T> unary(LazyOp op, const LazyArray<T> &a);
+    static LazyArray<T> binary(LazyOp op, const LazyArray<T> &a, const LazyArray<T> &b);
+    static LazyArray<T> scalar(LazyOp op, const LazyArray<T> &a, T b, bool reversed);
+
+public:
+    // Leaf referring to the view, later writes to it are seen by eval()
+    explicit LazyArray(const NDArray<T> &array);
+
+    DimVec get_shape() const;
+    // Compute the expression into a new array, or into an existing view of the same shape
+    NDArray<T> eval() const;
+    void eval(NDArray<T> &out) const;
+
+    // Unary ops
+    LazyArray<T> neg() const;
+    LazyArray<T> exp() const;
+    LazyArray<T> log() const;
+    LazyArray<T> sqrt() const;
+    LazyArray<T> sin() const;
+    LazyArray<T> cos() const;
+    LazyArray<T> tanh() const;
+    // Binary ops, broadcasting like the eager ones
+    LazyArray<T> add(const LazyArray<T> &other) const;
+    LazyArray<T> add(T scalar) const;
+    LazyArray<T> sub(const LazyArray<T> &other) const;
+    LazyArray<T> sub(T scalar) const;
+    LazyArray<T> rsub(T scalar) const;
+    LazyArray<T> mul(const LazyArray<T> &other) const;
+    LazyArray<T> mul(T scalar) const;
+    LazyArray<T> div(const LazyArray<T> &other) const;
+    LazyArray<T> div(T scalar) const;
+    LazyArray<T> rdiv(T scalar) const;
+    LazyArray<T> pow(const LazyArray<T> &other) const;
+    LazyArray<T> pow(T scalar) const;
+};
+
+enum class SparseFormat : uint8_t
+{
+    CSR, // row offsets into column indices and values, sorted by row and column, no duplicates
+    COO, // a row and a column index per value, in any order, duplicates add up
+};
+
+/**
+ * @brief A 2D matrix that stores only its non zero elements, in CSR or COO format (see sparse_ops.inl).
+ *
+ * The indices and values are compact 1D NDArrays (int64 indices), so they come from the Allocator and
+ * count towards memory_stats. The arrays are shared between copies and never written after
+ * construction. CSR is the compute format: ops on a COO matrix convert it first.
+ *
+ * @tparam T The numeric data type of the array elements.
+ */
+template <typename T>
+class SparseNDArray
+{
+    SparseFormat format;
+    DimVec shape;
+    NDArray<int64_t> rows; // row offsets (CSR, rows + 1 of them) or row indices (COO, one per value)
+    NDArray<int64_t> cols;
+    NDArray<T> values;
+
+    SparseNDArray(SparseFormat format, DimVec shape, NDArray<int64_t> rows, NDArray<int64_t> cols, NDArray<T> values);
+    template <typename U>
+    friend class SparseNDArray;
+
+public:
+    // From its arrays, checked against each other and the shape. Throws std::invalid_argument.
+    static SparseNDArray<T> csr(const DimVec &shape, const NDArray<int64_t> &row_offsets,
+                                const NDArray<int64_t> &col_indices, const NDArray<T> &values);
+    static SparseNDArray<T> coo(const DimVec &shape, const NDArray<int64_t> &row_indices,
+                                const NDArray<int64_t> &col_indices, const NDArray<T> &values);
+    // The non zero elements of a 2D array, in row major order
+    static SparseNDArray<T> from_dense(const NDArray<T> &dense, SparseFormat format = SparseFormat::CSR);
+
+    NDArray<T> to_dense() const;
+    SparseNDArray<T> to_csr() const;
+    SparseNDArray<T> to_coo() const;
+    // Same indices, values converted to element type U
+    template <typename U>
+    SparseNDArray<U> astype() const;
+
+    SparseFormat get_format() const;
+    DimVec get_shape() const;
+    size_t nnz() const;
+    NDArray<int64_t> get_rows() const;
+    NDArray<int64_t> get_cols() const;
+    NDArray<T> get_values() const;
+
+    // Dense sums along axis 1 ([rows]) or axis 0 ([cols])
+    NDArray<T> sum(int64_t axis = 1) const;
+    // Elementwise product with a dense array broadcast to the shape, keeping this sparsity pattern
+    SparseNDArray<T> multiply(const NDArray<T> &dense) const;
+};
+
+// Sparse a [M, K] @ dense b [K, N], parallel over blocks of rows holding equal shares of the non zeros
+template <typename T>
+NDArray<T> spmm(const SparseNDArray<T> &a, const NDArray<T> &b);
+
+#include <dtypes.inl>
 #include <compact_array.inl>
 #include <ndarray_core.inl>
 #include <ndarray_views.inl>
+#include <cast_ops.inl>
 #include <unary_ops.inl>
 #include <reduction_ops.inl>
+#include <softmax_ops.inl>
+#include <moments_ops.inl>
+#include <index_ops.inl>
 #include <ewise_ops.inl>
 #include <scalar_ops.inl>
+#include <lazy_ops.inl>
+#include <quant_ops.inl>
+#include <conv_ops.inl>
+#include <pool_ops.inl>
+#include <sparse_ops.inl>
 
 // extern template class instantiation, if file imports backend_cpu.hpp, it does not
 // implicitly create the template class 
 extern template class CompactArray<float>;
 extern template class NDArray<float>;
+extern template class LazyArray<float>;
+extern template class SparseNDArray<float>;
 
 extern template NDArray<float> ewise_add(const NDArray<float>&, const NDArray<float>&);
 extern template NDArray<float> ewise_sub(const NDArray<float>&, const NDArray<float>&);
@@ -179,4 +480,45 @@ extern template NDArray<float> scalar_pow(const NDArray<float>&, float);
 extern template NDArray<float> scalar_rsub(const NDArray<float>&, float);
 extern template NDArray<float> scalar_rdiv(const NDArray<float>&, float);
 extern template NDArray<float> matmul(const NDArray<float>& a, const NDArray<float>& b);
-
+extern template NDArray<float> spmm(const SparseNDArray<float>&, const NDArray<float>&);
+
+extern template void ewise_add(const NDArray<float>&, const NDArray<float>&, NDArray<float>&);
+extern template void ewise_sub(const NDArray<float>&, const NDArray<float>&, NDArray<float>&);
+extern template void ewise_mul(const NDArray<float>&, const NDArray<float>&, NDArray<float>&);
+extern template void ewise_div(const NDArray<float>&, const NDArray<float>&, NDArray<float>&);
+extern template void ewise_pow(const NDArray<float>&, const NDArray<float>&, NDArray<float>&);
+
+extern template void scalar_add(const NDArray<float>&, float, NDArray<float>&);
+extern template void scalar_sub(const NDArray<float>&, float, NDArray<float>&);
+extern template void scalar_rsub(const NDArray<float>&, float, NDArray<float>&);
+extern template void scalar_mul(const NDArray<float>&, float, NDArray<float>&);
+extern template void scalar_div(const NDArray<float>&, float, NDArray<float>&);
+extern template void scalar_rdiv(const NDArray<float>&, float, NDArray<float>&);
+extern template void scalar_pow(const NDArray<float>&, float, NDArray<float>&);
+
+// The other element types (dtypes.inl) are instantiated in backend_dtypes.cc, with the array classes
+// and the free ops that float instantiates above
+#define PHOTON_DTYPE_TEMPLATES(EXTERN, T)                                                   \
+    EXTERN template class CompactArray<T>;                                                  \
+    EXTERN template class NDArray<T>;                                                       \
+    EXTERN template NDArray<T> ewise_add(const NDArray<T> &, const NDArray<T> &);           \
+    EXTERN template NDArray<T> ewise_sub(const NDArray<T> &, const NDArray<T> &);           \
+    EXTERN template NDArray<T> ewise_mul(const NDArray<T> &, const NDArray<T> &);           \
+    EXTERN template NDArray<T> ewise_div(const NDArray<T> &, const NDArray<T> &);           \
+    EXTERN template NDArray<T> ewise_pow(const NDArray<T> &, const NDArray<T> &);           \
+    EXTERN template NDArray<T> scalar_add(const NDArray<T> &, T);                           \
+    EXTERN template NDArray<T> scalar_sub(const NDArray<T> &, T);                           \
+    EXTERN template NDArray<T> scalar_mul(const NDArray<T> &, T);                           \
+    EXTERN template NDArray<T> scalar_div(const NDArray<T> &, T);                           \
+    EXTERN template NDArray<T> scalar_pow(const NDArray<T> &, T);                           \
+    EXTERN template NDArray<T> scalar_rsub(const NDArray<T> &, T);                          \
+    EXTERN template NDArray<T> scalar_rdiv(const NDArray<T> &, T);                          \
+    EXTERN template NDArray<T> matmul(const NDArray<T> &, const NDArray<T> &);
+
+PHOTON_DTYPE_TEMPLATES(extern, double)
+PHOTON_DTYPE_TEMPLATES(extern, int32_t)
+PHOTON_DTYPE_TEMPLATES(extern, int64_t)
+PHOTON_DTYPE_TEMPLATES(extern, int8_t)
+PHOTON_DTYPE_TEMPLATES(extern, uint8_t)
+PHOTON_DTYPE_TEMPLATES(extern, bfloat16)
+PHOTON_DTYPE_TEMPLATES(extern, float16)
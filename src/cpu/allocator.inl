@@ -0,0 +1,291 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Host memory allocators behind CompactArray.
+ *
+ * Every block is 64 byte aligned (a cache line, and a full AVX-512 vector). Each CompactArray keeps a
+ * reference to the allocator it came from, so the process wide default can be swapped with
+ * set_allocator at any time, live arrays are still returned to their own allocator.
+ *
+ * The default CachingAllocator rounds requests up to a size class (four per power of two) and keeps
+ * freed blocks on a free list per class, so the short lived intermediates of a training step reuse
+ * memory instead of going back to malloc and faulting in fresh pages every time. The cache is bounded
+ * by a byte limit, trim releases cached blocks back to the system.
+ */
+
+struct AllocatorStats
+{
+    size_t hits = 0;              // allocations served from the cache
+    size_t misses = 0;            // allocations that went to the system
+    size_t bytes_in_use = 0;      // bytes handed out and not yet returned
+    size_t peak_bytes_in_use = 0; // high water mark of bytes_in_use
+    size_t bytes_cached = 0;      // bytes held on the free lists
+};
+
+class Allocator
+{
+public:
+    static constexpr size_t kAlignment = 64;
+
+    virtual ~Allocator() = default;
+
+    // Returns a kAlignment aligned block of at least bytes, throws std::bad_alloc on failure
+    virtual void *allocate(size_t bytes) = 0;
+    // bytes must be the size passed to allocate
+    virtual void deallocate(void *ptr, size_t bytes) = 0;
+    // Release cached blocks until at most max_cached_bytes remain cached
+    virtual void trim(size_t max_cached_bytes = 0) { (void)max_cached_bytes; }
+    virtual AllocatorStats stats() const { return {}; }
+    // Restart peak_bytes_in_use at the current bytes_in_use
+    virtual void reset_peak() {}
+    virtual std::string name() const = 0;
+
+protected:
+    static size_t round_up(size_t bytes, size_t multiple) { return (bytes + multiple - 1) / multiple * multiple; }
+
+    static void *system_allocate(size_t bytes)
+    {
+        void *ptr = std::aligned_alloc(kAlignment, round_up(bytes, kAlignment));
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+        return ptr;
+    }
+};
+
+// Aligned malloc/free, no caching
+class SystemAllocator : public Allocator
+{
+public:
+    void *allocate(size_t bytes) override
+    {
+        void *ptr = system_allocate(bytes);
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.misses++;
+        counters.bytes_in_use += bytes;
+        counters.peak_bytes_in_use = std::max(counters.peak_bytes_in_use, counters.bytes_in_use);
+        return ptr;
+    }
+
+    void deallocate(void *ptr, size_t bytes) override
+    {
+        std::free(ptr);
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.bytes_in_use -= bytes;
+    }
+
+    AllocatorStats stats() const override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counters;
+    }
+
+    void reset_peak() override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.peak_bytes_in_use = counters.bytes_in_use;
+    }
+
+    std::string name() const override { return "system"; }
+
+private:
+    mutable std::mutex mutex;
+    AllocatorStats counters;
+};
+
+// Size class bucketed free list cache over aligned malloc
+class CachingAllocator : public Allocator
+{
+public:
+    explicit CachingAllocator(size_t cache_limit_bytes = size_t(1) << 30) : cache_limit{cache_limit_bytes} {}
+
+    ~CachingAllocator() override { trim(0); }
+
+    void *allocate(size_t bytes) override
+    {
+        const size_t cls = size_class(bytes);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = free_lists.find(cls);
+            if (it != free_lists.end() && !it->second.empty())
+            {
+                void *ptr = it->second.back();
+                it->second.pop_back();
+                counters.hits++;
+                counters.bytes_cached -= cls;
+                track_alloc(cls);
+                return ptr;
+            }
+        }
+
+        void *ptr;
+        try
+        {
+            ptr = system_allocate(cls);
+        }
+        catch (const std::bad_alloc &)
+        {
+            // the cache may be holding the memory we need
+            trim(0);
+            ptr = system_allocate(cls);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.misses++;
+        track_alloc(cls);
+        return ptr;
+    }
+
+    void deallocate(void *ptr, size_t bytes) override
+    {
+        const size_t cls = size_class(bytes);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            counters.bytes_in_use -= cls;
+            if (counters.bytes_cached + cls <= cache_limit)
+            {
+                free_lists[cls].push_back(ptr);
+                counters.bytes_cached += cls;
+                return;
+            }
+        }
+        std::free(ptr);
+    }
+
+    void trim(size_t max_cached_bytes = 0) override
+    {
+        std::vector<void *> released;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            // largest classes first, they return the most memory per block
+            std::vector<size_t> classes;
+            for (const auto &entry : free_lists)
+                classes.push_back(entry.first);
+            std::sort(classes.begin(), classes.end(), std::greater<size_t>());
+            for (size_t cls : classes)
+            {
+                auto &list = free_lists[cls];
+                while (!list.empty() && counters.bytes_cached > max_cached_bytes)
+                {
+                    released.push_back(list.back());
+                    list.pop_back();
+                    counters.bytes_cached -= cls;
+                }
+                if (list.empty())
+                    free_lists.erase(cls);
+            }
+        }
+        for (void *ptr : released)
+            std::free(ptr);
+    }
+
+    AllocatorStats stats() const override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counters;
+    }
+
+    void reset_peak() override
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        counters.peak_bytes_in_use = counters.bytes_in_use;
+    }
+
+    std::string name() const override { return "caching"; }
+
+    void set_cache_limit(size_t bytes)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            cache_limit = bytes;
+        }
+        trim(bytes);
+    }
+
+    size_t get_cache_limit() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return cache_limit;
+    }
+
+    // Rounds up to one of four classes per power of two (at most 25% slack), never below the alignment
+    static size_t size_class(size_t bytes)
+    {
+        if (bytes <= kAlignment)
+            return kAlignment;
+        size_t pow2 = size_t(1) << (63 - __builtin_clzll(bytes - 1));
+        return round_up(bytes, std::max(pow2 / 4, kAlignment));
+    }
+
+private:
+    mutable std::mutex mutex;
+    std::unordered_map<size_t, std::vector<void *>> free_lists;
+    AllocatorStats counters;
+    size_t cache_limit;
+
+    // caller holds the mutex
+    void track_alloc(size_t cls)
+    {
+        counters.bytes_in_use += cls;
+        counters.peak_bytes_in_use = std::max(counters.peak_bytes_in_use, counters.bytes_in_use);
+    }
+};
+
+/*
+ * Process wide default, used by every new CompactArray
+ */
+
+inline std::shared_ptr<Allocator> &default_allocator_slot()
+{
+    static std::shared_ptr<Allocator> slot = std::make_shared<CachingAllocator>();
+    return slot;
+}
+
+inline std::mutex &default_allocator_mutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+inline std::shared_ptr<Allocator> get_allocator()
+{
+    std::lock_guard<std::mutex> lock(default_allocator_mutex());
+    return default_allocator_slot();
+}
+
+inline void set_allocator(std::shared_ptr<Allocator> allocator)
+{
+    if (!allocator)
+        throw std::invalid_argument("Allocator must not be null");
+    std::lock_guard<std::mutex> lock(default_allocator_mutex());
+    default_allocator_slot() = std::move(allocator);
+}
+
+// Swap the default for a fresh allocator by name, "caching" or "system"
+inline void set_allocator(const std::string &name)
+{
+    if (name == "caching")
+        set_allocator(std::make_shared<CachingAllocator>());
+    else if (name == "system")
+        set_allocator(std::make_shared<SystemAllocator>());
+    else
+        throw std::invalid_argument("Unknown allocator '" + name + "', expected 'caching' or 'system'");
+}
+
+// Byte limit of the default allocator's cache, only meaningful for the caching allocator
+inline void set_allocator_cache_limit(size_t bytes)
+{
+    auto caching = std::dynamic_pointer_cast<CachingAllocator>(get_allocator());
+    if (!caching)
+        throw std::invalid_argument("The current allocator does not cache");
+    caching->set_cache_limit(bytes);
+}
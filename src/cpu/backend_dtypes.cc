@@ -0,0 +1,9 @@
+#include <backend_cpu.hpp>
+// Instantiate the templates for the element types besides float, see dtypes.inl
+PHOTON_DTYPE_TEMPLATES(, double)
+PHOTON_DTYPE_TEMPLATES(, int32_t)
+PHOTON_DTYPE_TEMPLATES(, int64_t)
+PHOTON_DTYPE_TEMPLATES(, int8_t)
+PHOTON_DTYPE_TEMPLATES(, uint8_t)
+PHOTON_DTYPE_TEMPLATES(, bfloat16)
+PHOTON_DTYPE_TEMPLATES(, float16)
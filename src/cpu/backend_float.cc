@@ -2,6 +2,8 @@
 // Instantiate float versions of templates 
 template class CompactArray<float>;
 template class NDArray<float>;
+template class LazyArray<float>;
+template class SparseNDArray<float>;
 template NDArray<float> ewise_add(const NDArray<float>&, const NDArray<float>&);
 template NDArray<float> ewise_sub(const NDArray<float>&, const NDArray<float>&);
 template NDArray<float> ewise_mul(const NDArray<float>&, const NDArray<float>&);
@@ -18,3 +20,18 @@ template NDArray<float> scalar_rsub(const NDArray<float>&, float);
 template NDArray<float> scalar_rdiv(const NDArray<float>&, float);
 
 template NDArray<float> matmul(const NDArray<float>&, const NDArray<float>&);
+template NDArray<float> spmm(const SparseNDArray<float>&, const NDArray<float>&);
+
+template void ewise_add(const NDArray<float>&, const NDArray<float>&, NDArray<float>&);
+template void ewise_sub(const NDArray<float>&, const NDArray<float>&, NDArray<float>&);
+template void ewise_mul(const NDArray<float>&, const NDArray<float>&, NDArray<float>&);
+template void ewise_div(const NDArray<float>&, const NDArray<float>&, NDArray<float>&);
+template void ewise_pow(const NDArray<float>&, const NDArray<float>&, NDArray<float>&);
+
+template void scalar_add(const NDArray<float>&, float, NDArray<float>&);
+template void scalar_sub(const NDArray<float>&, float, NDArray<float>&);
+template void scalar_rsub(const NDArray<float>&, float, NDArray<float>&);
+template void scalar_mul(const NDArray<float>&, float, NDArray<float>&);
+template void scalar_div(const NDArray<float>&, float, NDArray<float>&);
+template void scalar_rdiv(const NDArray<float>&, float, NDArray<float>&);
+template void scalar_pow(const NDArray<float>&, float, NDArray<float>&);
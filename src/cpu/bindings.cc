@@ -1,13 +1,24 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <type_traits>
 #include <backend_cpu.hpp>
 
 namespace py = pybind11;
 
-auto process_slices(const NDArray<float> &self, const py::object &index)
+template <typename T>
+auto process_slices(const NDArray<T> &self, const py::object &index)
 {
     // populate slice_ranges then call slice func with it to return the new view.
-    std::vector<NDArray<float>::Slice> slice_ranges;
+    std::vector<typename NDArray<T>::Slice> slice_ranges;
     const auto &shape = self.get_shape();
 
     // Tuple of slices, single slice, or single index.
@@ -57,60 +68,601 @@ auto process_slices(const NDArray<float> &self, const py::object &index)
     return slice_ranges;
 }
 
+/*
+ * out= and in place adapters. Results are written through the given view, which is returned so the
+ * same Python object comes back.
+ */
+
+using FArray = NDArray<float>;
+
+template <typename Alloc, typename Into>
+py::object with_out(const py::object &out, Alloc alloc, Into into)
+{
+    if (out.is_none())
+        return py::cast(alloc());
+    into(out.cast<FArray &>());
+    return out;
+}
+
+template <FArray (FArray::*Alloc)() const, void (FArray::*Into)(FArray &) const>
+py::object unary_with_out(const FArray &self, const py::object &out)
+{
+    return with_out(out, [&]
+                    { return (self.*Alloc)(); }, [&](FArray &o)
+                    { (self.*Into)(o); });
+}
+
+template <FArray (*Alloc)(const FArray &, const FArray &), void (*Into)(const FArray &, const FArray &, FArray &)>
+py::object ewise_with_out(const FArray &a, const FArray &b, const py::object &out)
+{
+    return with_out(out, [&]
+                    { return Alloc(a, b); }, [&](FArray &o)
+                    { Into(a, b, o); });
+}
+
+template <FArray (*Alloc)(const FArray &, float), void (*Into)(const FArray &, float, FArray &)>
+py::object scalar_with_out(const FArray &a, float b, const py::object &out)
+{
+    return with_out(out, [&]
+                    { return Alloc(a, b); }, [&](FArray &o)
+                    { Into(a, b, o); });
+}
+
+template <FArray &(FArray::*Method)()>
+py::object inplace(py::object self)
+{
+    (self.cast<FArray &>().*Method)();
+    return self;
+}
+
+template <typename Arg, FArray &(FArray::*Method)(Arg)>
+py::object inplace(py::object self, Arg other)
+{
+    (self.cast<FArray &>().*Method)(other);
+    return self;
+}
+
+/*
+ * Convolution and pooling arguments. Window sizes, strides, padding and dilation are an int or an
+ * (h, w) pair, the layout is given as a string.
+ */
+
+static std::pair<size_t, size_t> int_pair(const py::object &v, const char *name)
+{
+    if (py::isinstance<py::int_>(v))
+    {
+        const size_t n = v.cast<size_t>();
+        return {n, n};
+    }
+    const auto t = v.cast<std::vector<size_t>>();
+    if (t.size() != 2)
+        throw std::invalid_argument(std::string(name) + " must be an int or a pair of ints");
+    return {t[0], t[1]};
+}
+
+// True for NHWC, false for NCHW
+static bool channels_last(const std::string &layout, const char *op)
+{
+    if (layout != "NCHW" && layout != "NHWC")
+        throw std::invalid_argument(std::string(op) + " layout must be NCHW or NHWC");
+    return layout == "NHWC";
+}
+
+static SparseFormat sparse_format(const std::string &format)
+{
+    if (format != "csr" && format != "coo")
+        throw std::invalid_argument("sparse format must be csr or coo");
+    return format == "csr" ? SparseFormat::CSR : SparseFormat::COO;
+}
+
+static Conv2dParams conv2d_params(const py::object &stride, const py::object &padding, const py::object &dilation,
+                                  size_t groups, const std::string &layout)
+{
+    Conv2dParams p;
+    std::tie(p.stride_h, p.stride_w) = int_pair(stride, "stride");
+    std::tie(p.pad_h, p.pad_w) = int_pair(padding, "padding");
+    std::tie(p.dilation_h, p.dilation_w) = int_pair(dilation, "dilation");
+    p.groups = groups;
+    p.channels_last = channels_last(layout, "conv2d");
+    return p;
+}
+
+// stride defaults to the kernel size
+static Pool2dParams pool2d_params(const py::object &kernel_size, const py::object &stride, const py::object &padding,
+                                  bool ceil_mode, bool count_include_pad, const std::string &layout, const char *op)
+{
+    Pool2dParams p;
+    std::tie(p.kernel_h, p.kernel_w) = int_pair(kernel_size, "kernel_size");
+    std::tie(p.stride_h, p.stride_w) = stride.is_none() ? std::make_pair(p.kernel_h, p.kernel_w) : int_pair(stride, "stride");
+    std::tie(p.pad_h, p.pad_w) = int_pair(padding, "padding");
+    p.ceil_mode = ceil_mode;
+    p.count_include_pad = count_include_pad;
+    p.channels_last = channels_last(layout, op);
+    return p;
+}
+
+static Conv1dParams conv1d_params(size_t stride, size_t padding, size_t dilation, size_t groups, const std::string &layout)
+{
+    if (layout != "NCL" && layout != "NLC")
+        throw std::invalid_argument("conv1d layout must be NCL or NLC");
+    return Conv1dParams{stride, padding, dilation, groups, layout == "NLC"};
+}
+
+/*
+ * Construction from NumPy arrays and other buffer exporters. Without copy the array is a view of the
+ * buffer's memory, which keeps the exporting object alive, with copy it gets its own compact storage
+ * filled in one pass (a single memcpy for C contiguous buffers).
+ */
+
+// Buffer protocol format of an element type, bfloat16 has none
+template <typename T>
+std::string buffer_format()
+{
+    if constexpr (std::is_same_v<T, float16>)
+        return "e";
+    else
+        return py::format_descriptor<T>::format();
+}
+
+// Whether a buffer holds T elements. NumPy spells 8 byte integers 'l' or 'q' depending on the
+// platform, so integers match on signedness and size.
+template <typename T>
+bool buffer_matches(const py::buffer_info &info)
+{
+    if (info.itemsize != sizeof(T))
+        return false;
+    if constexpr (std::is_integral_v<T>)
+    {
+        const char c = info.format.empty() ? '\0' : info.format.back();
+        return c != '\0' && std::strchr(std::is_signed_v<T> ? "bhilq" : "BHILQ", c) != nullptr;
+    }
+    return info.format == buffer_format<T>();
+}
+
+// Exports a view to NumPy without copying, strides in bytes
+template <typename T>
+py::buffer_info ndarray_buffer(NDArray<T> &m)
+{
+    DimVec strides_bytes = m.get_strides();
+    for (auto &s : strides_bytes)
+    {
+        s *= sizeof(T);
+    }
+
+    return py::buffer_info(
+        m.get_handle()->ptr() + m.get_offset(), // Pointer to the start of data
+        sizeof(T),
+        buffer_format<T>(), // Dtype
+        m.get_shape().size(), // Ndims
+        m.get_shape(),
+        strides_bytes);
+}
+
+// Copies the elements of a buffer view in row major order, strides in bytes and possibly negative
+template <typename T>
+void copy_buffer(const char *src, const std::vector<py::ssize_t> &shape, const std::vector<py::ssize_t> &strides, size_t dim, T *&dst)
+{
+    if (dim + 1 == shape.size())
+    {
+        for (py::ssize_t i = 0; i < shape[dim]; i++)
+            std::memcpy(dst++, src + i * strides[dim], sizeof(T));
+        return;
+    }
+    for (py::ssize_t i = 0; i < shape[dim]; i++)
+        copy_buffer(src + i * strides[dim], shape, strides, dim + 1, dst);
+}
+
+template <typename T>
+NDArray<T> ndarray_from_buffer(const py::buffer &buf, bool copy)
+{
+    // the export stays held for as long as a wrapping array lives, see the owner below
+    auto export_info = std::make_unique<py::buffer_info>(buf.request());
+    const py::buffer_info &info = *export_info;
+    if (!buffer_matches<T>(info))
+        throw py::type_error(std::string("expected a ") + dtype_name<T>() + " buffer, got format '" + info.format + "'");
+
+    // a 0-d buffer becomes a one element array
+    DimVec shape(info.shape.begin(), info.shape.end());
+    std::vector<py::ssize_t> shape_s(info.shape), strides_s(info.strides);
+    if (shape.empty())
+    {
+        shape = {1};
+        shape_s = {1};
+        strides_s = {sizeof(T)};
+    }
+    size_t size = 1;
+    for (size_t d : shape)
+        size *= d;
+
+    if (copy)
+    {
+        NDArray<T> result = NDArray<T>::empty(shape);
+        T *dst = result.get_handle()->ptr();
+        bool c_contiguous = true;
+        py::ssize_t expected = sizeof(T);
+        for (size_t d = shape.size(); d-- > 0;)
+        {
+            if (shape_s[d] != 1 && strides_s[d] != expected)
+                c_contiguous = false;
+            expected *= shape_s[d];
+        }
+        if (c_contiguous)
+            std::memcpy(dst, info.ptr, size * sizeof(T));
+        else if (size > 0)
+            copy_buffer(static_cast<const char *>(info.ptr), shape_s, strides_s, 0, dst);
+        return result;
+    }
+
+    if (info.readonly)
+        throw std::invalid_argument("cannot wrap a read-only buffer, pass copy=True");
+    if (reinterpret_cast<uintptr_t>(info.ptr) % alignof(T) != 0)
+        throw std::invalid_argument("cannot wrap a misaligned buffer, pass copy=True");
+    DimVec strides(shape.size());
+    size_t extent = size == 0 ? 0 : 1;
+    for (size_t d = 0; d < shape.size(); d++)
+    {
+        if (strides_s[d] < 0 || strides_s[d] % static_cast<py::ssize_t>(sizeof(T)) != 0)
+            throw std::invalid_argument("cannot wrap a buffer with negative or unaligned strides, pass copy=True");
+        strides[d] = strides_s[d] / sizeof(T);
+        if (size > 0)
+            extent += (shape[d] - 1) * strides[d];
+    }
+
+    // The owner holds the buffer export itself, not only the exporter, so a resizable exporter
+    // (bytearray, array.array) refuses to reallocate while the memory is wrapped. The export and
+    // its reference to the exporter are released under the GIL, whichever thread drops the last view.
+    std::shared_ptr<void> owner(export_info.release(), [](void *p)
+                                {
+        py::gil_scoped_acquire gil;
+        delete static_cast<py::buffer_info *>(p); });
+    auto handle = std::make_shared<CompactArray<T>>(static_cast<T *>(info.ptr), extent, std::move(owner));
+    return NDArray<T>(std::move(handle), shape, strides);
+}
+
+// a.astype(dtype), returning the array class of the named dtype
+template <typename T>
+py::object astype_by_name(const NDArray<T> &a, const std::string &dtype)
+{
+    return visit_dtype(dtype, [&](auto tag)
+                       { return py::cast(a.template astype<decltype(tag)>()); });
+}
+
+// Python scalar as element type T. Integer arrays take only integral scalars that fit, a / 0.5 or
+// a + 2.7 on them is an error rather than a silent / 0 or + 2.
+template <typename T, typename S>
+T scalar_as(S value)
+{
+    if constexpr (std::is_integral_v<T>)
+    {
+        bool fits;
+        if constexpr (std::is_floating_point_v<S>)
+        {
+            if (std::trunc(value) != value)
+                throw std::invalid_argument(std::string("non-integral scalar for a ") + dtype_name<T>() + " array");
+            // max + 1 is a power of two, so exact in double
+            fits = value >= static_cast<double>(std::numeric_limits<T>::lowest()) &&
+                   value < static_cast<double>(std::numeric_limits<T>::max()) + 1.0;
+        }
+        else
+        {
+            fits = value >= static_cast<S>(std::numeric_limits<T>::lowest()) &&
+                   value <= static_cast<S>(std::numeric_limits<T>::max());
+        }
+        if (!fits)
+            throw std::invalid_argument(std::string("scalar out of range for a ") + dtype_name<T>() + " array");
+    }
+    return static_cast<T>(value);
+}
+
+/**
+ * Binds NDArray<T> for an element type besides float as NDArray<Name>, with views, arithmetic against
+ * arrays and Python scalars, reductions, matmul and astype. The float class below is the full
+ * featured one, these mainly hold data (token ids, masks, half size activations) between casts.
+ */
+template <typename T>
+void bind_ndarray(py::module_ &m, const char *name)
+{
+    using A = NDArray<T>;
+    auto cls = py::class_<A>(m, name, py::buffer_protocol());
+    if constexpr (!std::is_same_v<T, bfloat16>)
+    {
+        // bfloat16 has no buffer format, it is converted from and to float32 with astype
+        cls.def(py::init(&ndarray_from_buffer<T>), py::arg("data"), py::arg("copy") = false)
+            .def_buffer(&ndarray_buffer<T>);
+    }
+    cls.def_static("empty", &A::empty, py::arg("shape"))
+        .def_property_readonly("dtype", [](const A &)
+                               { return dtype_name<T>(); })
+        .def("astype", &astype_by_name<T>, py::arg("dtype"))
+        .def_property_readonly("shape", &A::get_shape)
+        .def_property_readonly("strides", &A::get_strides)
+        .def("transpose", &A::transpose)
+        .def("reshape", &A::reshape)
+        .def("broadcast", &A::broadcast)
+        .def("make_compact", &A::make_compact)
+        .def("__getitem__", [](const A &self, py::object index)
+             { return self.slice(process_slices(self, index)); })
+        .def("__add__", py::overload_cast<const A &, const A &>(&ewise_add<T>), py::is_operator())
+        .def("__sub__", py::overload_cast<const A &, const A &>(&ewise_sub<T>), py::is_operator())
+        .def("__mul__", py::overload_cast<const A &, const A &>(&ewise_mul<T>), py::is_operator())
+        .def("__truediv__", py::overload_cast<const A &, const A &>(&ewise_div<T>), py::is_operator())
+        // Exact Python ints take the int64_t overloads in pybind's first, non-converting pass, so large int64
+        // scalars don't round through double. Anything else converts through the double overloads.
+        .def("__add__", [](const A &a, double b)
+             { return scalar_add(a, scalar_as<T>(b)); }, py::is_operator())
+        .def("__add__", [](const A &a, int64_t b)
+             { return scalar_add(a, scalar_as<T>(b)); }, py::is_operator())
+        .def("__sub__", [](const A &a, double b)
+             { return scalar_sub(a, scalar_as<T>(b)); }, py::is_operator())
+        .def("__sub__", [](const A &a, int64_t b)
+             { return scalar_sub(a, scalar_as<T>(b)); }, py::is_operator())
+        .def("__mul__", [](const A &a, double b)
+             { return scalar_mul(a, scalar_as<T>(b)); }, py::is_operator())
+        .def("__mul__", [](const A &a, int64_t b)
+             { return scalar_mul(a, scalar_as<T>(b)); }, py::is_operator())
+        .def("__truediv__", [](const A &a, double b)
+             { return scalar_div(a, scalar_as<T>(b)); }, py::is_operator())
+        .def("__truediv__", [](const A &a, int64_t b)
+             { return scalar_div(a, scalar_as<T>(b)); }, py::is_operator())
+        .def("__matmul__", &matmul<T>, py::is_operator())
+        .def("neg", py::overload_cast<>(&A::neg, py::const_))
+        .def("exp", py::overload_cast<>(&A::exp, py::const_))
+        .def("log", py::overload_cast<>(&A::log, py::const_))
+        .def("sum", &A::sum, py::arg("axes"), py::arg("keepdims") = false)
+        .def("max", &A::max, py::arg("axes"), py::arg("keepdims") = false)
+        .def("min", &A::min, py::arg("axes"), py::arg("keepdims") = false)
+        .def("mean", &A::mean, py::arg("axes"), py::arg("keepdims") = false)
+        .def("softmax", &A::softmax, py::arg("axis") = -1)
+        .def("argmax", &A::argmax, py::arg("axis") = -1, py::arg("keepdims") = false)
+        .def("argmin", &A::argmin, py::arg("axis") = -1, py::arg("keepdims") = false)
+        .def("topk", &A::topk, py::arg("k"), py::arg("axis") = -1, py::arg("largest") = true, py::arg("sorted") = true);
+}
+
+/*
+ * Profiling session handed out by profile(), it records between __enter__ and __exit__ and keeps the
+ * events afterwards for the table, summary and trace export.
+ */
+struct Profile
+{
+    std::vector<profiler::Event> events;
+};
+
+static py::list operands_list(const std::vector<profiler::Operand> &inputs)
+{
+    py::list l;
+    for (const auto &o : inputs)
+    {
+        py::dict d;
+        d["dtype"] = o.dtype;
+        d["shape"] = o.shape;
+        d["strides"] = o.strides;
+        l.append(d);
+    }
+    return l;
+}
+
+static py::list events_list(const std::vector<profiler::Event> &events)
+{
+    py::list l;
+    for (const auto &e : events)
+    {
+        py::dict d;
+        d["op"] = e.op;
+        d["inputs"] = operands_list(e.inputs);
+        d["output_bytes"] = e.output_bytes;
+        d["start_ns"] = e.start_ns;
+        d["duration_ns"] = e.duration_ns;
+        d["self_ns"] = e.self_ns;
+        d["thread"] = e.thread;
+        d["depth"] = e.depth;
+        l.append(d);
+    }
+    return l;
+}
+
+static py::list summary_list(const std::vector<profiler::Event> &events, bool group_by_inputs)
+{
+    py::list l;
+    for (const auto &s : profiler::summarize(events, group_by_inputs))
+    {
+        py::dict d;
+        d["op"] = s.op;
+        d["inputs"] = s.inputs;
+        d["calls"] = s.calls;
+        d["total_ns"] = s.total_ns;
+        d["self_ns"] = s.self_ns;
+        d["output_bytes"] = s.output_bytes;
+        l.append(d);
+    }
+    return l;
+}
+
 PYBIND11_MODULE(backend_cpu, m)
 {
+    // Thread pool shared by every CPU kernel, defaults to PHOTON_NUM_THREADS or the core count
+    m.def("set_num_threads", &set_num_threads, py::arg("n"));
+    m.def("get_num_threads", &get_num_threads);
+
+    // ISA used by the float exp/log/sin/cos/tanh/pow kernels, defaults to the widest one supported
+    m.def("available_isas", []
+          {
+        std::vector<std::string> names;
+        for (CpuIsa isa : simd_math::available_isas())
+            names.push_back(isa_name(isa));
+        return names; });
+    m.def("get_math_isa", &simd_math::get_math_isa);
+    m.def("set_math_isa", &simd_math::set_math_isa, py::arg("isa"));
+
+    // Allocator behind every array's storage, "caching" (default) or "system"
+    m.def("set_allocator", py::overload_cast<const std::string &>(&set_allocator), py::arg("name"));
+    m.def("get_allocator", []
+          { return get_allocator()->name(); });
+    m.def("allocator_stats", []
+          {
+        AllocatorStats s = get_allocator()->stats();
+        py::dict d;
+        d["hits"] = s.hits;
+        d["misses"] = s.misses;
+        d["bytes_in_use"] = s.bytes_in_use;
+        d["peak_bytes_in_use"] = s.peak_bytes_in_use;
+        d["bytes_cached"] = s.bytes_cached;
+        return d; });
+    m.def("trim_allocator_cache", [](size_t max_cached_bytes)
+          { get_allocator()->trim(max_cached_bytes); }, py::arg("max_cached_bytes") = 0);
+    m.def("set_allocator_cache_limit", &set_allocator_cache_limit, py::arg("bytes"));
+
+    // Memory held by live arrays whatever the allocator, and with tagging the op behind each allocation
+    m.def("memory_stats", []
+          {
+        MemoryStats s = memory_stats();
+        py::dict d;
+        d["live_bytes"] = s.live_bytes;
+        d["peak_live_bytes"] = s.peak_live_bytes;
+        d["live_allocations"] = s.live_allocations;
+        d["allocations"] = s.allocations;
+        d["bytes_cached"] = s.bytes_cached;
+        return d; });
+    m.def("reset_peak_stats", &reset_peak_stats);
+    m.def("set_allocation_tagging", &set_allocation_tagging, py::arg("on"));
+    m.def("get_allocation_tagging", &get_allocation_tagging);
+    m.def("live_allocations", [](size_t top)
+          {
+        py::list l;
+        for (const LiveAllocation &a : live_allocations(top))
+        {
+            py::dict d;
+            d["op"] = a.op;
+            d["dtype"] = a.dtype;
+            d["elements"] = a.elements;
+            d["bytes"] = a.bytes;
+            l.append(d);
+        }
+        return l; }, py::arg("top") = 10);
+    m.def("memory_summary", &memory_summary, py::arg("top") = 10);
+
+    // Per op profiler: with profile() as p, then p.table(), p.events or p.export_chrome_trace(path)
+    py::class_<Profile>(m, "Profile")
+        .def("__enter__", [](py::object self)
+             {
+        profiler::Session::instance().start();
+        self.cast<Profile &>().events.clear();
+        return self; })
+        .def("__exit__", [](Profile &self, py::args)
+             {
+        self.events = profiler::Session::instance().stop();
+        return false; })
+        .def("table", [](const Profile &self, bool group_by_inputs, size_t top)
+             { return profiler::format_table(self.events, group_by_inputs, top); },
+             py::arg("group_by_inputs") = true, py::arg("top") = 20)
+        .def("summary", [](const Profile &self, bool group_by_inputs)
+             { return summary_list(self.events, group_by_inputs); }, py::arg("group_by_inputs") = true)
+        .def("export_chrome_trace", [](const Profile &self, const std::string &path)
+             {
+        FILE *f = std::fopen(path.c_str(), "w");
+        if (!f)
+            throw std::invalid_argument("cannot open " + path + " for writing");
+        const std::string trace = profiler::chrome_trace(self.events);
+        std::fwrite(trace.data(), 1, trace.size(), f);
+        std::fclose(f); }, py::arg("path"))
+        .def_property_readonly("events", [](const Profile &self)
+                               { return events_list(self.events); })
+        .def("__str__", [](const Profile &self)
+             { return profiler::format_table(self.events, true, 20); });
+    m.def("profile", []
+          { return Profile{}; });
+
     py::class_<CompactArray<float>, std::shared_ptr<CompactArray<float>>>(m, "CompactArray")
         .def(py::init<const std::vector<float> &>())
-        .def_readonly("data", &CompactArray<float>::data)
+        .def_property_readonly("data", &CompactArray<float>::to_vector)
         .def("size", &CompactArray<float>::size)
         .def("print", &CompactArray<float>::print);
 
+    // Other element types, argmax/argmin/topk indices come back as NDArrayInt64
+    bind_ndarray<double>(m, "NDArrayFloat64");
+    bind_ndarray<int32_t>(m, "NDArrayInt32");
+    bind_ndarray<int64_t>(m, "NDArrayInt64");
+    bind_ndarray<int8_t>(m, "NDArrayInt8");
+    bind_ndarray<uint8_t>(m, "NDArrayUInt8");
+    bind_ndarray<bfloat16>(m, "NDArrayBFloat16");
+    bind_ndarray<float16>(m, "NDArrayFloat16");
+
     py::class_<NDArray<float>>(m, "NDArray", py::buffer_protocol())
+        // zero copy view of a float32 buffer such as a NumPy array, or a copy of it with copy=True
+        .def(py::init(&ndarray_from_buffer<float>), py::arg("data"), py::arg("copy") = false)
         .def(py::init<std::vector<float>, DimVec>())
         .def(py::init<std::vector<float>>())
-        .def_buffer([](NDArray<float> &m) -> py::buffer_info
-                    {
-        // Strides in B for numpy
-        DimVec strides_bytes = m.get_strides();
-        for (auto &s : strides_bytes)
-        {
-            s *= sizeof(float);
-        }
-
-        return py::buffer_info(
-            m.get_handle()->ptr() + m.get_offset(), // Pointer to the start of data
-            sizeof(float),
-            py::format_descriptor<float>::format(), // Dtype
-            m.get_shape().size(),                   // Ndims
-            m.get_shape(),
-            strides_bytes); })
+        // Uninitialised array, contents are whatever the allocator hands back
+        .def_static("empty", &NDArray<float>::empty, py::arg("shape"))
+        .def_buffer(&ndarray_buffer<float>)
+        .def_property_readonly("dtype", [](const FArray &)
+                               { return dtype_name<float>(); })
+        .def("astype", &astype_by_name<float>, py::arg("dtype"))
         .def("transpose", &NDArray<float>::transpose)
         // operator funcs, scalar and ewise
-        .def("__add__", &ewise_add<float>, py::is_operator())
-        .def("__add__", &scalar_add<float>, py::is_operator())
-        .def("__radd__", &scalar_add<float>, py::is_operator())
-        .def("__sub__", &ewise_sub<float>, py::is_operator())
-        .def("__sub__", &scalar_sub<float>, py::is_operator())
-        .def("__rsub__", &scalar_rsub<float>, py::is_operator())
-        .def("__mul__", &ewise_mul<float>, py::is_operator())
-        .def("__mul__", &scalar_mul<float>, py::is_operator())
-        .def("__rmul__", &scalar_mul<float>, py::is_operator())
-        .def("__truediv__", &ewise_div<float>, py::is_operator())
-        .def("__truediv__", &scalar_div<float>, py::is_operator())
-        .def("__rtruediv__", &scalar_rdiv<float>, py::is_operator())
-        .def("__pow__", &ewise_pow<float>, py::is_operator())
-        .def("__pow__", &scalar_pow<float>, py::is_operator())
-        .def("neg", &NDArray<float>::neg)
-        .def("exp", &NDArray<float>::exp)
-        .def("log", &NDArray<float>::log)
-        .def("sqrt", &NDArray<float>::sqrt)
-        .def("sin", &NDArray<float>::sin)
-        .def("cos", &NDArray<float>::cos)
-        .def("tanh", &NDArray<float>::tanh)
+        .def("__add__", py::overload_cast<const FArray &, const FArray &>(&ewise_add<float>), py::is_operator())
+        .def("__add__", py::overload_cast<const FArray &, float>(&scalar_add<float>), py::is_operator())
+        .def("__radd__", py::overload_cast<const FArray &, float>(&scalar_add<float>), py::is_operator())
+        .def("__sub__", py::overload_cast<const FArray &, const FArray &>(&ewise_sub<float>), py::is_operator())
+        .def("__sub__", py::overload_cast<const FArray &, float>(&scalar_sub<float>), py::is_operator())
+        .def("__rsub__", py::overload_cast<const FArray &, float>(&scalar_rsub<float>), py::is_operator())
+        .def("__mul__", py::overload_cast<const FArray &, const FArray &>(&ewise_mul<float>), py::is_operator())
+        .def("__mul__", py::overload_cast<const FArray &, float>(&scalar_mul<float>), py::is_operator())
+        .def("__rmul__", py::overload_cast<const FArray &, float>(&scalar_mul<float>), py::is_operator())
+        .def("__truediv__", py::overload_cast<const FArray &, const FArray &>(&ewise_div<float>), py::is_operator())
+        .def("__truediv__", py::overload_cast<const FArray &, float>(&scalar_div<float>), py::is_operator())
+        .def("__rtruediv__", py::overload_cast<const FArray &, float>(&scalar_rdiv<float>), py::is_operator())
+        .def("__pow__", py::overload_cast<const FArray &, const FArray &>(&ewise_pow<float>), py::is_operator())
+        .def("__pow__", py::overload_cast<const FArray &, float>(&scalar_pow<float>), py::is_operator())
+        // in place operators write through the view, the other operand broadcasts to its shape
+        .def("__iadd__", &inplace<const FArray &, &FArray::add_>, py::is_operator())
+        .def("__iadd__", &inplace<float, &FArray::add_>, py::is_operator())
+        .def("__isub__", &inplace<const FArray &, &FArray::sub_>, py::is_operator())
+        .def("__isub__", &inplace<float, &FArray::sub_>, py::is_operator())
+        .def("__imul__", &inplace<const FArray &, &FArray::mul_>, py::is_operator())
+        .def("__imul__", &inplace<float, &FArray::mul_>, py::is_operator())
+        .def("__itruediv__", &inplace<const FArray &, &FArray::div_>, py::is_operator())
+        .def("__itruediv__", &inplace<float, &FArray::div_>, py::is_operator())
+        .def("__ipow__", &inplace<const FArray &, &FArray::pow_>, py::is_operator())
+        .def("__ipow__", &inplace<float, &FArray::pow_>, py::is_operator())
+        .def("add_", &inplace<const FArray &, &FArray::add_>)
+        .def("add_", &inplace<float, &FArray::add_>)
+        .def("sub_", &inplace<const FArray &, &FArray::sub_>)
+        .def("sub_", &inplace<float, &FArray::sub_>)
+        .def("mul_", &inplace<const FArray &, &FArray::mul_>)
+        .def("mul_", &inplace<float, &FArray::mul_>)
+        .def("div_", &inplace<const FArray &, &FArray::div_>)
+        .def("div_", &inplace<float, &FArray::div_>)
+        .def("pow_", &inplace<const FArray &, &FArray::pow_>)
+        .def("pow_", &inplace<float, &FArray::pow_>)
+        // unary ops, optionally into an existing view with out=, or in place with the _ suffix
+        .def("neg", &unary_with_out<&FArray::neg, &FArray::neg>, py::arg("out") = py::none())
+        .def("exp", &unary_with_out<&FArray::exp, &FArray::exp>, py::arg("out") = py::none())
+        .def("log", &unary_with_out<&FArray::log, &FArray::log>, py::arg("out") = py::none())
+        .def("sqrt", &unary_with_out<&FArray::sqrt, &FArray::sqrt>, py::arg("out") = py::none())
+        .def("sin", &unary_with_out<&FArray::sin, &FArray::sin>, py::arg("out") = py::none())
+        .def("cos", &unary_with_out<&FArray::cos, &FArray::cos>, py::arg("out") = py::none())
+        .def("tanh", &unary_with_out<&FArray::tanh, &FArray::tanh>, py::arg("out") = py::none())
+        .def("neg_", &inplace<&FArray::neg_>)
+        .def("exp_", &inplace<&FArray::exp_>)
+        .def("log_", &inplace<&FArray::log_>)
+        .def("sqrt_", &inplace<&FArray::sqrt_>)
+        .def("sin_", &inplace<&FArray::sin_>)
+        .def("cos_", &inplace<&FArray::cos_>)
+        .def("tanh_", &inplace<&FArray::tanh_>)
         //reduction ops
         .def("sum", &NDArray<float>::sum)
         .def("min", &NDArray<float>::min)
         .def("max", &NDArray<float>::max)
+        .def("softmax", &NDArray<float>::softmax, py::arg("axis") = -1)
+        .def("log_softmax", &NDArray<float>::log_softmax, py::arg("axis") = -1)
+        .def("logsumexp", &NDArray<float>::logsumexp, py::arg("axes"), py::arg("keepdims") = false)
+        .def("mean", &NDArray<float>::mean, py::arg("axes"), py::arg("keepdims") = false)
+        .def("var", &NDArray<float>::var, py::arg("axes"), py::arg("correction") = 0.0, py::arg("keepdims") = false)
+        .def("std", &NDArray<float>::std, py::arg("axes"), py::arg("correction") = 0.0, py::arg("keepdims") = false)
+        .def("mean_var", &NDArray<float>::mean_var, py::arg("axes"), py::arg("correction") = 0.0, py::arg("keepdims") = false)
+        .def("argmax", &NDArray<float>::argmax, py::arg("axis") = -1, py::arg("keepdims") = false)
+        .def("argmin", &NDArray<float>::argmin, py::arg("axis") = -1, py::arg("keepdims") = false)
+        .def("topk", &NDArray<float>::topk, py::arg("k"), py::arg("axis") = -1, py::arg("largest") = true, py::arg("sorted") = true)
         .def("reshape", &NDArray<float>::reshape)
         .def("broadcast", &NDArray<float>::broadcast)
         .def("make_compact", &NDArray<float>::make_compact)
@@ -134,6 +686,198 @@ PYBIND11_MODULE(backend_cpu, m)
                  {
                      throw py::type_error("Value must be a scalar or NDArray");
                  } })
+        // deferred expression, ops on it fuse into one pass when a result is needed
+        .def("lazy", &NDArray<float>::lazy)
         .def_property_readonly("shape", &NDArray<float>::get_shape)
         .def_property_readonly("strides", &NDArray<float>::get_strides);
+
+    // Lazy expressions, NDArray operands are wrapped as leaves. Reductions, matmul and __array__
+    // evaluate the expression first.
+    using FLazy = LazyArray<float>;
+    py::class_<FLazy>(m, "LazyArray")
+        .def(py::init<const FArray &>())
+        .def("eval", [](const FLazy &self, const py::object &out)
+             { return with_out(out, [&]
+                               { return self.eval(); }, [&](FArray &o)
+                               { self.eval(o); }); }, py::arg("out") = py::none())
+        .def("__array__", [](const FLazy &self, py::args, py::kwargs)
+             { return py::module_::import("numpy").attr("asarray")(py::cast(self.eval())); })
+        .def("__add__", py::overload_cast<const FLazy &>(&FLazy::add, py::const_), py::is_operator())
+        .def("__add__", py::overload_cast<float>(&FLazy::add, py::const_), py::is_operator())
+        .def("__radd__", py::overload_cast<const FLazy &>(&FLazy::add, py::const_), py::is_operator())
+        .def("__radd__", py::overload_cast<float>(&FLazy::add, py::const_), py::is_operator())
+        .def("__sub__", py::overload_cast<const FLazy &>(&FLazy::sub, py::const_), py::is_operator())
+        .def("__sub__", py::overload_cast<float>(&FLazy::sub, py::const_), py::is_operator())
+        .def("__rsub__", [](const FLazy &self, const FLazy &other)
+             { return other.sub(self); }, py::is_operator())
+        .def("__rsub__", &FLazy::rsub, py::is_operator())
+        .def("__mul__", py::overload_cast<const FLazy &>(&FLazy::mul, py::const_), py::is_operator())
+        .def("__mul__", py::overload_cast<float>(&FLazy::mul, py::const_), py::is_operator())
+        .def("__rmul__", py::overload_cast<const FLazy &>(&FLazy::mul, py::const_), py::is_operator())
+        .def("__rmul__", py::overload_cast<float>(&FLazy::mul, py::const_), py::is_operator())
+        .def("__truediv__", py::overload_cast<const FLazy &>(&FLazy::div, py::const_), py::is_operator())
+        .def("__truediv__", py::overload_cast<float>(&FLazy::div, py::const_), py::is_operator())
+        .def("__rtruediv__", [](const FLazy &self, const FLazy &other)
+             { return other.div(self); }, py::is_operator())
+        .def("__rtruediv__", &FLazy::rdiv, py::is_operator())
+        .def("__pow__", py::overload_cast<const FLazy &>(&FLazy::pow, py::const_), py::is_operator())
+        .def("__pow__", py::overload_cast<float>(&FLazy::pow, py::const_), py::is_operator())
+        .def("__rpow__", [](const FLazy &self, const FLazy &other)
+             { return other.pow(self); }, py::is_operator())
+        .def("__neg__", &FLazy::neg)
+        .def("neg", &FLazy::neg)
+        .def("exp", &FLazy::exp)
+        .def("log", &FLazy::log)
+        .def("sqrt", &FLazy::sqrt)
+        .def("sin", &FLazy::sin)
+        .def("cos", &FLazy::cos)
+        .def("tanh", &FLazy::tanh)
+        .def("sum", [](const FLazy &self, const DimVec &axes, bool keepdims)
+             { return self.eval().sum(axes, keepdims); }, py::arg("axes"), py::arg("keepdims") = false)
+        .def("min", [](const FLazy &self, const DimVec &axes, bool keepdims)
+             { return self.eval().min(axes, keepdims); }, py::arg("axes"), py::arg("keepdims") = false)
+        .def("max", [](const FLazy &self, const DimVec &axes, bool keepdims)
+             { return self.eval().max(axes, keepdims); }, py::arg("axes"), py::arg("keepdims") = false)
+        .def("__matmul__", [](const FLazy &self, const FArray &other)
+             { return matmul(self.eval(), other); }, py::is_operator())
+        .def("__matmul__", [](const FLazy &self, const FLazy &other)
+             { return matmul(self.eval(), other.eval()); }, py::is_operator())
+        .def("__rmatmul__", [](const FLazy &self, const FArray &other)
+             { return matmul(other, self.eval()); }, py::is_operator())
+        .def_property_readonly("shape", &FLazy::get_shape);
+    py::implicitly_convertible<FArray, FLazy>();
+
+    // 2D sparse matrices: build from a dense array, or from index arrays with csr()/coo(). indptr is
+    // the CSR row offsets, row the COO row indices. Elementwise * with a dense array broadcasts it and
+    // keeps the sparsity pattern, @ (or spmm) with a dense [K, N] array gives a dense result. indices
+    // are the column indices in either format.
+    using FSparse = SparseNDArray<float>;
+    py::class_<FSparse>(m, "SparseNDArray")
+        .def_static("from_dense", [](const FArray &dense, const std::string &format)
+                    { return FSparse::from_dense(dense, sparse_format(format)); },
+                    py::arg("dense"), py::arg("format") = "csr")
+        .def_static("csr", &FSparse::csr, py::arg("shape"), py::arg("indptr"), py::arg("indices"), py::arg("values"))
+        .def_static("coo", &FSparse::coo, py::arg("shape"), py::arg("row"), py::arg("col"), py::arg("values"))
+        .def_property_readonly("shape", &FSparse::get_shape)
+        .def_property_readonly("nnz", &FSparse::nnz)
+        .def_property_readonly("format", [](const FSparse &self)
+                               { return self.get_format() == SparseFormat::CSR ? "csr" : "coo"; })
+        .def_property_readonly("indptr", [](const FSparse &self)
+                               {
+        if (self.get_format() != SparseFormat::CSR)
+            throw std::invalid_argument("indptr is only defined for csr, use row for coo");
+        return self.get_rows(); })
+        .def_property_readonly("row", [](const FSparse &self)
+                               {
+        if (self.get_format() != SparseFormat::COO)
+            throw std::invalid_argument("row is only defined for coo, use indptr for csr");
+        return self.get_rows(); })
+        .def_property_readonly("indices", &FSparse::get_cols)
+        .def_property_readonly("values", &FSparse::get_values)
+        .def("to_dense", &FSparse::to_dense)
+        .def("to_csr", &FSparse::to_csr)
+        .def("to_coo", &FSparse::to_coo)
+        .def("sum", &FSparse::sum, py::arg("axis") = 1)
+        .def("multiply", &FSparse::multiply, py::arg("dense"))
+        .def("__mul__", &FSparse::multiply, py::is_operator())
+        .def("__rmul__", &FSparse::multiply, py::is_operator())
+        .def("__matmul__", &spmm<float>, py::is_operator())
+        .def("__array__", [](const FSparse &self, py::args, py::kwargs)
+             { return py::module_::import("numpy").attr("asarray")(py::cast(self.to_dense())); });
+    m.def("spmm", &spmm<float>, py::arg("a"), py::arg("b"));
+
+    // Arithmetic with an optional out= view, b is an NDArray or a float
+    m.def("add", &ewise_with_out<&ewise_add<float>, &ewise_add<float>>, py::arg("a"), py::arg("b"), py::arg("out") = py::none());
+    m.def("add", &scalar_with_out<&scalar_add<float>, &scalar_add<float>>, py::arg("a"), py::arg("b"), py::arg("out") = py::none());
+    m.def("subtract", &ewise_with_out<&ewise_sub<float>, &ewise_sub<float>>, py::arg("a"), py::arg("b"), py::arg("out") = py::none());
+    m.def("subtract", &scalar_with_out<&scalar_sub<float>, &scalar_sub<float>>, py::arg("a"), py::arg("b"), py::arg("out") = py::none());
+    m.def("multiply", &ewise_with_out<&ewise_mul<float>, &ewise_mul<float>>, py::arg("a"), py::arg("b"), py::arg("out") = py::none());
+    m.def("multiply", &scalar_with_out<&scalar_mul<float>, &scalar_mul<float>>, py::arg("a"), py::arg("b"), py::arg("out") = py::none());
+    m.def("divide", &ewise_with_out<&ewise_div<float>, &ewise_div<float>>, py::arg("a"), py::arg("b"), py::arg("out") = py::none());
+    m.def("divide", &scalar_with_out<&scalar_div<float>, &scalar_div<float>>, py::arg("a"), py::arg("b"), py::arg("out") = py::none());
+    m.def("power", &ewise_with_out<&ewise_pow<float>, &ewise_pow<float>>, py::arg("a"), py::arg("b"), py::arg("out") = py::none());
+    m.def("power", &scalar_with_out<&scalar_pow<float>, &scalar_pow<float>>, py::arg("a"), py::arg("b"), py::arg("out") = py::none());
+
+    // Int8 inference: per channel symmetric quantization (weights [K, N] use axis=-1) and x @ w on the
+    // int8 GEMM. Float x is quantized per row on the fly, NDArrayInt8 x needs x_scales and gives an
+    // NDArrayInt8 when out_scale is set.
+    m.def("quantize_per_channel", &quantize_per_channel, py::arg("x"), py::arg("axis") = -1);
+    m.def("dequantize", &dequantize, py::arg("q"), py::arg("scales"), py::arg("axis") = -1);
+    m.def("qmatmul", [](const FArray &x, const NDArray<int8_t> &w, const FArray &w_scales, std::optional<FArray> bias)
+          { return qmatmul(x, w, w_scales, bias ? &*bias : nullptr); }, py::arg("x"), py::arg("w"), py::arg("w_scales"), py::arg("bias") = py::none());
+    m.def("qmatmul", [](const NDArray<int8_t> &x, const NDArray<int8_t> &w, const FArray &w_scales, const FArray &x_scales,
+                        std::optional<FArray> bias, std::optional<float> out_scale) -> py::object
+          {
+        const FArray *b = bias ? &*bias : nullptr;
+        if (out_scale)
+            return py::cast(qmatmul_requantize(x, x_scales, w, w_scales, *out_scale, b));
+        return py::cast(qmatmul(x, x_scales, w, w_scales, b)); },
+          py::arg("x"), py::arg("w"), py::arg("w_scales"), py::arg("x_scales"), py::arg("bias") = py::none(), py::arg("out_scale") = py::none());
+
+    // Convolution, x is NCHW / NHWC (NCL / NLC for conv1d) and w is [C_out, C_in / groups, KH, KW] in
+    // every layout. The backward functions take the shape of the array whose gradient they return.
+    m.def("conv2d", [](const FArray &x, const FArray &w, std::optional<FArray> bias, py::object stride, py::object padding,
+                       py::object dilation, size_t groups, const std::string &layout)
+          { return conv2d(x, w, bias ? &*bias : nullptr, conv2d_params(stride, padding, dilation, groups, layout)); },
+          py::arg("x"), py::arg("w"), py::arg("bias") = py::none(), py::arg("stride") = 1, py::arg("padding") = 0,
+          py::arg("dilation") = 1, py::arg("groups") = 1, py::arg("layout") = "NCHW");
+    m.def("conv2d_backward_input", [](const FArray &grad_out, const FArray &w, const DimVec &x_shape, py::object stride,
+                                      py::object padding, py::object dilation, size_t groups, const std::string &layout)
+          { return conv2d_backward_input(grad_out, w, x_shape, conv2d_params(stride, padding, dilation, groups, layout)); },
+          py::arg("grad_out"), py::arg("w"), py::arg("x_shape"), py::arg("stride") = 1, py::arg("padding") = 0,
+          py::arg("dilation") = 1, py::arg("groups") = 1, py::arg("layout") = "NCHW");
+    m.def("conv2d_backward_weight", [](const FArray &grad_out, const FArray &x, const DimVec &w_shape, py::object stride,
+                                       py::object padding, py::object dilation, size_t groups, const std::string &layout)
+          { return conv2d_backward_weight(grad_out, x, w_shape, conv2d_params(stride, padding, dilation, groups, layout)); },
+          py::arg("grad_out"), py::arg("x"), py::arg("w_shape"), py::arg("stride") = 1, py::arg("padding") = 0,
+          py::arg("dilation") = 1, py::arg("groups") = 1, py::arg("layout") = "NCHW");
+    m.def("conv1d", [](const FArray &x, const FArray &w, std::optional<FArray> bias, size_t stride, size_t padding,
+                       size_t dilation, size_t groups, const std::string &layout)
+          { return conv1d(x, w, bias ? &*bias : nullptr, conv1d_params(stride, padding, dilation, groups, layout)); },
+          py::arg("x"), py::arg("w"), py::arg("bias") = py::none(), py::arg("stride") = 1, py::arg("padding") = 0,
+          py::arg("dilation") = 1, py::arg("groups") = 1, py::arg("layout") = "NCL");
+    m.def("conv1d_backward_input", [](const FArray &grad_out, const FArray &w, const DimVec &x_shape, size_t stride,
+                                      size_t padding, size_t dilation, size_t groups, const std::string &layout)
+          { return conv1d_backward_input(grad_out, w, x_shape, conv1d_params(stride, padding, dilation, groups, layout)); },
+          py::arg("grad_out"), py::arg("w"), py::arg("x_shape"), py::arg("stride") = 1, py::arg("padding") = 0,
+          py::arg("dilation") = 1, py::arg("groups") = 1, py::arg("layout") = "NCL");
+    m.def("conv1d_backward_weight", [](const FArray &grad_out, const FArray &x, const DimVec &w_shape, size_t stride,
+                                       size_t padding, size_t dilation, size_t groups, const std::string &layout)
+          { return conv1d_backward_weight(grad_out, x, w_shape, conv1d_params(stride, padding, dilation, groups, layout)); },
+          py::arg("grad_out"), py::arg("x"), py::arg("w_shape"), py::arg("stride") = 1, py::arg("padding") = 0,
+          py::arg("dilation") = 1, py::arg("groups") = 1, py::arg("layout") = "NCL");
+
+    // Pooling over NCHW / NHWC, max_pool2d with return_indices gives (out, indices) where indices are
+    // flat positions within each input plane, as max_pool2d_backward takes them
+    m.def("max_pool2d", [](const FArray &x, py::object kernel_size, py::object stride, py::object padding, bool ceil_mode,
+                           bool return_indices, const std::string &layout) -> py::object
+          {
+        const Pool2dParams p = pool2d_params(kernel_size, stride, padding, ceil_mode, true, layout, "max_pool2d");
+        if (return_indices)
+            return py::cast(max_pool2d_with_indices(x, p));
+        return py::cast(max_pool2d(x, p)); },
+          py::arg("x"), py::arg("kernel_size"), py::arg("stride") = py::none(), py::arg("padding") = 0,
+          py::arg("ceil_mode") = false, py::arg("return_indices") = false, py::arg("layout") = "NCHW");
+    m.def("max_pool2d_backward", [](const FArray &grad_out, const NDArray<int64_t> &indices, const DimVec &x_shape,
+                                    const std::string &layout)
+          { return max_pool2d_backward(grad_out, indices, x_shape, channels_last(layout, "max_pool2d_backward")); },
+          py::arg("grad_out"), py::arg("indices"), py::arg("x_shape"), py::arg("layout") = "NCHW");
+    m.def("avg_pool2d", [](const FArray &x, py::object kernel_size, py::object stride, py::object padding, bool ceil_mode,
+                           bool count_include_pad, const std::string &layout)
+          { return avg_pool2d(x, pool2d_params(kernel_size, stride, padding, ceil_mode, count_include_pad, layout, "avg_pool2d")); },
+          py::arg("x"), py::arg("kernel_size"), py::arg("stride") = py::none(), py::arg("padding") = 0,
+          py::arg("ceil_mode") = false, py::arg("count_include_pad") = true, py::arg("layout") = "NCHW");
+    m.def("avg_pool2d_backward", [](const FArray &grad_out, const DimVec &x_shape, py::object kernel_size, py::object stride,
+                                    py::object padding, bool ceil_mode, bool count_include_pad, const std::string &layout)
+          { return avg_pool2d_backward(grad_out, x_shape, pool2d_params(kernel_size, stride, padding, ceil_mode, count_include_pad, layout, "avg_pool2d_backward")); },
+          py::arg("grad_out"), py::arg("x_shape"), py::arg("kernel_size"), py::arg("stride") = py::none(),
+          py::arg("padding") = 0, py::arg("ceil_mode") = false, py::arg("count_include_pad") = true, py::arg("layout") = "NCHW");
+    m.def("adaptive_avg_pool2d", [](const FArray &x, py::object output_size, const std::string &layout)
+          {
+        const auto [h, w] = int_pair(output_size, "output_size");
+        return adaptive_avg_pool2d(x, h, w, channels_last(layout, "adaptive_avg_pool2d")); },
+          py::arg("x"), py::arg("output_size"), py::arg("layout") = "NCHW");
+    m.def("adaptive_avg_pool2d_backward", [](const FArray &grad_out, const DimVec &x_shape, const std::string &layout)
+          { return adaptive_avg_pool2d_backward(grad_out, x_shape, channels_last(layout, "adaptive_avg_pool2d_backward")); },
+          py::arg("grad_out"), py::arg("x_shape"), py::arg("layout") = "NCHW");
 }
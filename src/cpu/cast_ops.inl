@@ -0,0 +1,50 @@
+#include <algorithm>
+#include <type_traits>
+#include <dtypes.inl>
+#include <profiler.inl>
+#include <strided_loop.inl>
+
+/**
+ * @brief astype, the elementwise conversion between element types.
+ *
+ * Conversions follow static_cast: floats to integers truncate toward zero, and anything to bfloat16
+ * or float16 rounds to nearest even. The 16 bit types are converted through float. The result is
+ * always a new compact array, also when U is T.
+ */
+
+template <typename U, typename T>
+U convert_element(T x)
+{
+    if constexpr (is_half_precision_v<T> && !std::is_same_v<U, float>)
+        return static_cast<U>(static_cast<float>(x));
+    else
+        return static_cast<U>(x);
+}
+
+template <typename T>
+template <typename U>
+NDArray<U> NDArray<T>::astype() const
+{
+    profiler::Scope prof("astype", *this);
+    NDArray<U> target = NDArray<U>::empty(shape);
+    prof.output(target);
+    U *dst_data = target.get_handle()->ptr();
+    const T *src_data = handle->ptr();
+
+    StridedLoop<2> loop(shape, {target.get_strides(), strides}, {0, offset});
+    loop.run_parallel(kElementwiseGrain, [&](const auto &offs, size_t n, const auto &st)
+                      {
+        U *dst = dst_data + offs[0];
+        const T *src = src_data + offs[1];
+        if (st[1] == 1)
+        {
+            for (size_t i = 0; i < n; i++)
+                dst[i] = convert_element<U>(src[i]);
+        }
+        else
+        {
+            for (std::ptrdiff_t i = 0; i < static_cast<std::ptrdiff_t>(n); i++)
+                dst[i] = convert_element<U>(src[i * st[1]]);
+        } });
+    return target;
+}
@@ -1,44 +1,84 @@
 #include <vector>
 #include <iostream>
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <allocator.inl>
+#include <memory_stats.inl>
 
 /*
  * Implementation of CompactArray methods.
  */
 
 template <typename T>
-CompactArray<T>::CompactArray(size_t size) : data(size) {}
+CompactArray<T>::CompactArray(size_t size) : _size{size}, _allocator{get_allocator()}
+{
+    _ptr = memory::allocate<T>(*_allocator, _size);
+    std::fill(_ptr, _ptr + _size, T{});
+}
+
+template <typename T>
+CompactArray<T>::CompactArray(size_t size, Uninitialized) : _size{size}, _allocator{get_allocator()}
+{
+    _ptr = memory::allocate<T>(*_allocator, _size);
+}
 
 template <typename T>
-CompactArray<T>::CompactArray(const std::vector<T> &input) : data(input) {}
+CompactArray<T>::CompactArray(const std::vector<T> &input) : _size{input.size()}, _allocator{get_allocator()}
+{
+    _ptr = memory::allocate<T>(*_allocator, _size);
+    std::copy(input.begin(), input.end(), _ptr);
+}
 
 template <typename T>
-CompactArray<T>::CompactArray(std::vector<T> &&input) : data{std::move(input)} {}
+CompactArray<T>::CompactArray(T *ptr, size_t size, std::shared_ptr<void> owner) : _ptr{ptr}, _size{size}, _owner{std::move(owner)}
+{
+}
+
+template <typename T>
+CompactArray<T>::~CompactArray()
+{
+    // external memory goes back to its owner when _owner is released
+    if (_ptr != nullptr && !_owner)
+        memory::deallocate(*_allocator, _ptr, _size);
+}
 
 template <typename T>
 size_t CompactArray<T>::size() const
 {
-    return data.size();
+    return _size;
 }
 
 template <typename T>
 void CompactArray<T>::print() const
 {
-    for (const auto &value : data)
+    for (size_t i = 0; i < _size; i++)
     {
-        std::cout << value << " ";
+        std::cout << _ptr[i] << " ";
     }
     std::cout << std::endl;
 }
 
+template <typename T>
+std::vector<T> CompactArray<T>::to_vector() const
+{
+    return std::vector<T>(_ptr, _ptr + _size);
+}
+
+template <typename T>
+bool CompactArray<T>::is_external() const
+{
+    return _owner != nullptr;
+}
+
 template <typename T>
 T *CompactArray<T>::ptr()
 {
-    return data.data();
+    return _ptr;
 }
 
 template <typename T>
 const T *CompactArray<T>::ptr() const
 {
-    return data.data();
+    return _ptr;
 }
-
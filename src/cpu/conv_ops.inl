@@ -0,0 +1,902 @@
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+#include <utility>
+#include <tuple>
+#include <optional>
+#include <stdexcept>
+#include <gemm.inl>
+#include <profiler.inl>
+#include <thread_pool.inl>
+
+/**
+ * @brief 2D (and, through a height of 1, 1D) convolution forward and backward on the float GEMM.
+ *
+ * Each group is a GEMM between its weights [C_out / groups, C_in / groups * KH * KW] and the im2col
+ * columns of its input. The columns are built one band of output rows at a time, sized so a band
+ * stays within kColumnBudget floats, so memory use is bounded by the band and not by the image or
+ * batch. NCHW lays the columns out as [C_in/g * KH * KW, band pixels] and multiplies weights @ columns
+ * straight into the output planes. NHWC lays them out as [band pixels, KH * KW * C_in/g], copying
+ * whole channel runs, and multiplies columns @ reordered weights straight into the output pixels.
+ * 1x1 convolutions with unit stride and no padding use the input itself as the columns.
+ *
+ * The input gradient is weights^T @ output gradient, scattered back with col2im. The weight gradient
+ * is the output gradient @ columns^T, accumulated over images and bands. Both are deterministic: a
+ * scatter or accumulation target is only ever written by one task.
+ *
+ * Depthwise convolutions (groups == C_in == C_out) would be GEMMs with a single output row, so they
+ * use direct kernels instead, vectorised along output columns (NCHW) or channels (NHWC).
+ *
+ * Work is split over images, groups and bands when there are at least as many as threads, otherwise
+ * tasks run in order and the GEMM and im2col inside them use the pool.
+ */
+
+namespace conv
+{
+    // Floats per im2col band buffer (4 MiB)
+    constexpr size_t kColumnBudget = size_t(1) << 20;
+    // Channels per task of the NHWC depthwise backward kernels
+    constexpr size_t kDepthwiseChannelBlock = 64;
+
+    // Sizes of one convolution, named as NCHW for both layouts
+    struct Geometry
+    {
+        size_t N, C, H, W;     // input
+        size_t K, KH, KW;      // output channels and kernel
+        size_t OH, OW;         // output
+        size_t groups, Cg, Kg; // input and output channels per group
+        size_t sh, sw, ph, pw, dh, dw;
+        bool channels_last;
+
+        // GEMM reduction length of one group
+        size_t kdim() const { return Cg * KH * KW; }
+        DimVec out_shape() const { return channels_last ? DimVec{N, OH, OW, K} : DimVec{N, K, OH, OW}; }
+        bool depthwise() const { return groups > 1 && groups == C && K == C; }
+        bool pointwise() const { return KH == 1 && KW == 1 && sh == 1 && sw == 1 && ph == 0 && pw == 0; }
+    };
+
+    inline Geometry make_geometry(const DimVec &x_shape, const DimVec &w_shape, const Conv2dParams &p)
+    {
+        if (x_shape.size() != 4 || w_shape.size() != 4)
+            throw std::invalid_argument("conv2d needs a 4D input and a 4D weight [C_out, C_in / groups, KH, KW]");
+        if (p.groups == 0 || p.stride_h == 0 || p.stride_w == 0 || p.dilation_h == 0 || p.dilation_w == 0)
+            throw std::invalid_argument("conv2d stride, dilation and groups must be positive");
+
+        Geometry g;
+        g.channels_last = p.channels_last;
+        g.N = x_shape[0];
+        g.C = p.channels_last ? x_shape[3] : x_shape[1];
+        g.H = p.channels_last ? x_shape[1] : x_shape[2];
+        g.W = p.channels_last ? x_shape[2] : x_shape[3];
+        g.K = w_shape[0];
+        g.KH = w_shape[2];
+        g.KW = w_shape[3];
+        g.groups = p.groups;
+        if (g.C % g.groups != 0 || g.K % g.groups != 0 || w_shape[1] * g.groups != g.C)
+            throw std::invalid_argument("conv2d weight [C_out, C_in / groups, KH, KW] does not match the input channels and groups");
+        g.Cg = g.C / g.groups;
+        g.Kg = g.K / g.groups;
+        g.sh = p.stride_h;
+        g.sw = p.stride_w;
+        g.ph = p.pad_h;
+        g.pw = p.pad_w;
+        g.dh = p.dilation_h;
+        g.dw = p.dilation_w;
+
+        if (g.KH == 0 || g.KW == 0 || g.H + 2 * g.ph < (g.KH - 1) * g.dh + 1 || g.W + 2 * g.pw < (g.KW - 1) * g.dw + 1)
+            throw std::invalid_argument("conv2d kernel is larger than the padded input");
+        g.OH = (g.H + 2 * g.ph - (g.KH - 1) * g.dh - 1) / g.sh + 1;
+        g.OW = (g.W + 2 * g.pw - (g.KW - 1) * g.dw - 1) / g.sw + 1;
+        return g;
+    }
+
+    inline NDArray<float> compact(const NDArray<float> &a) { return a.is_contiguous() ? a : a.make_compact(); }
+    inline const float *data_of(const NDArray<float> &a) { return a.get_handle()->ptr() + a.get_offset(); }
+
+    // [lo, hi) of the output positions o < out_len whose input position o * stride + offset is in [0, in_len)
+    inline std::pair<size_t, size_t> valid_range(size_t out_len, std::ptrdiff_t offset, size_t stride, size_t in_len)
+    {
+        const std::ptrdiff_t s = static_cast<std::ptrdiff_t>(stride);
+        const std::ptrdiff_t lo = offset < 0 ? (-offset + s - 1) / s : 0;
+        const std::ptrdiff_t hi = std::max<std::ptrdiff_t>(0, (static_cast<std::ptrdiff_t>(in_len) - offset + s - 1) / s);
+        const size_t h = std::min(static_cast<size_t>(hi), out_len);
+        return {std::min(static_cast<size_t>(lo), h), h};
+    }
+
+    // Input column offset and valid output column range of each kernel column kw
+    struct ColumnTap
+    {
+        std::ptrdiff_t off;
+        size_t lo, hi;
+    };
+
+    inline std::vector<ColumnTap> column_taps(const Geometry &g)
+    {
+        std::vector<ColumnTap> taps(g.KW);
+        for (size_t kw = 0; kw < g.KW; kw++)
+        {
+            taps[kw].off = static_cast<std::ptrdiff_t>(kw * g.dw) - static_cast<std::ptrdiff_t>(g.pw);
+            std::tie(taps[kw].lo, taps[kw].hi) = valid_range(g.OW, taps[kw].off, g.sw, g.W);
+        }
+        return taps;
+    }
+
+    // Input row (or column) read by output position o and kernel tap k, negative or >= len when in the padding
+    inline std::ptrdiff_t input_pos(size_t o, size_t stride, size_t k, size_t dilation, size_t pad)
+    {
+        return static_cast<std::ptrdiff_t>(o * stride + k * dilation) - static_cast<std::ptrdiff_t>(pad);
+    }
+
+    // Per thread buffers, for the im2col band and for the weight gradient's transposed output gradient
+    // and partial product
+    inline gemm::PackBuffer<> &column_buffer()
+    {
+        thread_local gemm::PackBuffer<> buf;
+        return buf;
+    }
+
+    inline gemm::PackBuffer<> &scratch_buffer()
+    {
+        thread_local gemm::PackBuffer<> buf;
+        return buf;
+    }
+
+    // Output rows per im2col band
+    inline size_t band_rows(const Geometry &g)
+    {
+        return std::clamp<size_t>(kColumnBudget / std::max<size_t>(1, g.kdim() * g.OW), 1, g.OH);
+    }
+
+    /**
+     * @brief fn(task) for every task. Tasks are spread over the pool when there are enough to occupy it,
+     * otherwise they run in order on the caller and the kernels inside them use the pool.
+     */
+    template <typename F>
+    void for_each_task(size_t tasks, F &&fn)
+    {
+        const bool spread = tasks >= get_num_threads();
+        parallel_for(0, tasks, spread ? 1 : tasks, [&](size_t lo, size_t hi)
+                     {
+            for (size_t t = lo; t < hi; t++)
+                fn(t); });
+    }
+
+    // dst[j * rows + i] = src[i * ld + j] for a rows x cols block
+    inline void transpose(const float *src, size_t ld, size_t rows, size_t cols, float *dst)
+    {
+        transpose_copy::transpose(src, ld, dst, rows, cols, rows);
+    }
+
+    /**
+     * @brief NCHW im2col of output rows [oh0, oh1) for one image and group: cols [kdim, P] with row
+     * (c * KH + kh) * KW + kw, where P = (oh1 - oh0) * OW. xg points at the group's first input plane.
+     */
+    inline void im2col_nchw(const Geometry &g, const float *xg, size_t oh0, size_t oh1, float *cols)
+    {
+        const size_t P = (oh1 - oh0) * g.OW;
+        parallel_for(0, g.kdim(), std::max<size_t>(1, kElementwiseGrain / P), [&](size_t lo, size_t hi)
+                     {
+            for (size_t r = lo; r < hi; r++)
+            {
+                const size_t c = r / (g.KH * g.KW), kh = r / g.KW % g.KH, kw = r % g.KW;
+                const float *plane = xg + c * g.H * g.W;
+                const std::ptrdiff_t off = input_pos(0, g.sw, kw, g.dw, g.pw);
+                const auto [lo_w, hi_w] = valid_range(g.OW, off, g.sw, g.W);
+                float *dst = cols + r * P;
+                for (size_t oh = oh0; oh < oh1; oh++, dst += g.OW)
+                {
+                    const std::ptrdiff_t ih = input_pos(oh, g.sh, kh, g.dh, g.ph);
+                    if (ih < 0 || ih >= static_cast<std::ptrdiff_t>(g.H))
+                    {
+                        std::fill(dst, dst + g.OW, 0.0f);
+                        continue;
+                    }
+                    const float *row = plane + ih * g.W;
+                    std::fill(dst, dst + lo_w, 0.0f);
+                    if (g.sw == 1)
+                        std::copy(row + (static_cast<std::ptrdiff_t>(lo_w) + off), row + (static_cast<std::ptrdiff_t>(hi_w) + off), dst + lo_w);
+                    else
+                        for (size_t ow = lo_w; ow < hi_w; ow++)
+                            dst[ow] = row[static_cast<std::ptrdiff_t>(ow * g.sw) + off];
+                    std::fill(dst + hi_w, dst + g.OW, 0.0f);
+                }
+            } });
+    }
+
+    // Adjoint of im2col_nchw: adds the columns back into the group's input gradient planes gxg
+    inline void col2im_nchw(const Geometry &g, const float *cols, size_t oh0, size_t oh1, float *gxg)
+    {
+        const size_t P = (oh1 - oh0) * g.OW;
+        const size_t taps = g.KH * g.KW;
+        // rows of one input channel add into the same plane, so channels are the unit of work
+        parallel_for(0, g.Cg, std::max<size_t>(1, kElementwiseGrain / (P * taps)), [&](size_t lo, size_t hi)
+                     {
+            for (size_t c = lo; c < hi; c++)
+            {
+                float *plane = gxg + c * g.H * g.W;
+                for (size_t kh = 0; kh < g.KH; kh++)
+                    for (size_t kw = 0; kw < g.KW; kw++)
+                    {
+                        const std::ptrdiff_t off = input_pos(0, g.sw, kw, g.dw, g.pw);
+                        const auto [lo_w, hi_w] = valid_range(g.OW, off, g.sw, g.W);
+                        const float *src = cols + ((c * g.KH + kh) * g.KW + kw) * P;
+                        for (size_t oh = oh0; oh < oh1; oh++, src += g.OW)
+                        {
+                            const std::ptrdiff_t ih = input_pos(oh, g.sh, kh, g.dh, g.ph);
+                            if (ih < 0 || ih >= static_cast<std::ptrdiff_t>(g.H))
+                                continue;
+                            float *row = plane + ih * g.W;
+                            for (size_t ow = lo_w; ow < hi_w; ow++)
+                                row[static_cast<std::ptrdiff_t>(ow * g.sw) + off] += src[ow];
+                        }
+                    }
+            } });
+    }
+
+    /**
+     * @brief NHWC im2col of output rows [oh0, oh1) for one image and group: cols [P, kdim] with column
+     * (kh * KW + kw) * Cg + c. xg points at the image's first pixel, offset to the group's channels.
+     */
+    inline void im2col_nhwc(const Geometry &g, const float *xg, size_t oh0, size_t oh1, float *cols)
+    {
+        const size_t P = (oh1 - oh0) * g.OW;
+        const size_t kdim = g.kdim();
+        parallel_for(0, P, std::max<size_t>(1, kElementwiseGrain / kdim), [&](size_t lo, size_t hi)
+                     {
+            for (size_t p = lo; p < hi; p++)
+            {
+                const size_t oh = oh0 + p / g.OW, ow = p % g.OW;
+                float *dst = cols + p * kdim;
+                for (size_t kh = 0; kh < g.KH; kh++)
+                {
+                    const std::ptrdiff_t ih = input_pos(oh, g.sh, kh, g.dh, g.ph);
+                    const bool row_valid = ih >= 0 && ih < static_cast<std::ptrdiff_t>(g.H);
+                    for (size_t kw = 0; kw < g.KW; kw++, dst += g.Cg)
+                    {
+                        const std::ptrdiff_t iw = input_pos(ow, g.sw, kw, g.dw, g.pw);
+                        if (!row_valid || iw < 0 || iw >= static_cast<std::ptrdiff_t>(g.W))
+                            std::fill(dst, dst + g.Cg, 0.0f);
+                        else
+                        {
+                            const float *src = xg + (ih * g.W + iw) * g.C;
+                            std::copy(src, src + g.Cg, dst);
+                        }
+                    }
+                }
+            } });
+    }
+
+    // Adjoint of im2col_nhwc. Neighbouring pixels overlap in the input, so this runs on one thread.
+    inline void col2im_nhwc(const Geometry &g, const float *cols, size_t oh0, size_t oh1, float *gxg)
+    {
+        const size_t P = (oh1 - oh0) * g.OW;
+        for (size_t p = 0; p < P; p++)
+        {
+            const size_t oh = oh0 + p / g.OW, ow = p % g.OW;
+            const float *src = cols + p * g.kdim();
+            for (size_t kh = 0; kh < g.KH; kh++)
+            {
+                const std::ptrdiff_t ih = input_pos(oh, g.sh, kh, g.dh, g.ph);
+                const bool row_valid = ih >= 0 && ih < static_cast<std::ptrdiff_t>(g.H);
+                for (size_t kw = 0; kw < g.KW; kw++, src += g.Cg)
+                {
+                    const std::ptrdiff_t iw = input_pos(ow, g.sw, kw, g.dw, g.pw);
+                    if (!row_valid || iw < 0 || iw >= static_cast<std::ptrdiff_t>(g.W))
+                        continue;
+                    float *dst = gxg + (ih * g.W + iw) * g.C;
+                    for (size_t c = 0; c < g.Cg; c++)
+                        dst[c] += src[c];
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Weights [K, Cg, KH, KW] reordered per group for the NHWC GEMMs. With transposed set it is
+     * [groups][kdim][Kg] (the B operand of the forward pass), otherwise [K][kdim] (the A operand of the
+     * input gradient), kdim ordered (kh, kw, c) in both.
+     */
+    inline NDArray<float> reorder_weights_nhwc(const Geometry &g, const float *w, bool transposed)
+    {
+        const size_t kdim = g.kdim();
+        NDArray<float> out = NDArray<float>::empty({g.K * kdim});
+        float *dst = out.get_handle()->ptr();
+        for (size_t k = 0; k < g.K; k++)
+        {
+            const size_t gi = k / g.Kg, kg = k % g.Kg;
+            for (size_t c = 0; c < g.Cg; c++)
+                for (size_t t = 0; t < g.KH * g.KW; t++)
+                {
+                    const size_t r = t * g.Cg + c;
+                    const float v = w[(k * g.Cg + c) * g.KH * g.KW + t];
+                    if (transposed)
+                        dst[(gi * kdim + r) * g.Kg + kg] = v;
+                    else
+                        dst[k * kdim + r] = v;
+                }
+        }
+        return out;
+    }
+
+    inline void forward_nchw(const Geometry &g, const float *x, const float *w, const float *bias, float *out)
+    {
+        const size_t kdim = g.kdim(), plane = g.OH * g.OW;
+        const size_t rows = g.pointwise() ? g.OH : band_rows(g);
+        const size_t bands = (g.OH + rows - 1) / rows;
+        for_each_task(g.N * g.groups * bands, [&](size_t t)
+                      {
+            const size_t n = t / (g.groups * bands), gi = t / bands % g.groups;
+            const size_t oh0 = t % bands * rows, oh1 = std::min(g.OH, oh0 + rows);
+            const size_t P = (oh1 - oh0) * g.OW;
+            const float *xg = x + (n * g.C + gi * g.Cg) * g.H * g.W;
+            float *dst = out + (n * g.K + gi * g.Kg) * plane + oh0 * g.OW;
+
+            if (g.pointwise())
+                gemm::sgemm(g.Kg, P, kdim, w + gi * g.Kg * kdim, kdim, xg, g.H * g.W, dst, plane);
+            else
+            {
+                float *cols = column_buffer().get(kdim * P);
+                im2col_nchw(g, xg, oh0, oh1, cols);
+                gemm::sgemm(g.Kg, P, kdim, w + gi * g.Kg * kdim, kdim, cols, P, dst, plane);
+            }
+            if (bias)
+                for (size_t k = 0; k < g.Kg; k++)
+                {
+                    const float b = bias[gi * g.Kg + k];
+                    for (size_t p = 0; p < P; p++)
+                        dst[k * plane + p] += b;
+                } });
+    }
+
+    inline void forward_nhwc(const Geometry &g, const float *x, const float *w, const float *bias, float *out)
+    {
+        const size_t kdim = g.kdim();
+        const NDArray<float> wt = reorder_weights_nhwc(g, w, true);
+        const float *wd = wt.get_handle()->ptr();
+        const auto add_bias = [&](float *dst, size_t P, size_t gi)
+        {
+            if (bias)
+                for (size_t p = 0; p < P; p++)
+                    for (size_t k = 0; k < g.Kg; k++)
+                        dst[p * g.K + k] += bias[gi * g.Kg + k];
+        };
+
+        if (g.pointwise())
+        {
+            // every pixel of the batch is one row of a single GEMM per group
+            const size_t P = g.N * g.H * g.W;
+            for_each_task(g.groups, [&](size_t gi)
+                          {
+                gemm::sgemm(P, g.Kg, kdim, x + gi * g.Cg, g.C, wd + gi * kdim * g.Kg, g.Kg, out + gi * g.Kg, g.K);
+                add_bias(out + gi * g.Kg, P, gi); });
+            return;
+        }
+
+        const size_t rows = band_rows(g);
+        const size_t bands = (g.OH + rows - 1) / rows;
+        for_each_task(g.N * g.groups * bands, [&](size_t t)
+                      {
+            const size_t n = t / (g.groups * bands), gi = t / bands % g.groups;
+            const size_t oh0 = t % bands * rows, oh1 = std::min(g.OH, oh0 + rows);
+            const size_t P = (oh1 - oh0) * g.OW;
+            float *cols = column_buffer().get(kdim * P);
+            im2col_nhwc(g, x + n * g.H * g.W * g.C + gi * g.Cg, oh0, oh1, cols);
+            float *dst = out + ((n * g.OH + oh0) * g.OW) * g.K + gi * g.Kg;
+            gemm::sgemm(P, g.Kg, kdim, cols, kdim, wd + gi * kdim * g.Kg, g.Kg, dst, g.K);
+            add_bias(dst, P, gi); });
+    }
+
+    inline void backward_input_nchw(const Geometry &g, const float *go, const float *w, float *gx)
+    {
+        const size_t kdim = g.kdim(), plane = g.OH * g.OW;
+        // weights transposed per group, [groups][kdim][Kg]
+        NDArray<float> wt_array = NDArray<float>::empty({g.K * kdim});
+        float *wt = wt_array.get_handle()->ptr();
+        for (size_t gi = 0; gi < g.groups; gi++)
+            transpose(w + gi * g.Kg * kdim, kdim, g.Kg, kdim, wt + gi * kdim * g.Kg);
+
+        const size_t rows = g.pointwise() ? g.OH : band_rows(g);
+        // bands of one image and group scatter into overlapping input rows, so they share a task
+        for_each_task(g.N * g.groups, [&](size_t t)
+                      {
+            const size_t n = t / g.groups, gi = t % g.groups;
+            float *gxg = gx + (n * g.C + gi * g.Cg) * g.H * g.W;
+            const float *gog = go + (n * g.K + gi * g.Kg) * plane;
+            const float *wg = wt + gi * kdim * g.Kg;
+            if (g.pointwise())
+            {
+                gemm::sgemm(g.Cg, plane, g.Kg, wg, g.Kg, gog, plane, gxg, g.H * g.W);
+                return;
+            }
+            std::fill(gxg, gxg + g.Cg * g.H * g.W, 0.0f);
+            for (size_t oh0 = 0; oh0 < g.OH; oh0 += rows)
+            {
+                const size_t oh1 = std::min(g.OH, oh0 + rows);
+                const size_t P = (oh1 - oh0) * g.OW;
+                float *cols = column_buffer().get(kdim * P);
+                gemm::sgemm(kdim, P, g.Kg, wg, g.Kg, gog + oh0 * g.OW, plane, cols, P);
+                col2im_nchw(g, cols, oh0, oh1, gxg);
+            } });
+    }
+
+    inline void backward_input_nhwc(const Geometry &g, const float *go, const float *w, float *gx)
+    {
+        const size_t kdim = g.kdim();
+        const NDArray<float> wr = reorder_weights_nhwc(g, w, false);
+        const float *wd = wr.get_handle()->ptr();
+
+        if (g.pointwise())
+        {
+            const size_t P = g.N * g.H * g.W;
+            for_each_task(g.groups, [&](size_t gi)
+                          { gemm::sgemm(P, g.Cg, g.Kg, go + gi * g.Kg, g.K, wd + gi * g.Kg * kdim, kdim, gx + gi * g.Cg, g.C); });
+            return;
+        }
+
+        const size_t rows = band_rows(g);
+        for_each_task(g.N * g.groups, [&](size_t t)
+                      {
+            const size_t n = t / g.groups, gi = t % g.groups;
+            float *gxg = gx + n * g.H * g.W * g.C + gi * g.Cg;
+            for (size_t p = 0; p < g.H * g.W; p++)
+                std::fill(gxg + p * g.C, gxg + p * g.C + g.Cg, 0.0f);
+            for (size_t oh0 = 0; oh0 < g.OH; oh0 += rows)
+            {
+                const size_t oh1 = std::min(g.OH, oh0 + rows);
+                const size_t P = (oh1 - oh0) * g.OW;
+                float *cols = column_buffer().get(kdim * P);
+                gemm::sgemm(P, kdim, g.Kg, go + ((n * g.OH + oh0) * g.OW) * g.K + gi * g.Kg, g.K,
+                            wd + gi * g.Kg * kdim, kdim, cols, kdim);
+                col2im_nhwc(g, cols, oh0, oh1, gxg);
+            } });
+    }
+
+    /**
+     * @brief Weight gradient of one group, summed over every image and band into acc. NCHW accumulates
+     * columns @ output gradient^T as [kdim, Kg], NHWC output gradient^T @ columns as [Kg, kdim].
+     */
+    inline void backward_weight_group(const Geometry &g, const float *go, const float *x, size_t gi, float *acc)
+    {
+        const size_t kdim = g.kdim(), plane = g.OH * g.OW;
+        const size_t rows = band_rows(g);
+        bool first = true;
+        for (size_t n = 0; n < g.N; n++)
+            for (size_t oh0 = 0; oh0 < g.OH; oh0 += rows)
+            {
+                const size_t oh1 = std::min(g.OH, oh0 + rows);
+                const size_t P = (oh1 - oh0) * g.OW;
+                float *scratch = scratch_buffer().get(g.Kg * P + (first ? 0 : kdim * g.Kg));
+                float *go_t = scratch;
+                // the first product initialises acc, later ones go through a partial buffer
+                float *part = first ? acc : scratch + g.Kg * P;
+
+                if (g.channels_last)
+                {
+                    const float *xg = x + n * g.H * g.W * g.C + gi * g.Cg;
+                    transpose(go + ((n * g.OH + oh0) * g.OW) * g.K + gi * g.Kg, g.K, P, g.Kg, go_t);
+                    if (g.pointwise())
+                        gemm::sgemm(g.Kg, kdim, P, go_t, P, xg + oh0 * g.W * g.C, g.C, part, kdim);
+                    else
+                    {
+                        float *cols = column_buffer().get(kdim * P);
+                        im2col_nhwc(g, xg, oh0, oh1, cols);
+                        gemm::sgemm(g.Kg, kdim, P, go_t, P, cols, kdim, part, kdim);
+                    }
+                }
+                else
+                {
+                    const float *xg = x + (n * g.C + gi * g.Cg) * g.H * g.W;
+                    transpose(go + (n * g.K + gi * g.Kg) * plane + oh0 * g.OW, plane, g.Kg, P, go_t);
+                    if (g.pointwise())
+                        gemm::sgemm(kdim, g.Kg, P, xg + oh0 * g.W, g.H * g.W, go_t, g.Kg, part, g.Kg);
+                    else
+                    {
+                        float *cols = column_buffer().get(kdim * P);
+                        im2col_nchw(g, xg, oh0, oh1, cols);
+                        gemm::sgemm(kdim, g.Kg, P, cols, P, go_t, g.Kg, part, g.Kg);
+                    }
+                }
+                if (!first)
+                    for (size_t i = 0; i < kdim * g.Kg; i++)
+                        acc[i] += part[i];
+                first = false;
+            }
+        if (first)
+            std::fill(acc, acc + kdim * g.Kg, 0.0f);
+    }
+
+    inline void backward_weight(const Geometry &g, const float *go, const float *x, float *gw)
+    {
+        const size_t kdim = g.kdim();
+        for_each_task(g.groups, [&](size_t gi)
+                      {
+            NDArray<float> acc_array = NDArray<float>::empty({kdim * g.Kg});
+            float *acc = acc_array.get_handle()->ptr();
+            backward_weight_group(g, go, x, gi, acc);
+            // back to [K, Cg, KH, KW]
+            for (size_t k = 0; k < g.Kg; k++)
+                for (size_t c = 0; c < g.Cg; c++)
+                    for (size_t t = 0; t < g.KH * g.KW; t++)
+                    {
+                        const size_t r = g.channels_last ? t * g.Cg + c : c * g.KH * g.KW + t;
+                        gw[((gi * g.Kg + k) * g.Cg + c) * g.KH * g.KW + t] =
+                            g.channels_last ? acc[k * kdim + r] : acc[r * g.Kg + k];
+                    } });
+    }
+
+    /**
+     * @brief Direct depthwise kernels. NCHW works a plane at a time and runs along output rows, NHWC a
+     * pixel at a time along channels with the weights reordered to [KH * KW, C].
+     */
+    inline void depthwise_forward(const Geometry &g, const float *x, const float *w, const float *bias, float *out)
+    {
+        const size_t taps = g.KH * g.KW;
+        if (!g.channels_last)
+        {
+            const std::vector<ColumnTap> cols_w = column_taps(g);
+            parallel_for(0, g.N * g.C, 1, [&](size_t lo, size_t hi)
+                         {
+                for (size_t pl = lo; pl < hi; pl++)
+                {
+                    const size_t c = pl % g.C;
+                    const float *xp = x + pl * g.H * g.W;
+                    const float *wc = w + c * taps;
+                    float *op = out + pl * g.OH * g.OW;
+                    for (size_t oh = 0; oh < g.OH; oh++)
+                    {
+                        float *o = op + oh * g.OW;
+                        std::fill(o, o + g.OW, bias ? bias[c] : 0.0f);
+                        for (size_t kh = 0; kh < g.KH; kh++)
+                        {
+                            const std::ptrdiff_t ih = input_pos(oh, g.sh, kh, g.dh, g.ph);
+                            if (ih < 0 || ih >= static_cast<std::ptrdiff_t>(g.H))
+                                continue;
+                            const float *row = xp + ih * g.W;
+                            for (size_t kw = 0; kw < g.KW; kw++)
+                            {
+                                const float wv = wc[kh * g.KW + kw];
+                                const auto [off, lo_w, hi_w] = cols_w[kw];
+                                if (g.sw == 1)
+                                {
+                                    const float *src = row + (static_cast<std::ptrdiff_t>(lo_w) + off);
+                                    for (size_t i = 0; i < hi_w - lo_w; i++)
+                                        o[lo_w + i] += wv * src[i];
+                                }
+                                else
+                                    for (size_t ow = lo_w; ow < hi_w; ow++)
+                                        o[ow] += wv * row[static_cast<std::ptrdiff_t>(ow * g.sw) + off];
+                            }
+                        }
+                    }
+                } });
+            return;
+        }
+
+        std::vector<float> wt(taps * g.C);
+        for (size_t c = 0; c < g.C; c++)
+            for (size_t t = 0; t < taps; t++)
+                wt[t * g.C + c] = w[c * taps + t];
+        parallel_for(0, g.N * g.OH, 1, [&](size_t lo, size_t hi)
+                     {
+            for (size_t r = lo; r < hi; r++)
+            {
+                const size_t n = r / g.OH, oh = r % g.OH;
+                for (size_t ow = 0; ow < g.OW; ow++)
+                {
+                    float *o = out + (r * g.OW + ow) * g.C;
+                    if (bias)
+                        std::copy(bias, bias + g.C, o);
+                    else
+                        std::fill(o, o + g.C, 0.0f);
+                    for (size_t kh = 0; kh < g.KH; kh++)
+                    {
+                        const std::ptrdiff_t ih = input_pos(oh, g.sh, kh, g.dh, g.ph);
+                        if (ih < 0 || ih >= static_cast<std::ptrdiff_t>(g.H))
+                            continue;
+                        for (size_t kw = 0; kw < g.KW; kw++)
+                        {
+                            const std::ptrdiff_t iw = input_pos(ow, g.sw, kw, g.dw, g.pw);
+                            if (iw < 0 || iw >= static_cast<std::ptrdiff_t>(g.W))
+                                continue;
+                            const float *xp = x + ((n * g.H + ih) * g.W + iw) * g.C;
+                            const float *wk = wt.data() + (kh * g.KW + kw) * g.C;
+                            for (size_t c = 0; c < g.C; c++)
+                                o[c] += wk[c] * xp[c];
+                        }
+                    }
+                }
+            } });
+    }
+
+    inline void depthwise_backward_input(const Geometry &g, const float *go, const float *w, float *gx)
+    {
+        const size_t taps = g.KH * g.KW;
+        if (!g.channels_last)
+        {
+            const std::vector<ColumnTap> cols_w = column_taps(g);
+            parallel_for(0, g.N * g.C, 1, [&](size_t lo, size_t hi)
+                         {
+                for (size_t pl = lo; pl < hi; pl++)
+                {
+                    const float *wc = w + (pl % g.C) * taps;
+                    const float *gp = go + pl * g.OH * g.OW;
+                    float *xp = gx + pl * g.H * g.W;
+                    std::fill(xp, xp + g.H * g.W, 0.0f);
+                    for (size_t oh = 0; oh < g.OH; oh++)
+                    {
+                        const float *grow = gp + oh * g.OW;
+                        for (size_t kh = 0; kh < g.KH; kh++)
+                        {
+                            const std::ptrdiff_t ih = input_pos(oh, g.sh, kh, g.dh, g.ph);
+                            if (ih < 0 || ih >= static_cast<std::ptrdiff_t>(g.H))
+                                continue;
+                            float *row = xp + ih * g.W;
+                            for (size_t kw = 0; kw < g.KW; kw++)
+                            {
+                                const float wv = wc[kh * g.KW + kw];
+                                const auto [off, lo_w, hi_w] = cols_w[kw];
+                                if (g.sw == 1)
+                                {
+                                    float *dst = row + (static_cast<std::ptrdiff_t>(lo_w) + off);
+                                    for (size_t i = 0; i < hi_w - lo_w; i++)
+                                        dst[i] += wv * grow[lo_w + i];
+                                }
+                                else
+                                    for (size_t ow = lo_w; ow < hi_w; ow++)
+                                        row[static_cast<std::ptrdiff_t>(ow * g.sw) + off] += wv * grow[ow];
+                            }
+                        }
+                    }
+                } });
+            return;
+        }
+
+        std::vector<float> wt(taps * g.C);
+        for (size_t c = 0; c < g.C; c++)
+            for (size_t t = 0; t < taps; t++)
+                wt[t * g.C + c] = w[c * taps + t];
+        // pixels of an image overlap in the input, tasks are (image, channel block)
+        const size_t blocks = (g.C + kDepthwiseChannelBlock - 1) / kDepthwiseChannelBlock;
+        parallel_for(0, g.N * blocks, 1, [&](size_t lo, size_t hi)
+                     {
+            for (size_t t = lo; t < hi; t++)
+            {
+                const size_t n = t / blocks;
+                const size_t c0 = t % blocks * kDepthwiseChannelBlock, c1 = std::min(g.C, c0 + kDepthwiseChannelBlock);
+                float *gxn = gx + n * g.H * g.W * g.C;
+                for (size_t p = 0; p < g.H * g.W; p++)
+                    std::fill(gxn + p * g.C + c0, gxn + p * g.C + c1, 0.0f);
+                for (size_t oh = 0; oh < g.OH; oh++)
+                    for (size_t ow = 0; ow < g.OW; ow++)
+                    {
+                        const float *gp = go + ((n * g.OH + oh) * g.OW + ow) * g.C;
+                        for (size_t kh = 0; kh < g.KH; kh++)
+                        {
+                            const std::ptrdiff_t ih = input_pos(oh, g.sh, kh, g.dh, g.ph);
+                            if (ih < 0 || ih >= static_cast<std::ptrdiff_t>(g.H))
+                                continue;
+                            for (size_t kw = 0; kw < g.KW; kw++)
+                            {
+                                const std::ptrdiff_t iw = input_pos(ow, g.sw, kw, g.dw, g.pw);
+                                if (iw < 0 || iw >= static_cast<std::ptrdiff_t>(g.W))
+                                    continue;
+                                float *xp = gxn + (ih * g.W + iw) * g.C;
+                                const float *wk = wt.data() + (kh * g.KW + kw) * g.C;
+                                for (size_t c = c0; c < c1; c++)
+                                    xp[c] += wk[c] * gp[c];
+                            }
+                        }
+                    }
+            } });
+    }
+
+    inline void depthwise_backward_weight(const Geometry &g, const float *go, const float *x, float *gw)
+    {
+        const size_t taps = g.KH * g.KW;
+        if (!g.channels_last)
+        {
+            const std::vector<ColumnTap> cols_w = column_taps(g);
+            parallel_for(0, g.C, 1, [&](size_t lo, size_t hi)
+                         {
+                // per tap running products along an output row, summed once at the end
+                std::vector<float> acc(taps * g.OW);
+                for (size_t c = lo; c < hi; c++)
+                {
+                    std::fill(acc.begin(), acc.end(), 0.0f);
+                    for (size_t n = 0; n < g.N; n++)
+                    {
+                        const float *xp = x + (n * g.C + c) * g.H * g.W;
+                        const float *gp = go + (n * g.C + c) * g.OH * g.OW;
+                        for (size_t oh = 0; oh < g.OH; oh++)
+                        {
+                            const float *grow = gp + oh * g.OW;
+                            for (size_t kh = 0; kh < g.KH; kh++)
+                            {
+                                const std::ptrdiff_t ih = input_pos(oh, g.sh, kh, g.dh, g.ph);
+                                if (ih < 0 || ih >= static_cast<std::ptrdiff_t>(g.H))
+                                    continue;
+                                const float *row = xp + ih * g.W;
+                                for (size_t kw = 0; kw < g.KW; kw++)
+                                {
+                                    float *a = acc.data() + (kh * g.KW + kw) * g.OW;
+                                    const auto [off, lo_w, hi_w] = cols_w[kw];
+                                    for (size_t ow = lo_w; ow < hi_w; ow++)
+                                        a[ow] += grow[ow] * row[static_cast<std::ptrdiff_t>(ow * g.sw) + off];
+                                }
+                            }
+                        }
+                    }
+                    for (size_t t = 0; t < taps; t++)
+                    {
+                        float s = 0.0f;
+                        for (size_t ow = 0; ow < g.OW; ow++)
+                            s += acc[t * g.OW + ow];
+                        gw[c * taps + t] = s;
+                    }
+                } });
+            return;
+        }
+
+        const size_t blocks = (g.C + kDepthwiseChannelBlock - 1) / kDepthwiseChannelBlock;
+        parallel_for(0, blocks, 1, [&](size_t lo, size_t hi)
+                     {
+            std::vector<float> acc(taps * kDepthwiseChannelBlock);
+            for (size_t b = lo; b < hi; b++)
+            {
+                const size_t c0 = b * kDepthwiseChannelBlock, c1 = std::min(g.C, c0 + kDepthwiseChannelBlock);
+                const size_t cb = c1 - c0;
+                std::fill(acc.begin(), acc.end(), 0.0f);
+                for (size_t n = 0; n < g.N; n++)
+                    for (size_t oh = 0; oh < g.OH; oh++)
+                        for (size_t ow = 0; ow < g.OW; ow++)
+                        {
+                            const float *gp = go + ((n * g.OH + oh) * g.OW + ow) * g.C + c0;
+                            for (size_t kh = 0; kh < g.KH; kh++)
+                            {
+                                const std::ptrdiff_t ih = input_pos(oh, g.sh, kh, g.dh, g.ph);
+                                if (ih < 0 || ih >= static_cast<std::ptrdiff_t>(g.H))
+                                    continue;
+                                for (size_t kw = 0; kw < g.KW; kw++)
+                                {
+                                    const std::ptrdiff_t iw = input_pos(ow, g.sw, kw, g.dw, g.pw);
+                                    if (iw < 0 || iw >= static_cast<std::ptrdiff_t>(g.W))
+                                        continue;
+                                    const float *xp = x + ((n * g.H + ih) * g.W + iw) * g.C + c0;
+                                    float *a = acc.data() + (kh * g.KW + kw) * kDepthwiseChannelBlock;
+                                    for (size_t c = 0; c < cb; c++)
+                                        a[c] += gp[c] * xp[c];
+                                }
+                            }
+                        }
+                for (size_t c = 0; c < cb; c++)
+                    for (size_t t = 0; t < taps; t++)
+                        gw[(c0 + c) * taps + t] = acc[t * kDepthwiseChannelBlock + c];
+            } });
+    }
+
+    inline Geometry checked_backward_geometry(const DimVec &grad_shape, const DimVec &x_shape, const DimVec &w_shape,
+                                              const Conv2dParams &p)
+    {
+        const Geometry g = make_geometry(x_shape, w_shape, p);
+        if (grad_shape != g.out_shape())
+            throw std::invalid_argument("conv2d grad_out does not match the convolution's output shape");
+        return g;
+    }
+
+    inline Conv2dParams params_2d(const Conv1dParams &p)
+    {
+        Conv2dParams q;
+        q.stride_w = p.stride;
+        q.pad_w = p.padding;
+        q.dilation_w = p.dilation;
+        q.groups = p.groups;
+        q.channels_last = p.channels_last;
+        return q;
+    }
+
+    // [N, C, L] / [N, L, C] as a height 1 image, and the weight [K, Cg, KL] as [K, Cg, 1, KL]
+    inline DimVec shape_2d(const DimVec &shape, bool is_weight, bool channels_last)
+    {
+        if (shape.size() != 3)
+            throw std::invalid_argument("conv1d needs a 3D input and a 3D weight [C_out, C_in / groups, K]");
+        if (channels_last && !is_weight)
+            return {shape[0], 1, shape[1], shape[2]};
+        return {shape[0], shape[1], 1, shape[2]};
+    }
+
+    inline DimVec shape_1d(const DimVec &shape, bool is_weight, bool channels_last)
+    {
+        if (channels_last && !is_weight)
+            return {shape[0], shape[2], shape[3]};
+        return {shape[0], shape[1], shape[3]};
+    }
+}
+
+inline NDArray<float> conv2d(const NDArray<float> &x, const NDArray<float> &w, const NDArray<float> *bias,
+                             const Conv2dParams &p)
+{
+    profiler::Scope prof("conv2d", x, w);
+    const conv::Geometry g = conv::make_geometry(x.get_shape(), w.get_shape(), p);
+    if (bias && bias->get_shape() != DimVec{g.K})
+        throw std::invalid_argument("conv2d bias needs one element per output channel");
+
+    const NDArray<float> xc = conv::compact(x), wc = conv::compact(w);
+    const std::optional<NDArray<float>> bc = bias ? std::optional<NDArray<float>>(conv::compact(*bias)) : std::nullopt;
+    const float *b = bc ? conv::data_of(*bc) : nullptr;
+    NDArray<float> out = NDArray<float>::empty(g.out_shape());
+    float *dst = out.get_handle()->ptr();
+    if (g.depthwise())
+        conv::depthwise_forward(g, conv::data_of(xc), conv::data_of(wc), b, dst);
+    else if (g.channels_last)
+        conv::forward_nhwc(g, conv::data_of(xc), conv::data_of(wc), b, dst);
+    else
+        conv::forward_nchw(g, conv::data_of(xc), conv::data_of(wc), b, dst);
+    prof.output(out);
+    return out;
+}
+
+inline NDArray<float> conv2d_backward_input(const NDArray<float> &grad_out, const NDArray<float> &w,
+                                            const DimVec &x_shape, const Conv2dParams &p)
+{
+    profiler::Scope prof("conv2d_backward_input", grad_out, w);
+    const conv::Geometry g = conv::checked_backward_geometry(grad_out.get_shape(), x_shape, w.get_shape(), p);
+    const NDArray<float> gc = conv::compact(grad_out), wc = conv::compact(w);
+    NDArray<float> gx = NDArray<float>::empty(x_shape);
+    float *dst = gx.get_handle()->ptr();
+    if (g.depthwise())
+        conv::depthwise_backward_input(g, conv::data_of(gc), conv::data_of(wc), dst);
+    else if (g.channels_last)
+        conv::backward_input_nhwc(g, conv::data_of(gc), conv::data_of(wc), dst);
+    else
+        conv::backward_input_nchw(g, conv::data_of(gc), conv::data_of(wc), dst);
+    prof.output(gx);
+    return gx;
+}
+
+inline NDArray<float> conv2d_backward_weight(const NDArray<float> &grad_out, const NDArray<float> &x,
+                                             const DimVec &w_shape, const Conv2dParams &p)
+{
+    profiler::Scope prof("conv2d_backward_weight", grad_out, x);
+    const conv::Geometry g = conv::checked_backward_geometry(grad_out.get_shape(), x.get_shape(), w_shape, p);
+    const NDArray<float> gc = conv::compact(grad_out), xc = conv::compact(x);
+    NDArray<float> gw = NDArray<float>::empty(w_shape);
+    float *dst = gw.get_handle()->ptr();
+    if (g.depthwise())
+        conv::depthwise_backward_weight(g, conv::data_of(gc), conv::data_of(xc), dst);
+    else
+        conv::backward_weight(g, conv::data_of(gc), conv::data_of(xc), dst);
+    prof.output(gw);
+    return gw;
+}
+
+inline NDArray<float> conv1d(const NDArray<float> &x, const NDArray<float> &w, const NDArray<float> *bias,
+                             const Conv1dParams &p)
+{
+    profiler::Scope prof("conv1d", x, w);
+    const bool cl = p.channels_last;
+    const NDArray<float> out = conv2d(x.reshape(conv::shape_2d(x.get_shape(), false, cl)),
+                                      w.reshape(conv::shape_2d(w.get_shape(), true, cl)), bias, conv::params_2d(p));
+    return prof.result(out.reshape(conv::shape_1d(out.get_shape(), false, cl)));
+}
+
+inline NDArray<float> conv1d_backward_input(const NDArray<float> &grad_out, const NDArray<float> &w,
+                                            const DimVec &x_shape, const Conv1dParams &p)
+{
+    profiler::Scope prof("conv1d_backward_input", grad_out, w);
+    const bool cl = p.channels_last;
+    const NDArray<float> gx = conv2d_backward_input(grad_out.reshape(conv::shape_2d(grad_out.get_shape(), false, cl)),
+                                                    w.reshape(conv::shape_2d(w.get_shape(), true, cl)),
+                                                    conv::shape_2d(x_shape, false, cl), conv::params_2d(p));
+    return prof.result(gx.reshape(x_shape));
+}
+
+inline NDArray<float> conv1d_backward_weight(const NDArray<float> &grad_out, const NDArray<float> &x,
+                                             const DimVec &w_shape, const Conv1dParams &p)
+{
+    profiler::Scope prof("conv1d_backward_weight", grad_out, x);
+    const bool cl = p.channels_last;
+    const NDArray<float> gw = conv2d_backward_weight(grad_out.reshape(conv::shape_2d(grad_out.get_shape(), false, cl)),
+                                                     x.reshape(conv::shape_2d(x.get_shape(), false, cl)),
+                                                     conv::shape_2d(w_shape, true, cl), conv::params_2d(p));
+    return prof.result(gw.reshape(w_shape));
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+/**
+ * Runtime CPU feature detection for the kernels that ship hand written SIMD paths.
+ *
+ * Everything is compiled for the baseline target, the wider paths are compiled with per function
+ * target attributes and selected once at runtime (CPUID via __builtin_cpu_supports), so the same
+ * binary runs on any x86-64 host. Other compilers/architectures always get the portable paths.
+ */
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define PHOTON_X86_DISPATCH 1
+#include <immintrin.h>
+#else
+#define PHOTON_X86_DISPATCH 0
+#endif
+
+enum class CpuIsa
+{
+    Scalar = 0,
+    SSE42 = 1,
+    AVX2 = 2,   // AVX2 + FMA
+    AVX512 = 3, // AVX-512 F/BW/DQ/VL
+};
+
+inline const char *isa_name(CpuIsa isa)
+{
+    switch (isa)
+    {
+    case CpuIsa::SSE42:
+        return "sse4.2";
+    case CpuIsa::AVX2:
+        return "avx2";
+    case CpuIsa::AVX512:
+        return "avx512";
+    default:
+        return "scalar";
+    }
+}
+
+// Widest ISA the host supports, detected once.
+inline CpuIsa detect_isa()
+{
+    static const CpuIsa isa = []
+    {
+#if PHOTON_X86_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+            __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl"))
+            return CpuIsa::AVX512;
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return CpuIsa::AVX2;
+        if (__builtin_cpu_supports("sse4.2"))
+            return CpuIsa::SSE42;
+#endif
+        return CpuIsa::Scalar;
+    }();
+    return isa;
+}
+
+// VPDPBUSD (u8 x s8 dot products into int32) for the int8 GEMM, on 512 bit or on 256 bit vectors.
+// Neither is implied by the CpuIsa level, AVX-VNNI also exists on hosts without AVX-512.
+inline bool has_avx512_vnni()
+{
+#if PHOTON_X86_DISPATCH
+    static const bool ok = detect_isa() >= CpuIsa::AVX512 && __builtin_cpu_supports("avx512vnni");
+    return ok;
+#else
+    return false;
+#endif
+}
+
+inline bool has_avx_vnni()
+{
+#if PHOTON_X86_DISPATCH
+    static const bool ok = detect_isa() >= CpuIsa::AVX2 && __builtin_cpu_supports("avxvnni");
+    return ok;
+#else
+    return false;
+#endif
+}
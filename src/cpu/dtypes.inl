@@ -0,0 +1,225 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <stdexcept>
+#include <type_traits>
+
+/**
+ * @brief Element types besides float: double, int32_t, int64_t, int8_t, uint8_t and the 16 bit storage types
+ * bfloat16 and float16.
+ *
+ * The 16 bit types only store values. They convert implicitly to and from float, so every kernel
+ * written for T computes on them in float and rounds (to nearest even) once per element written.
+ * Sums, moments, softmax and matmul widen the whole operand to float, run the float kernel and narrow
+ * the result, so they also accumulate in float.
+ */
+
+namespace dtype_detail
+{
+    inline uint32_t float_bits(float f)
+    {
+        uint32_t u;
+        std::memcpy(&u, &f, sizeof(u));
+        return u;
+    }
+
+    inline float bits_float(uint32_t u)
+    {
+        float f;
+        std::memcpy(&f, &u, sizeof(f));
+        return f;
+    }
+}
+
+struct bfloat16
+{
+    uint16_t bits;
+
+    bfloat16() = default;
+    bfloat16(float f)
+    {
+        const uint32_t u = dtype_detail::float_bits(f);
+        // NaNs stay quiet NaNs, everything else rounds to nearest even
+        if ((u & 0x7fffffff) > 0x7f800000)
+            bits = static_cast<uint16_t>((u >> 16) | 0x40);
+        else
+            bits = static_cast<uint16_t>((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+    }
+    operator float() const { return dtype_detail::bits_float(static_cast<uint32_t>(bits) << 16); }
+
+    bfloat16 &operator+=(float x) { return *this = float(*this) + x; }
+    bfloat16 &operator-=(float x) { return *this = float(*this) - x; }
+    bfloat16 &operator*=(float x) { return *this = float(*this) * x; }
+    bfloat16 &operator/=(float x) { return *this = float(*this) / x; }
+
+    static constexpr bfloat16 from_bits(uint16_t b)
+    {
+        bfloat16 x{};
+        x.bits = b;
+        return x;
+    }
+};
+
+// IEEE binary16
+struct float16
+{
+    uint16_t bits;
+
+    float16() = default;
+    float16(float f)
+    {
+        uint32_t u = dtype_detail::float_bits(f);
+        const uint32_t sign = (u >> 16) & 0x8000;
+        u &= 0x7fffffff;
+        uint32_t h;
+        if (u >= 0x47800000)
+        {
+            // too large for a half, or inf/NaN
+            h = u > 0x7f800000 ? 0x7e00 : 0x7c00;
+        }
+        else if (u < 0x38800000)
+        {
+            // subnormal half, the float add rounds the mantissa into place
+            const float shifted = dtype_detail::bits_float(u) + 0.5f;
+            h = dtype_detail::float_bits(shifted) - 0x3f000000;
+        }
+        else
+        {
+            // rebias the exponent and round to nearest even
+            const uint32_t odd = (u >> 13) & 1;
+            u += 0xc8000fff + odd;
+            h = u >> 13;
+        }
+        bits = static_cast<uint16_t>(h | sign);
+    }
+    operator float() const
+    {
+        uint32_t u = static_cast<uint32_t>(bits & 0x7fff) << 13;
+        const uint32_t exp = u & 0x0f800000;
+        u += 0x38000000;
+        if (exp == 0x0f800000)
+        {
+            // inf/NaN
+            u += 0x38000000;
+        }
+        else if (exp == 0)
+        {
+            // subnormal, renormalise
+            u += 0x00800000;
+            u = dtype_detail::float_bits(dtype_detail::bits_float(u) - dtype_detail::bits_float(0x38800000));
+        }
+        return dtype_detail::bits_float(u | (static_cast<uint32_t>(bits & 0x8000) << 16));
+    }
+
+    float16 &operator+=(float x) { return *this = float(*this) + x; }
+    float16 &operator-=(float x) { return *this = float(*this) - x; }
+    float16 &operator*=(float x) { return *this = float(*this) * x; }
+    float16 &operator/=(float x) { return *this = float(*this) / x; }
+
+    static constexpr float16 from_bits(uint16_t b)
+    {
+        float16 x{};
+        x.bits = b;
+        return x;
+    }
+};
+
+namespace std
+{
+    template <>
+    class numeric_limits<bfloat16>
+    {
+    public:
+        static constexpr bool is_specialized = true;
+        static constexpr bool is_signed = true;
+        static constexpr bool is_integer = false;
+        static constexpr bool has_infinity = true;
+        static constexpr bool has_quiet_NaN = true;
+        static constexpr int digits = 8;
+        static constexpr bfloat16 min() { return bfloat16::from_bits(0x0080); }
+        static constexpr bfloat16 max() { return bfloat16::from_bits(0x7f7f); }
+        static constexpr bfloat16 lowest() { return bfloat16::from_bits(0xff7f); }
+        static constexpr bfloat16 epsilon() { return bfloat16::from_bits(0x3c00); }
+        static constexpr bfloat16 infinity() { return bfloat16::from_bits(0x7f80); }
+        static constexpr bfloat16 quiet_NaN() { return bfloat16::from_bits(0x7fc0); }
+    };
+
+    template <>
+    class numeric_limits<float16>
+    {
+    public:
+        static constexpr bool is_specialized = true;
+        static constexpr bool is_signed = true;
+        static constexpr bool is_integer = false;
+        static constexpr bool has_infinity = true;
+        static constexpr bool has_quiet_NaN = true;
+        static constexpr int digits = 11;
+        static constexpr float16 min() { return float16::from_bits(0x0400); }
+        static constexpr float16 max() { return float16::from_bits(0x7bff); }
+        static constexpr float16 lowest() { return float16::from_bits(0xfbff); }
+        static constexpr float16 epsilon() { return float16::from_bits(0x1400); }
+        static constexpr float16 infinity() { return float16::from_bits(0x7c00); }
+        static constexpr float16 quiet_NaN() { return float16::from_bits(0x7e00); }
+    };
+}
+
+// Storage only types that compute in float
+template <typename T>
+inline constexpr bool is_half_precision_v = std::is_same_v<T, bfloat16> || std::is_same_v<T, float16>;
+
+// Name of an element type, as the bindings and astype spell it
+template <typename T>
+constexpr const char *dtype_name()
+{
+    if constexpr (std::is_same_v<T, float>)
+        return "float32";
+    else if constexpr (std::is_same_v<T, double>)
+        return "float64";
+    else if constexpr (std::is_same_v<T, int32_t>)
+        return "int32";
+    else if constexpr (std::is_same_v<T, int64_t>)
+        return "int64";
+    else if constexpr (std::is_same_v<T, int8_t>)
+        return "int8";
+    else if constexpr (std::is_same_v<T, uint8_t>)
+        return "uint8";
+    else if constexpr (std::is_same_v<T, bfloat16>)
+        return "bfloat16";
+    else if constexpr (std::is_same_v<T, float16>)
+        return "float16";
+    else
+        static_assert(sizeof(T) == 0, "unsupported element type");
+}
+
+// Calls fn(T{}) for the element type named dtype, throws for an unknown name
+template <typename Fn>
+decltype(auto) visit_dtype(const std::string &dtype, Fn fn)
+{
+    if (dtype == "float32")
+        return fn(float{});
+    if (dtype == "float64")
+        return fn(double{});
+    if (dtype == "int32")
+        return fn(int32_t{});
+    if (dtype == "int64")
+        return fn(int64_t{});
+    if (dtype == "int8")
+        return fn(int8_t{});
+    if (dtype == "uint8")
+        return fn(uint8_t{});
+    if (dtype == "bfloat16")
+        return fn(bfloat16{});
+    if (dtype == "float16")
+        return fn(float16{});
+    throw std::invalid_argument("unknown dtype '" + dtype + "'");
+}
+
+// Transcendental ops and statistics are only defined for floating point arrays
+template <typename T>
+void require_floating(const char *op)
+{
+    if constexpr (std::is_integral_v<T>)
+        throw std::invalid_argument(std::string(op) + " needs a floating point array, convert it with astype first");
+}
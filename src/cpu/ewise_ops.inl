@@ -2,46 +2,49 @@
 #include <numeric>   
 #include <functional> 
 #include <cmath>    
+#include <algorithm>
 #include <view_helpers.inl>
+#include <type_traits>
+#include <profiler.inl>
+#include <strided_loop.inl>
+#include <simd_math.inl>
 
 
 template <typename T>
 void NDArray<T>::setitem_ewise(const std::vector<Slice> &slice_ranges, const NDArray<T> &source)
 {
+    profiler::Scope prof("setitem_ewise", *this, source);
     NDArray<T> target_view = this->slice(slice_ranges);
+    prof.output(target_view);
     DimVec target_shape = target_view.get_shape();
-    size_t total_size = std::accumulate(target_shape.begin(), target_shape.end(), 1ULL, std::multiplies<size_t>());
 
-    // Try broadcasting if doesn't match, will throw error if incompatible.
-    NDArray<T> broadcasted_source = (source.get_shape() == target_shape) ? source : source.broadcast(target_shape);
+    // Try broadcasting if doesn't match, will throw error if incompatible. Copy first if the source
+    // overlaps the target in any other way than being the same view.
+    NDArray<T> broadcasted_source = alias_safe_input(broadcast_to_out(source, target_shape), target_view);
 
-    // Odometer logic but two indices as 2 views being traversed.
-    size_t write_idx = target_view.get_offset();
-    size_t source_idx = broadcasted_source.get_offset();
     T *write_ptr = handle->ptr();
     const T *source_ptr = broadcasted_source.get_handle()->ptr();
-    DimVec indices(target_shape.size(), 0);
 
-    for (size_t i = 0; i < total_size; i++)
-    {
-        write_ptr[write_idx] = source_ptr[source_idx];
-        for (int dim = static_cast<int>(target_shape.size()) - 1; dim >= 0; --dim)
+    // Two views traversed together, target view and (possibly broadcast) source
+    StridedLoop<2> loop(target_shape, {target_view.get_strides(), broadcasted_source.get_strides()},
+                        {target_view.get_offset(), broadcasted_source.get_offset()});
+    loop.run_parallel(kElementwiseGrain, [&](const auto &offs, size_t n, const auto &st)
+             {
+        T *dst = write_ptr + offs[0];
+        const T *src = source_ptr + offs[1];
+        if (st[0] == 1 && st[1] == 1)
         {
-            write_idx += target_view.get_strides()[dim];
-            source_idx += broadcasted_source.get_strides()[dim];
-            indices[dim]++;
-            if (indices[dim] == target_shape[dim])
-            {
-                indices[dim] = 0;
-                write_idx -= target_shape[dim] * target_view.get_strides()[dim];
-                source_idx -= target_shape[dim] * broadcasted_source.get_strides()[dim];
-            }
-            else
-            {
-                break;
-            }
+            std::copy(src, src + n, dst);
         }
-    }
+        else if (st[0] == 1 && st[1] == 0)
+        {
+            std::fill(dst, dst + n, *src);
+        }
+        else
+        {
+            for (std::ptrdiff_t i = 0; i < static_cast<std::ptrdiff_t>(n); i++)
+                dst[i * st[0]] = src[i * st[1]];
+        } });
 }
 
 /** Ewise arithmetic ops
@@ -49,82 +52,232 @@ void NDArray<T>::setitem_ewise(const std::vector<Slice> &slice_ranges, const NDA
  *
  */
 template <typename T, typename Op>
-NDArray<T> ewise_op_kernel(const NDArray<T> &a, const NDArray<T> &b, Op op)
+void ewise_op_kernel(const NDArray<T> &a, const NDArray<T> &b, NDArray<T> &out, Op op)
 {
+    check_out_shape(out, broadcast_shape(a.get_shape(), b.get_shape()));
+    const auto &shape = out.get_shape();
 
-    const auto &shape = broadcast_shape(a.get_shape(), b.get_shape());
-
-    NDArray<T> broadcasted_b = (shape == b.get_shape()) ? b : b.broadcast(shape);
-    NDArray<T> broadcasted_a = (shape == a.get_shape()) ? a : a.broadcast(shape);
-    NDArray<T> target{shape};
-
-    const auto &astrides = broadcasted_a.get_strides();
-    const auto &bstrides = broadcasted_b.get_strides();
-    size_t total_size = std::accumulate(shape.begin(), shape.end(), 1ULL, std::multiplies<size_t>());
+    NDArray<T> broadcasted_a = alias_safe_input(broadcast_to_out(a, shape), out);
+    NDArray<T> broadcasted_b = alias_safe_input(broadcast_to_out(b, shape), out);
 
-    T *new_data = target.get_handle()->ptr();
+    T *new_data = out.get_handle()->ptr();
     const T *aptr = broadcasted_a.get_handle()->ptr();
     const T *bptr = broadcasted_b.get_handle()->ptr();
 
-    size_t a_idx = broadcasted_a.get_offset();
-    size_t b_idx = broadcasted_b.get_offset();
+    // The common layouts (contiguous output with both inputs contiguous, or one side broadcast along
+    // the row) get their own loops so they vectorise.
+    StridedLoop<3> loop(shape, {out.get_strides(), broadcasted_a.get_strides(), broadcasted_b.get_strides()},
+                        {out.get_offset(), broadcasted_a.get_offset(), broadcasted_b.get_offset()});
+    loop.run_parallel(kElementwiseGrain, [&](const auto &offs, size_t n, const auto &st)
+             {
+        T *dst = new_data + offs[0];
+        const T *x = aptr + offs[1];
+        const T *y = bptr + offs[2];
+        if (st[0] == 1 && st[1] == 1 && st[2] == 1)
+        {
+            for (size_t i = 0; i < n; i++)
+                dst[i] = op(x[i], y[i]);
+        }
+        else if (st[0] == 1 && st[1] == 1 && st[2] == 0)
+        {
+            const T yv = *y;
+            for (size_t i = 0; i < n; i++)
+                dst[i] = op(x[i], yv);
+        }
+        else if (st[0] == 1 && st[1] == 0 && st[2] == 1)
+        {
+            const T xv = *x;
+            for (size_t i = 0; i < n; i++)
+                dst[i] = op(xv, y[i]);
+        }
+        else
+        {
+            for (std::ptrdiff_t i = 0; i < static_cast<std::ptrdiff_t>(n); i++)
+                dst[i * st[0]] = op(x[i * st[1]], y[i * st[2]]);
+        } });
+}
+
+template <typename T, typename Op>
+NDArray<T> ewise_op_kernel(const NDArray<T> &a, const NDArray<T> &b, Op op)
+{
+    NDArray<T> target = NDArray<T>::empty(broadcast_shape(a.get_shape(), b.get_shape()));
+    ewise_op_kernel(a, b, target, op);
+    return target;
+}
 
-    DimVec indices(shape.size(), 0);
-    for (size_t i = 0; i < total_size; i++)
-    {
-        new_data[i] = op(aptr[a_idx], bptr[b_idx]);
+/**
+ * float pow through the simd_math kernels. For a contiguous output row the base is gathered into it,
+ * a strided exponent row is gathered chunk wise into a stack buffer and a broadcast one uses
+ * pow_scalar. Strided output rows go through stack buffers for both operands.
+ */
+inline void ewise_pow_simd(const NDArray<float> &a, const NDArray<float> &b, NDArray<float> &out)
+{
+    check_out_shape(out, broadcast_shape(a.get_shape(), b.get_shape()));
+    const auto &shape = out.get_shape();
+
+    NDArray<float> broadcasted_a = alias_safe_input(broadcast_to_out(a, shape), out);
+    NDArray<float> broadcasted_b = alias_safe_input(broadcast_to_out(b, shape), out);
 
-        for (int dim = static_cast<int>(shape.size()) - 1; dim >= 0; --dim)
+    float *new_data = out.get_handle()->ptr();
+    const float *aptr = broadcasted_a.get_handle()->ptr();
+    const float *bptr = broadcasted_b.get_handle()->ptr();
+    const auto &k = simd_math::kernels();
+
+    StridedLoop<3> loop(shape, {out.get_strides(), broadcasted_a.get_strides(), broadcasted_b.get_strides()},
+                        {out.get_offset(), broadcasted_a.get_offset(), broadcasted_b.get_offset()});
+    loop.run_parallel(kElementwiseGrain, [&](const auto &offs, size_t n, const auto &st)
+             {
+        float *dst = new_data + offs[0];
+        const float *x = aptr + offs[1];
+        const float *e = bptr + offs[2];
+        constexpr size_t chunk = 256;
+        if (st[0] != 1)
         {
-            indices[dim]++;
-            a_idx += astrides[dim];
-            b_idx += bstrides[dim];
-            if (indices[dim] < shape[dim])
+            float xb[chunk], eb[chunk];
+            for (size_t lo = 0; lo < n; lo += chunk)
             {
-                break;
+                const size_t m = std::min(chunk, n - lo);
+                for (size_t i = 0; i < m; i++)
+                {
+                    xb[i] = x[static_cast<std::ptrdiff_t>(lo + i) * st[1]];
+                    eb[i] = e[static_cast<std::ptrdiff_t>(lo + i) * st[2]];
+                }
+                k.pow(xb, eb, xb, m);
+                for (size_t i = 0; i < m; i++)
+                    dst[static_cast<std::ptrdiff_t>(lo + i) * st[0]] = xb[i];
             }
-            else
+            return;
+        }
+        if (st[1] != 1)
+        {
+            for (std::ptrdiff_t i = 0; i < static_cast<std::ptrdiff_t>(n); i++)
+                dst[i] = x[i * st[1]];
+            x = dst;
+        }
+        if (st[2] == 1)
+        {
+            k.pow(x, e, dst, n);
+        }
+        else if (st[2] == 0)
+        {
+            k.pow_scalar(x, *e, dst, n);
+        }
+        else
+        {
+            float eb[chunk];
+            for (size_t lo = 0; lo < n; lo += chunk)
             {
-                indices[dim] = 0;
-                a_idx -= shape[dim] * astrides[dim];
-                b_idx -= shape[dim] * bstrides[dim];
+                const size_t m = std::min(chunk, n - lo);
+                for (size_t i = 0; i < m; i++)
+                    eb[i] = e[static_cast<std::ptrdiff_t>(lo + i) * st[2]];
+                k.pow(x + lo, eb, dst + lo, m);
             }
-        }
+        } });
+}
+
+/** Integer division
+ *
+ * Integer division by zero traps (SIGFPE) instead of giving inf or NaN, so integer divisors are checked
+ * before any element is written. lowest / -1 traps as well, it wraps round to lowest instead.
+ */
+template <typename T>
+void check_integer_divisors(const NDArray<T> &divisor)
+{
+    if constexpr (std::is_integral_v<T>)
+    {
+        const T *ptr = divisor.get_handle()->ptr();
+        bool has_zero = false;
+        StridedLoop<1> loop(divisor.get_shape(), {divisor.get_strides()}, {divisor.get_offset()});
+        loop.run([&](const auto &offs, size_t n, const auto &st)
+                 {
+            for (std::ptrdiff_t i = 0; i < static_cast<std::ptrdiff_t>(n) && !has_zero; i++)
+                has_zero = ptr[offs[0] + i * st[0]] == 0; });
+        if (has_zero)
+            throw std::domain_error("integer division by zero");
     }
-    return target;
 }
 
 template <typename T>
-NDArray<T> ewise_add(const NDArray<T> &a, const NDArray<T> &b)
+inline T divide(T a, T b)
+{
+    if constexpr (std::is_integral_v<T> && std::is_signed_v<T>)
+    {
+        if (b == -1)
+            return static_cast<T>(std::make_unsigned_t<T>(0) - static_cast<std::make_unsigned_t<T>>(a));
+    }
+    return a / b;
+}
+
+/*
+ * Every op is written once in its out= form, the allocating and in place forms forward to it.
+ */
+
+#define PHOTON_EWISE_FORWARDS(name, method)                                             \
+    template <typename T>                                                               \
+    NDArray<T> ewise_##name(const NDArray<T> &a, const NDArray<T> &b)                   \
+    {                                                                                   \
+        NDArray<T> target = NDArray<T>::empty(broadcast_shape(a.get_shape(), b.get_shape())); \
+        ewise_##name(a, b, target);                                                     \
+        return target;                                                                  \
+    }                                                                                   \
+    template <typename T>                                                               \
+    NDArray<T> &NDArray<T>::method(const NDArray<T> &other)                             \
+    {                                                                                   \
+        ewise_##name(*this, other, *this);                                              \
+        return *this;                                                                   \
+    }
+
+template <typename T>
+void ewise_add(const NDArray<T> &a, const NDArray<T> &b, NDArray<T> &out)
 {
-    return ewise_op_kernel(a, b, [](T a, T b)
-                           { return a + b; });
+    profiler::Scope prof("ewise_add", a, b);
+    prof.output(out);
+    ewise_op_kernel(a, b, out, [](T a, T b)
+                    { return a + b; });
 }
+PHOTON_EWISE_FORWARDS(add, add_)
 
 template <typename T>
-NDArray<T> ewise_sub(const NDArray<T> &a, const NDArray<T> &b)
+void ewise_sub(const NDArray<T> &a, const NDArray<T> &b, NDArray<T> &out)
 {
-    return ewise_op_kernel(a, b, [](T a, T b)
-                           { return a - b; });
+    profiler::Scope prof("ewise_sub", a, b);
+    prof.output(out);
+    ewise_op_kernel(a, b, out, [](T a, T b)
+                    { return a - b; });
 }
+PHOTON_EWISE_FORWARDS(sub, sub_)
 
 template <typename T>
-NDArray<T> ewise_mul(const NDArray<T> &a, const NDArray<T> &b)
+void ewise_mul(const NDArray<T> &a, const NDArray<T> &b, NDArray<T> &out)
 {
-    return ewise_op_kernel(a, b, [](T a, T b)
-                           { return a * b; });
+    profiler::Scope prof("ewise_mul", a, b);
+    prof.output(out);
+    ewise_op_kernel(a, b, out, [](T a, T b)
+                    { return a * b; });
 }
+PHOTON_EWISE_FORWARDS(mul, mul_)
 
 template <typename T>
-NDArray<T> ewise_pow(const NDArray<T> &a, const NDArray<T> &b)
+void ewise_pow(const NDArray<T> &a, const NDArray<T> &b, NDArray<T> &out)
 {
-    return ewise_op_kernel(a, b, [](T a, T b)
-                           { return std::pow(a, b); });
+    profiler::Scope prof("ewise_pow", a, b);
+    prof.output(out);
+    if constexpr (std::is_same_v<T, float>)
+        return ewise_pow_simd(a, b, out);
+    ewise_op_kernel(a, b, out, [](T a, T b)
+                    { return std::pow(a, b); });
 }
+PHOTON_EWISE_FORWARDS(pow, pow_)
 
 template <typename T>
-NDArray<T> ewise_div(const NDArray<T> &a, const NDArray<T> &b)
+void ewise_div(const NDArray<T> &a, const NDArray<T> &b, NDArray<T> &out)
 {
-    return ewise_op_kernel(a, b, [](T a, T b)
-                           { return a / b; });
+    profiler::Scope prof("ewise_div", a, b);
+    prof.output(out);
+    check_integer_divisors(b);
+    ewise_op_kernel(a, b, out, [](T a, T b)
+                    { return divide(a, b); });
 }
+PHOTON_EWISE_FORWARDS(div, div_)
+
+#undef PHOTON_EWISE_FORWARDS
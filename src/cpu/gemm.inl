@@ -0,0 +1,438 @@
+#pragma once
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <cpu_features.inl>
+#include <thread_pool.inl>
+#include <transpose.inl>
+
+/**
+ * Single precision GEMM, C = A @ B, in the GotoBLAS/BLIS style.
+ *
+ * The loops are nested as
+ *   jc (NC cols of B/C, sized for L3) -> pc (KC of the reduction dim, L1/L2)
+ *     -> ic (MC rows of A/C, L2) -> jr (NR) -> ir (MR) -> micro-kernel
+ * B[pc, jc] is packed once per (jc, pc) into NR wide column slivers and A[ic, pc] is packed into MR tall
+ * row slivers, both laid out k-major so the micro-kernel streams them with unit stride. The micro-kernel
+ * keeps an MR x NR tile of C in registers, computes the rank-KC update from zero and adds it to C once,
+ * so every element of C is accumulated in the same order no matter how the M/N dims are tiled.
+ *
+ * Micro-kernels exist for AVX-512 (12x32), AVX2/FMA (6x16) and a portable fallback (4x8), picked
+ * once at runtime.
+ *
+ * With more than one thread, packing of the shared B panel is split over its slivers and the ic loop
+ * is run over the thread pool, falling back to (row block, column chunk) tasks when M has fewer MC
+ * blocks than there are threads.
+ *
+ * A and B may have any row and column strides (transposed, sliced or stride 0 broadcast views), the
+ * packing routines read them in place, so strided operands never need a compact copy.
+ */
+
+namespace gemm
+{
+    // micro-kernel: c[MR x NR] (row stride ldc) (+)= packed_a[kc x MR]^T @ packed_b[kc x NR]
+    using MicroKernel = void (*)(size_t kc, const float *a, const float *b, float *c, size_t ldc, bool accumulate);
+
+    struct KernelInfo
+    {
+        size_t mr, nr;
+        size_t mc, kc, nc;
+        MicroKernel ukernel;
+        CpuIsa isa;
+    };
+
+    /** Micro-kernels
+     *
+     */
+
+    template <size_t MR, size_t NR>
+    void ukernel_generic(size_t kc, const float *a, const float *b, float *c, size_t ldc, bool accumulate)
+    {
+        float acc[MR][NR] = {};
+        for (size_t k = 0; k < kc; k++)
+        {
+            for (size_t i = 0; i < MR; i++)
+            {
+                const float a_val = a[i];
+                for (size_t j = 0; j < NR; j++)
+                    acc[i][j] += a_val * b[j];
+            }
+            a += MR;
+            b += NR;
+        }
+        for (size_t i = 0; i < MR; i++)
+        {
+            for (size_t j = 0; j < NR; j++)
+                c[i * ldc + j] = accumulate ? c[i * ldc + j] + acc[i][j] : acc[i][j];
+        }
+    }
+
+#if PHOTON_X86_DISPATCH
+    __attribute__((target("avx2,fma"))) inline void ukernel_avx2_6x16(size_t kc, const float *a, const float *b,
+                                                                      float *c, size_t ldc, bool accumulate)
+    {
+        __m256 acc[6][2];
+#pragma GCC unroll 6
+        for (int i = 0; i < 6; i++)
+        {
+            acc[i][0] = _mm256_setzero_ps();
+            acc[i][1] = _mm256_setzero_ps();
+        }
+        for (size_t k = 0; k < kc; k++)
+        {
+            const __m256 b0 = _mm256_load_ps(b);
+            const __m256 b1 = _mm256_load_ps(b + 8);
+#pragma GCC unroll 6
+            for (int i = 0; i < 6; i++)
+            {
+                const __m256 a_val = _mm256_broadcast_ss(a + i);
+                acc[i][0] = _mm256_fmadd_ps(a_val, b0, acc[i][0]);
+                acc[i][1] = _mm256_fmadd_ps(a_val, b1, acc[i][1]);
+            }
+            a += 6;
+            b += 16;
+        }
+#pragma GCC unroll 6
+        for (int i = 0; i < 6; i++)
+        {
+            float *c_row = c + i * ldc;
+            if (accumulate)
+            {
+                acc[i][0] = _mm256_add_ps(_mm256_loadu_ps(c_row), acc[i][0]);
+                acc[i][1] = _mm256_add_ps(_mm256_loadu_ps(c_row + 8), acc[i][1]);
+            }
+            _mm256_storeu_ps(c_row, acc[i][0]);
+            _mm256_storeu_ps(c_row + 8, acc[i][1]);
+        }
+    }
+
+    __attribute__((target("avx512f"))) inline void ukernel_avx512_12x32(size_t kc, const float *a, const float *b,
+                                                                        float *c, size_t ldc, bool accumulate)
+    {
+        __m512 acc[12][2];
+#pragma GCC unroll 12
+        for (int i = 0; i < 12; i++)
+        {
+            acc[i][0] = _mm512_setzero_ps();
+            acc[i][1] = _mm512_setzero_ps();
+        }
+        for (size_t k = 0; k < kc; k++)
+        {
+            const __m512 b0 = _mm512_load_ps(b);
+            const __m512 b1 = _mm512_load_ps(b + 16);
+#pragma GCC unroll 12
+            for (int i = 0; i < 12; i++)
+            {
+                const __m512 a_val = _mm512_set1_ps(a[i]);
+                acc[i][0] = _mm512_fmadd_ps(a_val, b0, acc[i][0]);
+                acc[i][1] = _mm512_fmadd_ps(a_val, b1, acc[i][1]);
+            }
+            a += 12;
+            b += 32;
+        }
+#pragma GCC unroll 12
+        for (int i = 0; i < 12; i++)
+        {
+            float *c_row = c + i * ldc;
+            if (accumulate)
+            {
+                acc[i][0] = _mm512_add_ps(_mm512_loadu_ps(c_row), acc[i][0]);
+                acc[i][1] = _mm512_add_ps(_mm512_loadu_ps(c_row + 16), acc[i][1]);
+            }
+            _mm512_storeu_ps(c_row, acc[i][0]);
+            _mm512_storeu_ps(c_row + 16, acc[i][1]);
+        }
+    }
+#endif
+
+    inline const KernelInfo &kernel_for(CpuIsa isa)
+    {
+#if PHOTON_X86_DISPATCH
+        static const KernelInfo avx512{12, 32, 144, 256, 3072, ukernel_avx512_12x32, CpuIsa::AVX512};
+        static const KernelInfo avx2{6, 16, 120, 256, 3072, ukernel_avx2_6x16, CpuIsa::AVX2};
+        if (isa >= CpuIsa::AVX512)
+            return avx512;
+        if (isa >= CpuIsa::AVX2)
+            return avx2;
+#endif
+        static const KernelInfo generic{4, 8, 128, 256, 2048, ukernel_generic<4, 8>, CpuIsa::Scalar};
+        return generic;
+    }
+
+    // M * N * K below which sgemm runs on the calling thread only
+    constexpr size_t kParallelFlopsThreshold = size_t(1) << 18;
+
+    inline const KernelInfo &default_kernel()
+    {
+        return kernel_for(detect_isa());
+    }
+
+    /** Packing
+     *
+     */
+
+    // 64B aligned scratch for packed panels, grown on demand and reused by the calling thread.
+    template <typename T = float>
+    struct PackBuffer
+    {
+        std::unique_ptr<T, decltype(&std::free)> data{nullptr, &std::free};
+        size_t capacity = 0;
+
+        T *get(size_t count)
+        {
+            if (count > capacity)
+            {
+                size_t bytes = ((count * sizeof(T) + 63) / 64) * 64;
+                data.reset(static_cast<T *>(std::aligned_alloc(64, bytes)));
+                if (!data)
+                    throw std::bad_alloc();
+                capacity = bytes / sizeof(T);
+            }
+            return data.get();
+        }
+    };
+
+    // Per thread pack buffers. Accessed through functions so a worker thread that only reaches them
+    // from inside a pool task still constructs its own copy.
+    inline PackBuffer<> &a_pack_buffer()
+    {
+        thread_local PackBuffer<> buf;
+        return buf;
+    }
+
+    inline PackBuffer<> &b_pack_buffer()
+    {
+        thread_local PackBuffer<> buf;
+        return buf;
+    }
+
+    // Pack the mc x kc block of A (element (i, k) at a[i * rs + k * cs]) into MR tall slivers, zero
+    // padding the last sliver.
+    inline void pack_a(size_t mc, size_t kc, const float *a, size_t rs, size_t cs, size_t mr, float *packed)
+    {
+        for (size_t i0 = 0; i0 < mc; i0 += mr)
+        {
+            const size_t rows = std::min(mr, mc - i0);
+            for (size_t k = 0; k < kc; k++)
+            {
+                for (size_t i = 0; i < rows; i++)
+                    packed[i] = a[(i0 + i) * rs + k * cs];
+                for (size_t i = rows; i < mr; i++)
+                    packed[i] = 0.0f;
+                packed += mr;
+            }
+        }
+    }
+
+    // Pack the kc x nc block of B (element (k, j) at b[k * rs + j * cs]) into NR wide slivers, zero
+    // padding the last sliver.
+    inline void pack_b(size_t kc, size_t nc, const float *b, size_t rs, size_t cs, size_t nr, float *packed)
+    {
+        for (size_t j0 = 0; j0 < nc; j0 += nr)
+        {
+            const size_t cols = std::min(nr, nc - j0);
+            if (cs != 1 && rs == 1)
+            {
+                // columns of B are contiguous (e.g. W.T), transpose the sliver in register tiles
+                transpose_copy::transpose(b + j0 * cs, cs, packed, nr, kc, cols);
+                for (size_t k = 0; k < kc && cols < nr; k++)
+                    std::fill(packed + k * nr + cols, packed + (k + 1) * nr, 0.0f);
+                packed += kc * nr;
+                continue;
+            }
+            for (size_t k = 0; k < kc; k++)
+            {
+                const float *b_row = b + k * rs + j0 * cs;
+                if (cs == 1)
+                    std::copy(b_row, b_row + cols, packed);
+                else
+                    for (size_t j = 0; j < cols; j++)
+                        packed[j] = b_row[j * cs];
+                std::fill(packed + cols, packed + nr, 0.0f);
+                packed += nr;
+            }
+        }
+    }
+
+    /** Macro kernel: C[mc x nc] (+)= packed A block @ packed B panel
+     *
+     */
+    inline void macro_kernel(const KernelInfo &kern, size_t mc, size_t nc, size_t kc, const float *packed_a,
+                             const float *packed_b, float *c, size_t ldc, bool accumulate)
+    {
+        const size_t mr = kern.mr, nr = kern.nr;
+        // partial tiles at the edges go through a scratch tile so the micro-kernel is always full size
+        alignas(64) float edge[32 * 32];
+
+        for (size_t j0 = 0; j0 < nc; j0 += nr)
+        {
+            const size_t cols = std::min(nr, nc - j0);
+            const float *b_sliver = packed_b + j0 * kc;
+            for (size_t i0 = 0; i0 < mc; i0 += mr)
+            {
+                const size_t rows = std::min(mr, mc - i0);
+                const float *a_sliver = packed_a + i0 * kc;
+                float *c_tile = c + i0 * ldc + j0;
+                if (rows == mr && cols == nr)
+                {
+                    kern.ukernel(kc, a_sliver, b_sliver, c_tile, ldc, accumulate);
+                    continue;
+                }
+                kern.ukernel(kc, a_sliver, b_sliver, edge, nr, false);
+                for (size_t i = 0; i < rows; i++)
+                {
+                    for (size_t j = 0; j < cols; j++)
+                        c_tile[i * ldc + j] = accumulate ? c_tile[i * ldc + j] + edge[i * nr + j] : edge[i * nr + j];
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief C = A @ B for strided A (M x K, element (i, k) at A[i * a_rs + k * a_cs]) and B (K x N,
+     * element (k, j) at B[k * b_rs + j * b_cs]) into row major C (M x N, row stride ldc). C is
+     * overwritten.
+     */
+    inline void sgemm_strided(size_t M, size_t N, size_t K, const float *A, size_t a_rs, size_t a_cs,
+                              const float *B, size_t b_rs, size_t b_cs, float *C, size_t ldc,
+                              const KernelInfo &kern = default_kernel())
+    {
+        if (M == 0 || N == 0)
+            return;
+        if (K == 0)
+        {
+            for (size_t i = 0; i < M; i++)
+                std::fill(C + i * ldc, C + i * ldc + N, 0.0f);
+            return;
+        }
+
+        float *packed_b = b_pack_buffer().get(kern.kc * ((std::min(kern.nc, N) + kern.nr - 1) / kern.nr) * kern.nr);
+
+        // small products aren't worth waking the pool for
+        const bool threaded = M * N * K >= kParallelFlopsThreshold;
+        const size_t threads = threaded ? get_num_threads() : 1;
+
+        for (size_t jc = 0; jc < N; jc += kern.nc)
+        {
+            const size_t nc = std::min(kern.nc, N - jc);
+            const size_t n_slivers = (nc + kern.nr - 1) / kern.nr;
+            for (size_t pc = 0; pc < K; pc += kern.kc)
+            {
+                const size_t kc = std::min(kern.kc, K - pc);
+                // first K block overwrites C, the rest accumulate into it
+                const bool accumulate = pc > 0;
+
+                // B panel is shared by every task, pack its slivers in parallel
+                parallel_for(0, n_slivers, threaded ? 1 : n_slivers, [&](size_t lo, size_t hi)
+                             { pack_b(kc, std::min(hi * kern.nr, nc) - lo * kern.nr, B + pc * b_rs + (jc + lo * kern.nr) * b_cs,
+                                      b_rs, b_cs, kern.nr, packed_b + lo * kern.nr * kc); });
+
+                // Tasks are (MC row block, column chunk) pairs. Column chunks only split the panel when there
+                // are fewer row blocks than threads, each task packs its own A block.
+                const size_t n_ic = (M + kern.mc - 1) / kern.mc;
+                const size_t col_chunks = std::min(n_slivers, std::max<size_t>(1, (threads + n_ic - 1) / n_ic));
+                const size_t slivers_per_chunk = (n_slivers + col_chunks - 1) / col_chunks;
+                const size_t n_tasks = n_ic * col_chunks;
+
+                parallel_for(0, n_tasks, threaded ? 1 : n_tasks, [&](size_t lo, size_t hi)
+                             {
+                    float *packed_a = a_pack_buffer().get(kern.mc * kern.kc);
+                    size_t packed_ic = M;
+                    for (size_t t = lo; t < hi; t++)
+                    {
+                        const size_t ic = (t / col_chunks) * kern.mc;
+                        const size_t j0 = (t % col_chunks) * slivers_per_chunk * kern.nr;
+                        if (j0 >= nc)
+                            continue;
+                        const size_t mc = std::min(kern.mc, M - ic);
+                        const size_t cols = std::min(slivers_per_chunk * kern.nr, nc - j0);
+                        // consecutive tasks of the same row block reuse the packed A
+                        if (ic != packed_ic)
+                        {
+                            pack_a(mc, kc, A + ic * a_rs + pc * a_cs, a_rs, a_cs, kern.mr, packed_a);
+                            packed_ic = ic;
+                        }
+                        macro_kernel(kern, mc, cols, kc, packed_a, packed_b + j0 * kc, C + ic * ldc + jc + j0, ldc,
+                                     accumulate);
+                    } });
+            }
+        }
+    }
+
+    /**
+     * @brief C = A @ B for row major A (M x K, row stride lda), B (K x N, row stride ldb) and C (M x N,
+     * row stride ldc). C is overwritten.
+     */
+    inline void sgemm(size_t M, size_t N, size_t K, const float *A, size_t lda, const float *B, size_t ldb,
+                      float *C, size_t ldc, const KernelInfo &kern = default_kernel())
+    {
+        sgemm_strided(M, N, K, A, lda, 1, B, ldb, 1, C, ldc, kern);
+    }
+
+    /**
+     * @brief Batched C[b] = A[b] @ B[b] over the pool, with the batch and the output tile grid
+     * partitioned together.
+     *
+     * Each batch's C is cut into m_tiles x n_tiles blocks (multiples of MR/NR), doubling the split of the
+     * larger tile side until there are a few work items per thread. A large batch therefore runs one item
+     * per matrix, while a batch smaller than the thread count, or a few large matrices, are split over
+     * their tiles as well. Every item runs the serial sgemm on its block, and since sgemm accumulates each
+     * element of C in the same order regardless of tiling, results are bit identical for any thread count.
+     *
+     * A/B for batch i start at A + a_offsets[i] / B + b_offsets[i], with the element strides of
+     * sgemm_strided. C for batch i is row major at C + i * M * ldc.
+     */
+    inline void sgemm_batched(size_t batch, size_t M, size_t N, size_t K, const float *A, const size_t *a_offsets,
+                              size_t a_rs, size_t a_cs, const float *B, const size_t *b_offsets, size_t b_rs,
+                              size_t b_cs, float *C, size_t ldc, const KernelInfo &kern = default_kernel())
+    {
+        if (batch == 0 || M == 0 || N == 0)
+            return;
+        if (batch == 1)
+        {
+            // single matrix, sgemm parallelises internally
+            sgemm_strided(M, N, K, A + a_offsets[0], a_rs, a_cs, B + b_offsets[0], b_rs, b_cs, C, ldc, kern);
+            return;
+        }
+
+        const size_t threads = batch * M * N * K >= kParallelFlopsThreshold ? get_num_threads() : 1;
+        const size_t target_items = threads > 1 ? threads * 4 : 1;
+
+        size_t m_tiles = 1, n_tiles = 1;
+        while (batch * m_tiles * n_tiles < target_items)
+        {
+            const size_t tile_m = (M + m_tiles - 1) / m_tiles;
+            const size_t tile_n = (N + n_tiles - 1) / n_tiles;
+            // keep tiles at least a few micro-tiles across so packing stays amortised
+            const bool can_split_m = tile_m >= 4 * kern.mr;
+            const bool can_split_n = tile_n >= 4 * kern.nr;
+            if (can_split_m && (tile_m >= tile_n || !can_split_n))
+                m_tiles *= 2;
+            else if (can_split_n)
+                n_tiles *= 2;
+            else
+                break;
+        }
+        const size_t tile_m = ((M + m_tiles - 1) / m_tiles + kern.mr - 1) / kern.mr * kern.mr;
+        const size_t tile_n = ((N + n_tiles - 1) / n_tiles + kern.nr - 1) / kern.nr * kern.nr;
+        m_tiles = (M + tile_m - 1) / tile_m;
+        n_tiles = (N + tile_n - 1) / tile_n;
+        const size_t items_per_batch = m_tiles * n_tiles;
+
+        parallel_for(0, batch * items_per_batch, threads > 1 ? 1 : batch * items_per_batch, [&](size_t lo, size_t hi)
+                     {
+            for (size_t item = lo; item < hi; item++)
+            {
+                const size_t b = item / items_per_batch;
+                const size_t i0 = (item % items_per_batch) / n_tiles * tile_m;
+                const size_t j0 = (item % n_tiles) * tile_n;
+                const size_t rows = std::min(tile_m, M - i0);
+                const size_t cols = std::min(tile_n, N - j0);
+                sgemm_strided(rows, cols, K, A + a_offsets[b] + i0 * a_rs, a_rs, a_cs, B + b_offsets[b] + j0 * b_cs, b_rs,
+                              b_cs, C + b * M * ldc + i0 * ldc + j0, ldc, kern);
+            } });
+    }
+}
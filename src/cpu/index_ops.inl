@@ -0,0 +1,310 @@
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <profiler.inl>
+#include <reduction_engine.inl>
+
+/**
+ * @brief argmax, argmin and topk along one axis.
+ *
+ * Each row (the axis, for every index of the other dims) is scanned in blocks of kIndexBlock
+ * elements, strided rows are gathered a block at a time. argmax only keeps the best block max (the
+ * vectorised reduce::reduce_run) and the block it came from, then rescans that one block for the
+ * index. topk keeps a k element heap and skips every block whose max cannot enter it, which for k
+ * much smaller than the row is nearly all of them after the first few.
+ *
+ * Rows run in parallel. When there are too few rows to occupy the pool, e.g. greedy decoding over a
+ * 250k vocabulary with batch 1, each row is split into chunks whose winners are merged afterwards.
+ * Ties always resolve to the lowest index, so the result doesn't depend on the thread count. NaNs are
+ * skipped.
+ */
+
+constexpr size_t kIndexBlock = 1024;
+
+template <bool Largest, typename T>
+struct IndexOrder
+{
+    // a value no element loses to
+    static T worst()
+    {
+        if constexpr (std::numeric_limits<T>::has_infinity)
+            return Largest ? static_cast<T>(-std::numeric_limits<T>::infinity()) : std::numeric_limits<T>::infinity();
+        else
+            return Largest ? std::numeric_limits<T>::lowest() : std::numeric_limits<T>::max();
+    }
+    static bool better(T a, T b) { return Largest ? a > b : a < b; }
+    // best of a block, through the vectorised reduction
+    static T block_best(const T *x, size_t n)
+    {
+        return reduce::reduce_run(x, n, 1, worst(), [](T a, T b)
+                                  { return Largest ? std::max(a, b) : std::min(a, b); });
+    }
+    // Orders (value, index) candidates best first
+    bool operator()(const std::pair<T, int64_t> &a, const std::pair<T, int64_t> &b) const
+    {
+        if (a.first != b.first)
+            return better(a.first, b.first);
+        return a.second < b.second;
+    }
+};
+
+// Calls fn(block, n, lo) on the blocks of elements [lo, hi) of the row x at stride s
+template <typename T, typename Fn>
+void index_for_each_block(const T *x, size_t s, size_t lo, size_t hi, T *buf, Fn fn)
+{
+    for (size_t b = lo; b < hi; b += kIndexBlock)
+    {
+        const size_t m = std::min(kIndexBlock, hi - b);
+        if (s == 1)
+        {
+            fn(x + b, m, b);
+            continue;
+        }
+        for (size_t i = 0; i < m; i++)
+            buf[i] = x[(b + i) * s];
+        fn(static_cast<const T *>(buf), m, b);
+    }
+}
+
+// Best (value, first index) over elements [lo, hi) of the row
+template <bool Largest, typename T>
+std::pair<T, int64_t> arg_best(const T *x, size_t s, size_t lo, size_t hi)
+{
+    using Order = IndexOrder<Largest, T>;
+    T buf[kIndexBlock];
+    T best = Order::worst();
+    size_t best_block = lo;
+    index_for_each_block(x, s, lo, hi, buf, [&](const T *block, size_t m, size_t b)
+                         {
+        const T v = Order::block_best(block, m);
+        if (Order::better(v, best))
+        {
+            best = v;
+            best_block = b;
+        } });
+    const size_t end = std::min(best_block + kIndexBlock, hi);
+    for (size_t i = best_block; i < end; i++)
+    {
+        if (x[i * s] == best)
+            return {best, static_cast<int64_t>(i)};
+    }
+    // nothing beat worst(), e.g. an all -inf row for argmax
+    return {best, static_cast<int64_t>(lo)};
+}
+
+// Up to k best (value, index) pairs of elements [lo, hi) of the row, in no particular order
+template <bool Largest, typename T>
+std::vector<std::pair<T, int64_t>> topk_candidates(const T *x, size_t s, size_t lo, size_t hi, size_t k)
+{
+    using Order = IndexOrder<Largest, T>;
+    const Order before;
+    // heap under the best first order, so the front is the worst kept candidate
+    std::vector<std::pair<T, int64_t>> heap;
+    heap.reserve(k);
+    if (k == 0)
+        return heap;
+    T buf[kIndexBlock];
+    index_for_each_block(x, s, lo, hi, buf, [&](const T *block, size_t m, size_t b)
+                         {
+        // later elements only get in by being strictly better than the worst kept one
+        if (heap.size() == k && !Order::better(Order::block_best(block, m), heap.front().first))
+            return;
+        for (size_t i = 0; i < m; i++)
+        {
+            const T v = block[i];
+            if (v != v)
+                continue;
+            if (heap.size() < k)
+            {
+                heap.emplace_back(v, static_cast<int64_t>(b + i));
+                std::push_heap(heap.begin(), heap.end(), before);
+            }
+            else if (Order::better(v, heap.front().first))
+            {
+                std::pop_heap(heap.begin(), heap.end(), before);
+                heap.back() = {v, static_cast<int64_t>(b + i)};
+                std::push_heap(heap.begin(), heap.end(), before);
+            }
+        } });
+    return heap;
+}
+
+// Chunks of a long row, block aligned, when there are fewer rows than threads to spread
+inline std::vector<std::pair<size_t, size_t>> index_row_chunks(size_t n_rows, size_t n)
+{
+    std::vector<std::pair<size_t, size_t>> chunks;
+    const size_t threads = get_num_threads();
+    size_t n_chunks = 1;
+    if (n_rows < threads && n >= 2 * kElementwiseGrain)
+        n_chunks = std::min(threads * 4, n / kElementwiseGrain);
+    const size_t chunk = (n / n_chunks + kIndexBlock - 1) / kIndexBlock * kIndexBlock;
+    for (size_t lo = 0; lo < n; lo += chunk)
+        chunks.emplace_back(lo, std::min(lo + chunk, n));
+    return chunks;
+}
+
+template <bool Largest, typename T>
+NDArray<int64_t> arg_reduce_kernel(const NDArray<T> &a, int64_t axis, bool keepdims)
+{
+    const DimVec &shape = a.get_shape();
+    const size_t ax = normalize_axis(axis, shape.size());
+    const size_t n = shape[ax];
+    if (n == 0)
+        throw std::invalid_argument("argmax/argmin of an empty axis");
+
+    std::vector<bool> is_removed(shape.size(), false);
+    is_removed[ax] = true;
+    NDArray<int64_t> target = NDArray<int64_t>::empty(reduced_shape(shape, is_removed, keepdims));
+    int64_t *out = target.get_handle()->ptr();
+
+    std::vector<bool> is_kept(shape.size(), true);
+    is_kept[ax] = false;
+    const DimVec strides = a.get_strides();
+    const reduce::DimGroup rows = reduce::make_group(shape, strides, is_kept, false);
+    const size_t n_rows = rows.size();
+    const size_t s = strides[ax];
+    const T *src = a.get_handle()->ptr() + a.get_offset();
+
+    const auto chunks = index_row_chunks(n_rows, n);
+    if (chunks.size() == 1)
+    {
+        const size_t grain = std::max<size_t>(1, kElementwiseGrain / n);
+        parallel_for(0, n_rows, grain, [&](size_t lo, size_t hi)
+                     {
+            reduce::GroupWalker w(rows, lo);
+            for (size_t r = lo; r < hi; r++, w.next())
+                out[r] = arg_best<Largest>(src + w.off, s, 0, n).second; });
+        return target;
+    }
+
+    std::vector<std::pair<T, int64_t>> partial(chunks.size());
+    for (size_t r = 0; r < n_rows; r++)
+    {
+        const T *x = src + rows.offset(r);
+        parallel_for(0, chunks.size(), 1, [&](size_t lo, size_t hi)
+                     {
+            for (size_t c = lo; c < hi; c++)
+                partial[c] = arg_best<Largest>(x, s, chunks[c].first, chunks[c].second); });
+        // chunks in order, a later one only wins when strictly better
+        auto best = partial[0];
+        for (size_t c = 1; c < chunks.size(); c++)
+        {
+            if (IndexOrder<Largest, T>::better(partial[c].first, best.first))
+                best = partial[c];
+        }
+        out[r] = best.second;
+    }
+    return target;
+}
+
+template <bool Largest, typename T>
+std::pair<NDArray<T>, NDArray<int64_t>> topk_kernel(const NDArray<T> &a, size_t k, int64_t axis, bool sorted)
+{
+    const DimVec &shape = a.get_shape();
+    const size_t ax = normalize_axis(axis, shape.size());
+    const size_t n = shape[ax];
+    if (k > n)
+        throw std::invalid_argument("k is larger than the size of the axis");
+
+    DimVec out_shape = shape;
+    out_shape[ax] = k;
+    NDArray<T> values = NDArray<T>::empty(out_shape);
+    NDArray<int64_t> indices = NDArray<int64_t>::empty(out_shape);
+    T *val_out = values.get_handle()->ptr();
+    int64_t *idx_out = indices.get_handle()->ptr();
+
+    // one row per index of the other dims, the outputs share their compact strides
+    const DimVec strides = a.get_strides();
+    const DimVec compact = values.get_strides();
+    reduce::DimGroup src_rows, out_rows;
+    for (size_t d = 0; d < shape.size(); d++)
+    {
+        if (d == ax)
+            continue;
+        src_rows.dims.push_back(shape[d]);
+        src_rows.strides.push_back(strides[d]);
+        out_rows.dims.push_back(shape[d]);
+        out_rows.strides.push_back(compact[d]);
+    }
+    const size_t n_rows = src_rows.size();
+    const size_t s = strides[ax];
+    const size_t os = compact[ax];
+    const T *src = a.get_handle()->ptr() + a.get_offset();
+    const IndexOrder<Largest, T> before;
+
+    auto write = [&](std::vector<std::pair<T, int64_t>> &cand, size_t out_off)
+    {
+        // fewer than k candidates only when the row has NaNs, the missing slots get value NaN and index -1
+        if (sorted)
+            std::sort(cand.begin(), cand.end(), before);
+        else
+            std::sort(cand.begin(), cand.end(), [](const auto &x, const auto &y)
+                      { return x.second < y.second; });
+        for (size_t i = 0; i < k; i++)
+        {
+            const auto c = i < cand.size() ? cand[i] : std::pair<T, int64_t>{std::numeric_limits<T>::quiet_NaN(), -1};
+            val_out[out_off + i * os] = c.first;
+            idx_out[out_off + i * os] = c.second;
+        }
+    };
+
+    const auto chunks = index_row_chunks(n_rows, n);
+    if (chunks.size() == 1)
+    {
+        const size_t grain = std::max<size_t>(1, kElementwiseGrain / std::max<size_t>(n, 1));
+        parallel_for(0, n_rows, grain, [&](size_t lo, size_t hi)
+                     {
+            reduce::GroupWalker ws(src_rows, lo), wo(out_rows, lo);
+            for (size_t r = lo; r < hi; r++, ws.next(), wo.next())
+            {
+                auto cand = topk_candidates<Largest>(src + ws.off, s, 0, n, k);
+                write(cand, wo.off);
+            } });
+        return {values, indices};
+    }
+
+    std::vector<std::vector<std::pair<T, int64_t>>> partial(chunks.size());
+    for (size_t r = 0; r < n_rows; r++)
+    {
+        const T *x = src + src_rows.offset(r);
+        parallel_for(0, chunks.size(), 1, [&](size_t lo, size_t hi)
+                     {
+            for (size_t c = lo; c < hi; c++)
+                partial[c] = topk_candidates<Largest>(x, s, chunks[c].first, chunks[c].second, k); });
+        std::vector<std::pair<T, int64_t>> cand;
+        for (const auto &p : partial)
+            cand.insert(cand.end(), p.begin(), p.end());
+        if (cand.size() > k)
+        {
+            std::nth_element(cand.begin(), cand.begin() + k, cand.end(), before);
+            cand.resize(k);
+        }
+        write(cand, out_rows.offset(r));
+    }
+    return {values, indices};
+}
+
+template <typename T>
+NDArray<int64_t> NDArray<T>::argmax(int64_t axis, bool keepdims) const
+{
+    profiler::Scope prof("argmax", *this);
+    return prof.result(arg_reduce_kernel<true>(*this, axis, keepdims));
+}
+
+template <typename T>
+NDArray<int64_t> NDArray<T>::argmin(int64_t axis, bool keepdims) const
+{
+    profiler::Scope prof("argmin", *this);
+    return prof.result(arg_reduce_kernel<false>(*this, axis, keepdims));
+}
+
+template <typename T>
+std::pair<NDArray<T>, NDArray<int64_t>> NDArray<T>::topk(size_t k, int64_t axis, bool largest, bool sorted) const
+{
+    profiler::Scope prof("topk", *this);
+    if (largest)
+        return prof.result(topk_kernel<true>(*this, k, axis, sorted));
+    return prof.result(topk_kernel<false>(*this, k, axis, sorted));
+}
@@ -0,0 +1,616 @@
+#include <vector>
+#include <array>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <algorithm>
+#include <iterator>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include <view_helpers.inl>
+#include <profiler.inl>
+#include <strided_loop.inl>
+#include <simd_math.inl>
+
+/**
+ * @brief Lazy elementwise expressions, fused into one pass over the output on eval().
+ *
+ * NDArray::lazy() wraps a view as a leaf, and unary, scalar and elementwise ops on a LazyArray only
+ * record a node, so (a * b + c).tanh() * 0.5 becomes a small DAG instead of four passes that each
+ * write a full temporary. eval() compiles the DAG into a short register program:
+ *
+ *  - leaves are deduplicated by view, shared subexpressions are computed once, and scalars stay
+ *    immediate operands of the instruction that uses them;
+ *  - registers are blocks of kLazyBlock elements in a per thread scratch buffer, a register is reused
+ *    as soon as its last reader has run, so the working set stays in L1.
+ *
+ * The program then runs inside a single StridedLoop over the output and every (broadcast) leaf. Each
+ * row is cut into blocks: contiguous leaves are read in place, strided ones are gathered and row
+ * broadcast ones are filled once per row. Every instruction is a unit stride loop over one block the
+ * compiler vectorises, float transcendentals go through the same simd_math kernels as the eager ops,
+ * so fused and eager results are bit identical. The last instruction writes straight into a
+ * contiguous output row.
+ *
+ * One pass handles at most kLazyMaxLeaves distinct leaves and kLazyMaxNodes ops. Building a larger
+ * expression evaluates the bigger operand eagerly and continues from it as a new leaf.
+ */
+
+enum class LazyOp : uint8_t
+{
+    Leaf,
+    Const,
+    Neg,
+    Exp,
+    Log,
+    Sqrt,
+    Sin,
+    Cos,
+    Tanh,
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Pow
+};
+
+constexpr size_t kLazyMaxLeaves = 8;
+constexpr size_t kLazyMaxNodes = 64;
+constexpr size_t kLazyBlock = 256;
+
+template <typename T>
+struct LazyNode
+{
+    LazyOp op;
+    DimVec shape;
+    // operands, rhs only for binary ops
+    std::shared_ptr<const LazyNode<T>> lhs, rhs;
+    // Leaf only
+    std::optional<NDArray<T>> array;
+    // Const only
+    T value{};
+    // distinct leaf nodes below, sorted
+    std::vector<const LazyNode<T> *> leaves;
+    // ops below and including this one, a shared subexpression counts once per use
+    size_t n_ops = 0;
+};
+
+/*
+ * Compiled form
+ */
+
+// Immediate operand of a binary instruction
+enum class LazyImm : uint8_t
+{
+    None,
+    Rhs,
+    Lhs
+};
+
+template <typename T>
+struct LazyInstr
+{
+    LazyOp op;
+    LazyImm imm = LazyImm::None;
+    // value ids, a leaf's value id is its leaf index, the instruction k defines value n_leaves + k
+    uint16_t a = 0, b = 0;
+    // scratch block the result is written to
+    uint16_t slot = 0;
+    T value{};
+};
+
+template <typename T>
+struct LazyProgram
+{
+    std::vector<NDArray<T>> leaves;
+    std::vector<LazyInstr<T>> code;
+    // slots [0, n_leaves) hold gathered leaves, the rest instruction results
+    size_t n_slots = 0;
+    uint16_t result = 0;
+};
+
+template <typename T>
+class LazyCompiler
+{
+public:
+    LazyProgram<T> compile(const LazyNode<T> &root)
+    {
+        std::vector<Pending> pending;
+        const uint16_t root_val = emit(root, pending);
+
+        // renumber: leaves first, then instructions in emission order
+        const size_t n_leaves = prog.leaves.size();
+        auto value_id = [&](Ref r)
+        { return static_cast<uint16_t>(r.is_leaf ? r.index : n_leaves + r.index); };
+        for (const auto &p : pending)
+        {
+            LazyInstr<T> in;
+            in.op = p.op;
+            in.imm = p.imm;
+            in.a = value_id(p.a);
+            in.b = value_id(p.b);
+            in.value = p.value;
+            prog.code.push_back(in);
+        }
+        prog.result = value_id(refs[root_val]);
+
+        allocate_slots(n_leaves);
+        return std::move(prog);
+    }
+
+private:
+    struct Ref
+    {
+        bool is_leaf;
+        size_t index;
+    };
+    struct Pending
+    {
+        LazyOp op;
+        LazyImm imm;
+        Ref a, b;
+        T value;
+    };
+
+    LazyProgram<T> prog;
+    std::vector<Ref> refs;
+    std::unordered_map<const LazyNode<T> *, uint16_t> memo;
+
+    static bool same_view(const NDArray<T> &x, const NDArray<T> &y)
+    {
+        return x.get_handle() == y.get_handle() && x.get_offset() == y.get_offset() &&
+               x.get_shape() == y.get_shape() && x.get_strides() == y.get_strides();
+    }
+
+    // post order walk, returns an index into refs
+    uint16_t emit(const LazyNode<T> &node, std::vector<Pending> &pending)
+    {
+        auto it = memo.find(&node);
+        if (it != memo.end())
+            return it->second;
+
+        Ref ref;
+        if (node.op == LazyOp::Leaf)
+        {
+            size_t i = 0;
+            while (i < prog.leaves.size() && !same_view(prog.leaves[i], *node.array))
+                i++;
+            if (i == prog.leaves.size())
+                prog.leaves.push_back(*node.array);
+            ref = {true, i};
+        }
+        else
+        {
+            Pending p{node.op, LazyImm::None, {}, {}, T{}};
+            const LazyNode<T> &lhs = *node.lhs;
+            if (node.rhs && node.rhs->op == LazyOp::Const)
+            {
+                p.imm = LazyImm::Rhs;
+                p.value = node.rhs->value;
+                p.a = p.b = refs[emit(lhs, pending)];
+            }
+            else if (node.rhs && lhs.op == LazyOp::Const)
+            {
+                p.imm = LazyImm::Lhs;
+                p.value = lhs.value;
+                p.a = p.b = refs[emit(*node.rhs, pending)];
+            }
+            else
+            {
+                p.a = refs[emit(lhs, pending)];
+                p.b = node.rhs ? refs[emit(*node.rhs, pending)] : p.a;
+            }
+            pending.push_back(p);
+            ref = {false, pending.size() - 1};
+        }
+        refs.push_back(ref);
+        const auto id = static_cast<uint16_t>(refs.size() - 1);
+        memo.emplace(&node, id);
+        return id;
+    }
+
+    // Linear scan over the straight line code, a slot is free again after its value's last read
+    void allocate_slots(size_t n_leaves)
+    {
+        auto &code = prog.code;
+        std::vector<size_t> last_use(n_leaves + code.size(), 0);
+        for (size_t k = 0; k < code.size(); k++)
+        {
+            last_use[code[k].a] = k;
+            last_use[code[k].b] = k;
+        }
+
+        std::vector<uint16_t> free_slots;
+        size_t n_slots = n_leaves;
+        for (size_t k = 0; k < code.size(); k++)
+        {
+            // operands die here, the result may take over their slot (every op is elementwise)
+            for (uint16_t v : {code[k].a, code[k].b})
+            {
+                if (v >= n_leaves && last_use[v] == k && std::find(free_slots.begin(), free_slots.end(), code[v - n_leaves].slot) == free_slots.end())
+                    free_slots.push_back(code[v - n_leaves].slot);
+            }
+            if (free_slots.empty())
+            {
+                code[k].slot = static_cast<uint16_t>(n_slots++);
+            }
+            else
+            {
+                code[k].slot = free_slots.back();
+                free_slots.pop_back();
+            }
+        }
+        prog.n_slots = n_slots;
+    }
+};
+
+/*
+ * Block kernels
+ */
+
+template <typename T>
+void lazy_unary_block(LazyOp op, const T *x, T *z, size_t m)
+{
+    if constexpr (std::is_same_v<T, float>)
+    {
+        const auto &k = simd_math::kernels();
+        switch (op)
+        {
+        case LazyOp::Exp:
+            return k.exp(x, z, m);
+        case LazyOp::Log:
+            return k.log(x, z, m);
+        case LazyOp::Sin:
+            return k.sin(x, z, m);
+        case LazyOp::Cos:
+            return k.cos(x, z, m);
+        case LazyOp::Tanh:
+            return k.tanh(x, z, m);
+        default:
+            break;
+        }
+    }
+    switch (op)
+    {
+    case LazyOp::Neg:
+        for (size_t i = 0; i < m; i++)
+            z[i] = -x[i];
+        break;
+    case LazyOp::Sqrt:
+        for (size_t i = 0; i < m; i++)
+            z[i] = std::sqrt(x[i]);
+        break;
+    case LazyOp::Exp:
+        for (size_t i = 0; i < m; i++)
+            z[i] = std::exp(x[i]);
+        break;
+    case LazyOp::Log:
+        for (size_t i = 0; i < m; i++)
+            z[i] = std::log(x[i]);
+        break;
+    case LazyOp::Sin:
+        for (size_t i = 0; i < m; i++)
+            z[i] = std::sin(x[i]);
+        break;
+    case LazyOp::Cos:
+        for (size_t i = 0; i < m; i++)
+            z[i] = std::cos(x[i]);
+        break;
+    case LazyOp::Tanh:
+        for (size_t i = 0; i < m; i++)
+            z[i] = std::tanh(x[i]);
+        break;
+    default:
+        break;
+    }
+}
+
+template <typename T, typename Op>
+void lazy_binary_block(const LazyInstr<T> &in, const T *x, const T *y, T *z, size_t m, Op op)
+{
+    const T s = in.value;
+    if (in.imm == LazyImm::None)
+    {
+        for (size_t i = 0; i < m; i++)
+            z[i] = op(x[i], y[i]);
+    }
+    else if (in.imm == LazyImm::Rhs)
+    {
+        for (size_t i = 0; i < m; i++)
+            z[i] = op(x[i], s);
+    }
+    else
+    {
+        for (size_t i = 0; i < m; i++)
+            z[i] = op(s, x[i]);
+    }
+}
+
+template <typename T>
+void lazy_run_instr(const LazyInstr<T> &in, const T *x, const T *y, T *z, size_t m)
+{
+    switch (in.op)
+    {
+    case LazyOp::Add:
+        return lazy_binary_block(in, x, y, z, m, [](T u, T v)
+                                 { return u + v; });
+    case LazyOp::Sub:
+        return lazy_binary_block(in, x, y, z, m, [](T u, T v)
+                                 { return u - v; });
+    case LazyOp::Mul:
+        return lazy_binary_block(in, x, y, z, m, [](T u, T v)
+                                 { return u * v; });
+    case LazyOp::Div:
+        return lazy_binary_block(in, x, y, z, m, [](T u, T v)
+                                 { return u / v; });
+    case LazyOp::Pow:
+        if constexpr (std::is_same_v<T, float>)
+        {
+            if (in.imm == LazyImm::None)
+                return simd_math::kernels().pow(x, y, z, m);
+            if (in.imm == LazyImm::Rhs)
+                return simd_math::kernels().pow_scalar(x, in.value, z, m);
+        }
+        return lazy_binary_block(in, x, y, z, m, [](T u, T v)
+                                 { return static_cast<T>(std::pow(u, v)); });
+    default:
+        return lazy_unary_block(in.op, x, z, m);
+    }
+}
+
+// Per thread register file, grown on demand
+template <typename T>
+T *lazy_scratch(size_t n)
+{
+    thread_local std::vector<T> buf;
+    if (buf.size() < n)
+        buf.resize(n);
+    return buf.data();
+}
+
+/*
+ * LazyArray
+ */
+
+template <typename T>
+LazyArray<T>::LazyArray(std::shared_ptr<const LazyNode<T>> node) : node{std::move(node)}
+{
+}
+
+template <typename T>
+LazyArray<T>::LazyArray(const NDArray<T> &array)
+{
+    auto leaf = std::make_shared<LazyNode<T>>();
+    leaf->op = LazyOp::Leaf;
+    leaf->shape = array.get_shape();
+    leaf->array = array;
+    leaf->leaves = {leaf.get()};
+    node = std::move(leaf);
+}
+
+template <typename T>
+LazyArray<T> NDArray<T>::lazy() const
+{
+    return LazyArray<T>(*this);
+}
+
+template <typename T>
+DimVec LazyArray<T>::get_shape() const
+{
+    return node->shape;
+}
+
+template <typename T>
+LazyArray<T> LazyArray<T>::unary(LazyOp op, const LazyArray<T> &a)
+{
+    if (a.node->n_ops + 1 > kLazyMaxNodes)
+        return unary(op, LazyArray<T>(a.eval()));
+    auto n = std::make_shared<LazyNode<T>>();
+    n->op = op;
+    n->shape = a.node->shape;
+    n->lhs = a.node;
+    n->leaves = a.node->leaves;
+    n->n_ops = a.node->n_ops + 1;
+    return LazyArray<T>(std::move(n));
+}
+
+template <typename T>
+LazyArray<T> LazyArray<T>::binary(LazyOp op, const LazyArray<T> &a, const LazyArray<T> &b)
+{
+    // throws on incompatible shapes before anything is evaluated
+    DimVec shape = broadcast_shape(a.node->shape, b.node->shape);
+
+    std::vector<const LazyNode<T> *> leaves;
+    std::set_union(a.node->leaves.begin(), a.node->leaves.end(), b.node->leaves.begin(), b.node->leaves.end(),
+                   std::back_inserter(leaves));
+    if (leaves.size() > kLazyMaxLeaves || a.node->n_ops + b.node->n_ops + 1 > kLazyMaxNodes)
+    {
+        // too big for one pass, compute the larger side now and fuse the rest
+        if (a.node->n_ops >= b.node->n_ops && a.node->op != LazyOp::Leaf)
+            return binary(op, LazyArray<T>(a.eval()), b);
+        if (b.node->op != LazyOp::Leaf)
+            return binary(op, a, LazyArray<T>(b.eval()));
+        return binary(op, LazyArray<T>(a.eval()), b);
+    }
+
+    auto n = std::make_shared<LazyNode<T>>();
+    n->op = op;
+    n->shape = std::move(shape);
+    n->lhs = a.node;
+    n->rhs = b.node;
+    n->leaves = std::move(leaves);
+    n->n_ops = a.node->n_ops + b.node->n_ops + 1;
+    return LazyArray<T>(std::move(n));
+}
+
+template <typename T>
+LazyArray<T> LazyArray<T>::scalar(LazyOp op, const LazyArray<T> &a, T b, bool reversed)
+{
+    if (a.node->n_ops + 1 > kLazyMaxNodes)
+        return scalar(op, LazyArray<T>(a.eval()), b, reversed);
+    auto c = std::make_shared<LazyNode<T>>();
+    c->op = LazyOp::Const;
+    c->value = b;
+
+    auto n = std::make_shared<LazyNode<T>>();
+    n->op = op;
+    n->shape = a.node->shape;
+    n->lhs = reversed ? c : a.node;
+    n->rhs = reversed ? a.node : c;
+    n->leaves = a.node->leaves;
+    n->n_ops = a.node->n_ops + 1;
+    return LazyArray<T>(std::move(n));
+}
+
+#define PHOTON_LAZY_UNARY(name, op)                    \
+    template <typename T>                              \
+    LazyArray<T> LazyArray<T>::name() const            \
+    {                                                  \
+        return unary(LazyOp::op, *this);               \
+    }
+
+#define PHOTON_LAZY_BINARY(name, op)                                      \
+    template <typename T>                                                 \
+    LazyArray<T> LazyArray<T>::name(const LazyArray<T> &other) const      \
+    {                                                                     \
+        return binary(LazyOp::op, *this, other);                          \
+    }                                                                     \
+    template <typename T>                                                 \
+    LazyArray<T> LazyArray<T>::name(T scalar_value) const                 \
+    {                                                                     \
+        return scalar(LazyOp::op, *this, scalar_value, false);            \
+    }
+
+PHOTON_LAZY_UNARY(neg, Neg)
+PHOTON_LAZY_UNARY(exp, Exp)
+PHOTON_LAZY_UNARY(log, Log)
+PHOTON_LAZY_UNARY(sqrt, Sqrt)
+PHOTON_LAZY_UNARY(sin, Sin)
+PHOTON_LAZY_UNARY(cos, Cos)
+PHOTON_LAZY_UNARY(tanh, Tanh)
+PHOTON_LAZY_BINARY(add, Add)
+PHOTON_LAZY_BINARY(sub, Sub)
+PHOTON_LAZY_BINARY(mul, Mul)
+PHOTON_LAZY_BINARY(div, Div)
+PHOTON_LAZY_BINARY(pow, Pow)
+
+#undef PHOTON_LAZY_UNARY
+#undef PHOTON_LAZY_BINARY
+
+template <typename T>
+LazyArray<T> LazyArray<T>::rsub(T scalar_value) const
+{
+    return scalar(LazyOp::Sub, *this, scalar_value, true);
+}
+
+template <typename T>
+LazyArray<T> LazyArray<T>::rdiv(T scalar_value) const
+{
+    return scalar(LazyOp::Div, *this, scalar_value, true);
+}
+
+/*
+ * Evaluation
+ */
+
+template <typename T>
+NDArray<T> LazyArray<T>::eval() const
+{
+    NDArray<T> target = NDArray<T>::empty(node->shape);
+    eval(target);
+    return target;
+}
+
+template <typename T>
+void LazyArray<T>::eval(NDArray<T> &out) const
+{
+    profiler::Scope prof("lazy_eval");
+    prof.output(out);
+    check_out_shape(out, node->shape);
+    const auto &shape = out.get_shape();
+
+    LazyProgram<T> prog = LazyCompiler<T>().compile(*node);
+    const size_t n_leaves = prog.leaves.size();
+
+    // operand 0 is the output, then one per leaf, unused operands walk the output with zero strides
+    constexpr size_t N = kLazyMaxLeaves + 1;
+    std::vector<NDArray<T>> views;
+    std::array<DimVec, N> strides;
+    typename StridedLoop<N>::Offsets offsets{};
+    std::array<const T *, N> bases{};
+    strides[0] = out.get_strides();
+    offsets[0] = out.get_offset();
+    for (size_t i = 0; i < n_leaves; i++)
+        views.push_back(alias_safe_input(broadcast_to_out(prog.leaves[i], shape), out));
+    for (size_t i = 1; i < N; i++)
+    {
+        if (i <= n_leaves)
+        {
+            strides[i] = views[i - 1].get_strides();
+            offsets[i] = views[i - 1].get_offset();
+            bases[i] = views[i - 1].get_handle()->ptr();
+        }
+        else
+        {
+            strides[i] = DimVec(shape.size(), 0);
+        }
+    }
+    T *out_data = out.get_handle()->ptr();
+
+    const auto &code = prog.code;
+    const size_t n_slots = prog.n_slots;
+    const uint16_t result = prog.result;
+
+    StridedLoop<N> loop(shape, strides, offsets);
+    loop.run_parallel(kElementwiseGrain, [&](const auto &offs, size_t n, const auto &st)
+                      {
+        T *scratch = lazy_scratch<T>(n_slots * kLazyBlock);
+        const T *vals[kLazyMaxLeaves + kLazyMaxNodes];
+        T *dst = out_data + offs[0];
+
+        for (size_t lo = 0; lo < n; lo += kLazyBlock)
+        {
+            const size_t m = std::min(kLazyBlock, n - lo);
+            for (size_t i = 0; i < n_leaves; i++)
+            {
+                const std::ptrdiff_t s = st[i + 1];
+                const T *src = bases[i + 1] + offs[i + 1] + static_cast<std::ptrdiff_t>(lo) * s;
+                T *slot = scratch + i * kLazyBlock;
+                if (s == 1)
+                {
+                    vals[i] = src;
+                    continue;
+                }
+                // a broadcast leaf is the same value along the whole row, fill its slot once
+                if (s == 0 && lo == 0)
+                    std::fill(slot, slot + std::min(kLazyBlock, n), *src);
+                else if (s != 0)
+                {
+                    for (size_t j = 0; j < m; j++)
+                        slot[j] = src[static_cast<std::ptrdiff_t>(j) * s];
+                }
+                vals[i] = slot;
+            }
+
+            T *row_out = dst + static_cast<std::ptrdiff_t>(lo) * st[0];
+            for (size_t k = 0; k < code.size(); k++)
+            {
+                const LazyInstr<T> &in = code[k];
+                // the final value goes straight to a contiguous output row
+                T *z = (k + 1 == code.size() && st[0] == 1) ? row_out : scratch + in.slot * kLazyBlock;
+                lazy_run_instr(in, vals[in.a], vals[in.b], z, m);
+                vals[n_leaves + k] = z;
+            }
+
+            const T *res = vals[result];
+            if (res == row_out)
+                continue;
+            if (st[0] == 1)
+                std::copy(res, res + m, row_out);
+            else
+            {
+                for (size_t j = 0; j < m; j++)
+                    row_out[static_cast<std::ptrdiff_t>(j) * st[0]] = res[j];
+            }
+        } });
+}
@@ -0,0 +1,193 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <allocator.inl>
+#include <profiler.inl>
+
+/**
+ * @brief Process wide accounting of the memory held by CompactArrays.
+ *
+ * Every array that allocates its storage is counted from construction to destruction, whichever
+ * allocator it came from, in the bytes it asked for (AllocatorStats counts size classes instead).
+ * Arrays wrapping NumPy memory are not counted, the memory is not ours. With allocation tagging on,
+ * each new allocation also records the ops open on the allocating thread (e.g. "matmul/make_compact"),
+ * so the largest live arrays can be traced back to the op that created them.
+ */
+
+struct MemoryStats
+{
+    size_t live_bytes = 0;       // bytes held by live arrays
+    size_t peak_live_bytes = 0;  // high water mark of live_bytes since start or reset_peak_stats
+    size_t live_allocations = 0; // arrays holding storage right now
+    size_t allocations = 0;      // arrays allocated since start
+    size_t bytes_cached = 0;     // bytes held by the current allocator's cache
+};
+
+struct LiveAllocation
+{
+    std::string op; // ops open when it was allocated, empty when allocated outside any op
+    const char *dtype;
+    size_t elements;
+    size_t bytes;
+};
+
+namespace memory
+{
+    struct Tag
+    {
+        std::string op;
+        const char *dtype;
+        size_t elements;
+        size_t bytes;
+    };
+
+    struct Counters
+    {
+        std::atomic<size_t> live_bytes{0};
+        std::atomic<size_t> peak_live_bytes{0};
+        std::atomic<size_t> live_allocations{0};
+        std::atomic<size_t> allocations{0};
+        std::atomic<bool> tagging{false};
+        std::mutex tags_mutex;
+        std::unordered_map<const void *, Tag> tags;
+    };
+
+    inline Counters &counters()
+    {
+        static Counters c;
+        return c;
+    }
+
+    inline size_t storage_bytes(size_t elements, size_t element_size)
+    {
+        return std::max<size_t>(elements, 1) * element_size;
+    }
+
+    // Storage for elements of T from allocator, accounted for until the matching deallocate
+    template <typename T>
+    T *allocate(Allocator &allocator, size_t elements)
+    {
+        const size_t bytes = storage_bytes(elements, sizeof(T));
+        T *ptr = static_cast<T *>(allocator.allocate(bytes));
+        Counters &c = counters();
+        const size_t live = c.live_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        size_t peak = c.peak_live_bytes.load(std::memory_order_relaxed);
+        while (live > peak && !c.peak_live_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+        {
+        }
+        c.live_allocations.fetch_add(1, std::memory_order_relaxed);
+        c.allocations.fetch_add(1, std::memory_order_relaxed);
+        if (c.tagging.load(std::memory_order_relaxed))
+        {
+            Tag tag{profiler::Scope::op_path(), dtype_name<T>(), elements, bytes};
+            std::lock_guard<std::mutex> lock(c.tags_mutex);
+            // tagging may have been turned off, and the tags cleared, since the check above
+            if (c.tagging.load(std::memory_order_relaxed))
+                c.tags[ptr] = std::move(tag);
+        }
+        return ptr;
+    }
+
+    template <typename T>
+    void deallocate(Allocator &allocator, T *ptr, size_t elements)
+    {
+        const size_t bytes = storage_bytes(elements, sizeof(T));
+        Counters &c = counters();
+        c.live_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+        c.live_allocations.fetch_sub(1, std::memory_order_relaxed);
+        if (c.tagging.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(c.tags_mutex);
+            c.tags.erase(ptr);
+        }
+        allocator.deallocate(ptr, bytes);
+    }
+}
+
+inline MemoryStats memory_stats()
+{
+    memory::Counters &c = memory::counters();
+    MemoryStats s;
+    s.live_bytes = c.live_bytes.load();
+    s.peak_live_bytes = c.peak_live_bytes.load();
+    s.live_allocations = c.live_allocations.load();
+    s.allocations = c.allocations.load();
+    s.bytes_cached = get_allocator()->stats().bytes_cached;
+    return s;
+}
+
+// Restarts the peak at the current live bytes, for this accounting and the current allocator's stats
+inline void reset_peak_stats()
+{
+    memory::Counters &c = memory::counters();
+    c.peak_live_bytes.store(c.live_bytes.load());
+    get_allocator()->reset_peak();
+}
+
+// Turns allocation tagging on or off. Only arrays allocated while it is on are tagged, turning it
+// off forgets the tags.
+inline void set_allocation_tagging(bool on)
+{
+    memory::Counters &c = memory::counters();
+    std::lock_guard<std::mutex> lock(c.tags_mutex);
+    if (c.tagging.load() == on)
+        return;
+    c.tagging.store(on);
+    // the op scopes only run while someone needs them
+    if (on)
+        profiler::active++;
+    else
+    {
+        profiler::active--;
+        c.tags.clear();
+    }
+}
+
+inline bool get_allocation_tagging()
+{
+    return memory::counters().tagging.load();
+}
+
+// The top largest live tagged arrays, largest first
+inline std::vector<LiveAllocation> live_allocations(size_t top)
+{
+    memory::Counters &c = memory::counters();
+    std::vector<LiveAllocation> live;
+    {
+        std::lock_guard<std::mutex> lock(c.tags_mutex);
+        for (const auto &[ptr, tag] : c.tags)
+            live.push_back({tag.op, tag.dtype, tag.elements, tag.bytes});
+    }
+    std::sort(live.begin(), live.end(), [](const LiveAllocation &a, const LiveAllocation &b)
+              { return a.bytes > b.bytes; });
+    if (live.size() > top)
+        live.resize(top);
+    return live;
+}
+
+// Counters and the top largest tagged live arrays as a table
+inline std::string memory_summary(size_t top)
+{
+    const MemoryStats s = memory_stats();
+    std::string out;
+    char line[256];
+    std::snprintf(line, sizeof(line),
+                  "live %.3f MB in %zu arrays, peak %.3f MB, %zu allocations, cached %.3f MB\n",
+                  s.live_bytes / 1e6, s.live_allocations, s.peak_live_bytes / 1e6, s.allocations, s.bytes_cached / 1e6);
+    out += line;
+    if (!get_allocation_tagging())
+        return out + "allocation tagging is off\n";
+    std::snprintf(line, sizeof(line), "%12s %-9s %12s  %s\n", "MB", "dtype", "elements", "op");
+    out += line;
+    for (const LiveAllocation &a : live_allocations(top))
+    {
+        std::snprintf(line, sizeof(line), "%12.3f %-9s %12zu  ", a.bytes / 1e6, a.dtype, a.elements);
+        out += line + (a.op.empty() ? std::string("(outside ops)") : a.op) + "\n";
+    }
+    return out;
+}
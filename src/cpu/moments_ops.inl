@@ -0,0 +1,385 @@
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <utility>
+#include <dtypes.inl>
+#include <profiler.inl>
+#include <reduction_engine.inl>
+
+/**
+ * @brief mean, var, std and mean_var over axes, from one read of the source.
+ *
+ * Every output accumulates the moments (count, mean, M2 = sum of squared deviations) of its elements
+ * and partial moments are combined with the parallel (Chan et al.) update
+ *
+ *     delta = mean_b - mean_a,  M2 = M2_a + M2_b + delta^2 * n_a * n_b / (n_a + n_b)
+ *
+ * so the result never subtracts two large sums, unlike sum(x^2) - n * mean^2.
+ *
+ * The layouts follow the reduction engine (reduction_engine.inl), with the same pairwise trees, so
+ * results are bit identical for any number of threads:
+ *  - Horizontal: each kBlock element leaf is shifted by its float mean (found on a first pass over
+ *    the block while it is in L1) and sums the shifted values and their squares in kLanes lanes.
+ *  - Accumulate rows: a leaf of kRowLeaf rows runs a vectorised Welford update in double across a
+ *    tile of kTile outputs.
+ * Moments are kept in double throughout. bfloat16/float16 arrays are widened to float first.
+ */
+namespace reduce
+{
+    struct Moments
+    {
+        double n = 0;
+        double mean = 0;
+        double m2 = 0;
+
+        void merge(const Moments &b)
+        {
+            if (b.n == 0)
+                return;
+            if (n == 0)
+            {
+                *this = b;
+                return;
+            }
+            const double total = n + b.n;
+            const double delta = b.mean - mean;
+            mean += delta * (b.n / total);
+            m2 += b.m2 + delta * delta * (n * b.n / total);
+            n = total;
+        }
+    };
+
+    // Moments of n <= kBlock elements at stride s
+    template <typename T>
+    Moments block_moments(const T *x, size_t n, size_t s)
+    {
+        T buf[kBlock];
+        if (s != 1)
+        {
+            for (size_t i = 0; i < n; i++)
+                buf[i] = x[i * s];
+            x = buf;
+        }
+        const T shift = reduce_run(x, n, 1, T(0), [](T a, T b)
+                                   { return a + b; }) /
+                        static_cast<T>(n);
+        T sum[kLanes] = {}, sq[kLanes] = {};
+        size_t i = 0;
+        for (; i + kLanes <= n; i += kLanes)
+        {
+            for (size_t j = 0; j < kLanes; j++)
+            {
+                const T d = x[i + j] - shift;
+                sum[j] += d;
+                sq[j] += d * d;
+            }
+        }
+        for (; i < n; i++)
+        {
+            const T d = x[i] - shift;
+            sum[0] += d;
+            sq[0] += d * d;
+        }
+        for (size_t w = kLanes / 2; w > 0; w /= 2)
+        {
+            for (size_t j = 0; j < w; j++)
+            {
+                sum[j] += sum[j + w];
+                sq[j] += sq[j + w];
+            }
+        }
+        // the shift is only close to the mean, correct for the remainder
+        const double dn = static_cast<double>(n);
+        const double ds = sum[0];
+        return {dn, static_cast<double>(shift) + ds / dn, std::max(0.0, static_cast<double>(sq[0]) - ds * ds / dn)};
+    }
+
+    template <typename T, typename Store>
+    void horizontal_moments(const T *src, const DimGroup &kept, const DimGroup &red, Store store)
+    {
+        const size_t n_out = kept.size();
+        const size_t n_red = red.size();
+        const size_t n_in = red.inner_dim();
+        const size_t s_in = red.inner_stride();
+        const Tree tree{kBlock, kLanes};
+
+        // elements [lo, hi) of the reduced space of the output starting at base, hi - lo <= kBlock
+        auto leaf = [&](const T *base, size_t lo, size_t hi)
+        {
+            Moments acc;
+            while (lo < hi)
+            {
+                const size_t row = lo / n_in, col = lo % n_in;
+                const size_t n = std::min(hi - lo, n_in - col);
+                acc.merge(block_moments(base + red.offset(row * n_in) + col * s_in, n, s_in));
+                lo += n;
+            }
+            return acc;
+        };
+        auto serial = [&](const T *base, size_t lo, size_t hi, auto &self) -> Moments
+        {
+            if (tree.is_leaf(lo, hi))
+                return leaf(base, lo, hi);
+            size_t m = tree.mid(lo, hi);
+            Moments a = self(base, lo, m, self);
+            a.merge(self(base, m, hi, self));
+            return a;
+        };
+
+        if (n_out >= get_num_threads() || n_red < 2 * kElementwiseGrain)
+        {
+            const size_t grain = std::max<size_t>(1, kElementwiseGrain / std::max<size_t>(n_red, 1));
+            parallel_for(0, n_out, grain, [&](size_t lo, size_t hi)
+                         {
+                GroupWalker w(kept, lo);
+                for (size_t k = lo; k < hi; k++, w.next())
+                    store(k, serial(src + w.off, 0, n_red, serial)); });
+            return;
+        }
+
+        // few outputs, each one's top subtrees run in parallel
+        const int depth = parallel_depth(n_red, kElementwiseGrain);
+        std::vector<std::pair<size_t, size_t>> parts;
+        tree.subtrees(0, n_red, depth, parts);
+        std::vector<Moments> partial(parts.size());
+        for (size_t k = 0; k < n_out; k++)
+        {
+            const T *base = src + kept.offset(k);
+            parallel_for(0, parts.size(), 1, [&](size_t lo, size_t hi)
+                         {
+                for (size_t p = lo; p < hi; p++)
+                    partial[p] = serial(base, parts[p].first, parts[p].second, serial); });
+            size_t next = 0;
+            auto merge = [&](size_t a, size_t b)
+            { partial[a].merge(partial[b]); };
+            store(k, partial[tree.fold(0, n_red, depth, next, merge)]);
+        }
+    }
+
+    // Moments of a tile of outputs, all with the same count
+    struct TileMoments
+    {
+        double n = 0;
+        double *mean;
+        double *m2;
+
+        void merge(const TileMoments &b, size_t w)
+        {
+            const double total = n + b.n;
+            const double wb = b.n / total, cross = n * b.n / total;
+            for (size_t c = 0; c < w; c++)
+            {
+                const double delta = b.mean[c] - mean[c];
+                mean[c] += delta * wb;
+                m2[c] += b.m2[c] + delta * delta * cross;
+            }
+            n = total;
+        }
+    };
+
+    template <typename T, typename Store>
+    void accumulate_rows_moments(const T *src, const DimGroup &kept, const DimGroup &red, Store store)
+    {
+        DimGroup outer{DimVec(kept.dims.begin(), kept.dims.end() - 1), DimVec(kept.strides.begin(), kept.strides.end() - 1)};
+        const size_t n_cols = kept.dims.back();
+        const size_t n_outer = outer.size();
+        const size_t n_tiles = (n_cols + kTile - 1) / kTile;
+        const size_t n_rows = red.size();
+        const Tree tree{kRowLeaf, 1};
+
+        // Welford over rows [lo, hi) of a w column tile
+        auto leaf = [&](const T *base, size_t lo, size_t hi, size_t w, TileMoments &acc)
+        {
+            GroupWalker r(red, lo);
+            std::fill(acc.mean, acc.mean + w, 0.0);
+            std::fill(acc.m2, acc.m2 + w, 0.0);
+            for (size_t i = lo; i < hi; i++, r.next())
+            {
+                const T *row = base + r.off;
+                const double inv = 1.0 / static_cast<double>(i - lo + 1);
+                for (size_t c = 0; c < w; c++)
+                {
+                    const double x = row[c];
+                    const double d = x - acc.mean[c];
+                    acc.mean[c] += d * inv;
+                    acc.m2[c] += d * (x - acc.mean[c]);
+                }
+            }
+            acc.n = static_cast<double>(hi - lo);
+        };
+        // stack holds one (mean, m2) tile pair per remaining tree level
+        auto serial = [&](const T *base, size_t lo, size_t hi, size_t w, TileMoments &acc, double *stack, auto &self) -> void
+        {
+            if (tree.is_leaf(lo, hi))
+                return leaf(base, lo, hi, w, acc);
+            size_t m = tree.mid(lo, hi);
+            self(base, lo, m, w, acc, stack, self);
+            TileMoments b{0, stack, stack + kTile};
+            self(base, m, hi, w, b, stack + 2 * kTile, self);
+            acc.merge(b, w);
+        };
+        size_t levels = 1;
+        for (size_t n = n_rows; n > kRowLeaf; n = (n + 1) / 2)
+            levels++;
+
+        auto emit = [&](size_t o, size_t c0, size_t w, const TileMoments &acc)
+        {
+            for (size_t c = 0; c < w; c++)
+                store(o * n_cols + c0 + c, Moments{acc.n, acc.mean[c], acc.m2[c]});
+        };
+
+        const size_t n_tasks = n_outer * n_tiles;
+        const size_t tile_work = std::min(n_cols, kTile) * n_rows;
+        if (n_tasks >= get_num_threads() || tile_work < 2 * kElementwiseGrain)
+        {
+            const size_t grain = std::max<size_t>(1, kElementwiseGrain / std::max<size_t>(tile_work, 1));
+            parallel_for(0, n_tasks, grain, [&](size_t lo, size_t hi)
+                         {
+                std::vector<double> mem((2 * levels + 2) * kTile);
+                for (size_t t = lo; t < hi; t++)
+                {
+                    const size_t o = t / n_tiles, c0 = t % n_tiles * kTile;
+                    const size_t w = std::min(kTile, n_cols - c0);
+                    TileMoments acc{0, mem.data(), mem.data() + kTile};
+                    serial(src + outer.offset(o) + c0, 0, n_rows, w, acc, mem.data() + 2 * kTile, serial);
+                    emit(o, c0, w, acc);
+                } });
+            return;
+        }
+
+        // few tiles, each one's top subtrees run in parallel into their own partial tiles
+        const int depth = parallel_depth(n_rows, std::max<size_t>(1, kElementwiseGrain / std::min(n_cols, kTile)));
+        std::vector<std::pair<size_t, size_t>> parts;
+        tree.subtrees(0, n_rows, depth, parts);
+        std::vector<double> partial_mem(parts.size() * 2 * kTile);
+        std::vector<TileMoments> partial(parts.size());
+        for (size_t p = 0; p < parts.size(); p++)
+            partial[p] = {0, partial_mem.data() + 2 * p * kTile, partial_mem.data() + (2 * p + 1) * kTile};
+        for (size_t t = 0; t < n_tasks; t++)
+        {
+            const size_t o = t / n_tiles, c0 = t % n_tiles * kTile;
+            const size_t w = std::min(kTile, n_cols - c0);
+            const T *base = src + outer.offset(o) + c0;
+            parallel_for(0, parts.size(), 1, [&](size_t lo, size_t hi)
+                         {
+                std::vector<double> stack(2 * levels * kTile);
+                for (size_t p = lo; p < hi; p++)
+                    serial(base, parts[p].first, parts[p].second, w, partial[p], stack.data(), serial); });
+            size_t next = 0;
+            auto merge = [&](size_t a, size_t b)
+            { partial[a].merge(partial[b], w); };
+            emit(o, c0, w, partial[tree.fold(0, n_rows, depth, next, merge)]);
+        }
+    }
+
+    /**
+     * @brief Moments of the dims flagged in is_reduced of the view (src + offset, shape, strides),
+     * store(k, moments) is called once for every element k of the compact result.
+     */
+    template <typename T, typename Store>
+    void moments_into(const T *src, const DimVec &shape, const DimVec &strides, const std::vector<bool> &is_reduced, Store store)
+    {
+        std::vector<bool> is_kept(is_reduced.size());
+        for (size_t d = 0; d < is_reduced.size(); d++)
+            is_kept[d] = !is_reduced[d];
+        const DimGroup kept = make_group(shape, strides, is_kept, false);
+        const DimGroup red = make_group(shape, strides, is_reduced, true);
+
+        for (size_t d = 0; d < shape.size(); d++)
+        {
+            if (shape[d] == 0)
+            {
+                const size_t n_out = kept.size();
+                for (size_t k = 0; k < n_out; k++)
+                    store(k, Moments{});
+                return;
+            }
+        }
+
+        const bool rows_layout = !kept.dims.empty() && kept.inner_stride() == 1 && kept.inner_dim() >= 8 &&
+                                 red.inner_stride() != 1 && !red.dims.empty();
+        if (rows_layout)
+            accumulate_rows_moments(src, kept, red, store);
+        else
+            horizontal_moments(src, kept, red, store);
+    }
+}
+
+// Writes the mean and/or the variance (m2 / (n - correction), its sqrt with take_sqrt) of a over axes
+template <typename T>
+void moments_kernel(const NDArray<T> &a, const DimVec &axes, double correction, bool take_sqrt, T *mean_out, T *var_out)
+{
+    const DimVec &shape = a.get_shape();
+    const std::vector<bool> is_removed = reduced_dims_mask(shape, axes);
+    reduce::moments_into(a.get_handle()->ptr() + a.get_offset(), shape, a.get_strides(), is_removed,
+                         [&](size_t k, const reduce::Moments &m)
+                         {
+                             // empty reductions give NaN, as 0 / 0 does
+                             if (mean_out)
+                                 mean_out[k] = m.n == 0 ? std::numeric_limits<T>::quiet_NaN() : static_cast<T>(m.mean);
+                             if (var_out)
+                             {
+                                 const double var = m.m2 / std::max(0.0, m.n - correction);
+                                 var_out[k] = static_cast<T>(take_sqrt ? std::sqrt(var) : var);
+                             }
+                         });
+}
+
+template <typename T>
+NDArray<T> NDArray<T>::mean(const DimVec &axes, bool keepdims) const
+{
+    profiler::Scope prof("mean", *this);
+    require_floating<T>("mean");
+    if constexpr (is_half_precision_v<T>)
+        return prof.result(astype<float>().mean(axes, keepdims).template astype<T>());
+    NDArray<T> target = empty(reduced_shape(shape, reduced_dims_mask(shape, axes), keepdims));
+    moments_kernel(*this, axes, 0, false, target.get_handle()->ptr(), static_cast<T *>(nullptr));
+    prof.output(target);
+    return target;
+}
+
+template <typename T>
+NDArray<T> NDArray<T>::var(const DimVec &axes, double correction, bool keepdims) const
+{
+    profiler::Scope prof("var", *this);
+    require_floating<T>("var");
+    if constexpr (is_half_precision_v<T>)
+        return prof.result(astype<float>().var(axes, correction, keepdims).template astype<T>());
+    NDArray<T> target = empty(reduced_shape(shape, reduced_dims_mask(shape, axes), keepdims));
+    moments_kernel(*this, axes, correction, false, static_cast<T *>(nullptr), target.get_handle()->ptr());
+    prof.output(target);
+    return target;
+}
+
+template <typename T>
+NDArray<T> NDArray<T>::std(const DimVec &axes, double correction, bool keepdims) const
+{
+    profiler::Scope prof("std", *this);
+    require_floating<T>("std");
+    if constexpr (is_half_precision_v<T>)
+        return prof.result(astype<float>().std(axes, correction, keepdims).template astype<T>());
+    NDArray<T> target = empty(reduced_shape(shape, reduced_dims_mask(shape, axes), keepdims));
+    moments_kernel(*this, axes, correction, true, static_cast<T *>(nullptr), target.get_handle()->ptr());
+    prof.output(target);
+    return target;
+}
+
+template <typename T>
+std::pair<NDArray<T>, NDArray<T>> NDArray<T>::mean_var(const DimVec &axes, double correction, bool keepdims) const
+{
+    profiler::Scope prof("mean_var", *this);
+    require_floating<T>("mean_var");
+    if constexpr (is_half_precision_v<T>)
+    {
+        const auto [m, v] = astype<float>().mean_var(axes, correction, keepdims);
+        return prof.result(std::make_pair(m.template astype<T>(), v.template astype<T>()));
+    }
+    const DimVec out_shape = reduced_shape(shape, reduced_dims_mask(shape, axes), keepdims);
+    NDArray<T> mean_target = empty(out_shape);
+    NDArray<T> var_target = empty(out_shape);
+    prof.output(mean_target);
+    prof.output(var_target);
+    moments_kernel(*this, axes, correction, false, mean_target.get_handle()->ptr(), var_target.get_handle()->ptr());
+    return {mean_target, var_target};
+}
@@ -25,6 +25,13 @@ NDArray<T>::NDArray(const DimVec &shape) : shape{shape}, offset{0}
     initialise_strides();
 }
 
+template <typename T>
+NDArray<T> NDArray<T>::empty(const DimVec &shape)
+{
+    size_t total_size = std::accumulate(shape.begin(), shape.end(), 1ULL, std::multiplies<size_t>());
+    return NDArray<T>(std::make_shared<CompactArray<T>>(total_size, uninitialized), shape);
+}
+
 template <typename T>
 NDArray<T>::NDArray(std::vector<T> data) : offset{0}
 {
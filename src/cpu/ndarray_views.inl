@@ -7,6 +7,9 @@
 #include <cmath>
 #include <algorithm>
 #include <view_helpers.inl>
+#include <profiler.inl>
+#include <strided_loop.inl>
+#include <transpose.inl>
 
 
 /**
@@ -19,37 +22,35 @@ template <typename T>
 NDArray<T> NDArray<T>::make_compact() const
 {
     // Need to allocate new compact array with matching shape and row major strides for given data.
-    size_t new_size = std::accumulate(shape.begin(), shape.end(), 1ULL, std::multiplies<size_t>());
-    auto new_handle = std::make_shared<CompactArray<T>>(new_size);
+    // every element is written below, so skip zeroing the new storage
+    profiler::Scope prof("make_compact", *this);
+    NDArray<T> target = NDArray<T>::empty(shape);
+    prof.output(target);
 
-    T *new_data = new_handle->ptr();
+    T *new_data = target.handle->ptr();
     const T *old_data = handle->ptr();
-    size_t curr_idx = offset;
-    DimVec indices(shape.size(), 0);
-    for (size_t i = 0; i < new_size; i++)
-    {
-        new_data[i] = old_data[curr_idx];
 
-        for (int dim = static_cast<int>(shape.size()) - 1; dim >= 0; --dim)
+    StridedLoop<2> loop(shape, {target.strides, strides}, {0, offset});
+    // transposed / permuted views: copy tile by tile instead of striding across the source rows
+    if (transpose_copy::copy_permuted(loop, new_data, old_data + offset))
+        return target;
+
+    // target is compact, so its inner stride is always 1
+    loop.run_parallel(kElementwiseGrain, [&](const auto &offs, size_t n, const auto &st)
+             {
+        T *dst = new_data + offs[0];
+        const T *src = old_data + offs[1];
+        if (st[1] == 1)
         {
-            indices[dim]++;
-            curr_idx += strides[dim];
-
-            if (indices[dim] < shape[dim])
-            {
-                // dim index less than shape dim, break as no carry handling needed
-                break;
-            }
-            else
-            {
-                // reset dim index to 0, loop handles incrementing next dim
-                indices[dim] = 0;
-                // subtract total offset for current dim
-                curr_idx -= shape[dim] * strides[dim];
-            }
+            // contiguous run (the whole array if already compact), plain copy
+            std::copy(src, src + n, dst);
         }
-    }
-    return NDArray<T>(std::move(new_handle), shape, 0);
+        else
+        {
+            for (std::ptrdiff_t i = 0; i < static_cast<std::ptrdiff_t>(n); i++)
+                dst[i] = src[i * st[1]];
+        } });
+    return target;
 }
 
 template <typename T>
@@ -167,3 +168,49 @@ NDArray<T> NDArray<T>::broadcast(const DimVec &new_shape) const
 
     return NDArray<T>(handle, new_shape, new_strides, offset);
 }
+
+/**
+ * Helpers for kernels writing into an existing (possibly strided) output view.
+ *
+ */
+
+// in viewed at the output shape, broadcasting if needed
+template <typename T>
+NDArray<T> broadcast_to_out(const NDArray<T> &in, const DimVec &out_shape)
+{
+    return (in.get_shape() == out_shape) ? in : in.broadcast(out_shape);
+}
+
+template <typename T>
+void check_out_shape(const NDArray<T> &out, const DimVec &expected)
+{
+    if (out.get_shape() != expected)
+        throw std::invalid_argument("Output array shape does not match the shape of the result");
+    // A broadcast output maps many elements onto one address, parallel chunks would race on it
+    const auto &strides = out.get_strides();
+    for (size_t i = 0; i < expected.size(); i++)
+    {
+        if (expected[i] > 1 && strides[i] == 0)
+            throw std::invalid_argument("Output array cannot be a broadcast view with a zero stride");
+    }
+}
+
+/**
+ * Input view that is safe to read while out is being written. Elementwise kernels read each element
+ * before writing the same position, so an input that is exactly the output view is fine, but any
+ * other view of the same CompactArray (shifted, transposed, broadcast) could read values that were
+ * already overwritten, so it's copied first. in must already have the output's shape.
+ */
+template <typename T>
+NDArray<T> alias_safe_input(const NDArray<T> &in, const NDArray<T> &out)
+{
+    if (in.get_handle() != out.get_handle())
+        return in;
+    bool same_view = in.get_offset() == out.get_offset();
+    const auto &shape = out.get_shape();
+    const auto in_strides = in.get_strides();
+    const auto out_strides = out.get_strides();
+    for (size_t i = 0; i < shape.size() && same_view; i++)
+        same_view = shape[i] == 1 || in_strides[i] == out_strides[i];
+    return same_view ? in : in.make_compact();
+}
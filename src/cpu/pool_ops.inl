@@ -0,0 +1,599 @@
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <string>
+#include <stdexcept>
+#include <thread_pool.inl>
+#include <profiler.inl>
+
+/**
+ * @brief Max, average and adaptive average 2D pooling, forward and backward, in NCHW and NHWC.
+ *
+ * Pooling windows are those of a depthwise convolution with unit dilation, so the shapes and tap
+ * ranges come from conv::Geometry. NCHW kernels work one plane at a time and run along output rows,
+ * NHWC kernels one pixel at a time and run along channels. Forward passes are parallel over planes
+ * (NCHW) or output rows (NHWC). Backward passes scatter into overlapping windows, so each task owns
+ * a plane (NCHW) or an image's block of channels (NHWC).
+ *
+ * max_pool2d_with_indices also returns, for every output element, the flat index ih * W + iw of its
+ * max within the input plane, and max_pool2d_backward scatters the output gradient there instead of
+ * recomputing the max. NaNs propagate through max pooling.
+ */
+
+namespace pool
+{
+    // Channels per task of the NHWC backward kernels
+    constexpr size_t kChannelBlock = 64;
+
+    inline size_t out_size(size_t in, size_t k, size_t s, size_t pad, bool ceil_mode)
+    {
+        const size_t span = in + 2 * pad - k;
+        size_t out = (ceil_mode ? (span + s - 1) / s : span / s) + 1;
+        // a ceil_mode window has to start inside the input or its left padding
+        if (ceil_mode && (out - 1) * s >= in + pad)
+            out--;
+        return out;
+    }
+
+    inline conv::Geometry make_geometry(const DimVec &x_shape, const Pool2dParams &p, const char *op)
+    {
+        if (x_shape.size() != 4)
+            throw std::invalid_argument(std::string(op) + " needs a 4D input");
+        if (p.kernel_h == 0 || p.kernel_w == 0 || p.stride_h == 0 || p.stride_w == 0)
+            throw std::invalid_argument(std::string(op) + " kernel size and stride must be positive");
+        if (2 * p.pad_h > p.kernel_h || 2 * p.pad_w > p.kernel_w)
+            throw std::invalid_argument(std::string(op) + " padding must be at most half the kernel size");
+
+        conv::Geometry g;
+        g.channels_last = p.channels_last;
+        g.N = x_shape[0];
+        g.C = p.channels_last ? x_shape[3] : x_shape[1];
+        g.H = p.channels_last ? x_shape[1] : x_shape[2];
+        g.W = p.channels_last ? x_shape[2] : x_shape[3];
+        g.K = g.groups = g.C;
+        g.Cg = g.Kg = 1;
+        g.KH = p.kernel_h;
+        g.KW = p.kernel_w;
+        g.sh = p.stride_h;
+        g.sw = p.stride_w;
+        g.ph = p.pad_h;
+        g.pw = p.pad_w;
+        g.dh = g.dw = 1;
+        if (g.H + 2 * g.ph < g.KH || g.W + 2 * g.pw < g.KW)
+            throw std::invalid_argument(std::string(op) + " kernel is larger than the padded input");
+        g.OH = out_size(g.H, g.KH, g.sh, g.ph, p.ceil_mode);
+        g.OW = out_size(g.W, g.KW, g.sw, g.pw, p.ceil_mode);
+        return g;
+    }
+
+    inline DimVec image_dims(const DimVec &x_shape, bool channels_last, const char *op)
+    {
+        if (x_shape.size() != 4)
+            throw std::invalid_argument(std::string(op) + " needs a 4D input");
+        return channels_last ? DimVec{x_shape[0], x_shape[3], x_shape[1], x_shape[2]} : x_shape;
+    }
+
+    inline bool in_range(std::ptrdiff_t i, size_t len) { return i >= 0 && i < static_cast<std::ptrdiff_t>(len); }
+
+    /**
+     * @brief 1 / (elements averaged) along one dimension for each output position. With include_pad the
+     * window counts its padding, but not the part a ceil_mode window hangs past the padding.
+     */
+    inline std::vector<float> inverse_counts(size_t out_len, size_t in_len, size_t k, size_t s, size_t pad,
+                                             bool include_pad)
+    {
+        std::vector<float> inv(out_len);
+        for (size_t o = 0; o < out_len; o++)
+        {
+            const std::ptrdiff_t start = static_cast<std::ptrdiff_t>(o * s) - static_cast<std::ptrdiff_t>(pad);
+            const std::ptrdiff_t end = std::min<std::ptrdiff_t>(start + k, in_len + pad);
+            const std::ptrdiff_t count = include_pad ? end - start
+                                                     : std::min<std::ptrdiff_t>(end, in_len) - std::max<std::ptrdiff_t>(start, 0);
+            inv[o] = 1.0f / static_cast<float>(count);
+        }
+        return inv;
+    }
+
+    /**
+     * @brief Max pooling, optionally with indices. While scanning a window the kernel tap of the current
+     * max is kept as int32 next to the float max, so the compare and select stay the same width and
+     * vectorise. It is turned into the flat input index once the window is done.
+     */
+    template <bool WithIndices>
+    void max_forward(const conv::Geometry &g, const float *x, float *out, int64_t *indices)
+    {
+        constexpr float lowest = -std::numeric_limits<float>::infinity();
+        // flat input index of kernel tap t for the window at (oh, ow)
+        const auto flat_index = [&](size_t oh, size_t ow, int32_t t)
+        {
+            return conv::input_pos(oh, g.sh, t / g.KW, 1, g.ph) * static_cast<std::ptrdiff_t>(g.W) +
+                   conv::input_pos(ow, g.sw, t % g.KW, 1, g.pw);
+        };
+
+        if (!g.channels_last)
+        {
+            const std::vector<conv::ColumnTap> taps = conv::column_taps(g);
+            parallel_for(0, g.N * g.C, 1, [&](size_t lo, size_t hi)
+                         {
+                std::vector<int32_t> best(WithIndices ? g.OW : 0);
+                for (size_t pl = lo; pl < hi; pl++)
+                {
+                    const float *xp = x + pl * g.H * g.W;
+                    for (size_t oh = 0; oh < g.OH; oh++)
+                    {
+                        float *o = out + (pl * g.OH + oh) * g.OW;
+                        std::fill(o, o + g.OW, lowest);
+                        std::fill(best.begin(), best.end(), -1);
+                        for (size_t kh = 0; kh < g.KH; kh++)
+                        {
+                            const std::ptrdiff_t ih = conv::input_pos(oh, g.sh, kh, 1, g.ph);
+                            if (!in_range(ih, g.H))
+                                continue;
+                            const float *row = xp + ih * g.W;
+                            for (size_t kw = 0; kw < g.KW; kw++)
+                            {
+                                const auto [off, lo_w, hi_w] = taps[kw];
+                                const int32_t tap = static_cast<int32_t>(kh * g.KW + kw);
+                                for (size_t ow = lo_w; ow < hi_w; ow++)
+                                {
+                                    const float v = row[static_cast<std::ptrdiff_t>(ow * g.sw) + off];
+                                    if constexpr (WithIndices)
+                                    {
+                                        // the first element is taken even if it is -inf, so every index is set
+                                        const bool take = v > o[ow] || v != v || best[ow] < 0;
+                                        o[ow] = take ? v : o[ow];
+                                        best[ow] = take ? tap : best[ow];
+                                    }
+                                    else
+                                        o[ow] = v > o[ow] || v != v ? v : o[ow];
+                                }
+                            }
+                        }
+                        if constexpr (WithIndices)
+                        {
+                            int64_t *id = indices + (pl * g.OH + oh) * g.OW;
+                            for (size_t ow = 0; ow < g.OW; ow++)
+                                id[ow] = flat_index(oh, ow, best[ow]);
+                        }
+                    }
+                } });
+            return;
+        }
+
+        parallel_for(0, g.N * g.OH, 1, [&](size_t lo, size_t hi)
+                     {
+            std::vector<int32_t> best(WithIndices ? g.C : 0);
+            for (size_t r = lo; r < hi; r++)
+            {
+                const size_t n = r / g.OH, oh = r % g.OH;
+                for (size_t ow = 0; ow < g.OW; ow++)
+                {
+                    float *o = out + (r * g.OW + ow) * g.C;
+                    std::fill(o, o + g.C, lowest);
+                    std::fill(best.begin(), best.end(), -1);
+                    for (size_t kh = 0; kh < g.KH; kh++)
+                    {
+                        const std::ptrdiff_t ih = conv::input_pos(oh, g.sh, kh, 1, g.ph);
+                        if (!in_range(ih, g.H))
+                            continue;
+                        for (size_t kw = 0; kw < g.KW; kw++)
+                        {
+                            const std::ptrdiff_t iw = conv::input_pos(ow, g.sw, kw, 1, g.pw);
+                            if (!in_range(iw, g.W))
+                                continue;
+                            const float *xp = x + ((n * g.H + ih) * g.W + iw) * g.C;
+                            const int32_t tap = static_cast<int32_t>(kh * g.KW + kw);
+                            for (size_t c = 0; c < g.C; c++)
+                            {
+                                const float v = xp[c];
+                                if constexpr (WithIndices)
+                                {
+                                    const bool take = v > o[c] || v != v || best[c] < 0;
+                                    o[c] = take ? v : o[c];
+                                    best[c] = take ? tap : best[c];
+                                }
+                                else
+                                    o[c] = v > o[c] || v != v ? v : o[c];
+                            }
+                        }
+                    }
+                    if constexpr (WithIndices)
+                    {
+                        int64_t *id = indices + (r * g.OW + ow) * g.C;
+                        for (size_t c = 0; c < g.C; c++)
+                            id[c] = flat_index(oh, ow, best[c]);
+                    }
+                }
+            } });
+    }
+
+    inline void avg_forward(const conv::Geometry &g, bool include_pad, const float *x, float *out)
+    {
+        const std::vector<float> inv_h = inverse_counts(g.OH, g.H, g.KH, g.sh, g.ph, include_pad);
+        const std::vector<float> inv_w = inverse_counts(g.OW, g.W, g.KW, g.sw, g.pw, include_pad);
+        if (!g.channels_last)
+        {
+            const std::vector<conv::ColumnTap> taps = conv::column_taps(g);
+            parallel_for(0, g.N * g.C, 1, [&](size_t lo, size_t hi)
+                         {
+                for (size_t pl = lo; pl < hi; pl++)
+                {
+                    const float *xp = x + pl * g.H * g.W;
+                    for (size_t oh = 0; oh < g.OH; oh++)
+                    {
+                        float *o = out + (pl * g.OH + oh) * g.OW;
+                        std::fill(o, o + g.OW, 0.0f);
+                        for (size_t kh = 0; kh < g.KH; kh++)
+                        {
+                            const std::ptrdiff_t ih = conv::input_pos(oh, g.sh, kh, 1, g.ph);
+                            if (!in_range(ih, g.H))
+                                continue;
+                            const float *row = xp + ih * g.W;
+                            for (const auto &[off, lo_w, hi_w] : taps)
+                                for (size_t ow = lo_w; ow < hi_w; ow++)
+                                    o[ow] += row[static_cast<std::ptrdiff_t>(ow * g.sw) + off];
+                        }
+                        for (size_t ow = 0; ow < g.OW; ow++)
+                            o[ow] *= inv_h[oh] * inv_w[ow];
+                    }
+                } });
+            return;
+        }
+
+        parallel_for(0, g.N * g.OH, 1, [&](size_t lo, size_t hi)
+                     {
+            for (size_t r = lo; r < hi; r++)
+            {
+                const size_t n = r / g.OH, oh = r % g.OH;
+                for (size_t ow = 0; ow < g.OW; ow++)
+                {
+                    float *o = out + (r * g.OW + ow) * g.C;
+                    std::fill(o, o + g.C, 0.0f);
+                    for (size_t kh = 0; kh < g.KH; kh++)
+                    {
+                        const std::ptrdiff_t ih = conv::input_pos(oh, g.sh, kh, 1, g.ph);
+                        if (!in_range(ih, g.H))
+                            continue;
+                        for (size_t kw = 0; kw < g.KW; kw++)
+                        {
+                            const std::ptrdiff_t iw = conv::input_pos(ow, g.sw, kw, 1, g.pw);
+                            if (!in_range(iw, g.W))
+                                continue;
+                            const float *xp = x + ((n * g.H + ih) * g.W + iw) * g.C;
+                            for (size_t c = 0; c < g.C; c++)
+                                o[c] += xp[c];
+                        }
+                    }
+                    const float scale = inv_h[oh] * inv_w[ow];
+                    for (size_t c = 0; c < g.C; c++)
+                        o[c] *= scale;
+                }
+            } });
+    }
+
+    inline void avg_backward(const conv::Geometry &g, bool include_pad, const float *go, float *gx)
+    {
+        const std::vector<float> inv_h = inverse_counts(g.OH, g.H, g.KH, g.sh, g.ph, include_pad);
+        const std::vector<float> inv_w = inverse_counts(g.OW, g.W, g.KW, g.sw, g.pw, include_pad);
+        if (!g.channels_last)
+        {
+            const std::vector<conv::ColumnTap> taps = conv::column_taps(g);
+            parallel_for(0, g.N * g.C, 1, [&](size_t lo, size_t hi)
+                         {
+                std::vector<float> scaled(g.OW);
+                for (size_t pl = lo; pl < hi; pl++)
+                {
+                    float *xp = gx + pl * g.H * g.W;
+                    std::fill(xp, xp + g.H * g.W, 0.0f);
+                    for (size_t oh = 0; oh < g.OH; oh++)
+                    {
+                        const float *grow = go + (pl * g.OH + oh) * g.OW;
+                        for (size_t ow = 0; ow < g.OW; ow++)
+                            scaled[ow] = grow[ow] * (inv_h[oh] * inv_w[ow]);
+                        for (size_t kh = 0; kh < g.KH; kh++)
+                        {
+                            const std::ptrdiff_t ih = conv::input_pos(oh, g.sh, kh, 1, g.ph);
+                            if (!in_range(ih, g.H))
+                                continue;
+                            float *row = xp + ih * g.W;
+                            for (const auto &[off, lo_w, hi_w] : taps)
+                                for (size_t ow = lo_w; ow < hi_w; ow++)
+                                    row[static_cast<std::ptrdiff_t>(ow * g.sw) + off] += scaled[ow];
+                        }
+                    }
+                } });
+            return;
+        }
+
+        const size_t blocks = (g.C + kChannelBlock - 1) / kChannelBlock;
+        parallel_for(0, g.N * blocks, 1, [&](size_t lo, size_t hi)
+                     {
+            for (size_t t = lo; t < hi; t++)
+            {
+                const size_t n = t / blocks;
+                const size_t c0 = t % blocks * kChannelBlock, c1 = std::min(g.C, c0 + kChannelBlock);
+                float *gxn = gx + n * g.H * g.W * g.C;
+                for (size_t p = 0; p < g.H * g.W; p++)
+                    std::fill(gxn + p * g.C + c0, gxn + p * g.C + c1, 0.0f);
+                for (size_t oh = 0; oh < g.OH; oh++)
+                    for (size_t ow = 0; ow < g.OW; ow++)
+                    {
+                        const float *gp = go + ((n * g.OH + oh) * g.OW + ow) * g.C;
+                        const float scale = inv_h[oh] * inv_w[ow];
+                        for (size_t kh = 0; kh < g.KH; kh++)
+                        {
+                            const std::ptrdiff_t ih = conv::input_pos(oh, g.sh, kh, 1, g.ph);
+                            if (!in_range(ih, g.H))
+                                continue;
+                            for (size_t kw = 0; kw < g.KW; kw++)
+                            {
+                                const std::ptrdiff_t iw = conv::input_pos(ow, g.sw, kw, 1, g.pw);
+                                if (!in_range(iw, g.W))
+                                    continue;
+                                float *xp = gxn + (ih * g.W + iw) * g.C;
+                                for (size_t c = c0; c < c1; c++)
+                                    xp[c] += gp[c] * scale;
+                            }
+                        }
+                    }
+            } });
+    }
+
+    // Adaptive pooling window [start, end) of output position o along a dimension
+    inline size_t adaptive_start(size_t o, size_t in, size_t out) { return o * in / out; }
+    inline size_t adaptive_end(size_t o, size_t in, size_t out) { return ((o + 1) * in + out - 1) / out; }
+}
+
+inline NDArray<float> max_pool2d(const NDArray<float> &x, const Pool2dParams &p)
+{
+    profiler::Scope prof("max_pool2d", x);
+    const conv::Geometry g = pool::make_geometry(x.get_shape(), p, "max_pool2d");
+    const NDArray<float> xc = conv::compact(x);
+    NDArray<float> out = NDArray<float>::empty(g.out_shape());
+    pool::max_forward<false>(g, conv::data_of(xc), out.get_handle()->ptr(), nullptr);
+    prof.output(out);
+    return out;
+}
+
+inline std::pair<NDArray<float>, NDArray<int64_t>> max_pool2d_with_indices(const NDArray<float> &x, const Pool2dParams &p)
+{
+    profiler::Scope prof("max_pool2d_with_indices", x);
+    const conv::Geometry g = pool::make_geometry(x.get_shape(), p, "max_pool2d");
+    const NDArray<float> xc = conv::compact(x);
+    NDArray<float> out = NDArray<float>::empty(g.out_shape());
+    NDArray<int64_t> indices = NDArray<int64_t>::empty(g.out_shape());
+    pool::max_forward<true>(g, conv::data_of(xc), out.get_handle()->ptr(), indices.get_handle()->ptr());
+    prof.output(out);
+    prof.output(indices);
+    return {out, indices};
+}
+
+inline NDArray<float> max_pool2d_backward(const NDArray<float> &grad_out, const NDArray<int64_t> &indices,
+                                          const DimVec &x_shape, bool channels_last)
+{
+    profiler::Scope prof("max_pool2d_backward", grad_out, indices);
+    const DimVec d = pool::image_dims(x_shape, channels_last, "max_pool2d_backward");
+    const DimVec go_shape = grad_out.get_shape();
+    if (go_shape != indices.get_shape() || go_shape.size() != 4 || go_shape[0] != d[0] ||
+        go_shape[channels_last ? 3 : 1] != d[1])
+        throw std::invalid_argument("max_pool2d_backward grad_out and indices must match the pooled output");
+    const size_t N = d[0], C = d[1], plane = d[2] * d[3];
+    const size_t out_plane = channels_last ? go_shape[1] * go_shape[2] : go_shape[2] * go_shape[3];
+
+    const NDArray<float> gc = conv::compact(grad_out);
+    const NDArray<int64_t> ic = indices.is_contiguous() ? indices : indices.make_compact();
+    const float *go = conv::data_of(gc);
+    const int64_t *idx = ic.get_handle()->ptr() + ic.get_offset();
+    NDArray<float> gx = NDArray<float>::empty(x_shape);
+    prof.output(gx);
+    float *dst = gx.get_handle()->ptr();
+    const auto check = [&](int64_t i)
+    {
+        if (i < 0 || static_cast<size_t>(i) >= plane)
+            throw std::invalid_argument("max_pool2d_backward index out of range");
+    };
+
+    if (!channels_last)
+    {
+        parallel_for(0, N * C, 1, [&](size_t lo, size_t hi)
+                     {
+            for (size_t pl = lo; pl < hi; pl++)
+            {
+                float *xp = dst + pl * plane;
+                std::fill(xp, xp + plane, 0.0f);
+                for (size_t o = pl * out_plane; o < (pl + 1) * out_plane; o++)
+                {
+                    check(idx[o]);
+                    xp[idx[o]] += go[o];
+                }
+            } });
+        return gx;
+    }
+
+    const size_t blocks = (C + pool::kChannelBlock - 1) / pool::kChannelBlock;
+    parallel_for(0, N * blocks, 1, [&](size_t lo, size_t hi)
+                 {
+        for (size_t t = lo; t < hi; t++)
+        {
+            const size_t n = t / blocks;
+            const size_t c0 = t % blocks * pool::kChannelBlock, c1 = std::min(C, c0 + pool::kChannelBlock);
+            float *xn = dst + n * plane * C;
+            for (size_t p = 0; p < plane; p++)
+                std::fill(xn + p * C + c0, xn + p * C + c1, 0.0f);
+            for (size_t o = n * out_plane; o < (n + 1) * out_plane; o++)
+                for (size_t c = c0; c < c1; c++)
+                {
+                    check(idx[o * C + c]);
+                    xn[idx[o * C + c] * C + c] += go[o * C + c];
+                }
+        } });
+    return gx;
+}
+
+inline NDArray<float> avg_pool2d(const NDArray<float> &x, const Pool2dParams &p)
+{
+    profiler::Scope prof("avg_pool2d", x);
+    const conv::Geometry g = pool::make_geometry(x.get_shape(), p, "avg_pool2d");
+    const NDArray<float> xc = conv::compact(x);
+    NDArray<float> out = NDArray<float>::empty(g.out_shape());
+    pool::avg_forward(g, p.count_include_pad, conv::data_of(xc), out.get_handle()->ptr());
+    prof.output(out);
+    return out;
+}
+
+inline NDArray<float> avg_pool2d_backward(const NDArray<float> &grad_out, const DimVec &x_shape, const Pool2dParams &p)
+{
+    profiler::Scope prof("avg_pool2d_backward", grad_out);
+    const conv::Geometry g = pool::make_geometry(x_shape, p, "avg_pool2d_backward");
+    if (grad_out.get_shape() != g.out_shape())
+        throw std::invalid_argument("avg_pool2d_backward grad_out does not match the pooled output shape");
+    const NDArray<float> gc = conv::compact(grad_out);
+    NDArray<float> gx = NDArray<float>::empty(x_shape);
+    pool::avg_backward(g, p.count_include_pad, conv::data_of(gc), gx.get_handle()->ptr());
+    prof.output(gx);
+    return gx;
+}
+
+inline NDArray<float> adaptive_avg_pool2d(const NDArray<float> &x, size_t out_h, size_t out_w, bool channels_last)
+{
+    profiler::Scope prof("adaptive_avg_pool2d", x);
+    const DimVec d = pool::image_dims(x.get_shape(), channels_last, "adaptive_avg_pool2d");
+    const size_t N = d[0], C = d[1], H = d[2], W = d[3];
+    if (out_h == 0 || out_w == 0 || H == 0 || W == 0)
+        throw std::invalid_argument("adaptive_avg_pool2d needs a non-empty input and output size");
+
+    const NDArray<float> xc = conv::compact(x);
+    const float *src = conv::data_of(xc);
+    NDArray<float> out = NDArray<float>::empty(channels_last ? DimVec{N, out_h, out_w, C} : DimVec{N, C, out_h, out_w});
+    prof.output(out);
+    float *dst = out.get_handle()->ptr();
+
+    if (!channels_last)
+    {
+        parallel_for(0, N * C, 1, [&](size_t lo, size_t hi)
+                     {
+            // rows of a window are summed first, then each output sums its columns of that row sum
+            std::vector<float> row_sum(W);
+            for (size_t pl = lo; pl < hi; pl++)
+            {
+                const float *xp = src + pl * H * W;
+                for (size_t oh = 0; oh < out_h; oh++)
+                {
+                    const size_t h0 = pool::adaptive_start(oh, H, out_h), h1 = pool::adaptive_end(oh, H, out_h);
+                    std::copy(xp + h0 * W, xp + (h0 + 1) * W, row_sum.begin());
+                    for (size_t ih = h0 + 1; ih < h1; ih++)
+                        for (size_t iw = 0; iw < W; iw++)
+                            row_sum[iw] += xp[ih * W + iw];
+                    for (size_t ow = 0; ow < out_w; ow++)
+                    {
+                        const size_t w0 = pool::adaptive_start(ow, W, out_w), w1 = pool::adaptive_end(ow, W, out_w);
+                        float s = 0.0f;
+                        for (size_t iw = w0; iw < w1; iw++)
+                            s += row_sum[iw];
+                        dst[(pl * out_h + oh) * out_w + ow] = s / static_cast<float>((h1 - h0) * (w1 - w0));
+                    }
+                }
+            } });
+        return out;
+    }
+
+    parallel_for(0, N * out_h, 1, [&](size_t lo, size_t hi)
+                 {
+        for (size_t r = lo; r < hi; r++)
+        {
+            const size_t n = r / out_h, oh = r % out_h;
+            const size_t h0 = pool::adaptive_start(oh, H, out_h), h1 = pool::adaptive_end(oh, H, out_h);
+            for (size_t ow = 0; ow < out_w; ow++)
+            {
+                const size_t w0 = pool::adaptive_start(ow, W, out_w), w1 = pool::adaptive_end(ow, W, out_w);
+                float *o = dst + (r * out_w + ow) * C;
+                std::fill(o, o + C, 0.0f);
+                for (size_t ih = h0; ih < h1; ih++)
+                    for (size_t iw = w0; iw < w1; iw++)
+                    {
+                        const float *xp = src + ((n * H + ih) * W + iw) * C;
+                        for (size_t c = 0; c < C; c++)
+                            o[c] += xp[c];
+                    }
+                const float scale = 1.0f / static_cast<float>((h1 - h0) * (w1 - w0));
+                for (size_t c = 0; c < C; c++)
+                    o[c] *= scale;
+            }
+        } });
+    return out;
+}
+
+inline NDArray<float> adaptive_avg_pool2d_backward(const NDArray<float> &grad_out, const DimVec &x_shape,
+                                                   bool channels_last)
+{
+    profiler::Scope prof("adaptive_avg_pool2d_backward", grad_out);
+    const DimVec d = pool::image_dims(x_shape, channels_last, "adaptive_avg_pool2d_backward");
+    const size_t N = d[0], C = d[1], H = d[2], W = d[3];
+    const DimVec go_shape = grad_out.get_shape();
+    if (go_shape.size() != 4 || go_shape[0] != N || go_shape[channels_last ? 3 : 1] != C)
+        throw std::invalid_argument("adaptive_avg_pool2d_backward grad_out does not match the input");
+    const size_t out_h = go_shape[channels_last ? 1 : 2], out_w = go_shape[channels_last ? 2 : 3];
+    if (out_h == 0 || out_w == 0 || H == 0 || W == 0)
+        throw std::invalid_argument("adaptive_avg_pool2d needs a non-empty input and output size");
+
+    const NDArray<float> gc = conv::compact(grad_out);
+    const float *go = conv::data_of(gc);
+    NDArray<float> gx = NDArray<float>::empty(x_shape);
+    prof.output(gx);
+    float *dst = gx.get_handle()->ptr();
+    const auto scale = [&](size_t oh, size_t ow)
+    {
+        return 1.0f / static_cast<float>((pool::adaptive_end(oh, H, out_h) - pool::adaptive_start(oh, H, out_h)) *
+                                         (pool::adaptive_end(ow, W, out_w) - pool::adaptive_start(ow, W, out_w)));
+    };
+
+    if (!channels_last)
+    {
+        parallel_for(0, N * C, 1, [&](size_t lo, size_t hi)
+                     {
+            for (size_t pl = lo; pl < hi; pl++)
+            {
+                float *xp = dst + pl * H * W;
+                std::fill(xp, xp + H * W, 0.0f);
+                for (size_t oh = 0; oh < out_h; oh++)
+                    for (size_t ow = 0; ow < out_w; ow++)
+                    {
+                        const float v = go[(pl * out_h + oh) * out_w + ow] * scale(oh, ow);
+                        const size_t w0 = pool::adaptive_start(ow, W, out_w), w1 = pool::adaptive_end(ow, W, out_w);
+                        for (size_t ih = pool::adaptive_start(oh, H, out_h); ih < pool::adaptive_end(oh, H, out_h); ih++)
+                            for (size_t iw = w0; iw < w1; iw++)
+                                xp[ih * W + iw] += v;
+                    }
+            } });
+        return gx;
+    }
+
+    const size_t blocks = (C + pool::kChannelBlock - 1) / pool::kChannelBlock;
+    parallel_for(0, N * blocks, 1, [&](size_t lo, size_t hi)
+                 {
+        for (size_t t = lo; t < hi; t++)
+        {
+            const size_t n = t / blocks;
+            const size_t c0 = t % blocks * pool::kChannelBlock, c1 = std::min(C, c0 + pool::kChannelBlock);
+            float *xn = dst + n * H * W * C;
+            for (size_t p = 0; p < H * W; p++)
+                std::fill(xn + p * C + c0, xn + p * C + c1, 0.0f);
+            for (size_t oh = 0; oh < out_h; oh++)
+                for (size_t ow = 0; ow < out_w; ow++)
+                {
+                    const float *gp = go + ((n * out_h + oh) * out_w + ow) * C;
+                    const float s = scale(oh, ow);
+                    const size_t w0 = pool::adaptive_start(ow, W, out_w), w1 = pool::adaptive_end(ow, W, out_w);
+                    for (size_t ih = pool::adaptive_start(oh, H, out_h); ih < pool::adaptive_end(oh, H, out_h); ih++)
+                        for (size_t iw = w0; iw < w1; iw++)
+                        {
+                            float *xp = xn + (ih * W + iw) * C;
+                            for (size_t c = c0; c < c1; c++)
+                                xp[c] += gp[c] * s;
+                        }
+                }
+        } });
+    return gx;
+}
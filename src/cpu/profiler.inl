@@ -0,0 +1,342 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <dtypes.inl>
+
+/**
+ * @brief Per op profiler.
+ *
+ * Every kernel entry point opens a Scope. Outside a profiling session that is one relaxed load of the
+ * active flag and a never taken branch. During a session each scope records the op name, the dtype,
+ * shape and strides of its inputs, the bytes of its outputs, its wall time and the calling thread.
+ * Ops called by other ops (a make_compact inside matmul, say) show up nested under their caller: their
+ * time counts towards the caller's total but not its self time. A session is process wide, events
+ * from every thread go to the same list. Allocation tagging (memory_stats.inl) turns the scopes on as
+ * well, to name the op behind each allocation.
+ */
+namespace profiler
+{
+    struct Operand
+    {
+        const char *dtype;
+        DimVec shape;
+        DimVec strides;
+    };
+
+    struct Event
+    {
+        const char *op = "";
+        std::vector<Operand> inputs;
+        size_t output_bytes = 0;
+        int64_t start_ns = 0;    // since the session started
+        int64_t duration_ns = 0;
+        int64_t self_ns = 0;     // duration minus the ops nested in it on the same thread
+        uint32_t thread = 0;     // small sequential id, in order of each thread's first op
+        uint32_t depth = 0;      // 0 for ops called from outside the backend
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    // Number of users of the scopes, a running session and allocation tagging
+    inline std::atomic<int> active{0};
+
+    inline uint32_t thread_id()
+    {
+        static std::atomic<uint32_t> next{0};
+        thread_local const uint32_t id = next++;
+        return id;
+    }
+
+    class Session
+    {
+    public:
+        static Session &instance()
+        {
+            static Session session;
+            return session;
+        }
+
+        // Starts recording, throws if a session is already running
+        void start()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (running.load())
+                throw std::runtime_error("a profiling session is already running");
+            events.clear();
+            origin = Clock::now();
+            running.store(true);
+            active++;
+        }
+
+        // Stops recording and returns the events in order of completion
+        std::vector<Event> stop()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (running.exchange(false))
+                active--;
+            return std::move(events);
+        }
+
+        void record(Event &&event, Clock::time_point start)
+        {
+            if (!running.load(std::memory_order_relaxed))
+                return;
+            std::lock_guard<std::mutex> lock(mutex);
+            // ops that outlive their session, or started before it, are dropped
+            if (!running.load() || start < origin)
+                return;
+            event.start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(start - origin).count();
+            events.push_back(std::move(event));
+        }
+
+    private:
+        std::mutex mutex;
+        std::atomic<bool> running{false};
+        std::vector<Event> events;
+        Clock::time_point origin;
+    };
+
+    template <typename T>
+    Operand operand(const NDArray<T> &a)
+    {
+        return {dtype_name<T>(), a.get_shape(), a.get_strides()};
+    }
+
+    template <typename T>
+    size_t output_bytes(const NDArray<T> &a)
+    {
+        size_t n = sizeof(T);
+        for (size_t d : a.get_shape())
+            n *= d;
+        return n;
+    }
+
+    // Sparse operands have no strides, describe() marks them as sparse instead
+    template <typename T>
+    Operand operand(const SparseNDArray<T> &a)
+    {
+        return {dtype_name<T>(), a.get_shape(), {}};
+    }
+
+    template <typename T>
+    size_t output_bytes(const SparseNDArray<T> &a)
+    {
+        return output_bytes(a.get_rows()) + output_bytes(a.get_cols()) + output_bytes(a.get_values());
+    }
+
+    template <typename A, typename B>
+    size_t output_bytes(const std::pair<A, B> &p)
+    {
+        return output_bytes(p.first) + output_bytes(p.second);
+    }
+
+    /**
+     * @brief Times one op from construction to destruction, see the namespace comment. Kernels report
+     * their result with output(), or result() when returning a temporary.
+     */
+    class Scope
+    {
+        struct Frame
+        {
+            Event event;
+            Clock::time_point start;
+            int64_t nested_ns = 0;
+            Frame *parent = nullptr;
+        };
+
+        std::unique_ptr<Frame> frame;
+
+        static Frame *&current()
+        {
+            thread_local Frame *top = nullptr;
+            return top;
+        }
+
+        void begin(const char *op, std::vector<Operand> &&inputs)
+        {
+            frame = std::make_unique<Frame>();
+            frame->event.op = op;
+            frame->event.inputs = std::move(inputs);
+            frame->event.thread = thread_id();
+            frame->parent = current();
+            frame->event.depth = frame->parent ? frame->parent->event.depth + 1 : 0;
+            current() = frame.get();
+            frame->start = Clock::now();
+        }
+
+        void end()
+        {
+            const int64_t ns =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - frame->start).count();
+            current() = frame->parent;
+            if (frame->parent)
+                frame->parent->nested_ns += ns;
+            frame->event.duration_ns = ns;
+            frame->event.self_ns = ns - frame->nested_ns;
+            Session::instance().record(std::move(frame->event), frame->start);
+        }
+
+    public:
+        template <typename... Arrays>
+        explicit Scope(const char *op, const Arrays &...inputs)
+        {
+            if (active.load(std::memory_order_relaxed))
+                begin(op, {operand(inputs)...});
+        }
+
+        // Ops open on this thread, outermost first and joined by '/', empty outside any op
+        static std::string op_path()
+        {
+            std::string path;
+            for (const Frame *f = current(); f; f = f->parent)
+                path = f->parent ? "/" + std::string(f->event.op) + path : f->event.op + path;
+            return path;
+        }
+
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+
+        ~Scope()
+        {
+            if (frame)
+                end();
+        }
+
+        template <typename R>
+        void output(const R &result)
+        {
+            if (frame)
+                frame->event.output_bytes += output_bytes(result);
+        }
+
+        // output() on a temporary passing through, as in return prof.result(kernel(...))
+        template <typename R>
+        R result(R &&r)
+        {
+            static_assert(!std::is_lvalue_reference_v<R>, "use output() on named results");
+            output(r);
+            return std::move(r);
+        }
+    };
+
+    // "float32[64, 128]", with the strides appended when they are not row major, or "{sparse}"
+    inline std::string describe(const Operand &o)
+    {
+        auto join = [](const DimVec &v)
+        {
+            std::string s;
+            for (size_t i = 0; i < v.size(); i++)
+                s += (i ? ", " : "") + std::to_string(v[i]);
+            return s;
+        };
+        std::string s = std::string(o.dtype) + "[" + join(o.shape) + "]";
+        if (o.strides.size() != o.shape.size())
+            return s + "{sparse}";
+        size_t expected = 1;
+        bool row_major = true;
+        for (size_t d = o.shape.size(); d-- > 0;)
+        {
+            row_major &= o.shape[d] == 1 || o.strides[d] == expected;
+            expected *= o.shape[d];
+        }
+        if (!row_major)
+            s += "{" + join(o.strides) + "}";
+        return s;
+    }
+
+    inline std::string describe(const std::vector<Operand> &inputs)
+    {
+        std::string s;
+        for (size_t i = 0; i < inputs.size(); i++)
+            s += (i ? ", " : "") + describe(inputs[i]);
+        return s;
+    }
+
+    struct Summary
+    {
+        std::string op;
+        std::string inputs; // empty when grouped by op only
+        size_t calls = 0;
+        int64_t total_ns = 0;
+        int64_t self_ns = 0;
+        size_t output_bytes = 0;
+    };
+
+    // Events grouped by op (and by input signature with by_inputs), by descending self time
+    inline std::vector<Summary> summarize(const std::vector<Event> &events, bool by_inputs)
+    {
+        std::map<std::pair<std::string, std::string>, Summary> groups;
+        for (const Event &e : events)
+        {
+            const std::string inputs = by_inputs ? describe(e.inputs) : std::string();
+            Summary &s = groups[{e.op, inputs}];
+            s.op = e.op;
+            s.inputs = inputs;
+            s.calls++;
+            s.total_ns += e.duration_ns;
+            s.self_ns += e.self_ns;
+            s.output_bytes += e.output_bytes;
+        }
+        std::vector<Summary> rows;
+        for (auto &[key, s] : groups)
+            rows.push_back(std::move(s));
+        std::stable_sort(rows.begin(), rows.end(), [](const Summary &a, const Summary &b)
+                         { return a.self_ns > b.self_ns; });
+        return rows;
+    }
+
+    // Aggregate table of the top rows of summarize, with each row's share of the total self time
+    inline std::string format_table(const std::vector<Event> &events, bool by_inputs, size_t top)
+    {
+        const std::vector<Summary> rows = summarize(events, by_inputs);
+        int64_t all_ns = 0;
+        for (const Summary &s : rows)
+            all_ns += s.self_ns;
+
+        std::string out;
+        char line[256];
+        std::snprintf(line, sizeof(line), "%-24s %8s %12s %12s %12s %7s %12s  %s\n", "op", "calls", "total ms",
+                      "self ms", "avg us", "self %", "output MB", by_inputs ? "inputs" : "");
+        out += line;
+        for (size_t i = 0; i < rows.size() && i < top; i++)
+        {
+            const Summary &s = rows[i];
+            std::snprintf(line, sizeof(line), "%-24s %8zu %12.3f %12.3f %12.2f %7.1f %12.3f  ", s.op.c_str(), s.calls,
+                          s.total_ns * 1e-6, s.self_ns * 1e-6, s.total_ns * 1e-3 / s.calls,
+                          all_ns ? 100.0 * s.self_ns / all_ns : 0.0, s.output_bytes / 1e6);
+            out += line + s.inputs + "\n";
+        }
+        if (rows.size() > top)
+            out += "... " + std::to_string(rows.size() - top) + " more\n";
+        return out;
+    }
+
+    // Chrome trace_event JSON (chrome://tracing, Perfetto), one complete event per op
+    inline std::string chrome_trace(const std::vector<Event> &events)
+    {
+        std::string out = "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+        char buf[128];
+        for (size_t i = 0; i < events.size(); i++)
+        {
+            const Event &e = events[i];
+            std::snprintf(buf, sizeof(buf), "%s\n{\"ph\": \"X\", \"cat\": \"op\", \"pid\": 0, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, ",
+                          i ? "," : "", e.thread, e.start_ns * 1e-3, e.duration_ns * 1e-3);
+            out += buf;
+            out += "\"name\": \"" + std::string(e.op) + "\", \"args\": {\"inputs\": \"" + describe(e.inputs) +
+                   "\", \"output_bytes\": " + std::to_string(e.output_bytes) + "}}";
+        }
+        out += "\n]}\n";
+        return out;
+    }
+}
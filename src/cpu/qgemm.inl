@@ -0,0 +1,522 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <cpu_features.inl>
+#include <thread_pool.inl>
+#include <gemm.inl>
+
+/**
+ * Int8 GEMM with int32 accumulation, C = A @ B for int8 A (M x K) and B (K x N), blocked and packed
+ * like the float sgemm (gemm.inl).
+ *
+ * The int8 dot product instructions (VPDPBUSD) multiply unsigned by signed bytes and sum groups of 4
+ * adjacent products into each int32 lane, so both operands are packed in groups of 4 along K:
+ *   A slivers as [K/4][MR][4], zero padded past K,
+ *   B slivers as [K/4][NR][4] with every byte offset to unsigned (b + 128, b xor 0x80).
+ * The offset adds 128 * rowsum(A)[i] to every C[i, j], which is subtracted again once the last K block
+ * of a tile is done. Offsetting B rather than A keeps that correction O(M * K), small next to the
+ * weights for inference shapes. All int32 arithmetic wraps, so the result is exact whenever the true
+ * A @ B fits in int32 (K up to ~130k).
+ *
+ * Micro-kernels:
+ *   AVX-512 VNNI 12x32 and AVX-VNNI 6x16 (VPDPBUSD),
+ *   AVX2 4x8 with VPMADDWD on int16, A is widened when it is packed and B per group in the kernel.
+ *   VPMADDUBSW would skip the widening but saturates the int16 sum of two u8 x s8 products, which
+ *   the offset weights reach,
+ *   a portable 4x8 fallback.
+ *
+ * Finished tiles are handed to an epilogue while still in cache, which is where the quantized ops
+ * (quant_ops.inl) apply scales, bias and requantization.
+ */
+
+namespace qgemm
+{
+    // micro-kernel: c[MR x NR] (row stride ldc) (+)= packed_a[kq x MR x 4]^T @ packed_b[kq x NR x 4]
+    using MicroKernel = void (*)(size_t kq, const int8_t *a, const uint8_t *b, int32_t *c, size_t ldc,
+                                 bool accumulate);
+
+    enum class QIsa
+    {
+        Scalar = 0,
+        AVX2 = 1,
+        AVXVNNI = 2,
+        AVX512VNNI = 3,
+    };
+
+    inline const char *qisa_name(QIsa isa)
+    {
+        switch (isa)
+        {
+        case QIsa::AVX2:
+            return "avx2";
+        case QIsa::AVXVNNI:
+            return "avx-vnni";
+        case QIsa::AVX512VNNI:
+            return "avx512-vnni";
+        default:
+            return "scalar";
+        }
+    }
+
+    // Widest int8 path the host supports, detected once.
+    inline QIsa detect_qisa()
+    {
+        static const QIsa isa = []
+        {
+            if (has_avx512_vnni())
+                return QIsa::AVX512VNNI;
+            if (has_avx_vnni())
+                return QIsa::AVXVNNI;
+            if (detect_isa() >= CpuIsa::AVX2)
+                return QIsa::AVX2;
+            return QIsa::Scalar;
+        }();
+        return isa;
+    }
+
+    // Int8 paths the host supports, narrowest first
+    inline std::vector<QIsa> available_qisas()
+    {
+        std::vector<QIsa> isas{QIsa::Scalar};
+        if (detect_isa() >= CpuIsa::AVX2)
+            isas.push_back(QIsa::AVX2);
+        if (has_avx_vnni())
+            isas.push_back(QIsa::AVXVNNI);
+        if (has_avx512_vnni())
+            isas.push_back(QIsa::AVX512VNNI);
+        return isas;
+    }
+
+    // kc is in elements of K and a multiple of 4. a_bytes is the size of a packed A element, 2 for the
+    // AVX2 kernel which takes A already widened to 16 bits.
+    struct KernelInfo
+    {
+        size_t mr, nr;
+        size_t mc, kc, nc;
+        MicroKernel ukernel;
+        QIsa isa;
+        size_t a_bytes;
+    };
+
+    // A's 4 bytes of one group, to broadcast
+    inline int load_group(const int8_t *p)
+    {
+        int v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    /** Micro-kernels
+     *
+     */
+
+    template <size_t MR, size_t NR>
+    void ukernel_generic(size_t kq, const int8_t *a, const uint8_t *b, int32_t *c, size_t ldc, bool accumulate)
+    {
+        // unsigned so the sums wrap like the SIMD kernels
+        uint32_t acc[MR][NR] = {};
+        for (size_t g = 0; g < kq; g++)
+        {
+            for (size_t i = 0; i < MR; i++)
+            {
+                for (size_t j = 0; j < NR; j++)
+                {
+                    int32_t dot = 0;
+                    for (size_t t = 0; t < 4; t++)
+                        dot += int32_t(a[4 * i + t]) * int32_t(b[4 * j + t]);
+                    acc[i][j] += static_cast<uint32_t>(dot);
+                }
+            }
+            a += 4 * MR;
+            b += 4 * NR;
+        }
+        for (size_t i = 0; i < MR; i++)
+        {
+            for (size_t j = 0; j < NR; j++)
+            {
+                const uint32_t prev = accumulate ? static_cast<uint32_t>(c[i * ldc + j]) : 0;
+                c[i * ldc + j] = static_cast<int32_t>(prev + acc[i][j]);
+            }
+        }
+    }
+
+#if PHOTON_X86_DISPATCH
+    __attribute__((target("avx2"))) inline void ukernel_avx2_4x8(size_t kq, const int8_t *a, const uint8_t *b,
+                                                                 int32_t *c, size_t ldc, bool accumulate)
+    {
+        // A comes packed as 16 bit values. acc[i][0] holds columns 0-3 and acc[i][1] columns 4-7, each as
+        // two partial sums (k0 + k1, k2 + k3).
+        __m256i acc[4][2];
+#pragma GCC unroll 4
+        for (int i = 0; i < 4; i++)
+        {
+            acc[i][0] = _mm256_setzero_si256();
+            acc[i][1] = _mm256_setzero_si256();
+        }
+        for (size_t g = 0; g < kq; g++)
+        {
+            const __m256i b0 = _mm256_cvtepu8_epi16(_mm_load_si128(reinterpret_cast<const __m128i *>(b)));
+            const __m256i b1 = _mm256_cvtepu8_epi16(_mm_load_si128(reinterpret_cast<const __m128i *>(b + 16)));
+#pragma GCC unroll 4
+            for (int i = 0; i < 4; i++)
+            {
+                long long group;
+                std::memcpy(&group, a + 8 * i, sizeof(group));
+                const __m256i a_val = _mm256_set1_epi64x(group);
+                acc[i][0] = _mm256_add_epi32(acc[i][0], _mm256_madd_epi16(a_val, b0));
+                acc[i][1] = _mm256_add_epi32(acc[i][1], _mm256_madd_epi16(a_val, b1));
+            }
+            a += 32;
+            b += 32;
+        }
+        // pairwise add the partial sums, hadd leaves the columns as 0 1 4 5 | 2 3 6 7
+        const __m256i order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+#pragma GCC unroll 4
+        for (int i = 0; i < 4; i++)
+        {
+            __m256i row = _mm256_permutevar8x32_epi32(_mm256_hadd_epi32(acc[i][0], acc[i][1]), order);
+            __m256i *c_row = reinterpret_cast<__m256i *>(c + i * ldc);
+            if (accumulate)
+                row = _mm256_add_epi32(_mm256_loadu_si256(c_row), row);
+            _mm256_storeu_si256(c_row, row);
+        }
+    }
+
+    __attribute__((target("avx2,avxvnni"))) inline void ukernel_avxvnni_6x16(size_t kq, const int8_t *a,
+                                                                             const uint8_t *b, int32_t *c,
+                                                                             size_t ldc, bool accumulate)
+    {
+        __m256i acc[6][2];
+#pragma GCC unroll 6
+        for (int i = 0; i < 6; i++)
+        {
+            acc[i][0] = _mm256_setzero_si256();
+            acc[i][1] = _mm256_setzero_si256();
+        }
+        for (size_t g = 0; g < kq; g++)
+        {
+            const __m256i b0 = _mm256_load_si256(reinterpret_cast<const __m256i *>(b));
+            const __m256i b1 = _mm256_load_si256(reinterpret_cast<const __m256i *>(b + 32));
+#pragma GCC unroll 6
+            for (int i = 0; i < 6; i++)
+            {
+                const __m256i a_val = _mm256_set1_epi32(load_group(a + 4 * i));
+                acc[i][0] = _mm256_dpbusd_avx_epi32(acc[i][0], b0, a_val);
+                acc[i][1] = _mm256_dpbusd_avx_epi32(acc[i][1], b1, a_val);
+            }
+            a += 24;
+            b += 64;
+        }
+#pragma GCC unroll 6
+        for (int i = 0; i < 6; i++)
+        {
+            __m256i *c_row = reinterpret_cast<__m256i *>(c + i * ldc);
+            if (accumulate)
+            {
+                acc[i][0] = _mm256_add_epi32(_mm256_loadu_si256(c_row), acc[i][0]);
+                acc[i][1] = _mm256_add_epi32(_mm256_loadu_si256(c_row + 1), acc[i][1]);
+            }
+            _mm256_storeu_si256(c_row, acc[i][0]);
+            _mm256_storeu_si256(c_row + 1, acc[i][1]);
+        }
+    }
+
+    __attribute__((target("avx512f,avx512vnni"))) inline void ukernel_avx512vnni_12x32(size_t kq, const int8_t *a,
+                                                                                        const uint8_t *b, int32_t *c,
+                                                                                        size_t ldc, bool accumulate)
+    {
+        __m512i acc[12][2];
+#pragma GCC unroll 12
+        for (int i = 0; i < 12; i++)
+        {
+            acc[i][0] = _mm512_setzero_si512();
+            acc[i][1] = _mm512_setzero_si512();
+        }
+        for (size_t g = 0; g < kq; g++)
+        {
+            const __m512i b0 = _mm512_load_si512(b);
+            const __m512i b1 = _mm512_load_si512(b + 64);
+#pragma GCC unroll 12
+            for (int i = 0; i < 12; i++)
+            {
+                const __m512i a_val = _mm512_set1_epi32(load_group(a + 4 * i));
+                acc[i][0] = _mm512_dpbusd_epi32(acc[i][0], b0, a_val);
+                acc[i][1] = _mm512_dpbusd_epi32(acc[i][1], b1, a_val);
+            }
+            a += 48;
+            b += 128;
+        }
+#pragma GCC unroll 12
+        for (int i = 0; i < 12; i++)
+        {
+            int32_t *c_row = c + i * ldc;
+            if (accumulate)
+            {
+                acc[i][0] = _mm512_add_epi32(_mm512_loadu_si512(c_row), acc[i][0]);
+                acc[i][1] = _mm512_add_epi32(_mm512_loadu_si512(c_row + 16), acc[i][1]);
+            }
+            _mm512_storeu_si512(c_row, acc[i][0]);
+            _mm512_storeu_si512(c_row + 16, acc[i][1]);
+        }
+    }
+#endif
+
+    // Kernel for the given path, or the widest supported one below it
+    inline const KernelInfo &kernel_for(QIsa isa)
+    {
+#if PHOTON_X86_DISPATCH
+        // kc bytes of A and B slivers stay in L1, the MC x KC block of A in L2
+        static const KernelInfo avx512vnni{12, 32, 144, 512, 4096, ukernel_avx512vnni_12x32, QIsa::AVX512VNNI, 1};
+        static const KernelInfo avxvnni{6, 16, 120, 512, 4096, ukernel_avxvnni_6x16, QIsa::AVXVNNI, 1};
+        static const KernelInfo avx2{4, 8, 128, 256, 4096, ukernel_avx2_4x8, QIsa::AVX2, 2};
+        if (isa >= QIsa::AVX512VNNI && has_avx512_vnni())
+            return avx512vnni;
+        if (isa >= QIsa::AVXVNNI && has_avx_vnni())
+            return avxvnni;
+        if (isa >= QIsa::AVX2 && detect_isa() >= CpuIsa::AVX2)
+            return avx2;
+#endif
+        static const KernelInfo generic{4, 8, 128, 512, 2048, ukernel_generic<4, 8>, QIsa::Scalar, 1};
+        return generic;
+    }
+
+    inline const KernelInfo &default_kernel()
+    {
+        return kernel_for(detect_qisa());
+    }
+
+    /** Packing
+     *
+     */
+
+    inline gemm::PackBuffer<int8_t> &a_pack_buffer()
+    {
+        thread_local gemm::PackBuffer<int8_t> buf;
+        return buf;
+    }
+
+    inline gemm::PackBuffer<uint8_t> &b_pack_buffer()
+    {
+        thread_local gemm::PackBuffer<uint8_t> buf;
+        return buf;
+    }
+
+    // Pack the mc x kc block of A (row stride lda) into MR tall slivers of 4 element groups, zero padding
+    // the last sliver and the last group. U is int8_t, or int16_t for a_bytes 2.
+    template <typename U>
+    void pack_a(size_t mc, size_t kc, const int8_t *a, size_t lda, size_t mr, U *packed)
+    {
+        const size_t kq = (kc + 3) / 4;
+        for (size_t i0 = 0; i0 < mc; i0 += mr)
+        {
+            const size_t rows = std::min(mr, mc - i0);
+            for (size_t i = 0; i < rows; i++)
+            {
+                const int8_t *src = a + (i0 + i) * lda;
+                U *dst = packed + 4 * i;
+                for (size_t k = 0; k < kc; k++)
+                    dst[4 * mr * (k / 4) + k % 4] = src[k];
+                for (size_t k = kc; k < 4 * kq; k++)
+                    dst[4 * mr * (k / 4) + k % 4] = 0;
+            }
+            for (size_t g = 0; g < kq; g++)
+                std::fill(packed + 4 * mr * g + 4 * rows, packed + 4 * mr * (g + 1), U(0));
+            packed += 4 * mr * kq;
+        }
+    }
+
+    // Interleave 4 rows of B (row stride ldb) into groups of 4 bytes per column for cols columns, offset
+    // to unsigned
+    inline void interleave_rows(const int8_t *src, size_t ldb, size_t rows, size_t cols, uint8_t *dst)
+    {
+        size_t j = 0;
+#if defined(__SSE2__)
+        if (rows == 4)
+        {
+            const __m128i offset = _mm_set1_epi8(static_cast<char>(0x80));
+            for (; j + 16 <= cols; j += 16)
+            {
+                const __m128i r0 = _mm_xor_si128(offset, _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + j)));
+                const __m128i r1 = _mm_xor_si128(offset, _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + ldb + j)));
+                const __m128i r2 = _mm_xor_si128(offset, _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * ldb + j)));
+                const __m128i r3 = _mm_xor_si128(offset, _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 3 * ldb + j)));
+                const __m128i r01_lo = _mm_unpacklo_epi8(r0, r1), r01_hi = _mm_unpackhi_epi8(r0, r1);
+                const __m128i r23_lo = _mm_unpacklo_epi8(r2, r3), r23_hi = _mm_unpackhi_epi8(r2, r3);
+                __m128i *out = reinterpret_cast<__m128i *>(dst + 4 * j);
+                _mm_storeu_si128(out, _mm_unpacklo_epi16(r01_lo, r23_lo));
+                _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(r01_lo, r23_lo));
+                _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(r01_hi, r23_hi));
+                _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(r01_hi, r23_hi));
+            }
+        }
+#endif
+        for (; j < cols; j++)
+        {
+            for (size_t t = 0; t < rows; t++)
+                dst[4 * j + t] = static_cast<uint8_t>(src[t * ldb + j]) ^ 0x80;
+        }
+    }
+
+    // Pack the kc x nc block of B (row stride ldb) into NR wide slivers of 4 byte groups offset to
+    // unsigned, zero padding the last sliver and the last group. Goes over the block in column strips of
+    // kPackCols, so every 4 rows read a long run of each row while writing to few slivers at a time.
+    constexpr size_t kPackCols = 1024;
+
+    inline void pack_b(size_t kc, size_t nc, const int8_t *b, size_t ldb, size_t nr, uint8_t *packed)
+    {
+        const size_t kq = (kc + 3) / 4;
+        const size_t strip = std::max(nr, kPackCols / nr * nr);
+        for (size_t s0 = 0; s0 < nc; s0 += strip)
+        {
+            const size_t s1 = std::min(nc, s0 + strip);
+            for (size_t j0 = s0; j0 < s1; j0 += nr)
+            {
+                if (s1 - j0 < nr || kc % 4 != 0)
+                    std::memset(packed + j0 * 4 * kq, 0, 4 * nr * kq);
+            }
+            for (size_t g = 0; g < kq; g++)
+            {
+                const size_t rows = std::min<size_t>(4, kc - 4 * g);
+                for (size_t j0 = s0; j0 < s1; j0 += nr)
+                    interleave_rows(b + 4 * g * ldb + j0, ldb, rows, std::min(nr, s1 - j0),
+                                    packed + j0 * 4 * kq + 4 * nr * g);
+            }
+        }
+    }
+
+    /** Macro kernel: C[mc x nc] (+)= packed A block @ packed B panel
+     *
+     */
+    inline void macro_kernel(const KernelInfo &kern, size_t mc, size_t nc, size_t kc, const int8_t *packed_a,
+                             const uint8_t *packed_b, int32_t *c, size_t ldc, bool accumulate)
+    {
+        const size_t mr = kern.mr, nr = kern.nr;
+        const size_t kq = (kc + 3) / 4;
+        alignas(64) int32_t edge[32 * 32];
+
+        for (size_t j0 = 0; j0 < nc; j0 += nr)
+        {
+            const size_t cols = std::min(nr, nc - j0);
+            const uint8_t *b_sliver = packed_b + j0 * 4 * kq;
+            for (size_t i0 = 0; i0 < mc; i0 += mr)
+            {
+                const size_t rows = std::min(mr, mc - i0);
+                const int8_t *a_sliver = packed_a + i0 * 4 * kq * kern.a_bytes;
+                int32_t *c_tile = c + i0 * ldc + j0;
+                if (rows == mr && cols == nr)
+                {
+                    kern.ukernel(kq, a_sliver, b_sliver, c_tile, ldc, accumulate);
+                    continue;
+                }
+                kern.ukernel(kq, a_sliver, b_sliver, edge, nr, false);
+                for (size_t i = 0; i < rows; i++)
+                {
+                    for (size_t j = 0; j < cols; j++)
+                    {
+                        const uint32_t prev = accumulate ? static_cast<uint32_t>(c_tile[i * ldc + j]) : 0;
+                        c_tile[i * ldc + j] = static_cast<int32_t>(prev + static_cast<uint32_t>(edge[i * nr + j]));
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief C = A @ B in int32 for row major int8 A (M x K, row stride lda) and B (K x N, row stride
+     * ldb), into C (M x N, row stride ldc), which is overwritten.
+     *
+     * Once a block of C is final, epilogue(i0, j0, rows, cols) is called for it from the thread that
+     * computed it. Blocks never overlap and cover C exactly once.
+     */
+    template <typename Epilogue>
+    void qgemm(size_t M, size_t N, size_t K, const int8_t *A, size_t lda, const int8_t *B, size_t ldb, int32_t *C,
+               size_t ldc, Epilogue &&epilogue, const KernelInfo &kern = default_kernel())
+    {
+        if (M == 0 || N == 0)
+            return;
+        if (K == 0)
+        {
+            for (size_t i = 0; i < M; i++)
+                std::fill(C + i * ldc, C + i * ldc + N, 0);
+            epilogue(size_t(0), size_t(0), M, N);
+            return;
+        }
+
+        uint8_t *packed_b = b_pack_buffer().get(kern.kc * ((std::min(kern.nc, N) + kern.nr - 1) / kern.nr) * kern.nr);
+
+        const bool threaded = M * N * K >= gemm::kParallelFlopsThreshold;
+        const size_t threads = threaded ? get_num_threads() : 1;
+
+        // 128 * row sums of A, what the unsigned offset of B adds to each row of C
+        std::vector<uint32_t> offset(M);
+        parallel_for(0, M, threaded ? std::max<size_t>(1, kElementwiseGrain / K) : M, [&](size_t lo, size_t hi)
+                     {
+            for (size_t i = lo; i < hi; i++)
+            {
+                int32_t sum = 0;
+                for (size_t k = 0; k < K; k++)
+                    sum += A[i * lda + k];
+                offset[i] = static_cast<uint32_t>(sum) << 7;
+            } });
+
+        for (size_t jc = 0; jc < N; jc += kern.nc)
+        {
+            const size_t nc = std::min(kern.nc, N - jc);
+            const size_t n_slivers = (nc + kern.nr - 1) / kern.nr;
+            for (size_t pc = 0; pc < K; pc += kern.kc)
+            {
+                const size_t kc = std::min(kern.kc, K - pc);
+                const size_t kq = (kc + 3) / 4;
+                const bool accumulate = pc > 0;
+                const bool last = pc + kc == K;
+
+                parallel_for(0, n_slivers, threaded ? 1 : n_slivers, [&](size_t lo, size_t hi)
+                             { pack_b(kc, std::min(hi * kern.nr, nc) - lo * kern.nr, B + pc * ldb + jc + lo * kern.nr, ldb,
+                                      kern.nr, packed_b + lo * kern.nr * 4 * kq); });
+
+                // same (MC row block, column chunk) tasks as sgemm
+                const size_t n_ic = (M + kern.mc - 1) / kern.mc;
+                const size_t col_chunks = std::min(n_slivers, std::max<size_t>(1, (threads + n_ic - 1) / n_ic));
+                const size_t slivers_per_chunk = (n_slivers + col_chunks - 1) / col_chunks;
+                const size_t n_tasks = n_ic * col_chunks;
+
+                parallel_for(0, n_tasks, threaded ? 1 : n_tasks, [&](size_t lo, size_t hi)
+                             {
+                    int8_t *packed_a = a_pack_buffer().get(kern.mc * kern.kc * kern.a_bytes);
+                    size_t packed_ic = M;
+                    for (size_t t = lo; t < hi; t++)
+                    {
+                        const size_t ic = (t / col_chunks) * kern.mc;
+                        const size_t j0 = (t % col_chunks) * slivers_per_chunk * kern.nr;
+                        if (j0 >= nc)
+                            continue;
+                        const size_t mc = std::min(kern.mc, M - ic);
+                        const size_t cols = std::min(slivers_per_chunk * kern.nr, nc - j0);
+                        if (ic != packed_ic)
+                        {
+                            if (kern.a_bytes == 2)
+                                pack_a(mc, kc, A + ic * lda + pc, lda, kern.mr, reinterpret_cast<int16_t *>(packed_a));
+                            else
+                                pack_a(mc, kc, A + ic * lda + pc, lda, kern.mr, packed_a);
+                            packed_ic = ic;
+                        }
+                        int32_t *c_block = C + ic * ldc + jc + j0;
+                        macro_kernel(kern, mc, cols, kc, packed_a, packed_b + j0 * 4 * kq, c_block, ldc, accumulate);
+                        if (!last)
+                            continue;
+                        for (size_t i = 0; i < mc; i++)
+                        {
+                            int32_t *c_row = c_block + i * ldc;
+                            const uint32_t off = offset[ic + i];
+                            for (size_t j = 0; j < cols; j++)
+                                c_row[j] = static_cast<int32_t>(static_cast<uint32_t>(c_row[j]) - off);
+                        }
+                        epilogue(ic, jc + j0, mc, cols);
+                    } });
+            }
+        }
+    }
+}
@@ -0,0 +1,330 @@
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <utility>
+#include <optional>
+#include <type_traits>
+#include <stdexcept>
+#include <qgemm.inl>
+#include <profiler.inl>
+#include <reduction_engine.inl>
+#include <thread_pool.inl>
+
+/**
+ * @brief Int8 quantization for CPU inference.
+ *
+ * Quantization is symmetric: q = round(x / scale) clamped to [-127, 127], so x ~ q * scale, with
+ * scale = max|x| / 127 over each channel (1 for an all zero channel, NaNs quantize to 0).
+ *
+ * qmatmul multiplies activations x [..., K] by int8 weights w [K, N] with one scale per output
+ * channel (w_scales [N], from quantize_per_channel(w, 1)) on the int8 GEMM, accumulating in int32.
+ * Float activations are quantized per row on the fly, int8 activations come with their own per row
+ * (or single) scales. The epilogue runs on each output tile as soon as the GEMM finishes it and
+ * computes acc * x_scale[i] * w_scale[j] + bias[j], optionally requantized to int8 with out_scale.
+ */
+
+namespace quant
+{
+    // Round to nearest even in plain float arithmetic so the loops vectorize without SSE4.1,
+    // exact for |x| < 2^22
+    inline float round_even(float x)
+    {
+        constexpr float magic = 12582912.0f; // 1.5 * 2^23
+        return (x + magic) - magic;
+    }
+
+    inline int8_t to_int8(float x)
+    {
+        const float r = round_even(std::min(127.0f, std::max(-127.0f, x)));
+        return static_cast<int8_t>(x == x ? r : 0.0f);
+    }
+
+    // q[i] = to_int8(x[i] * mul). The compiler keeps the clamps of to_int8 as branches, so the SSE2
+    // path spells them out.
+    inline void quantize_run(const float *x, size_t n, float mul, int8_t *q)
+    {
+        size_t i = 0;
+#if defined(__SSE2__)
+        const __m128 m = _mm_set1_ps(mul), hi = _mm_set1_ps(127.0f), lo = _mm_set1_ps(-127.0f);
+        const auto convert = [&](const float *p)
+        {
+            __m128 v = _mm_mul_ps(_mm_loadu_ps(p), m);
+            // NaN to 0, then clamp and round to nearest even (the default rounding mode)
+            v = _mm_and_ps(v, _mm_cmpord_ps(v, v));
+            return _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(v, hi), lo));
+        };
+        for (; i + 16 <= n; i += 16)
+        {
+            const __m128i w0 = _mm_packs_epi32(convert(x + i), convert(x + i + 4));
+            const __m128i w1 = _mm_packs_epi32(convert(x + i + 8), convert(x + i + 12));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(q + i), _mm_packs_epi16(w0, w1));
+        }
+#endif
+        for (; i < n; i++)
+            q[i] = to_int8(x[i] * mul);
+    }
+
+    // Quantize compact data viewed as [outer, channels, inner] with one scale per channel, channels are
+    // spread over the pool
+    inline void quantize_channels(const float *x, size_t outer, size_t channels, size_t inner, int8_t *q,
+                                  float *scales)
+    {
+        const size_t per_channel = std::max<size_t>(1, outer * inner);
+        const size_t grain = std::max<size_t>(1, kElementwiseGrain / per_channel);
+        const auto abs_max = [](float a, float b)
+        { return std::max(a, std::fabs(b)); };
+        parallel_for(0, channels, grain, [&](size_t lo, size_t hi)
+                     {
+            std::fill(scales + lo, scales + hi, 0.0f);
+            for (size_t o = 0; o < outer; o++)
+            {
+                const float *block = x + o * channels * inner;
+                if (inner == 1)
+                {
+                    // channels are the contiguous dim, update them side by side
+                    for (size_t c = lo; c < hi; c++)
+                        scales[c] = abs_max(scales[c], block[c]);
+                    continue;
+                }
+                for (size_t c = lo; c < hi; c++)
+                    scales[c] = abs_max(scales[c], reduce::reduce_run(block + c * inner, inner, 1, 0.0f, abs_max));
+            }
+            for (size_t c = lo; c < hi; c++)
+                scales[c] = scales[c] > 0.0f && std::isfinite(scales[c]) ? scales[c] / 127.0f : 1.0f;
+            for (size_t o = 0; o < outer; o++)
+            {
+                const size_t base = o * channels * inner;
+                if (inner == 1)
+                {
+                    for (size_t c = lo; c < hi; c++)
+                        q[base + c] = to_int8(x[base + c] / scales[c]);
+                    continue;
+                }
+                for (size_t c = lo; c < hi; c++)
+                    quantize_run(x + base + c * inner, inner, 1.0f / scales[c], q + base + c * inner);
+            } });
+    }
+
+    // Splits shape around axis into [outer, channels, inner]
+    inline void channel_extents(const DimVec &shape, size_t axis, size_t &outer, size_t &channels, size_t &inner)
+    {
+        outer = 1;
+        inner = 1;
+        for (size_t d = 0; d < axis; d++)
+            outer *= shape[d];
+        channels = shape[axis];
+        for (size_t d = axis + 1; d < shape.size(); d++)
+            inner *= shape[d];
+    }
+
+    // A compact copy of the array unless it already is compact, and a pointer to its first element
+    template <typename T>
+    struct CompactView
+    {
+        NDArray<T> array;
+        const T *data;
+
+        explicit CompactView(const NDArray<T> &a)
+            : array(a.is_contiguous() ? a : a.make_compact()), data(array.get_handle()->ptr() + array.get_offset())
+        {
+        }
+    };
+
+    inline size_t element_count(const DimVec &shape)
+    {
+        size_t count = 1;
+        for (size_t d : shape)
+            count *= d;
+        return count;
+    }
+
+    // Scales for n channels, either n of them or a single shared one. Returns the stride to step by.
+    inline size_t scale_stride(const NDArray<float> &scales, size_t n, const char *what)
+    {
+        const size_t count = element_count(scales.get_shape());
+        if (count == n)
+            return 1;
+        if (count == 1)
+            return 0;
+        throw std::invalid_argument(std::string(what) + " needs one scale per channel or a single scale");
+    }
+
+    inline void check_bias(const NDArray<float> *bias, size_t N)
+    {
+        if (bias && element_count(bias->get_shape()) != N)
+            throw std::invalid_argument("qmatmul bias needs one element per output channel");
+    }
+
+    /**
+     * @brief Shared body of the qmatmul variants: out[M x N] = store(i, j, int32 x_q @ w) for int8 x_q
+     * [M, K] and the [K, N] weights, with the shapes already checked.
+     */
+    template <typename Store>
+    void qmatmul_rows(const int8_t *xq, size_t M, size_t K, const NDArray<int8_t> &w, size_t N, Store &&store)
+    {
+        // the packing reads unit stride rows of w, other layouts are compacted first
+        const NDArray<int8_t> w_keep = w.get_strides()[1] == 1 ? w : w.make_compact();
+        const int8_t *w_data = w_keep.get_handle()->ptr() + w_keep.get_offset();
+        const size_t ldw = w_keep.get_strides()[0];
+
+        // int32 scratch from the array allocator, which caches it for the next call
+        const NDArray<int32_t> acc = NDArray<int32_t>::empty({M * N});
+        int32_t *acc_data = acc.get_handle()->ptr();
+        qgemm::qgemm(M, N, K, xq, K, w_data, ldw, acc_data, N, [&](size_t i0, size_t j0, size_t rows, size_t cols)
+                     {
+            for (size_t i = i0; i < i0 + rows; i++)
+                store(i, j0, cols, acc_data + i * N + j0); });
+    }
+
+    // Checks x [..., K] against w [K, N] and gives M (rows of x), K, N and the output shape
+    inline DimVec qmatmul_shape(const DimVec &x_shape, const NDArray<int8_t> &w, size_t &M, size_t &K, size_t &N)
+    {
+        const DimVec w_shape = w.get_shape();
+        if (w_shape.size() != 2)
+            throw std::invalid_argument("qmatmul needs 2D weights [K, N]");
+        if (x_shape.empty() || x_shape.back() != w_shape[0])
+            throw std::invalid_argument("Incompatible arrays for qmatmul, [..., K] @ [K, N] required");
+        K = w_shape[0];
+        N = w_shape[1];
+        M = 1;
+        for (size_t d = 0; d + 1 < x_shape.size(); d++)
+            M *= x_shape[d];
+        DimVec out_shape(x_shape.begin(), x_shape.end() - 1);
+        out_shape.push_back(N);
+        return out_shape;
+    }
+
+    /**
+     * @brief Runs x_q @ w and writes acc * x_scale[i] * w_scale[j] + bias[j] per output element, as float
+     * (Out float) or requantized with out_scale (Out int8_t).
+     */
+    template <typename Out>
+    NDArray<Out> qmatmul_scaled(const int8_t *xq, const float *x_scales, size_t x_step, size_t M, size_t K, size_t N,
+                                const DimVec &out_shape, const NDArray<int8_t> &w, const NDArray<float> &w_scales,
+                                const NDArray<float> *bias, float out_scale = 1.0f)
+    {
+        const size_t w_step = scale_stride(w_scales, N, "w_scales");
+        check_bias(bias, N);
+        const CompactView<float> ws(w_scales);
+        const std::optional<CompactView<float>> bias_view = bias ? std::optional<CompactView<float>>(*bias) : std::nullopt;
+        const float *b = bias_view ? bias_view->data : nullptr;
+        const float inv_out = 1.0f / out_scale;
+
+        NDArray<Out> out = NDArray<Out>::empty(out_shape);
+        Out *dst = out.get_handle()->ptr();
+        qmatmul_rows(xq, M, K, w, N, [&](size_t i, size_t j0, size_t cols, const int32_t *acc)
+                     {
+            const float xs = x_scales[i * x_step];
+            Out *row = dst + i * N + j0;
+            const auto value = [&](size_t j)
+            {
+                const float v = static_cast<float>(acc[j]) * (xs * ws.data[(j0 + j) * w_step]);
+                return b ? v + b[j0 + j] : v;
+            };
+            if constexpr (std::is_same_v<Out, int8_t>)
+            {
+                // requantized in runs through a float block
+                float block[256];
+                for (size_t j1 = 0; j1 < cols; j1 += 256)
+                {
+                    const size_t n = std::min<size_t>(256, cols - j1);
+                    for (size_t j = 0; j < n; j++)
+                        block[j] = value(j1 + j);
+                    quantize_run(block, n, inv_out, row + j1);
+                }
+            }
+            else
+            {
+                for (size_t j = 0; j < cols; j++)
+                    row[j] = value(j);
+            } });
+        return out;
+    }
+}
+
+inline std::pair<NDArray<int8_t>, NDArray<float>> quantize_per_channel(const NDArray<float> &x, int64_t axis)
+{
+    profiler::Scope prof("quantize_per_channel", x);
+    const DimVec shape = x.get_shape();
+    const size_t ax = normalize_axis(axis, shape.size());
+    size_t outer, channels, inner;
+    quant::channel_extents(shape, ax, outer, channels, inner);
+
+    const quant::CompactView<float> src(x);
+    NDArray<int8_t> q = NDArray<int8_t>::empty(shape);
+    NDArray<float> scales = NDArray<float>::empty({channels});
+    quant::quantize_channels(src.data, outer, channels, inner, q.get_handle()->ptr(), scales.get_handle()->ptr());
+    prof.output(q);
+    prof.output(scales);
+    return {q, scales};
+}
+
+inline NDArray<float> dequantize(const NDArray<int8_t> &q, const NDArray<float> &scales, int64_t axis)
+{
+    profiler::Scope prof("dequantize", q, scales);
+    const DimVec shape = q.get_shape();
+    const size_t ax = normalize_axis(axis, shape.size());
+    size_t outer, channels, inner;
+    quant::channel_extents(shape, ax, outer, channels, inner);
+    const size_t step = quant::scale_stride(scales, channels, "dequantize");
+
+    const quant::CompactView<int8_t> src(q);
+    const quant::CompactView<float> s(scales);
+    NDArray<float> out = NDArray<float>::empty(shape);
+    float *dst = out.get_handle()->ptr();
+    const size_t rows = outer * channels;
+    parallel_for(0, rows, std::max<size_t>(1, kElementwiseGrain / std::max<size_t>(1, inner)), [&](size_t lo, size_t hi)
+                 {
+        for (size_t r = lo; r < hi; r++)
+        {
+            const float scale = s.data[(r % channels) * step];
+            for (size_t i = 0; i < inner; i++)
+                dst[r * inner + i] = static_cast<float>(src.data[r * inner + i]) * scale;
+        } });
+    prof.output(out);
+    return out;
+}
+
+inline NDArray<float> qmatmul(const NDArray<float> &x, const NDArray<int8_t> &w, const NDArray<float> &w_scales,
+                              const NDArray<float> *bias)
+{
+    profiler::Scope prof("qmatmul", x, w);
+    size_t M, K, N;
+    const DimVec out_shape = quant::qmatmul_shape(x.get_shape(), w, M, K, N);
+
+    // per row dynamic quantization of the activations
+    const quant::CompactView<float> src(x);
+    const NDArray<int8_t> xq = NDArray<int8_t>::empty({M * K});
+    const NDArray<float> x_scales = NDArray<float>::empty({M});
+    quant::quantize_channels(src.data, 1, M, K, xq.get_handle()->ptr(), x_scales.get_handle()->ptr());
+    return prof.result(quant::qmatmul_scaled<float>(xq.get_handle()->ptr(), x_scales.get_handle()->ptr(), 1, M, K, N,
+                                                    out_shape, w, w_scales, bias));
+}
+
+inline NDArray<float> qmatmul(const NDArray<int8_t> &x, const NDArray<float> &x_scales, const NDArray<int8_t> &w,
+                              const NDArray<float> &w_scales, const NDArray<float> *bias)
+{
+    profiler::Scope prof("qmatmul", x, w);
+    size_t M, K, N;
+    const DimVec out_shape = quant::qmatmul_shape(x.get_shape(), w, M, K, N);
+    const size_t x_step = quant::scale_stride(x_scales, M, "x_scales");
+    const quant::CompactView<int8_t> xq(x);
+    const quant::CompactView<float> xs(x_scales);
+    return prof.result(quant::qmatmul_scaled<float>(xq.data, xs.data, x_step, M, K, N, out_shape, w, w_scales, bias));
+}
+
+inline NDArray<int8_t> qmatmul_requantize(const NDArray<int8_t> &x, const NDArray<float> &x_scales,
+                                          const NDArray<int8_t> &w, const NDArray<float> &w_scales, float out_scale,
+                                          const NDArray<float> *bias)
+{
+    profiler::Scope prof("qmatmul_requantize", x, w);
+    if (!(out_scale > 0.0f) || !std::isfinite(out_scale))
+        throw std::invalid_argument("qmatmul out_scale must be positive");
+    size_t M, K, N;
+    const DimVec out_shape = quant::qmatmul_shape(x.get_shape(), w, M, K, N);
+    const size_t x_step = quant::scale_stride(x_scales, M, "x_scales");
+    const quant::CompactView<int8_t> xq(x);
+    const quant::CompactView<float> xs(x_scales);
+    return prof.result(quant::qmatmul_scaled<int8_t>(xq.data, xs.data, x_step, M, K, N, out_shape, w, w_scales, bias, out_scale));
+}
@@ -0,0 +1,402 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <thread_pool.inl>
+
+/**
+ * @brief Reduction engine behind sum/max/min.
+ *
+ * The source is split into the kept dims (one per output element, in order, so the compact output
+ * index is the kept index) and the reduced dims, each group simplified like StridedLoop does (size 1
+ * dims dropped, contiguous neighbours merged). The layout then picks the strategy:
+ *
+ *  - Accumulate rows, when the innermost kept dim is contiguous and the reduced ones are not: a tile
+ *    of kTile outputs is combined with one reduced "row" of the source at a time, a unit stride loop
+ *    across the outputs.
+ *  - Horizontal otherwise (in particular for a unit stride innermost reduced dim): every output
+ *    reduces its own elements, in runs along the innermost reduced dim, with kLanes independent
+ *    accumulators the compiler maps onto vector registers.
+ *
+ * Both combine their partial results in a fixed pairwise tree, kBlock elements (or kRowLeaf rows)
+ * per leaf, so a float sum over n elements has O(log n) rounding error instead of O(n). Outputs are
+ * spread over the thread pool. When there are too few of them to occupy every thread, the top levels
+ * of each output's tree are computed in parallel instead (the two level split of a full reduction).
+ * The tree shape never depends on the thread count, so results are bit identical for any number of
+ * threads.
+ */
+namespace reduce
+{
+    // Elements per pairwise leaf, and independent accumulators within a leaf
+    constexpr size_t kBlock = 512;
+    constexpr size_t kLanes = 32;
+    // Outputs per accumulate rows tile, and source rows per leaf
+    constexpr size_t kTile = 2048;
+    constexpr size_t kRowLeaf = 64;
+
+    // Dims walked in row major order, with the source stride of each
+    struct DimGroup
+    {
+        DimVec dims;
+        DimVec strides;
+
+        size_t size() const
+        {
+            size_t n = 1;
+            for (size_t d : dims)
+                n *= d;
+            return n;
+        }
+
+        size_t offset(size_t index) const
+        {
+            size_t off = 0;
+            for (size_t d = dims.size(); d-- > 0;)
+            {
+                off += (index % dims[d]) * strides[d];
+                index /= dims[d];
+            }
+            return off;
+        }
+
+        // Innermost dim and stride, {1, 0} for an empty group
+        size_t inner_dim() const { return dims.empty() ? 1 : dims.back(); }
+        size_t inner_stride() const { return strides.empty() ? 0 : strides.back(); }
+    };
+
+    // Odometer over a DimGroup, cheaper than DimGroup::offset for consecutive indices
+    struct GroupWalker
+    {
+        const DimGroup &group;
+        DimVec idx;
+        size_t off = 0;
+
+        GroupWalker(const DimGroup &group, size_t start) : group{group}, idx(group.dims.size(), 0)
+        {
+            for (size_t d = group.dims.size(); d-- > 0;)
+            {
+                idx[d] = start % group.dims[d];
+                off += idx[d] * group.strides[d];
+                start /= group.dims[d];
+            }
+        }
+
+        void next()
+        {
+            for (size_t d = group.dims.size(); d-- > 0;)
+            {
+                off += group.strides[d];
+                if (++idx[d] < group.dims[d])
+                    return;
+                off -= idx[d] * group.strides[d];
+                idx[d] = 0;
+            }
+        }
+    };
+
+    // Group the given dims, dropping size 1 ones and merging contiguous neighbours. by_stride orders
+    // them by decreasing stride first, which the reduced dims can afford since any order reduces to
+    // the same result, and which turns e.g. a transposed full reduction back into one unit stride run.
+    inline DimGroup make_group(const DimVec &shape, const DimVec &strides, const std::vector<bool> &take, bool by_stride)
+    {
+        std::vector<size_t> order;
+        for (size_t d = 0; d < shape.size(); d++)
+        {
+            if (take[d] && shape[d] != 1)
+                order.push_back(d);
+        }
+        if (by_stride)
+            std::stable_sort(order.begin(), order.end(), [&](size_t x, size_t y)
+                             { return strides[x] > strides[y]; });
+
+        DimGroup g;
+        for (size_t d : order)
+        {
+            if (!g.dims.empty() && g.strides.back() == strides[d] * shape[d])
+            {
+                g.dims.back() *= shape[d];
+                g.strides.back() = strides[d];
+                continue;
+            }
+            g.dims.push_back(shape[d]);
+            g.strides.push_back(strides[d]);
+        }
+        return g;
+    }
+
+    /*
+     * Pairwise tree over [0, n), split at the midpoint rounded down to a multiple of align
+     */
+
+    struct Tree
+    {
+        size_t leaf;
+        size_t align;
+
+        bool is_leaf(size_t lo, size_t hi) const { return hi - lo <= leaf; }
+        size_t mid(size_t lo, size_t hi) const
+        {
+            size_t half = (hi - lo) / 2 / align * align;
+            return lo + std::max(half, align);
+        }
+
+        // Ranges of the subtrees depth levels down (or shallower leaves), left to right
+        void subtrees(size_t lo, size_t hi, int depth, std::vector<std::pair<size_t, size_t>> &out) const
+        {
+            if (depth == 0 || is_leaf(lo, hi))
+            {
+                out.emplace_back(lo, hi);
+                return;
+            }
+            size_t m = mid(lo, hi);
+            subtrees(lo, m, depth - 1, out);
+            subtrees(m, hi, depth - 1, out);
+        }
+
+        // Combine subtree results up the same tree, merge(a, b) folds partial b into partial a
+        template <typename Merge>
+        size_t fold(size_t lo, size_t hi, int depth, size_t &next, Merge &merge) const
+        {
+            if (depth == 0 || is_leaf(lo, hi))
+                return next++;
+            size_t m = mid(lo, hi);
+            size_t a = fold(lo, m, depth - 1, next, merge);
+            size_t b = fold(m, hi, depth - 1, next, merge);
+            merge(a, b);
+            return a;
+        }
+    };
+
+    // Tree depth that gives every thread a few subtrees of at least grain elements
+    inline int parallel_depth(size_t n, size_t grain)
+    {
+        const size_t target = get_num_threads() * 4;
+        int depth = 0;
+        while ((size_t(1) << depth) < target && (n >> (depth + 1)) >= grain)
+            depth++;
+        return depth;
+    }
+
+    /*
+     * Horizontal strategy
+     */
+
+    // Reduce n elements at stride s with kLanes accumulators, folded pairwise
+    template <typename T, typename Op>
+    T reduce_run(const T *x, size_t n, size_t s, T init, Op op)
+    {
+        if (n < kLanes)
+        {
+            T acc = init;
+            for (size_t i = 0; i < n; i++)
+                acc = op(acc, x[i * s]);
+            return acc;
+        }
+        T acc[kLanes];
+        std::fill(acc, acc + kLanes, init);
+        size_t i = 0;
+        if (s == 1)
+        {
+            for (; i + kLanes <= n; i += kLanes)
+                for (size_t j = 0; j < kLanes; j++)
+                    acc[j] = op(acc[j], x[i + j]);
+        }
+        else
+        {
+            for (; i + kLanes <= n; i += kLanes)
+                for (size_t j = 0; j < kLanes; j++)
+                    acc[j] = op(acc[j], x[(i + j) * s]);
+        }
+        for (const T *p = x + i * s; i < n; i++, p += s)
+            acc[0] = op(acc[0], *p);
+        for (size_t w = kLanes / 2; w > 0; w /= 2)
+            for (size_t j = 0; j < w; j++)
+                acc[j] = op(acc[j], acc[j + w]);
+        return acc[0];
+    }
+
+    template <typename T, typename Op>
+    void horizontal(const T *src, const DimGroup &kept, const DimGroup &red, T *out, Op op, T init)
+    {
+        const size_t n_out = kept.size();
+        const size_t n_red = red.size();
+        const size_t n_in = red.inner_dim();
+        const size_t s_in = red.inner_stride();
+        const Tree tree{kBlock, kLanes};
+
+        // elements [lo, hi) of the reduced space of the output starting at base
+        auto leaf = [&](const T *base, size_t lo, size_t hi)
+        {
+            T acc = init;
+            while (lo < hi)
+            {
+                const size_t row = lo / n_in, col = lo % n_in;
+                const size_t n = std::min(hi - lo, n_in - col);
+                acc = op(acc, reduce_run(base + red.offset(row * n_in) + col * s_in, n, s_in, init, op));
+                lo += n;
+            }
+            return acc;
+        };
+        auto serial = [&](const T *base, size_t lo, size_t hi, auto &self) -> T
+        {
+            if (tree.is_leaf(lo, hi))
+                return leaf(base, lo, hi);
+            size_t m = tree.mid(lo, hi);
+            T a = self(base, lo, m, self);
+            return op(a, self(base, m, hi, self));
+        };
+
+        if (n_out >= get_num_threads() || n_red < 2 * kElementwiseGrain)
+        {
+            const size_t grain = std::max<size_t>(1, kElementwiseGrain / std::max<size_t>(n_red, 1));
+            parallel_for(0, n_out, grain, [&](size_t lo, size_t hi)
+                         {
+                GroupWalker w(kept, lo);
+                for (size_t k = lo; k < hi; k++, w.next())
+                    out[k] = serial(src + w.off, 0, n_red, serial); });
+            return;
+        }
+
+        // few outputs, each one's top subtrees run in parallel
+        const int depth = parallel_depth(n_red, kElementwiseGrain);
+        std::vector<std::pair<size_t, size_t>> parts;
+        tree.subtrees(0, n_red, depth, parts);
+        std::vector<T> partial(parts.size());
+        for (size_t k = 0; k < n_out; k++)
+        {
+            const T *base = src + kept.offset(k);
+            parallel_for(0, parts.size(), 1, [&](size_t lo, size_t hi)
+                         {
+                for (size_t p = lo; p < hi; p++)
+                    partial[p] = serial(base, parts[p].first, parts[p].second, serial); });
+            size_t next = 0;
+            auto merge = [&](size_t a, size_t b)
+            { partial[a] = op(partial[a], partial[b]); };
+            out[k] = partial[tree.fold(0, n_red, depth, next, merge)];
+        }
+    }
+
+    /*
+     * Accumulate rows strategy
+     */
+
+    template <typename T, typename Op>
+    void accumulate_rows(const T *src, const DimGroup &kept, const DimGroup &red, T *out, Op op)
+    {
+        // the contiguous innermost kept dim is vectorised over, the rest are outer loops
+        DimGroup outer{DimVec(kept.dims.begin(), kept.dims.end() - 1), DimVec(kept.strides.begin(), kept.strides.end() - 1)};
+        const size_t n_cols = kept.dims.back();
+        const size_t n_outer = outer.size();
+        const size_t n_tiles = (n_cols + kTile - 1) / kTile;
+        const size_t n_rows = red.size();
+        const Tree tree{kRowLeaf, 1};
+
+        // combine rows [lo, hi) of columns [c0, c0 + w) into acc
+        auto leaf = [&](const T *base, size_t lo, size_t hi, size_t w, T *acc)
+        {
+            GroupWalker r(red, lo);
+            std::copy(base + r.off, base + r.off + w, acc);
+            for (size_t i = lo + 1; i < hi; i++)
+            {
+                r.next();
+                const T *row = base + r.off;
+                for (size_t c = 0; c < w; c++)
+                    acc[c] = op(acc[c], row[c]);
+            }
+        };
+        // stack holds one tile per remaining tree level
+        auto serial = [&](const T *base, size_t lo, size_t hi, size_t w, T *acc, T *stack, auto &self) -> void
+        {
+            if (tree.is_leaf(lo, hi))
+                return leaf(base, lo, hi, w, acc);
+            size_t m = tree.mid(lo, hi);
+            self(base, lo, m, w, acc, stack, self);
+            self(base, m, hi, w, stack, stack + kTile, self);
+            for (size_t c = 0; c < w; c++)
+                acc[c] = op(acc[c], stack[c]);
+        };
+        size_t levels = 1;
+        for (size_t n = n_rows; n > kRowLeaf; n = (n + 1) / 2)
+            levels++;
+
+        const size_t n_tasks = n_outer * n_tiles;
+        const size_t tile_work = std::min(n_cols, kTile) * n_rows;
+        if (n_tasks >= get_num_threads() || tile_work < 2 * kElementwiseGrain)
+        {
+            const size_t grain = std::max<size_t>(1, kElementwiseGrain / std::max<size_t>(tile_work, 1));
+            parallel_for(0, n_tasks, grain, [&](size_t lo, size_t hi)
+                         {
+                std::vector<T> stack(levels * kTile);
+                for (size_t t = lo; t < hi; t++)
+                {
+                    const size_t o = t / n_tiles, c0 = t % n_tiles * kTile;
+                    const size_t w = std::min(kTile, n_cols - c0);
+                    serial(src + outer.offset(o) + c0, 0, n_rows, w, out + o * n_cols + c0, stack.data(), serial);
+                } });
+            return;
+        }
+
+        // few tiles, each one's top subtrees run in parallel into their own partial tiles
+        const int depth = parallel_depth(n_rows, std::max<size_t>(1, kElementwiseGrain / std::min(n_cols, kTile)));
+        std::vector<std::pair<size_t, size_t>> parts;
+        tree.subtrees(0, n_rows, depth, parts);
+        std::vector<T> partial(parts.size() * kTile);
+        for (size_t t = 0; t < n_tasks; t++)
+        {
+            const size_t o = t / n_tiles, c0 = t % n_tiles * kTile;
+            const size_t w = std::min(kTile, n_cols - c0);
+            const T *base = src + outer.offset(o) + c0;
+            parallel_for(0, parts.size(), 1, [&](size_t lo, size_t hi)
+                         {
+                std::vector<T> stack(levels * kTile);
+                for (size_t p = lo; p < hi; p++)
+                    serial(base, parts[p].first, parts[p].second, w, partial.data() + p * kTile, stack.data(), serial); });
+            size_t next = 0;
+            auto merge = [&](size_t a, size_t b)
+            {
+                T *x = partial.data() + a * kTile;
+                const T *y = partial.data() + b * kTile;
+                for (size_t c = 0; c < w; c++)
+                    x[c] = op(x[c], y[c]);
+            };
+            const T *res = partial.data() + tree.fold(0, n_rows, depth, next, merge) * kTile;
+            std::copy(res, res + w, out + o * n_cols + c0);
+        }
+    }
+
+    /**
+     * @brief Reduce the dims flagged in is_reduced of the view (src + offset, shape, strides) into the
+     * compact out, whose elements follow the kept dims in order.
+     *
+     * @param init Identity of op, the result for an empty reduction.
+     */
+    template <typename T, typename Op>
+    void reduce_into(const T *src, const DimVec &shape, const DimVec &strides, const std::vector<bool> &is_reduced,
+                     T *out, Op op, T init)
+    {
+        std::vector<bool> is_kept(is_reduced.size());
+        for (size_t d = 0; d < is_reduced.size(); d++)
+            is_kept[d] = !is_reduced[d];
+        const DimGroup kept = make_group(shape, strides, is_kept, false);
+        const DimGroup red = make_group(shape, strides, is_reduced, true);
+
+        const size_t n_out = kept.size();
+        for (size_t d = 0; d < shape.size(); d++)
+        {
+            if (shape[d] == 0)
+            {
+                // nothing to reduce over, or nothing to reduce into
+                std::fill(out, out + n_out, init);
+                return;
+            }
+        }
+
+        const bool rows_layout = !kept.dims.empty() && kept.inner_stride() == 1 && kept.inner_dim() >= 8 &&
+                                 red.inner_stride() != 1 && !red.dims.empty();
+        if (rows_layout)
+            accumulate_rows(src, kept, red, out, op);
+        else
+            horizontal(src, kept, red, out, op, init);
+    }
+}
@@ -2,36 +2,97 @@
 #include <numeric>   
 #include <functional> 
 #include <cmath>    
+#include <type_traits>
+#include <algorithm>
+#include <dtypes.inl>
+#include <profiler.inl>
 #include <view_helpers.inl>
+#include <strided_loop.inl>
+#include <reduction_engine.inl>
+#include <gemm.inl>
 
 /**Matmul
  */
 
+// Element strides of a matrix operand: (i, j) is at offset + i * rs + j * cs
+struct MatStrides {
+  size_t rs;
+  size_t cs;
+};
+
 template <typename T>
-void matmul_2d_kernel(const T* src_a, const T* src_b, T* out, size_t offset_a,size_t offset_b, size_t offset_tgt, size_t M, size_t K, size_t P){
+void matmul_2d_kernel(const T* src_a, const T* src_b, T* out, size_t offset_a,size_t offset_b, size_t offset_tgt, size_t M, size_t K, size_t P,
+                      MatStrides sa, MatStrides sb){
   // iterate over reduction dim second to 
   // optimise for contiguity of mem access when reading src b
-  for (int i = 0; i< M; i++){
-    for (int k = 0; k < K; k++){
-      T a_val = src_a[offset_a + i * K + k];
-      for (int j = 0; j < P; j++){
-        // accumulate the dot products from columns as we iterate over reduction dims
-        out[offset_tgt + i * P + j] += a_val * src_b[offset_b + k * P + j];
+  for (size_t i = 0; i < M; i++){
+    T* out_row = out + offset_tgt + i * P;
+    for (size_t k = 0; k < K; k++){
+      T a_val = src_a[offset_a + i * sa.rs + k * sa.cs];
+      const T* b_row = src_b + offset_b + k * sb.rs;
+      // accumulate the dot products from columns as we iterate over reduction dims
+      if (sb.cs == 1){
+        for (size_t j = 0; j < P; j++) out_row[j] += a_val * b_row[j];
+      }
+      else {
+        for (size_t j = 0; j < P; j++) out_row[j] += a_val * b_row[j * sb.cs];
       }
     }
   }
 
 }
-// helper contiguous check
-inline bool is_2d_contiguous(const DimVec& shape, const DimVec& strides){
-  size_t rank = shape.size();
-  if (rank < 2) return true;
 
-  return (strides[rank-1] == 1 && strides[rank-2] == shape[rank-1]);
+// Single M x K @ K x P product into row major out (row stride P), overwriting it
+template <typename T>
+void matmul_2d(const T* src_a, MatStrides sa, const T* src_b, MatStrides sb, T* out, size_t M, size_t K, size_t P){
+  if constexpr (std::is_same_v<T, float>){
+    gemm::sgemm_strided(M, P, K, src_a, sa.rs, sa.cs, src_b, sb.rs, sb.cs, out, P);
+  }
+  else {
+    std::fill(out, out + M * P, T{});
+    matmul_2d_kernel(src_a, src_b, out, 0, 0, 0, M, K, P, sa, sb);
+  }
+}
+
+// True when every batch dim (the dims before the last two) is broadcast, i.e. size 1 or stride 0
+inline bool batch_is_broadcast(const DimVec& shape, const DimVec& strides){
+  for (size_t d = 0; d + 2 < shape.size(); d++){
+    if (shape[d] != 1 && strides[d] != 0) return false;
+  }
+  return true;
+}
+
+// Checks whether the batch dims followed by matrix dim mat_dim can be walked as a single run with one
+// stride, e.g. the rows of a contiguous [B, T, K] array. Sets stride to that run's stride.
+inline bool fold_batch_stride(const DimVec& shape, const DimVec& strides, size_t mat_dim, size_t& stride){
+  stride = 0;
+  size_t run = 0;
+  auto fold = [&](size_t d){
+    if (shape[d] == 1) return true;
+    if (run == 0){
+      stride = strides[d];
+      run = shape[d];
+      return true;
+    }
+    if (strides[d] != stride * run) return false;
+    run *= shape[d];
+    return true;
+  };
+  if (!fold(mat_dim)) return false;
+  for (size_t d = shape.size() - 2; d-- > 0;){
+    if (!fold(d)) return false;
+  }
+  return true;
 }
 
 template <typename T>
 NDArray<T> matmul(const NDArray<T>& a, const NDArray<T>& b){
+  profiler::Scope prof("matmul", a, b);
+  // 16 bit types run the float gemm, accumulating in float
+  if constexpr (is_half_precision_v<T>){
+    return prof.result(matmul(a.template astype<float>(), b.template astype<float>()).template astype<T>());
+  }
+
   const auto ashape = a.get_shape();
   const auto bshape = b.get_shape();
 
@@ -41,11 +102,11 @@ NDArray<T> matmul(const NDArray<T>& a, const NDArray<T>& b){
   
   DimVec a_batch_dims;
   DimVec b_batch_dims;
-  for (int i = 0; i < ashape.size()-2; i++){
+  for (size_t i = 0; i + 2 < ashape.size(); i++){
     a_batch_dims.push_back(ashape[i]);
   }
 
-  for (int i = 0; i < bshape.size()-2; i++){
+  for (size_t i = 0; i + 2 < bshape.size(); i++){
     b_batch_dims.push_back(bshape[i]);
   }
 
@@ -63,19 +124,14 @@ NDArray<T> matmul(const NDArray<T>& a, const NDArray<T>& b){
   broadcasted_b_shape.push_back(bshape[bshape.size()-1]);
   NDArray<T> broadcasted_b = b.broadcast(broadcasted_b_shape);
   
-  // Create NDArray we are writing to
   auto out_shape = batch_dims_broadcasted;
   out_shape.push_back(ashape[ashape.size()-2]); // M
   out_shape.push_back(bshape[bshape.size()-1]); // P
-  NDArray<T> target(out_shape);
-  
-  // If last 2 dims of a and b are non contiguous, we need to compact them as kernel assumes contiguity
-  // Note: this is currently inefficient as whole array is copied, need to figure way to optimise
-  NDArray<T> final_a = is_2d_contiguous(broadcasted_a.get_shape(), broadcasted_a.get_strides()) 
-                      ? broadcasted_a : broadcasted_a.make_compact();
-  NDArray<T> final_b = is_2d_contiguous(broadcasted_b.get_shape(), broadcasted_b.get_strides()) 
-                     ? broadcasted_b : broadcasted_b.make_compact();
   
+  // Operands are read in place through their strides, transposed, sliced and broadcast views included
+  const size_t rank = out_shape.size();
+  const MatStrides mat_a{broadcasted_a.get_strides()[rank-2], broadcasted_a.get_strides()[rank-1]};
+  const MatStrides mat_b{broadcasted_b.get_strides()[rank-2], broadcasted_b.get_strides()[rank-1]};
 
   // The dims of the matmul i.e., MxK @ KxP = MxP
   const auto M = ashape[ashape.size()-2];
@@ -83,29 +139,42 @@ NDArray<T> matmul(const NDArray<T>& a, const NDArray<T>& b){
   const auto P = bshape[bshape.size()-1];
 
   // pointers to data to feed into kernel
-  const T* src_a = final_a.get_handle()->ptr();
-  const T* src_b = final_b.get_handle()->ptr();
-  T* out = target.get_handle()->ptr();
-  
-  // data for batch index odometer logic so we can iteratively run matmul kernel with correct pointers to src/out arrays
+  const T* src_a = broadcasted_a.get_handle()->ptr();
+  const T* src_b = broadcasted_b.get_handle()->ptr();
   size_t batches = std::accumulate(batch_dims_broadcasted.begin(),batch_dims_broadcasted.end(), 1ULL, std::multiplies<size_t>());
-  DimVec batch_indices(batch_dims_broadcasted.size());
-  size_t offset_a = final_a.get_offset();
-  size_t offset_b = final_b.get_offset();
-  const DimVec strides_a = final_a.get_strides();
-  const DimVec strides_b = final_b.get_strides();
-  
 
-  // We loop and apply the matmul over the batches, kernel assumes last 2 dims are contiguous
-  for (int i = 0; i < batches; i++){
-    
-    // Each batch writes M * P elems to the target contiguously, offset_tgt skips these.
-    auto offset_tgt = i * M * P;
+  // b shared by every batch, e.g. [B, T, K] @ [K, P] weights: fold the batch into M and run one large
+  // GEMM instead of B small ones
+  size_t folded_stride = 0;
+  if (batches > 1 && batch_is_broadcast(broadcasted_b.get_shape(), broadcasted_b.get_strides()) &&
+      fold_batch_stride(broadcasted_a.get_shape(), broadcasted_a.get_strides(), rank-2, folded_stride)){
+    // rows (batch, m) of a have one stride and the output is [batches * M, P] row major
+    NDArray<T> target = NDArray<T>::empty(out_shape);
+    matmul_2d(src_a + broadcasted_a.get_offset(), MatStrides{folded_stride, mat_a.cs}, src_b + broadcasted_b.get_offset(), mat_b,
+              target.get_handle()->ptr(), batches * M, K, P);
+    prof.output(target);
+    return target;
+  }
+
+  // Create NDArray we are writing to
+  // sgemm overwrites the output, only the accumulating generic kernel needs it zeroed
+  NDArray<T> target = NDArray<T>::empty(out_shape);
+  prof.output(target);
+  T* out = target.get_handle()->ptr();
 
-    // Apply matmul kernel to the given 2d portions of a, b. Write to C contiguously
-    matmul_2d_kernel(src_a, src_b, out, offset_a, offset_b, offset_tgt, M, K, P);
+  // batch index odometer logic, collects the offsets of each batch's 2d portions of a and b
+  DimVec batch_indices(batch_dims_broadcasted.size());
+  size_t offset_a = broadcasted_a.get_offset();
+  size_t offset_b = broadcasted_b.get_offset();
+  const DimVec strides_a = broadcasted_a.get_strides();
+  const DimVec strides_b = broadcasted_b.get_strides();
+  std::vector<size_t> batch_offsets_a(batches), batch_offsets_b(batches);
+
+  for (size_t i = 0; i < batches; i++){
+    batch_offsets_a[i] = offset_a;
+    batch_offsets_b[i] = offset_b;
     // Increment the batch dim index tracker, adjust offsets of a and b appropriately to read next batch
-    for (int dim = batch_indices.size()-1; dim >= 0; dim--){
+    for (size_t dim = batch_indices.size(); dim-- > 0;){
       batch_indices[dim]++;
       offset_a += strides_a[dim];
       offset_b += strides_b[dim];
@@ -119,6 +188,19 @@ NDArray<T> matmul(const NDArray<T>& a, const NDArray<T>& b){
       }
     }
   }
+
+  if constexpr (std::is_same_v<T, float>){
+    // blocked + packed sgemm, batches and output tiles are split over the thread pool together
+    gemm::sgemm_batched(batches, M, P, K, src_a, batch_offsets_a.data(), mat_a.rs, mat_a.cs, src_b,
+                        batch_offsets_b.data(), mat_b.rs, mat_b.cs, out, P);
+  }
+  else {
+    std::fill(out, out + batches * M * P, T{});
+    // Each batch writes M * P elems to the target contiguously, offset_tgt skips these.
+    for (size_t i = 0; i < batches; i++){
+      matmul_2d_kernel(src_a, src_b, out, batch_offsets_a[i], batch_offsets_b[i], i * M * P, M, K, P, mat_a, mat_b);
+    }
+  }
   return target;
 }
 
@@ -128,112 +210,75 @@ NDArray<T> matmul(const NDArray<T>& a, const NDArray<T>& b){
  *
  */
 
-template <typename T, typename Op>
-NDArray<T> reduction_op_kernel(const NDArray<T>& a, const DimVec& axes, Op op, T init_val, bool keepdims){
-  
-  const DimVec& src_shape = a.get_shape();
+// Axis index into a shape of the given rank, negative axes count from the end
+inline size_t normalize_axis(int64_t axis, size_t rank){
+  if (axis < 0) axis += rank;
+  if (axis < 0 || axis >= (int64_t) rank) throw std::invalid_argument("invalid axis provided");
+  return axis;
+}
 
-  if (axes.size() > src_shape.size()) throw std::invalid_argument("Too many axes provided for reduction operation");
-  
-  DimVec tgt_shape;
+// Flags the dims of shape that axes reduce, negative axes count from the end
+inline std::vector<bool> reduced_dims_mask(const DimVec& shape, const DimVec& axes){
 
+  if (axes.size() > shape.size()) throw std::invalid_argument("Too many axes provided for reduction operation");
 
-  // bool mask for constant dim lookup for tgt shape construction
-  std::vector<bool> is_removed(src_shape.size(),0);
+  std::vector<bool> is_removed(shape.size(),0);
   for (int axis: axes){
-    if (axis < 0) axis += src_shape.size();
+    if (axis < 0) axis += shape.size();
     
     if (axis < 0) throw std::invalid_argument("invalid axis provided, too negative");
+    if (axis >= (int) shape.size()) throw std::invalid_argument("invalid axis provided, too large");
 
     is_removed[axis] = true;
   }
-  
-  for (int i = 0; i < src_shape.size(); i++){
+  return is_removed;
+}
+
+// Result shape of a reduction, reduced dims are kept as 1 with keepdims. A full reduction without
+// keepdims gives shape {1}.
+inline DimVec reduced_shape(const DimVec& shape, const std::vector<bool>& is_removed, bool keepdims){
+  DimVec tgt_shape;
+  for (size_t i = 0; i < shape.size(); i++){
     if (is_removed[i]){
       if (keepdims) tgt_shape.push_back(1);
     }  
     else {
-      tgt_shape.push_back(src_shape[i]);
+      tgt_shape.push_back(shape[i]);
     }
   }
-  
-  NDArray<T> target{tgt_shape.empty() ? DimVec{1} : tgt_shape};
+  return tgt_shape.empty() ? DimVec{1} : tgt_shape;
+}
 
-  T* tgt_ptr = target.get_handle()->ptr();
-  size_t tgt_total_size = target.get_handle()->size();
+template <typename T, typename Op>
+NDArray<T> reduction_op_kernel(const NDArray<T>& a, const DimVec& axes, Op op, T init_val, bool keepdims){
   
-  // initialise value for reduction operation 
-  for(size_t i=0; i<tgt_total_size; ++i) {
-      tgt_ptr[i] = init_val;
-  }
-
-  const T* src_ptr = a.get_handle()->ptr();
-  size_t src_total_size = std::accumulate(src_shape.begin(),src_shape.end(), 1ULL, std::multiplies<size_t>());
-
-  size_t src_offset = a.get_offset();
-  size_t tgt_offset = 0;
-  // Iterate through the source indices, but don't increment offset of 
-  // target ptr if dim is in mask. I.e., we set strides of those dims to 0
-  DimVec indices(src_shape.size(),0);
-
-  DimVec src_strides = a.get_strides();
+  const DimVec& src_shape = a.get_shape();
+  std::vector<bool> is_removed = reduced_dims_mask(src_shape, axes);
 
-  DimVec tgt_compact_strides = target.get_strides();
-  DimVec tgt_strides_mapped(src_strides.size());
-  // the compact stride index is handled differently if keepdims true/false, need explicit 
-  // manipulation.
-  size_t tgt_stride_idx = 0;
-  
-  for (int i = 0; i < tgt_strides_mapped.size(); i++){
-    // set removed dim strides to 0
-    if (is_removed[i]){
-      tgt_strides_mapped[i] = 0;
-      // keepdims means that the compact dims has an extra dim for reduced 1 dim, skip over.
-      if (keepdims) tgt_stride_idx++;
-    }
-    else {
-      // set to compact dim according to the idx
-      tgt_strides_mapped[i] = tgt_compact_strides[tgt_stride_idx++];
-    }
-  }
-  
-  for (int i = 0; i < src_total_size; i++){
-    tgt_ptr[tgt_offset] = op(tgt_ptr[tgt_offset], src_ptr[src_offset]);
-
-    for (int dim = indices.size() - 1; dim >=0; dim--){
-      
-      indices[dim]++;
-      src_offset += src_strides[dim];
-      tgt_offset += tgt_strides_mapped[dim];
-
-      if (indices[dim] == src_shape[dim]){
-        indices[dim] = 0;
-        src_offset -= src_strides[dim] * src_shape[dim];
-        tgt_offset -= tgt_strides_mapped[dim] * src_shape[dim];
-      }
-      else {
-        break;
-      }
-    }
-  }
+  // every element is written by the engine, see reduction_engine.inl for the strategies
+  NDArray<T> target = NDArray<T>::empty(reduced_shape(src_shape, is_removed, keepdims));
+  reduce::reduce_into(a.get_handle()->ptr() + a.get_offset(), src_shape, a.get_strides(), is_removed,
+                      target.get_handle()->ptr(), op, init_val);
   return target;
 }
 
 
 template <typename T>
 NDArray<T> NDArray<T>::sum(const DimVec& axes, bool keepdims) const{
-
-  return reduction_op_kernel(*this, axes, [](T a, T b){ return a + b;}, (T) 0, keepdims);
+  profiler::Scope prof("sum", *this);
+  // 16 bit types accumulate in float
+  if constexpr (is_half_precision_v<T>) return prof.result(astype<float>().sum(axes, keepdims).template astype<T>());
+  return prof.result(reduction_op_kernel(*this, axes, [](T a, T b){ return a + b;}, (T) 0, keepdims));
 }
 
 template <typename T>
 NDArray<T> NDArray<T>::max(const DimVec& axes, bool keepdims) const{
-
-  return reduction_op_kernel(*this, axes, [](T a, T b){ return std::max(a,b);}, std::numeric_limits<T>::lowest(), keepdims);
+  profiler::Scope prof("max", *this);
+  return prof.result(reduction_op_kernel(*this, axes, [](T a, T b){ return std::max(a,b);}, std::numeric_limits<T>::lowest(), keepdims));
 }
 template <typename T>
 NDArray<T> NDArray<T>::min(const DimVec& axes, bool keepdims) const{
-
-  return reduction_op_kernel(*this, axes, [](T a, T b){ return std::min(a,b);}, std::numeric_limits<T>::max(), keepdims);
+  profiler::Scope prof("min", *this);
+  return prof.result(reduction_op_kernel(*this, axes, [](T a, T b){ return std::min(a,b);}, std::numeric_limits<T>::max(), keepdims));
 }
 
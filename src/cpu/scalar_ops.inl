@@ -2,36 +2,34 @@
 #include <numeric>   
 #include <functional> 
 #include <cmath>    
+#include <algorithm>
+#include <type_traits>
+#include <profiler.inl>
+#include <strided_loop.inl>
+#include <simd_math.inl>
 
 template <typename T>
 void NDArray<T>::setitem_scalar(const std::vector<Slice> &slice_ranges, T scalar)
 {
+    profiler::Scope prof("setitem_scalar", *this);
     NDArray<T> target_view = this->slice(slice_ranges);
-    DimVec target_shape = target_view.get_shape();
-    size_t total_size = std::accumulate(target_shape.begin(), target_shape.end(), 1ULL, std::multiplies<size_t>());
-    // Odometer logic based on shape/strides of the target view
+    prof.output(target_view);
     T *write_ptr = handle->ptr();
-    DimVec indices(target_shape.size(), 0);
-    size_t curr_idx = target_view.get_offset();
-    for (size_t i = 0; i < total_size; i++)
-    {
-        write_ptr[curr_idx] = scalar;
-        for (int dim = static_cast<int>(target_shape.size()) - 1; dim >= 0; --dim)
+
+    // Single operand walk over the target view
+    StridedLoop<1> loop(target_view.get_shape(), {target_view.get_strides()}, {target_view.get_offset()});
+    loop.run_parallel(kElementwiseGrain, [&](const auto &offs, size_t n, const auto &st)
+             {
+        T *dst = write_ptr + offs[0];
+        if (st[0] == 1)
         {
-            // increment by target view strides
-            curr_idx += target_view.get_strides()[dim];
-            indices[dim]++;
-            if (indices[dim] == target_shape[dim])
-            {
-                indices[dim] = 0;
-                curr_idx -= target_shape[dim] * target_view.get_strides()[dim];
-            }
-            else
-            {
-                break;
-            }
+            std::fill(dst, dst + n, scalar);
         }
-    }
+        else
+        {
+            for (std::ptrdiff_t i = 0; i < static_cast<std::ptrdiff_t>(n); i++)
+                dst[i * st[0]] = scalar;
+        } });
 }
 
 /** Arithmetic scalar ops
@@ -39,85 +37,147 @@ void NDArray<T>::setitem_scalar(const std::vector<Slice> &slice_ranges, T scalar
  */
 
 template <typename T, typename Op>
-NDArray<T> scalar_op_kernel(const NDArray<T> &a, T scalar, Op op)
+void scalar_op_kernel(const NDArray<T> &a, T scalar, NDArray<T> &out, Op op)
 {
-    NDArray<T> target{a.get_shape()};
-    const auto &shape = target.get_shape();
-    const auto &strides = a.get_strides();
-    size_t total_size = std::accumulate(shape.begin(), shape.end(), 1ULL, std::multiplies<size_t>());
-
-    T *new_data = target.get_handle()->ptr();
-    const T *old_data = a.get_handle()->ptr();
+    check_out_shape(out, a.get_shape());
+    const NDArray<T> src_view = alias_safe_input(a, out);
+    const auto &shape = out.get_shape();
 
-    size_t curr_idx = a.get_offset();
-    DimVec indices(shape.size(), 0);
-    for (size_t i = 0; i < total_size; i++)
-    {
-        new_data[i] = op(old_data[curr_idx], scalar);
+    T *new_data = out.get_handle()->ptr();
+    const T *old_data = src_view.get_handle()->ptr();
 
-        for (int dim = static_cast<int>(shape.size()) - 1; dim >= 0; --dim)
+    StridedLoop<2> loop(shape, {out.get_strides(), src_view.get_strides()}, {out.get_offset(), src_view.get_offset()});
+    loop.run_parallel(kElementwiseGrain, [&](const auto &offs, size_t n, const auto &st)
+             {
+        T *dst = new_data + offs[0];
+        const T *src = old_data + offs[1];
+        if (st[0] == 1 && st[1] == 1)
         {
-            indices[dim]++;
-            curr_idx += strides[dim];
-
-            if (indices[dim] < shape[dim])
-            {
-                break;
-            }
-            else
-            {
-                indices[dim] = 0;
-                curr_idx -= shape[dim] * strides[dim];
-            }
+            for (size_t i = 0; i < n; i++)
+                dst[i] = op(src[i], scalar);
         }
-    }
+        else
+        {
+            for (std::ptrdiff_t i = 0; i < static_cast<std::ptrdiff_t>(n); i++)
+                dst[i * st[0]] = op(src[i * st[1]], scalar);
+        } });
+}
+
+template <typename T, typename Op>
+NDArray<T> scalar_op_kernel(const NDArray<T> &a, T scalar, Op op)
+{
+    NDArray<T> target = NDArray<T>::empty(a.get_shape());
+    scalar_op_kernel(a, scalar, target, op);
     return target;
 }
+
+/*
+ * Every op is written once in its out= form, the allocating and in place forms forward to it.
+ */
+
+#define PHOTON_SCALAR_FORWARDS(name)                          \
+    template <typename T>                                     \
+    NDArray<T> scalar_##name(const NDArray<T> &a, T b)        \
+    {                                                         \
+        NDArray<T> target = NDArray<T>::empty(a.get_shape()); \
+        scalar_##name(a, b, target);                          \
+        return target;                                        \
+    }
+
+#define PHOTON_SCALAR_INPLACE(name, method)        \
+    template <typename T>                          \
+    NDArray<T> &NDArray<T>::method(T scalar)       \
+    {                                              \
+        scalar_##name(*this, scalar, *this);       \
+        return *this;                              \
+    }
+
 template <typename T>
-NDArray<T> scalar_add(const NDArray<T> &a, T b)
+void scalar_add(const NDArray<T> &a, T b, NDArray<T> &out)
 {
-    return scalar_op_kernel(a, b, [](T a, T b)
-                            { return a + b; });
+    profiler::Scope prof("scalar_add", a);
+    prof.output(out);
+    scalar_op_kernel(a, b, out, [](T a, T b)
+                     { return a + b; });
 }
+PHOTON_SCALAR_FORWARDS(add)
+PHOTON_SCALAR_INPLACE(add, add_)
 
 template <typename T>
-NDArray<T> scalar_sub(const NDArray<T> &a, T b)
+void scalar_sub(const NDArray<T> &a, T b, NDArray<T> &out)
 {
-    return scalar_op_kernel(a, b, [](T a, T b)
-                            { return a - b; });
+    profiler::Scope prof("scalar_sub", a);
+    prof.output(out);
+    scalar_op_kernel(a, b, out, [](T a, T b)
+                     { return a - b; });
 }
+PHOTON_SCALAR_FORWARDS(sub)
+PHOTON_SCALAR_INPLACE(sub, sub_)
+
 template <typename T>
-NDArray<T> scalar_rsub(const NDArray<T> &a, T b)
+void scalar_rsub(const NDArray<T> &a, T b, NDArray<T> &out)
 {
-    return scalar_op_kernel(a, b, [](T a, T b)
-                            { return b - a; });
+    profiler::Scope prof("scalar_rsub", a);
+    prof.output(out);
+    scalar_op_kernel(a, b, out, [](T a, T b)
+                     { return b - a; });
 }
+PHOTON_SCALAR_FORWARDS(rsub)
 
 template <typename T>
-NDArray<T> scalar_div(const NDArray<T> &a, T b)
+void scalar_div(const NDArray<T> &a, T b, NDArray<T> &out)
 {
-    return scalar_op_kernel(a, b, [](T a, T b)
-                            { return a / b; });
+    profiler::Scope prof("scalar_div", a);
+    prof.output(out);
+    if constexpr (std::is_integral_v<T>)
+    {
+        if (b == 0)
+            throw std::domain_error("integer division by zero");
+    }
+    scalar_op_kernel(a, b, out, [](T a, T b)
+                     { return divide(a, b); });
 }
+PHOTON_SCALAR_FORWARDS(div)
+PHOTON_SCALAR_INPLACE(div, div_)
 
 template <typename T>
-NDArray<T> scalar_rdiv(const NDArray<T> &a, T b)
+void scalar_rdiv(const NDArray<T> &a, T b, NDArray<T> &out)
 {
-    return scalar_op_kernel(a, b, [](T a, T b)
-                            { return b / a; });
+    profiler::Scope prof("scalar_rdiv", a);
+    prof.output(out);
+    check_integer_divisors(a);
+    scalar_op_kernel(a, b, out, [](T a, T b)
+                     { return divide(b, a); });
 }
+PHOTON_SCALAR_FORWARDS(rdiv)
 
 template <typename T>
-NDArray<T> scalar_mul(const NDArray<T> &a, T b)
+void scalar_mul(const NDArray<T> &a, T b, NDArray<T> &out)
 {
-    return scalar_op_kernel(a, b, [](T a, T b)
-                            { return a * b; });
+    profiler::Scope prof("scalar_mul", a);
+    prof.output(out);
+    scalar_op_kernel(a, b, out, [](T a, T b)
+                     { return a * b; });
 }
+PHOTON_SCALAR_FORWARDS(mul)
+PHOTON_SCALAR_INPLACE(mul, mul_)
 
 template <typename T>
-NDArray<T> scalar_pow(const NDArray<T> &a, T b)
+void scalar_pow(const NDArray<T> &a, T b, NDArray<T> &out)
 {
-    return scalar_op_kernel(a, b, [](T a, T b)
-                            { return std::pow(a, b); });
+    profiler::Scope prof("scalar_pow", a);
+    prof.output(out);
+    if constexpr (std::is_same_v<T, float>)
+    {
+        auto pow_scalar = simd_math::kernels().pow_scalar;
+        return unary_row_kernel(a, out, [pow_scalar, b](const float *x, float *y, size_t n)
+                                { pow_scalar(x, b, y, n); });
+    }
+    scalar_op_kernel(a, b, out, [](T a, T b)
+                     { return std::pow(a, b); });
 }
+PHOTON_SCALAR_FORWARDS(pow)
+PHOTON_SCALAR_INPLACE(pow, pow_)
 
+#undef PHOTON_SCALAR_FORWARDS
+#undef PHOTON_SCALAR_INPLACE
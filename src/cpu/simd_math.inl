@@ -0,0 +1,163 @@
+#pragma once
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <cpu_features.inl>
+
+/**
+ * Vectorised float exp/log/sin/cos/tanh/pow used by the unary, scalar_pow and ewise_pow kernels.
+ *
+ * The kernel bodies live in simd_math_impl.inl and are compiled once per ISA (baseline, SSE4.2,
+ * AVX2/FMA, AVX-512). The widest one the CPU supports is picked at runtime, and can be lowered with
+ * set_math_isa, e.g. to benchmark or test the narrower paths. Error bounds are listed in
+ * simd_math_impl.inl.
+ */
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+#define PHOTON_SIMD_NS generic
+#define PHOTON_SIMD_WIDTH 4
+#include <simd_math_impl.inl>
+#undef PHOTON_SIMD_NS
+#undef PHOTON_SIMD_WIDTH
+
+#if PHOTON_X86_DISPATCH
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#define PHOTON_SIMD_NS sse42
+#define PHOTON_SIMD_WIDTH 4
+#include <simd_math_impl.inl>
+#undef PHOTON_SIMD_NS
+#undef PHOTON_SIMD_WIDTH
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#define PHOTON_SIMD_NS avx2
+#define PHOTON_SIMD_WIDTH 8
+#include <simd_math_impl.inl>
+#undef PHOTON_SIMD_NS
+#undef PHOTON_SIMD_WIDTH
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512dq,avx512bw,avx512vl,fma")
+#define PHOTON_SIMD_NS avx512
+#define PHOTON_SIMD_WIDTH 16
+#include <simd_math_impl.inl>
+#undef PHOTON_SIMD_NS
+#undef PHOTON_SIMD_WIDTH
+#pragma GCC pop_options
+#endif
+
+#pragma GCC diagnostic pop
+#define PHOTON_SIMD_MATH 1
+#else
+#define PHOTON_SIMD_MATH 0
+#endif
+
+namespace simd_math
+{
+    // Contiguous array kernels for one ISA
+    struct MathKernels
+    {
+        void (*exp)(const float *, float *, size_t);
+        void (*log)(const float *, float *, size_t);
+        void (*sin)(const float *, float *, size_t);
+        void (*cos)(const float *, float *, size_t);
+        void (*tanh)(const float *, float *, size_t);
+        void (*pow)(const float *, const float *, float *, size_t);
+        void (*pow_scalar)(const float *, float, float *, size_t);
+        CpuIsa isa;
+    };
+
+    // Plain loops over std::, used when there are no vector extensions, and for pow on the 4 wide
+    // ISAs where two double vectors per float vector lose to the scalar libm pow.
+    namespace libm
+    {
+        inline void exp(const float *x, float *y, size_t n) { for (size_t i = 0; i < n; i++) y[i] = std::exp(x[i]); }
+        inline void log(const float *x, float *y, size_t n) { for (size_t i = 0; i < n; i++) y[i] = std::log(x[i]); }
+        inline void sin(const float *x, float *y, size_t n) { for (size_t i = 0; i < n; i++) y[i] = std::sin(x[i]); }
+        inline void cos(const float *x, float *y, size_t n) { for (size_t i = 0; i < n; i++) y[i] = std::cos(x[i]); }
+        inline void tanh(const float *x, float *y, size_t n) { for (size_t i = 0; i < n; i++) y[i] = std::tanh(x[i]); }
+        inline void pow(const float *x, const float *e, float *y, size_t n) { for (size_t i = 0; i < n; i++) y[i] = std::pow(x[i], e[i]); }
+        inline void pow_scalar(const float *x, float e, float *y, size_t n) { for (size_t i = 0; i < n; i++) y[i] = std::pow(x[i], e); }
+    }
+
+#define PHOTON_MATH_KERNELS(ns, pow_ns, isa) \
+    MathKernels { ns::exp, ns::log, ns::sin, ns::cos, ns::tanh, pow_ns::pow, pow_ns::pow_scalar, isa }
+
+    // Kernels for the given ISA, or the widest compiled one below it
+    inline const MathKernels &kernels_for(CpuIsa isa)
+    {
+#if PHOTON_SIMD_MATH && PHOTON_X86_DISPATCH
+        static const MathKernels avx512_k = PHOTON_MATH_KERNELS(avx512, avx512, CpuIsa::AVX512);
+        static const MathKernels avx2_k = PHOTON_MATH_KERNELS(avx2, avx2, CpuIsa::AVX2);
+        static const MathKernels sse42_k = PHOTON_MATH_KERNELS(sse42, libm, CpuIsa::SSE42);
+        if (isa >= CpuIsa::AVX512)
+            return avx512_k;
+        if (isa >= CpuIsa::AVX2)
+            return avx2_k;
+        if (isa >= CpuIsa::SSE42)
+            return sse42_k;
+#endif
+#if PHOTON_SIMD_MATH
+        static const MathKernels generic_k = PHOTON_MATH_KERNELS(generic, libm, CpuIsa::Scalar);
+#else
+        static const MathKernels generic_k = PHOTON_MATH_KERNELS(libm, libm, CpuIsa::Scalar);
+#endif
+        return generic_k;
+    }
+#undef PHOTON_MATH_KERNELS
+
+    inline std::atomic<const MathKernels *> &active_kernels()
+    {
+        static std::atomic<const MathKernels *> active{&kernels_for(detect_isa())};
+        return active;
+    }
+
+    // Kernels used by the NDArray ops
+    inline const MathKernels &kernels()
+    {
+        return *active_kernels().load(std::memory_order_relaxed);
+    }
+
+    // ISAs this host can run, narrowest first
+    inline std::vector<CpuIsa> available_isas()
+    {
+        std::vector<CpuIsa> isas{CpuIsa::Scalar};
+#if PHOTON_SIMD_MATH && PHOTON_X86_DISPATCH
+        for (CpuIsa isa : {CpuIsa::SSE42, CpuIsa::AVX2, CpuIsa::AVX512})
+        {
+            if (isa <= detect_isa())
+                isas.push_back(isa);
+        }
+#endif
+        return isas;
+    }
+
+    inline void set_math_isa(const std::string &name)
+    {
+        for (CpuIsa isa : available_isas())
+        {
+            if (name == isa_name(isa))
+            {
+                active_kernels().store(&kernels_for(isa));
+                return;
+            }
+        }
+        throw std::invalid_argument("ISA '" + name + "' is not supported on this CPU");
+    }
+
+    inline std::string get_math_isa()
+    {
+        return isa_name(kernels().isa);
+    }
+}
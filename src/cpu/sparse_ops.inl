@@ -0,0 +1,555 @@
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <numeric>
+#include <string>
+#include <type_traits>
+#include <stdexcept>
+#include <utility>
+#include <cpu_features.inl>
+#include <thread_pool.inl>
+#include <profiler.inl>
+
+/**
+ * @brief SparseNDArray construction, format conversions and kernels.
+ *
+ * CSR keeps, for every row r, its column indices and values at [row_offsets[r], row_offsets[r + 1]),
+ * sorted by column without duplicates. COO keeps a (row, column, value) triple per element in any
+ * order and lets duplicates add up, which makes it the format to assemble a matrix in; to_csr sorts
+ * it and sums the duplicates. Row parallel kernels split the rows into blocks holding equal shares of
+ * the non zeros (plus one per row, for the per row overhead) rather than equal row counts, so a few
+ * dense rows do not leave one thread with most of the work.
+ *
+ * spmm streams each row of the sparse operand once and, for each non zero a[r, k], adds a[r, k] * b[k, :]
+ * to out[r, :]: every read of b is a contiguous row and every write stays in the output row, which is
+ * what makes it beat a dense matmul once most of a is zeros.
+ */
+
+namespace sparse
+{
+    // Row blocks per thread, some slack for blocks whose non zeros cost more than their share
+    constexpr size_t kBlocksPerThread = 4;
+
+    template <typename T>
+    const T *data_of(const NDArray<T> &a)
+    {
+        return a.get_handle()->ptr() + a.get_offset();
+    }
+
+    template <typename T>
+    T *data_of(NDArray<T> &a)
+    {
+        return a.get_handle()->ptr() + a.get_offset();
+    }
+
+    template <typename T>
+    bool is_nonzero(T x)
+    {
+        if constexpr (is_half_precision_v<T>)
+            return static_cast<float>(x) != 0.0f;
+        else
+            return x != T(0);
+    }
+
+    // A compact copy of a 1D array, or the array itself when it already is one
+    template <typename T>
+    NDArray<T> compact_1d(const NDArray<T> &a, const char *what)
+    {
+        if (a.get_shape().size() != 1)
+            throw std::invalid_argument(std::string("sparse: ") + what + " must be 1D");
+        return a.is_contiguous() ? a : a.make_compact();
+    }
+
+    inline void check_matrix_shape(const DimVec &shape, const char *op)
+    {
+        if (shape.size() != 2)
+            throw std::invalid_argument(std::string(op) + ": sparse arrays are 2D, got " +
+                                        std::to_string(shape.size()) + " dimensions");
+    }
+
+    inline void check_indices(const int64_t *indices, size_t n, size_t bound, const char *what)
+    {
+        for (size_t i = 0; i < n; i++)
+            if (indices[i] < 0 || static_cast<size_t>(indices[i]) >= bound)
+                throw std::invalid_argument(std::string("sparse: ") + what + " index " + std::to_string(indices[i]) +
+                                            " out of range for size " + std::to_string(bound));
+    }
+
+    // Row boundaries of blocks with about equal cost, cost(r) = row_offsets[r] + r being the cost of rows [0, r)
+    inline std::vector<size_t> row_blocks(const int64_t *row_offsets, size_t rows, size_t row_cost)
+    {
+        const size_t nnz = static_cast<size_t>(row_offsets[rows]);
+        const size_t total = nnz + rows;
+        size_t blocks = std::min(rows, get_num_threads() * kBlocksPerThread);
+        // not worth a task when the whole product is small
+        if (get_num_threads() == 1 || (nnz + rows) * row_cost < kElementwiseGrain)
+            blocks = std::min<size_t>(rows, 1);
+
+        std::vector<size_t> bounds{0};
+        for (size_t i = 1; i < blocks; i++)
+        {
+            const size_t target = total * i / blocks;
+            // first row whose prefix cost reaches the target
+            size_t lo = bounds.back(), hi = rows;
+            while (lo < hi)
+            {
+                const size_t mid = lo + (hi - lo) / 2;
+                if (static_cast<size_t>(row_offsets[mid]) + mid < target)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            if (lo > bounds.back())
+                bounds.push_back(lo);
+        }
+        if (rows > bounds.back())
+            bounds.push_back(rows);
+        return bounds;
+    }
+
+    // Output rows [lo, hi) of spmm, out[r, :] = sum over the row's non zeros of a[r, k] * b[k, :]
+    template <typename T>
+    inline void spmm_rows_generic(size_t lo, size_t hi, const int64_t *o, const int64_t *c, const T *v, const T *b,
+                                  size_t N, T *out)
+    {
+        for (size_t r = lo; r < hi; r++)
+        {
+            T *dst = out + r * N;
+            std::fill(dst, dst + N, T(0));
+            int64_t k = o[r];
+            // four non zeros per pass over the output row quarter its loads and stores
+            for (; k + 3 < o[r + 1]; k += 4)
+            {
+                const T x0 = v[k], x1 = v[k + 1], x2 = v[k + 2], x3 = v[k + 3];
+                const T *b0 = b + c[k] * N, *b1 = b + c[k + 1] * N, *b2 = b + c[k + 2] * N, *b3 = b + c[k + 3] * N;
+                for (size_t n = 0; n < N; n++)
+                    dst[n] += (x0 * b0[n] + x1 * b1[n]) + (x2 * b2[n] + x3 * b3[n]);
+            }
+            for (; k + 1 < o[r + 1]; k += 2)
+            {
+                const T x0 = v[k], x1 = v[k + 1];
+                const T *b0 = b + c[k] * N, *b1 = b + c[k + 1] * N;
+                for (size_t n = 0; n < N; n++)
+                    dst[n] += x0 * b0[n] + x1 * b1[n];
+            }
+            if (k < o[r + 1])
+            {
+                const T x = v[k];
+                const T *b0 = b + c[k] * N;
+                for (size_t n = 0; n < N; n++)
+                    dst[n] += x * b0[n];
+            }
+        }
+    }
+
+#if PHOTON_X86_DISPATCH
+    // The same loops vectorised for the wider ISAs (cpu_features.inl), picked at runtime for float
+    __attribute__((target("avx2,fma"), flatten)) inline void spmm_rows_avx2(size_t lo, size_t hi, const int64_t *o,
+                                                                   const int64_t *c, const float *v, const float *b,
+                                                                   size_t N, float *out)
+    {
+        spmm_rows_generic<float>(lo, hi, o, c, v, b, N, out);
+    }
+
+    __attribute__((target("avx512f"), flatten)) inline void spmm_rows_avx512(size_t lo, size_t hi, const int64_t *o,
+                                                                    const int64_t *c, const float *v, const float *b,
+                                                                    size_t N, float *out)
+    {
+        spmm_rows_generic<float>(lo, hi, o, c, v, b, N, out);
+    }
+#endif
+
+    template <typename T>
+    void spmm_rows(size_t lo, size_t hi, const int64_t *o, const int64_t *c, const T *v, const T *b, size_t N, T *out)
+    {
+#if PHOTON_X86_DISPATCH
+        if constexpr (std::is_same_v<T, float>)
+        {
+            if (detect_isa() >= CpuIsa::AVX512)
+                return spmm_rows_avx512(lo, hi, o, c, v, b, N, out);
+            if (detect_isa() >= CpuIsa::AVX2)
+                return spmm_rows_avx2(lo, hi, o, c, v, b, N, out);
+        }
+#endif
+        spmm_rows_generic<T>(lo, hi, o, c, v, b, N, out);
+    }
+
+    // fn(row_lo, row_hi) over the blocks of row_blocks, in parallel
+    template <typename F>
+    void for_row_blocks(const int64_t *row_offsets, size_t rows, size_t row_cost, F &&fn)
+    {
+        const std::vector<size_t> bounds = row_blocks(row_offsets, rows, row_cost);
+        parallel_for(0, bounds.size() - 1, 1, [&](size_t lo, size_t hi)
+                     {
+            for (size_t b = lo; b < hi; b++)
+                fn(bounds[b], bounds[b + 1]); });
+    }
+}
+
+template <typename T>
+SparseNDArray<T>::SparseNDArray(SparseFormat format, DimVec shape, NDArray<int64_t> rows, NDArray<int64_t> cols,
+                                NDArray<T> values)
+    : format(format), shape(std::move(shape)), rows(std::move(rows)), cols(std::move(cols)), values(std::move(values))
+{
+}
+
+template <typename T>
+SparseNDArray<T> SparseNDArray<T>::csr(const DimVec &shape, const NDArray<int64_t> &row_offsets,
+                                       const NDArray<int64_t> &col_indices, const NDArray<T> &values)
+{
+    sparse::check_matrix_shape(shape, "csr");
+    NDArray<int64_t> offsets = sparse::compact_1d(row_offsets, "row offsets");
+    NDArray<int64_t> cols = sparse::compact_1d(col_indices, "column indices");
+    NDArray<T> vals = sparse::compact_1d(values, "values");
+    const size_t nnz = vals.get_shape()[0];
+    if (offsets.get_shape()[0] != shape[0] + 1)
+        throw std::invalid_argument("csr: expected " + std::to_string(shape[0] + 1) + " row offsets, got " +
+                                    std::to_string(offsets.get_shape()[0]));
+    if (cols.get_shape()[0] != nnz)
+        throw std::invalid_argument("csr: column indices and values differ in length");
+
+    const int64_t *o = sparse::data_of(offsets);
+    const int64_t *c = sparse::data_of(cols);
+    if (o[0] != 0 || static_cast<size_t>(o[shape[0]]) != nnz)
+        throw std::invalid_argument("csr: row offsets must start at 0 and end at the number of values");
+    // every offset is checked before any column is read, so a bad offset can't index past the columns
+    for (size_t r = 0; r < shape[0]; r++)
+    {
+        if (o[r + 1] < o[r] || static_cast<size_t>(o[r + 1]) > nnz)
+            throw std::invalid_argument("csr: row offsets must be non decreasing and at most the number of values");
+    }
+    for (size_t r = 0; r < shape[0]; r++)
+    {
+        sparse::check_indices(c + o[r], o[r + 1] - o[r], shape[1], "column");
+        for (int64_t k = o[r] + 1; k < o[r + 1]; k++)
+            if (c[k] <= c[k - 1])
+                throw std::invalid_argument("csr: column indices must be increasing within a row, build duplicates as coo");
+    }
+    return SparseNDArray<T>(SparseFormat::CSR, shape, offsets, cols, vals);
+}
+
+template <typename T>
+SparseNDArray<T> SparseNDArray<T>::coo(const DimVec &shape, const NDArray<int64_t> &row_indices,
+                                       const NDArray<int64_t> &col_indices, const NDArray<T> &values)
+{
+    sparse::check_matrix_shape(shape, "coo");
+    NDArray<int64_t> rows = sparse::compact_1d(row_indices, "row indices");
+    NDArray<int64_t> cols = sparse::compact_1d(col_indices, "column indices");
+    NDArray<T> vals = sparse::compact_1d(values, "values");
+    const size_t nnz = vals.get_shape()[0];
+    if (rows.get_shape()[0] != nnz || cols.get_shape()[0] != nnz)
+        throw std::invalid_argument("coo: row indices, column indices and values differ in length");
+    sparse::check_indices(sparse::data_of(rows), nnz, shape[0], "row");
+    sparse::check_indices(sparse::data_of(cols), nnz, shape[1], "column");
+    return SparseNDArray<T>(SparseFormat::COO, shape, rows, cols, vals);
+}
+
+template <typename T>
+SparseNDArray<T> SparseNDArray<T>::from_dense(const NDArray<T> &dense, SparseFormat format)
+{
+    profiler::Scope prof("sparse_from_dense", dense);
+    const DimVec shape = dense.get_shape();
+    sparse::check_matrix_shape(shape, "from_dense");
+    const DimVec strides = dense.get_strides();
+    const size_t R = shape[0], C = shape[1], row_stride = strides[0], col_stride = strides[1];
+    const T *src = sparse::data_of(dense);
+    auto count = [C](const T *row, size_t step)
+    {
+        int64_t n = 0;
+        for (size_t c = 0; c < C; c++)
+            n += sparse::is_nonzero(row[c * step]);
+        return n;
+    };
+
+    // count each row's non zeros, then write them at their row's offset
+    NDArray<int64_t> offsets = NDArray<int64_t>::empty({R + 1});
+    int64_t *o = sparse::data_of(offsets);
+    o[0] = 0;
+    parallel_for(0, R, std::max<size_t>(1, kElementwiseGrain / std::max<size_t>(C, 1)), [&](size_t lo, size_t hi)
+                 {
+        for (size_t r = lo; r < hi; r++)
+        {
+            const T *row = src + r * row_stride;
+            // unit stride rows vectorise
+            o[r + 1] = col_stride == 1 ? count(row, 1) : count(row, col_stride);
+        } });
+    for (size_t r = 0; r < R; r++)
+        o[r + 1] += o[r];
+
+    const size_t nnz = static_cast<size_t>(o[R]);
+    NDArray<int64_t> cols = NDArray<int64_t>::empty({nnz});
+    NDArray<T> values = NDArray<T>::empty({nnz});
+    int64_t *ci = sparse::data_of(cols);
+    T *v = sparse::data_of(values);
+    sparse::for_row_blocks(o, R, 1, [&](size_t lo, size_t hi)
+                           {
+        for (size_t r = lo; r < hi; r++)
+        {
+            const T *row = src + r * row_stride;
+            int64_t k = o[r];
+            for (size_t c = 0; c < C; c++)
+            {
+                const T x = row[c * col_stride];
+                if (sparse::is_nonzero(x))
+                {
+                    ci[k] = static_cast<int64_t>(c);
+                    v[k++] = x;
+                }
+            }
+        } });
+
+    SparseNDArray<T> result(SparseFormat::CSR, shape, offsets, cols, values);
+    if (format == SparseFormat::COO)
+        result = result.to_coo();
+    prof.output(result);
+    return result;
+}
+
+template <typename T>
+NDArray<T> SparseNDArray<T>::to_dense() const
+{
+    profiler::Scope prof("sparse_to_dense", *this);
+    NDArray<T> out(shape);
+    T *d = sparse::data_of(out);
+    const int64_t *r = sparse::data_of(rows);
+    const int64_t *c = sparse::data_of(cols);
+    const T *v = sparse::data_of(values);
+    const size_t C = shape[1];
+    if (format == SparseFormat::CSR)
+    {
+        sparse::for_row_blocks(r, shape[0], 1, [&](size_t lo, size_t hi)
+                               {
+            for (size_t i = lo; i < hi; i++)
+                for (int64_t k = r[i]; k < r[i + 1]; k++)
+                    d[i * C + c[k]] = v[k]; });
+    }
+    else
+    {
+        // duplicates add up, so scatter serially
+        for (size_t k = 0; k < nnz(); k++)
+        {
+            T &x = d[r[k] * C + c[k]];
+            x = static_cast<T>(x + v[k]);
+        }
+    }
+    prof.output(out);
+    return out;
+}
+
+template <typename T>
+SparseNDArray<T> SparseNDArray<T>::to_coo() const
+{
+    if (format == SparseFormat::COO)
+        return *this;
+    profiler::Scope prof("sparse_to_coo", *this);
+    NDArray<int64_t> row_indices = NDArray<int64_t>::empty({nnz()});
+    int64_t *ri = sparse::data_of(row_indices);
+    const int64_t *o = sparse::data_of(rows);
+    sparse::for_row_blocks(o, shape[0], 1, [&](size_t lo, size_t hi)
+                           {
+        for (size_t r = lo; r < hi; r++)
+            std::fill(ri + o[r], ri + o[r + 1], static_cast<int64_t>(r)); });
+    // the column indices and values are shared, already in row major order
+    return prof.result(SparseNDArray<T>(SparseFormat::COO, shape, row_indices, cols, values));
+}
+
+template <typename T>
+SparseNDArray<T> SparseNDArray<T>::to_csr() const
+{
+    if (format == SparseFormat::CSR)
+        return *this;
+    profiler::Scope prof("sparse_to_csr", *this);
+    const size_t R = shape[0], n = nnz();
+    const int64_t *ri = sparse::data_of(rows);
+    const int64_t *ci = sparse::data_of(cols);
+    const T *vi = sparse::data_of(values);
+
+    // stable counting sort by row
+    std::vector<int64_t> bucket(R + 1, 0);
+    for (size_t k = 0; k < n; k++)
+        bucket[ri[k] + 1]++;
+    std::partial_sum(bucket.begin(), bucket.end(), bucket.begin());
+    std::vector<std::pair<int64_t, T>> entries(n);
+    {
+        std::vector<int64_t> next(bucket.begin(), bucket.end() - 1);
+        for (size_t k = 0; k < n; k++)
+            entries[next[ri[k]]++] = {ci[k], vi[k]};
+    }
+
+    // sort each row by column and fold duplicates into their first entry, counting what is left
+    NDArray<int64_t> offsets = NDArray<int64_t>::empty({R + 1});
+    int64_t *o = sparse::data_of(offsets);
+    o[0] = 0;
+    sparse::for_row_blocks(bucket.data(), R, 1, [&](size_t lo, size_t hi)
+                           {
+        for (size_t r = lo; r < hi; r++)
+        {
+            auto first = entries.begin() + bucket[r], last = entries.begin() + bucket[r + 1];
+            std::stable_sort(first, last, [](const auto &a, const auto &b)
+                             { return a.first < b.first; });
+            auto out = first;
+            for (auto it = first; it != last; ++it)
+            {
+                if (out != first && std::prev(out)->first == it->first)
+                    std::prev(out)->second = static_cast<T>(std::prev(out)->second + it->second);
+                else
+                    *out++ = *it;
+            }
+            o[r + 1] = out - first;
+        } });
+    for (size_t r = 0; r < R; r++)
+        o[r + 1] += o[r];
+
+    const size_t unique = static_cast<size_t>(o[R]);
+    NDArray<int64_t> cols_out = NDArray<int64_t>::empty({unique});
+    NDArray<T> values_out = NDArray<T>::empty({unique});
+    int64_t *c = sparse::data_of(cols_out);
+    T *v = sparse::data_of(values_out);
+    sparse::for_row_blocks(o, R, 1, [&](size_t lo, size_t hi)
+                           {
+        for (size_t r = lo; r < hi; r++)
+            for (int64_t k = o[r], j = bucket[r]; k < o[r + 1]; k++, j++)
+            {
+                c[k] = entries[j].first;
+                v[k] = entries[j].second;
+            } });
+    return prof.result(SparseNDArray<T>(SparseFormat::CSR, shape, offsets, cols_out, values_out));
+}
+
+template <typename T>
+template <typename U>
+SparseNDArray<U> SparseNDArray<T>::astype() const
+{
+    return SparseNDArray<U>(format, shape, rows, cols, values.template astype<U>());
+}
+
+template <typename T>
+SparseFormat SparseNDArray<T>::get_format() const
+{
+    return format;
+}
+
+template <typename T>
+DimVec SparseNDArray<T>::get_shape() const
+{
+    return shape;
+}
+
+template <typename T>
+size_t SparseNDArray<T>::nnz() const
+{
+    return values.get_shape()[0];
+}
+
+template <typename T>
+NDArray<int64_t> SparseNDArray<T>::get_rows() const
+{
+    return rows;
+}
+
+template <typename T>
+NDArray<int64_t> SparseNDArray<T>::get_cols() const
+{
+    return cols;
+}
+
+template <typename T>
+NDArray<T> SparseNDArray<T>::get_values() const
+{
+    return values;
+}
+
+template <typename T>
+NDArray<T> SparseNDArray<T>::sum(int64_t axis) const
+{
+    profiler::Scope prof("sparse_sum", *this);
+    const size_t ax = normalize_axis(axis, 2);
+    if constexpr (is_half_precision_v<T>)
+        return prof.result(astype<float>().sum(axis).template astype<T>());
+    else
+    {
+        const SparseNDArray<T> a = to_csr();
+        const int64_t *o = sparse::data_of(a.rows);
+        const int64_t *c = sparse::data_of(a.cols);
+        const T *v = sparse::data_of(a.values);
+        NDArray<T> out(DimVec{shape[1 - ax]});
+        T *d = sparse::data_of(out);
+        if (ax == 1)
+        {
+            sparse::for_row_blocks(o, shape[0], 1, [&](size_t lo, size_t hi)
+                                   {
+                for (size_t r = lo; r < hi; r++)
+                {
+                    T s = 0;
+                    for (int64_t k = o[r]; k < o[r + 1]; k++)
+                        s += v[k];
+                    d[r] = s;
+                } });
+        }
+        else
+        {
+            // columns are shared between rows, one pass scattering into the output
+            const size_t n = a.nnz();
+            for (size_t k = 0; k < n; k++)
+                d[c[k]] += v[k];
+        }
+        prof.output(out);
+        return out;
+    }
+}
+
+template <typename T>
+SparseNDArray<T> SparseNDArray<T>::multiply(const NDArray<T> &dense) const
+{
+    profiler::Scope prof("sparse_multiply", *this, dense);
+    const SparseNDArray<T> a = to_csr();
+    // only the stored elements are read, through the strides of the broadcast view
+    const NDArray<T> b = dense.broadcast(shape);
+    const DimVec strides = b.get_strides();
+    const T *src = sparse::data_of(b);
+    const int64_t *o = sparse::data_of(a.rows);
+    const int64_t *c = sparse::data_of(a.cols);
+    const T *v = sparse::data_of(a.values);
+    NDArray<T> values_out = NDArray<T>::empty({a.nnz()});
+    T *out = sparse::data_of(values_out);
+    sparse::for_row_blocks(o, shape[0], 1, [&](size_t lo, size_t hi)
+                           {
+        for (size_t r = lo; r < hi; r++)
+        {
+            const T *row = src + r * strides[0];
+            for (int64_t k = o[r]; k < o[r + 1]; k++)
+                out[k] = static_cast<T>(v[k] * row[c[k] * strides[1]]);
+        } });
+    // the product keeps the sparsity pattern, so the indices are shared
+    return prof.result(SparseNDArray<T>(SparseFormat::CSR, shape, a.rows, a.cols, values_out));
+}
+
+template <typename T>
+NDArray<T> spmm(const SparseNDArray<T> &a, const NDArray<T> &b)
+{
+    profiler::Scope prof("spmm", a, b);
+    const DimVec a_shape = a.get_shape(), b_shape = b.get_shape();
+    if (b_shape.size() != 2 || b_shape[0] != a_shape[1])
+        throw std::invalid_argument("spmm: expected b of shape [" + std::to_string(a_shape[1]) + ", N] for a of shape [" +
+                                    std::to_string(a_shape[0]) + ", " + std::to_string(a_shape[1]) + "]");
+    if constexpr (is_half_precision_v<T>)
+        return prof.result(spmm(a.template astype<float>(), b.template astype<float>()).template astype<T>());
+    else
+    {
+        const SparseNDArray<T> csr = a.to_csr();
+        const NDArray<T> rhs = b.is_contiguous() ? b : b.make_compact();
+        const size_t M = a_shape[0], N = b_shape[1];
+        NDArray<T> out = NDArray<T>::empty({M, N});
+        NDArray<int64_t> rows = csr.get_rows(), cols = csr.get_cols();
+        NDArray<T> values = csr.get_values();
+        const int64_t *o = sparse::data_of(rows);
+        const int64_t *c = sparse::data_of(cols);
+        const T *v = sparse::data_of(values);
+        const T *bp = sparse::data_of(rhs);
+        T *d = sparse::data_of(out);
+        sparse::for_row_blocks(o, M, N, [&](size_t lo, size_t hi)
+                               { sparse::spmm_rows<T>(lo, hi, o, c, v, bp, N, d); });
+        prof.output(out);
+        return out;
+    }
+}
@@ -0,0 +1,178 @@
+#pragma once
+#include <array>
+#include <vector>
+#include <cstddef>
+#include <numeric>
+#include <functional>
+#include <utility>
+#include <algorithm>
+#include <thread_pool.inl>
+
+/**
+ * @brief Shared iteration engine for walking N strided views of the same shape in lockstep.
+ *
+ * The views are simplified before iterating: size-1 dims are dropped and adjacent dims are merged
+ * whenever stride[d] == stride[d+1] * shape[d+1] holds for every operand (broadcast dims with stride 0
+ * in every operand merge too). The remaining dims are walked as a sequence of 1d rows over the
+ * innermost dim, so the odometer carry only runs once per row rather than once per element and fully
+ * contiguous views collapse to a single row.
+ *
+ * Each row is handed to a callback as (offsets, n, inner_strides), where offsets are the absolute
+ * element offsets of the row start for each operand and inner_strides are the constant per-operand
+ * strides along the row. Kernels branch on the inner strides once per row to pick a unit stride loop
+ * the compiler can vectorise.
+ *
+ * @tparam N Number of operands, e.g. 2 for out = op(a), 3 for out = op(a, b).
+ */
+template <size_t N>
+class StridedLoop
+{
+public:
+    using Offsets = std::array<size_t, N>;
+    using Strides = std::array<std::ptrdiff_t, N>;
+
+    StridedLoop(const DimVec &shape, const std::array<DimVec, N> &strides, const Offsets &offsets)
+        : base{offsets}
+    {
+        // Drop size 1 dims, their strides never contribute to an offset.
+        for (size_t d = 0; d < shape.size(); d++)
+        {
+            if (shape[d] == 1)
+                continue;
+            dims.push_back(shape[d]);
+            for (size_t op = 0; op < N; op++)
+                dim_strides[op].push_back(strides[op][d]);
+        }
+
+        // Merge dim d into d+1 (walking from the inside out) when every operand steps over d as if
+        // it were the continuation of d+1.
+        DimVec merged_dims;
+        std::array<DimVec, N> merged_strides;
+        for (int d = static_cast<int>(dims.size()) - 1; d >= 0; --d)
+        {
+            if (!merged_dims.empty())
+            {
+                bool can_merge = true;
+                for (size_t op = 0; op < N; op++)
+                {
+                    if (dim_strides[op][d] != merged_strides[op].back() * merged_dims.back())
+                    {
+                        can_merge = false;
+                        break;
+                    }
+                }
+                if (can_merge)
+                {
+                    merged_dims.back() *= dims[d];
+                    continue;
+                }
+            }
+            merged_dims.push_back(dims[d]);
+            for (size_t op = 0; op < N; op++)
+                merged_strides[op].push_back(dim_strides[op][d]);
+        }
+
+        // merged dims were built innermost first, flip back to outermost first
+        dims.assign(merged_dims.rbegin(), merged_dims.rend());
+        for (size_t op = 0; op < N; op++)
+            dim_strides[op].assign(merged_strides[op].rbegin(), merged_strides[op].rend());
+
+        // scalars (or all size 1 dims) are a single row of 1 element
+        if (dims.empty())
+        {
+            dims.push_back(1);
+            for (size_t op = 0; op < N; op++)
+                dim_strides[op].push_back(0);
+        }
+
+        total = std::accumulate(dims.begin(), dims.end(), 1ULL, std::multiplies<size_t>());
+        for (size_t op = 0; op < N; op++)
+            inner[op] = static_cast<std::ptrdiff_t>(dim_strides[op].back());
+    }
+
+    // Total number of elements visited
+    size_t size() const { return total; }
+    // Number of dims left after coalescing, 1 means every operand is walked as a single row
+    size_t rank() const { return dims.size(); }
+    // Length of the innermost (row) dim
+    size_t row_size() const { return dims.back(); }
+    const Strides &inner_strides() const { return inner; }
+    // Coalesced dims (outermost first) and each operand's strides over them
+    const DimVec &shape() const { return dims; }
+    const DimVec &strides(size_t op) const { return dim_strides[op]; }
+
+    /**
+     * @brief Visit the elements [begin, end) of the row major traversal, row by row.
+     *
+     * Rows are clipped to the range, so the range may be split arbitrarily, e.g. across threads.
+     */
+    template <typename F>
+    void run(size_t begin, size_t end, F &&row) const
+    {
+        if (begin >= end)
+            return;
+
+        const size_t rank = dims.size();
+        const size_t row_len = dims.back();
+
+        // unravel begin into outer dim indices + position in the row
+        DimVec indices(rank, 0);
+        size_t rem = begin;
+        for (int d = static_cast<int>(rank) - 1; d >= 0; --d)
+        {
+            indices[d] = rem % dims[d];
+            rem /= dims[d];
+        }
+        Offsets offs = base;
+        for (size_t op = 0; op < N; op++)
+            for (size_t d = 0; d < rank; d++)
+                offs[op] += indices[d] * dim_strides[op][d];
+
+        size_t pos = begin;
+        while (pos < end)
+        {
+            size_t n = std::min(row_len - indices[rank - 1], end - pos);
+            row(static_cast<const Offsets &>(offs), n, inner);
+            pos += n;
+            if (pos >= end)
+                break;
+
+            // rewind to the start of the row, then carry into the outer dims
+            for (size_t op = 0; op < N; op++)
+                offs[op] -= indices[rank - 1] * dim_strides[op][rank - 1];
+            indices[rank - 1] = 0;
+            for (int d = static_cast<int>(rank) - 2; d >= 0; --d)
+            {
+                indices[d]++;
+                for (size_t op = 0; op < N; op++)
+                    offs[op] += dim_strides[op][d];
+                if (indices[d] < dims[d])
+                    break;
+                indices[d] = 0;
+                for (size_t op = 0; op < N; op++)
+                    offs[op] -= dims[d] * dim_strides[op][d];
+            }
+        }
+    }
+
+    template <typename F>
+    void run(F &&row) const
+    {
+        run(0, total, std::forward<F>(row));
+    }
+
+    // Split the traversal into element ranges over the thread pool, row must be safe to call concurrently.
+    template <typename F>
+    void run_parallel(size_t grain, F &&row) const
+    {
+        parallel_for(0, total, grain, [&](size_t lo, size_t hi)
+                     { run(lo, hi, row); });
+    }
+
+private:
+    DimVec dims;
+    std::array<DimVec, N> dim_strides;
+    Offsets base;
+    Strides inner{};
+    size_t total = 1;
+};
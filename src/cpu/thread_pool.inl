@@ -0,0 +1,303 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+/**
+ * @brief Process wide work-stealing thread pool used by the CPU kernels to split their iteration space.
+ *
+ * parallel_for cuts [begin, end) into chunks and deals them round robin onto per worker deques. Each
+ * worker pops from the front of its own deque and, once that is empty, steals from the back of the
+ * others, so uneven chunks (e.g. rows of different cost, or threads descheduled by the OS) balance
+ * out. The calling thread takes part as worker 0 and returns once every chunk of its call is done.
+ *
+ * Ranges no larger than the grain run inline on the caller, as do parallel_for calls made from inside
+ * a pool task, so kernels can nest without deadlocking.
+ *
+ * The thread count defaults to the PHOTON_NUM_THREADS environment variable, falling back to the
+ * hardware concurrency, and can be changed with set_num_threads (not while kernels are running on
+ * other threads).
+ */
+class ThreadPool
+{
+public:
+    static ThreadPool &instance()
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    ~ThreadPool() { stop_workers(); }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Total threads used by parallel_for, including the calling thread
+    size_t num_threads() const { return n_threads.load(std::memory_order_relaxed); }
+
+    void set_num_threads(size_t n)
+    {
+        if (n == 0)
+            throw std::invalid_argument("Number of threads must be at least 1");
+        std::lock_guard<std::mutex> lock(config_mutex);
+        if (n == num_threads())
+            return;
+        stop_workers();
+        start_workers(n);
+    }
+
+    // True when called from a pool worker, or from a thread currently running pool tasks
+    static bool in_parallel_region() { return region_depth() > 0; }
+
+    /**
+     * @brief Run fn(lo, hi) over disjoint chunks covering [begin, end).
+     *
+     * @param grain Minimum chunk size, ranges this small (or any range when single threaded or nested)
+     * run as a single inline call.
+     */
+    template <typename F>
+    void parallel_for(size_t begin, size_t end, size_t grain, F &&fn)
+    {
+        if (begin >= end)
+            return;
+        grain = std::max<size_t>(grain, 1);
+        const size_t n = end - begin;
+        const size_t threads = num_threads();
+        if (threads == 1 || n <= grain || in_parallel_region())
+        {
+            fn(begin, end);
+            return;
+        }
+
+        // a few chunks per thread so stealing can even out imbalance, but never below the grain
+        const size_t max_chunks = (n + grain - 1) / grain;
+        const size_t n_chunks = std::min(max_chunks, threads * 4);
+        const size_t chunk = (n + n_chunks - 1) / n_chunks;
+
+        Job job;
+        job.ctx = &fn;
+        job.call = [](void *ctx, size_t lo, size_t hi)
+        { (*static_cast<std::remove_reference_t<F> *>(ctx))(lo, hi); };
+
+        std::vector<Task> tasks;
+        for (size_t lo = begin; lo < end; lo += chunk)
+            tasks.push_back({&job, lo, std::min(lo + chunk, end)});
+        job.remaining.store(tasks.size(), std::memory_order_relaxed);
+
+        // deal tasks over every queue, the caller's own share goes on queue 0
+        {
+            std::lock_guard<std::mutex> lock(config_mutex);
+            const size_t n_queues = queues.size();
+            for (size_t i = 0; i < tasks.size(); i++)
+            {
+                auto &q = *queues[i % n_queues];
+                std::lock_guard<std::mutex> qlock(q.mutex);
+                q.tasks.push_back(tasks[i]);
+            }
+            pending.fetch_add(tasks.size(), std::memory_order_release);
+        }
+        // taking the sleep mutex orders the notify after any worker's predicate check
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+        }
+        wake.notify_all();
+
+        // help out until every chunk of this job is done
+        {
+            RegionGuard guard;
+            while (job.remaining.load(std::memory_order_acquire) > 0)
+            {
+                Task task;
+                if (try_pop(0, task))
+                    execute(task);
+                else
+                    std::this_thread::yield();
+            }
+        }
+
+        if (job.error)
+            std::rethrow_exception(job.error);
+    }
+
+private:
+    struct Job
+    {
+        void *ctx = nullptr;
+        void (*call)(void *, size_t, size_t) = nullptr;
+        std::atomic<size_t> remaining{0};
+        std::mutex error_mutex;
+        std::exception_ptr error;
+    };
+
+    struct Task
+    {
+        Job *job = nullptr;
+        size_t lo = 0, hi = 0;
+    };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    struct RegionGuard
+    {
+        RegionGuard() { region_depth()++; }
+        ~RegionGuard() { region_depth()--; }
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> n_threads{1};
+    std::atomic<size_t> pending{0};
+    std::atomic<bool> stopping{false};
+    std::mutex config_mutex;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+
+    ThreadPool()
+    {
+        size_t n = std::max<unsigned>(std::thread::hardware_concurrency(), 1);
+        if (const char *env = std::getenv("PHOTON_NUM_THREADS"))
+        {
+            try
+            {
+                long requested = std::stol(env);
+                if (requested > 0)
+                    n = static_cast<size_t>(requested);
+            }
+            catch (const std::exception &)
+            {
+                // ignore malformed values, keep the hardware default
+            }
+        }
+        start_workers(n);
+    }
+
+    static int &region_depth()
+    {
+        thread_local int depth = 0;
+        return depth;
+    }
+
+    void start_workers(size_t n)
+    {
+        stopping.store(false);
+        queues.clear();
+        for (size_t i = 0; i < n; i++)
+            queues.push_back(std::make_unique<Queue>());
+        n_threads.store(n);
+        for (size_t i = 1; i < n; i++)
+            workers.emplace_back([this, i]
+                                 { worker_loop(i); });
+    }
+
+    void stop_workers()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping.store(true);
+        }
+        wake.notify_all();
+        for (auto &w : workers)
+            w.join();
+        workers.clear();
+    }
+
+    // Pop from the front of our own queue, else steal from the back of another one.
+    bool try_pop(size_t self, Task &out)
+    {
+        const size_t n_queues = queues.size();
+        for (size_t k = 0; k < n_queues; k++)
+        {
+            const size_t idx = (self + k) % n_queues;
+            auto &q = *queues[idx];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.tasks.empty())
+                continue;
+            if (k == 0)
+            {
+                out = q.tasks.front();
+                q.tasks.pop_front();
+            }
+            else
+            {
+                out = q.tasks.back();
+                q.tasks.pop_back();
+            }
+            pending.fetch_sub(1, std::memory_order_acq_rel);
+            return true;
+        }
+        return false;
+    }
+
+    static void execute(const Task &task)
+    {
+        Job &job = *task.job;
+        try
+        {
+            job.call(job.ctx, task.lo, task.hi);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(job.error_mutex);
+            if (!job.error)
+                job.error = std::current_exception();
+        }
+        job.remaining.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    void worker_loop(size_t self)
+    {
+        RegionGuard guard;
+        while (true)
+        {
+            Task task;
+            if (try_pop(self, task))
+            {
+                execute(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [this]
+                      { return stopping.load() || pending.load(std::memory_order_acquire) > 0; });
+            if (stopping.load())
+                return;
+        }
+    }
+};
+
+/*
+ * Kernel facing helpers
+ */
+
+// Elements per task for cheap elementwise kernels, below this a call stays single threaded.
+constexpr size_t kElementwiseGrain = size_t(1) << 15;
+
+inline size_t get_num_threads()
+{
+    return ThreadPool::instance().num_threads();
+}
+
+inline void set_num_threads(size_t n)
+{
+    ThreadPool::instance().set_num_threads(n);
+}
+
+template <typename F>
+void parallel_for(size_t begin, size_t end, size_t grain, F &&fn)
+{
+    ThreadPool::instance().parallel_for(begin, end, grain, std::forward<F>(fn));
+}
@@ -0,0 +1,244 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cpu_features.inl>
+#include <strided_loop.inl>
+#include <thread_pool.inl>
+
+/**
+ * Cache blocked transposes for copying permuted views, e.g. make_compact on transpose([0, 2, 1, 3]).
+ *
+ * A plain strided copy of a transposed matrix reads (or writes) one element per cache line and one
+ * line per TLB page once rows are a few KiB apart. Here the matrix is split recursively along its
+ * larger side until a tile fits in L1 (cache oblivious, no per cache size tuning), and tiles are
+ * moved through registers 8x8 (AVX2) or 4x4 (SSE) at a time, so every line that is loaded is used
+ * in full. The SIMD tiles only move bits, so they serve every 4 and 8 byte element type; other
+ * sizes take the scalar tile loop.
+ */
+
+namespace transpose_copy
+{
+    // Recursion stops once both sides are at most this long, 32x32 floats is 4 KiB per side
+    constexpr size_t kLeaf = 32;
+    // Permuted copies with a transposed side shorter than this are left to the strided loop
+    constexpr size_t kMinSide = 4;
+
+#if PHOTON_X86_DISPATCH
+    // dst[i * ld_dst + j] = src[j * ld_src + i] over rows x cols (multiples of 8) of 32 bit elements
+    __attribute__((target("avx2"))) inline void tiles_avx2_32(const void *src_v, size_t ld_src, void *dst_v,
+                                                              size_t ld_dst, size_t rows, size_t cols)
+    {
+        const float *src = static_cast<const float *>(src_v);
+        float *dst = static_cast<float *>(dst_v);
+        for (size_t j = 0; j < cols; j += 8)
+            for (size_t i = 0; i < rows; i += 8)
+            {
+                const float *s = src + j * ld_src + i;
+                float *d = dst + i * ld_dst + j;
+                __m256 r0 = _mm256_loadu_ps(s), r1 = _mm256_loadu_ps(s + ld_src);
+                __m256 r2 = _mm256_loadu_ps(s + 2 * ld_src), r3 = _mm256_loadu_ps(s + 3 * ld_src);
+                __m256 r4 = _mm256_loadu_ps(s + 4 * ld_src), r5 = _mm256_loadu_ps(s + 5 * ld_src);
+                __m256 r6 = _mm256_loadu_ps(s + 6 * ld_src), r7 = _mm256_loadu_ps(s + 7 * ld_src);
+
+                __m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpackhi_ps(r0, r1);
+                __m256 t2 = _mm256_unpacklo_ps(r2, r3), t3 = _mm256_unpackhi_ps(r2, r3);
+                __m256 t4 = _mm256_unpacklo_ps(r4, r5), t5 = _mm256_unpackhi_ps(r4, r5);
+                __m256 t6 = _mm256_unpacklo_ps(r6, r7), t7 = _mm256_unpackhi_ps(r6, r7);
+
+                r0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+                r1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+                r2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+                r3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+                r4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+                r5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+                r6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+                r7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+                _mm256_storeu_ps(d, _mm256_permute2f128_ps(r0, r4, 0x20));
+                _mm256_storeu_ps(d + ld_dst, _mm256_permute2f128_ps(r1, r5, 0x20));
+                _mm256_storeu_ps(d + 2 * ld_dst, _mm256_permute2f128_ps(r2, r6, 0x20));
+                _mm256_storeu_ps(d + 3 * ld_dst, _mm256_permute2f128_ps(r3, r7, 0x20));
+                _mm256_storeu_ps(d + 4 * ld_dst, _mm256_permute2f128_ps(r0, r4, 0x31));
+                _mm256_storeu_ps(d + 5 * ld_dst, _mm256_permute2f128_ps(r1, r5, 0x31));
+                _mm256_storeu_ps(d + 6 * ld_dst, _mm256_permute2f128_ps(r2, r6, 0x31));
+                _mm256_storeu_ps(d + 7 * ld_dst, _mm256_permute2f128_ps(r3, r7, 0x31));
+            }
+    }
+
+    // Same over multiples of 4 with 64 bit elements
+    __attribute__((target("avx2"))) inline void tiles_avx2_64(const void *src_v, size_t ld_src, void *dst_v,
+                                                              size_t ld_dst, size_t rows, size_t cols)
+    {
+        const double *src = static_cast<const double *>(src_v);
+        double *dst = static_cast<double *>(dst_v);
+        for (size_t j = 0; j < cols; j += 4)
+            for (size_t i = 0; i < rows; i += 4)
+            {
+                const double *s = src + j * ld_src + i;
+                double *d = dst + i * ld_dst + j;
+                const __m256d r0 = _mm256_loadu_pd(s), r1 = _mm256_loadu_pd(s + ld_src);
+                const __m256d r2 = _mm256_loadu_pd(s + 2 * ld_src), r3 = _mm256_loadu_pd(s + 3 * ld_src);
+                const __m256d t0 = _mm256_unpacklo_pd(r0, r1), t1 = _mm256_unpackhi_pd(r0, r1);
+                const __m256d t2 = _mm256_unpacklo_pd(r2, r3), t3 = _mm256_unpackhi_pd(r2, r3);
+                _mm256_storeu_pd(d, _mm256_permute2f128_pd(t0, t2, 0x20));
+                _mm256_storeu_pd(d + ld_dst, _mm256_permute2f128_pd(t1, t3, 0x20));
+                _mm256_storeu_pd(d + 2 * ld_dst, _mm256_permute2f128_pd(t0, t2, 0x31));
+                _mm256_storeu_pd(d + 3 * ld_dst, _mm256_permute2f128_pd(t1, t3, 0x31));
+            }
+    }
+
+    // 32 bit elements over multiples of 4 with SSE
+    inline void tiles_sse_32(const void *src_v, size_t ld_src, void *dst_v, size_t ld_dst, size_t rows, size_t cols)
+    {
+        const float *src = static_cast<const float *>(src_v);
+        float *dst = static_cast<float *>(dst_v);
+        for (size_t j = 0; j < cols; j += 4)
+            for (size_t i = 0; i < rows; i += 4)
+            {
+                const float *s = src + j * ld_src + i;
+                float *d = dst + i * ld_dst + j;
+                __m128 r0 = _mm_loadu_ps(s), r1 = _mm_loadu_ps(s + ld_src);
+                __m128 r2 = _mm_loadu_ps(s + 2 * ld_src), r3 = _mm_loadu_ps(s + 3 * ld_src);
+                _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+                _mm_storeu_ps(d, r0);
+                _mm_storeu_ps(d + ld_dst, r1);
+                _mm_storeu_ps(d + 2 * ld_dst, r2);
+                _mm_storeu_ps(d + 3 * ld_dst, r3);
+            }
+    }
+#endif
+
+    // One L1 sized tile: the SIMD kernel covers the whole tiles, the scalar loop the ragged edges
+    template <typename T>
+    inline void leaf(const T *src, size_t ld_src, T *dst, size_t ld_dst, size_t rows, size_t cols, CpuIsa isa)
+    {
+        size_t full_rows = 0, full_cols = 0;
+#if PHOTON_X86_DISPATCH
+        if constexpr (sizeof(T) == 4)
+        {
+            const size_t tile = isa >= CpuIsa::AVX2 ? 8 : 4;
+            full_rows = rows / tile * tile;
+            full_cols = cols / tile * tile;
+            if (isa >= CpuIsa::AVX2)
+                tiles_avx2_32(src, ld_src, dst, ld_dst, full_rows, full_cols);
+            else if (isa >= CpuIsa::SSE42)
+                tiles_sse_32(src, ld_src, dst, ld_dst, full_rows, full_cols);
+            else
+                full_rows = full_cols = 0;
+        }
+        else if constexpr (sizeof(T) == 8)
+        {
+            if (isa >= CpuIsa::AVX2)
+            {
+                full_rows = rows / 4 * 4;
+                full_cols = cols / 4 * 4;
+                tiles_avx2_64(src, ld_src, dst, ld_dst, full_rows, full_cols);
+            }
+        }
+#else
+        (void)isa;
+#endif
+        for (size_t i = 0; i < rows; i++)
+        {
+            // rows already done by the SIMD tiles only have their right edge left
+            const size_t j0 = i < full_rows ? full_cols : 0;
+            for (size_t j = j0; j < cols; j++)
+                dst[i * ld_dst + j] = src[j * ld_src + i];
+        }
+    }
+
+    /**
+     * @brief dst[i * ld_dst + j] = src[j * ld_src + i] for i < rows, j < cols, on the calling thread.
+     *
+     * Halves the longer side (at multiples of 8, so the SIMD tiles stay whole) until both fit in a
+     * leaf tile.
+     */
+    template <typename T>
+    inline void transpose(const T *src, size_t ld_src, T *dst, size_t ld_dst, size_t rows, size_t cols,
+                          CpuIsa isa = detect_isa())
+    {
+        while (rows > kLeaf || cols > kLeaf)
+        {
+            if (rows >= cols)
+            {
+                const size_t half = (rows / 2 + 7) & ~size_t(7);
+                transpose(src, ld_src, dst, ld_dst, half, cols, isa);
+                src += half;
+                dst += half * ld_dst;
+                rows -= half;
+            }
+            else
+            {
+                const size_t half = (cols / 2 + 7) & ~size_t(7);
+                transpose(src, ld_src, dst, ld_dst, rows, half, isa);
+                src += half * ld_src;
+                dst += half;
+                cols -= half;
+            }
+        }
+        leaf(src, ld_src, dst, ld_dst, rows, cols, isa);
+    }
+
+    /**
+     * @brief Copy a permuted view into its compact target with blocked transposes.
+     *
+     * Applies when, after the loop's dim coalescing, the source is not unit stride along the last
+     * dim but is along some outer dim p: every slice over (p, last) is then a transpose. Slices and
+     * strips of rows along p are spread over the thread pool. dst is the compact target, src points
+     * at the source view's first element. Returns false, copying nothing, for any other pattern.
+     */
+    template <typename T>
+    inline bool copy_permuted(const StridedLoop<2> &loop, T *dst, const T *src)
+    {
+        const DimVec &dims = loop.shape();
+        const DimVec &dst_strides = loop.strides(0), &src_strides = loop.strides(1);
+        const size_t rank = dims.size(), last = rank - 1;
+        if (rank < 2 || dst_strides[last] != 1 || src_strides[last] == 1)
+            return false;
+
+        size_t p = last;
+        for (size_t d = last; d-- > 0;)
+            if (src_strides[d] == 1)
+            {
+                p = d;
+                break;
+            }
+        if (p == last || dims[p] < kMinSide || dims[last] < kMinSide)
+            return false;
+
+        const size_t rows = dims[p], cols = dims[last];
+        const size_t ld_dst = dst_strides[p], ld_src = src_strides[last];
+        DimVec outer_dims, outer_dst, outer_src;
+        for (size_t d = 0; d < last; d++)
+            if (d != p)
+            {
+                outer_dims.push_back(dims[d]);
+                outer_dst.push_back(dst_strides[d]);
+                outer_src.push_back(src_strides[d]);
+            }
+
+        // strips of whole leaf rows sized to about one elementwise grain each
+        const size_t strip = std::min(rows, std::max(kLeaf, kElementwiseGrain / cols / kLeaf * kLeaf));
+        const size_t strips = (rows + strip - 1) / strip;
+        const size_t tasks = loop.size() / (rows * cols) * strips;
+        const size_t grain = std::max<size_t>(1, kElementwiseGrain / (strip * cols));
+        const CpuIsa isa = detect_isa();
+        parallel_for(0, tasks, grain, [&](size_t lo, size_t hi)
+                     {
+            for (size_t t = lo; t < hi; t++)
+            {
+                size_t slice = t / strips, dst_off = 0, src_off = 0;
+                for (size_t d = outer_dims.size(); d-- > 0;)
+                {
+                    const size_t idx = slice % outer_dims[d];
+                    slice /= outer_dims[d];
+                    dst_off += idx * outer_dst[d];
+                    src_off += idx * outer_src[d];
+                }
+                const size_t r0 = t % strips * strip, r1 = std::min(rows, r0 + strip);
+                transpose(src + src_off + r0, ld_src, dst + dst_off + r0 * ld_dst, ld_dst, r1 - r0, cols, isa);
+            } });
+        return true;
+    }
+}
@@ -2,87 +2,234 @@
 #include <numeric>   
 #include <functional> 
 #include <cmath>    
+#include <type_traits>
+#include <dtypes.inl>
+#include <profiler.inl>
+#include <strided_loop.inl>
+#include <simd_math.inl>
+
+template <typename T, typename Op>
+void unary_op_kernel(const NDArray<T> &a, NDArray<T> &out, Op op)
+{
+    check_out_shape(out, a.get_shape());
+    const NDArray<T> src_view = alias_safe_input(a, out);
+    const auto &shape = out.get_shape();
+
+    T *new_data = out.get_handle()->ptr();
+    const T *old_data = src_view.get_handle()->ptr();
+
+    StridedLoop<2> loop(shape, {out.get_strides(), src_view.get_strides()}, {out.get_offset(), src_view.get_offset()});
+    loop.run_parallel(kElementwiseGrain, [&](const auto &offs, size_t n, const auto &st)
+             {
+        T *dst = new_data + offs[0];
+        const T *src = old_data + offs[1];
+        if (st[0] == 1 && st[1] == 1)
+        {
+            for (size_t i = 0; i < n; i++)
+                dst[i] = op(src[i]);
+        }
+        else
+        {
+            for (std::ptrdiff_t i = 0; i < static_cast<std::ptrdiff_t>(n); i++)
+                dst[i * st[0]] = op(src[i * st[1]]);
+        } });
+}
 
 template <typename T, typename Op>
 NDArray<T> unary_op_kernel(const NDArray<T> &a, Op op)
 {
-    NDArray<T> target{a.get_shape()};
-    const auto &shape = target.get_shape();
-    const auto &strides = a.get_strides();
-    size_t total_size = std::accumulate(shape.begin(), shape.end(), 1ULL, std::multiplies<size_t>());
+    NDArray<T> target = NDArray<T>::empty(a.get_shape());
+    unary_op_kernel(a, target, op);
+    return target;
+}
 
-    T *new_data = target.get_handle()->ptr();
-    const T *old_data = a.get_handle()->ptr();
+/**
+ * Same walk as unary_op_kernel, but hands whole rows to an array kernel fn(src, dst, n) such as the
+ * simd_math ones. Strided source rows are first gathered into the output row (the kernels work in
+ * place), strided output rows go through a small stack buffer.
+ */
+template <typename T, typename RowFn>
+void unary_row_kernel(const NDArray<T> &a, NDArray<T> &out, RowFn fn)
+{
+    check_out_shape(out, a.get_shape());
+    const NDArray<T> src_view = alias_safe_input(a, out);
+    const auto &shape = out.get_shape();
 
-    size_t curr_idx = a.get_offset();
-    DimVec indices(shape.size(), 0);
-    for (size_t i = 0; i < total_size; i++)
-    {
-        new_data[i] = op(old_data[curr_idx]);
+    T *new_data = out.get_handle()->ptr();
+    const T *old_data = src_view.get_handle()->ptr();
 
-        for (int dim = static_cast<int>(shape.size()) - 1; dim >= 0; --dim)
+    StridedLoop<2> loop(shape, {out.get_strides(), src_view.get_strides()}, {out.get_offset(), src_view.get_offset()});
+    loop.run_parallel(kElementwiseGrain, [&](const auto &offs, size_t n, const auto &st)
+             {
+        T *dst = new_data + offs[0];
+        const T *src = old_data + offs[1];
+        if (st[0] == 1 && st[1] == 1)
         {
-            indices[dim]++;
-            curr_idx += strides[dim];
-
-            if (indices[dim] < shape[dim])
-            {
-                break;
-            }
-            else
+            fn(src, dst, n);
+        }
+        else if (st[0] == 1)
+        {
+            for (std::ptrdiff_t i = 0; i < static_cast<std::ptrdiff_t>(n); i++)
+                dst[i] = src[i * st[1]];
+            fn(dst, dst, n);
+        }
+        else
+        {
+            constexpr size_t chunk = 256;
+            T buf[chunk];
+            for (size_t lo = 0; lo < n; lo += chunk)
             {
-                indices[dim] = 0;
-                curr_idx -= shape[dim] * strides[dim];
+                const size_t m = std::min(chunk, n - lo);
+                for (size_t i = 0; i < m; i++)
+                    buf[i] = src[static_cast<std::ptrdiff_t>(lo + i) * st[1]];
+                fn(buf, buf, m);
+                for (size_t i = 0; i < m; i++)
+                    dst[static_cast<std::ptrdiff_t>(lo + i) * st[0]] = buf[i];
             }
-        }
-    }
+        } });
+}
+
+template <typename T, typename RowFn>
+NDArray<T> unary_row_kernel(const NDArray<T> &a, RowFn fn)
+{
+    NDArray<T> target = NDArray<T>::empty(a.get_shape());
+    unary_row_kernel(a, target, fn);
     return target;
 }
 
+// Row kernel fn on float applied to 16 bit rows, converted through a float buffer
+template <typename T, typename RowFn>
+auto widened_rows(RowFn fn)
+{
+    return [fn](const T *src, T *dst, size_t n)
+    {
+        constexpr size_t chunk = 256;
+        float buf[chunk];
+        for (size_t lo = 0; lo < n; lo += chunk)
+        {
+            const size_t m = std::min(chunk, n - lo);
+            for (size_t i = 0; i < m; i++)
+                buf[i] = src[lo + i];
+            fn(buf, buf, m);
+            for (size_t i = 0; i < m; i++)
+                dst[lo + i] = buf[i];
+        }
+    };
+}
+
+/*
+ * Every op is written once in its out= form, the allocating and in place forms forward to it.
+ */
+
+#define PHOTON_UNARY_FORWARDS(name)            \
+    template <typename T>                      \
+    NDArray<T> NDArray<T>::name() const        \
+    {                                          \
+        NDArray<T> target = empty(shape);      \
+        name(target);                          \
+        return target;                         \
+    }                                          \
+    template <typename T>                      \
+    NDArray<T> &NDArray<T>::name##_()          \
+    {                                          \
+        name(*this);                           \
+        return *this;                          \
+    }
+
 template <typename T>
-NDArray<T> NDArray<T>::neg() const
+void NDArray<T>::neg(NDArray<T> &out) const
 {
-    return unary_op_kernel(*this, [](T scalar)
-                           { return -scalar; });
+    profiler::Scope prof("neg", *this);
+    prof.output(out);
+    unary_op_kernel(*this, out, [](T scalar)
+                    { return -scalar; });
 }
+PHOTON_UNARY_FORWARDS(neg)
+
 template <typename T>
-NDArray<T> NDArray<T>::exp() const
+void NDArray<T>::exp(NDArray<T> &out) const
 {
-    return unary_op_kernel(*this, [](T scalar)
-                           { return std::exp(scalar); });
+    profiler::Scope prof("exp", *this);
+    prof.output(out);
+    require_floating<T>("exp");
+    if constexpr (std::is_same_v<T, float>)
+        return unary_row_kernel(*this, out, simd_math::kernels().exp);
+    if constexpr (is_half_precision_v<T>)
+        return unary_row_kernel(*this, out, widened_rows<T>(simd_math::kernels().exp));
+    unary_op_kernel(*this, out, [](T scalar)
+                    { return std::exp(scalar); });
 }
+PHOTON_UNARY_FORWARDS(exp)
 
 template <typename T>
-NDArray<T> NDArray<T>::log() const
+void NDArray<T>::log(NDArray<T> &out) const
 {
-    return unary_op_kernel(*this, [](T scalar)
-                           { return std::log(scalar); });
+    profiler::Scope prof("log", *this);
+    prof.output(out);
+    require_floating<T>("log");
+    if constexpr (std::is_same_v<T, float>)
+        return unary_row_kernel(*this, out, simd_math::kernels().log);
+    if constexpr (is_half_precision_v<T>)
+        return unary_row_kernel(*this, out, widened_rows<T>(simd_math::kernels().log));
+    unary_op_kernel(*this, out, [](T scalar)
+                    { return std::log(scalar); });
 }
+PHOTON_UNARY_FORWARDS(log)
 
 template <typename T>
-NDArray<T> NDArray<T>::sqrt() const
+void NDArray<T>::sqrt(NDArray<T> &out) const
 {
-    return unary_op_kernel(*this, [](T scalar)
-                           { return std::sqrt(scalar); });
+    profiler::Scope prof("sqrt", *this);
+    prof.output(out);
+    require_floating<T>("sqrt");
+    unary_op_kernel(*this, out, [](T scalar)
+                    { return std::sqrt(scalar); });
 }
+PHOTON_UNARY_FORWARDS(sqrt)
 
 template <typename T>
-NDArray<T> NDArray<T>::sin() const
+void NDArray<T>::sin(NDArray<T> &out) const
 {
-    return unary_op_kernel(*this, [](T scalar)
-                           { return std::sin(scalar); });
+    profiler::Scope prof("sin", *this);
+    prof.output(out);
+    require_floating<T>("sin");
+    if constexpr (std::is_same_v<T, float>)
+        return unary_row_kernel(*this, out, simd_math::kernels().sin);
+    if constexpr (is_half_precision_v<T>)
+        return unary_row_kernel(*this, out, widened_rows<T>(simd_math::kernels().sin));
+    unary_op_kernel(*this, out, [](T scalar)
+                    { return std::sin(scalar); });
 }
+PHOTON_UNARY_FORWARDS(sin)
 
 template <typename T>
-NDArray<T> NDArray<T>::cos() const
+void NDArray<T>::cos(NDArray<T> &out) const
 {
-    return unary_op_kernel(*this, [](T scalar)
-                           { return std::cos(scalar); });
+    profiler::Scope prof("cos", *this);
+    prof.output(out);
+    require_floating<T>("cos");
+    if constexpr (std::is_same_v<T, float>)
+        return unary_row_kernel(*this, out, simd_math::kernels().cos);
+    if constexpr (is_half_precision_v<T>)
+        return unary_row_kernel(*this, out, widened_rows<T>(simd_math::kernels().cos));
+    unary_op_kernel(*this, out, [](T scalar)
+                    { return std::cos(scalar); });
 }
+PHOTON_UNARY_FORWARDS(cos)
 
 template <typename T>
-NDArray<T> NDArray<T>::tanh() const
+void NDArray<T>::tanh(NDArray<T> &out) const
 {
-    return unary_op_kernel(*this, [](T scalar)
-                           { return std::tanh(scalar); });
+    profiler::Scope prof("tanh", *this);
+    prof.output(out);
+    require_floating<T>("tanh");
+    if constexpr (std::is_same_v<T, float>)
+        return unary_row_kernel(*this, out, simd_math::kernels().tanh);
+    if constexpr (is_half_precision_v<T>)
+        return unary_row_kernel(*this, out, widened_rows<T>(simd_math::kernels().tanh));
+    unary_op_kernel(*this, out, [](T scalar)
+                    { return std::tanh(scalar); });
 }
+PHOTON_UNARY_FORWARDS(tanh)
+
+#undef PHOTON_UNARY_FORWARDS
@@ -1,4 +1,6 @@
 
+import array
+import json
 import photon.backend_cpu as be
 import numpy as np
 import numpy.testing as npt
@@ -19,9 +21,379 @@ def test_stores_compact_array_correctly():
     arr = be.CompactArray(data)
     assert arr.data == data
 
+def test_allocator_reuses_freed_blocks():
+    be.trim_allocator_cache()
+    a = be.NDArray([1.0] * 1000, [10, 100])
+    (a + 1.0).exp()  # intermediates go back to the cache
+    before = be.allocator_stats()
+    assert before["bytes_cached"] > 0
+    b = a * 2.0
+    after = be.allocator_stats()
+    assert after["hits"] == before["hits"] + 1
+    npt.assert_allclose(np.array(b), np.full((10, 100), 2.0))
+
+    be.trim_allocator_cache()
+    assert be.allocator_stats()["bytes_cached"] == 0
+
+def test_system_allocator_roundtrip():
+    try:
+        be.set_allocator("system")
+        assert be.get_allocator() == "system"
+        a = be.NDArray([1.0, 2.0, 3.0, 4.0], [2, 2])
+        assert be.allocator_stats()["bytes_in_use"] >= 16
+        npt.assert_allclose(np.array(a @ a), [[7.0, 10.0], [15.0, 22.0]])
+        with pytest.raises(ValueError):
+            be.set_allocator_cache_limit(0)
+    finally:
+        be.set_allocator("caching")
+    with pytest.raises(ValueError):
+        be.set_allocator("arena")
+
+def test_memory_stats_count_live_arrays():
+    base = be.memory_stats()
+    a = be.NDArray([1.0] * 1000, [10, 100])
+    b = a * 2.0
+    stats = be.memory_stats()
+    assert stats["live_bytes"] == base["live_bytes"] + 8000
+    assert stats["live_allocations"] == base["live_allocations"] + 2
+    assert stats["allocations"] == base["allocations"] + 2
+    assert stats["peak_live_bytes"] >= stats["live_bytes"]
+    assert stats["bytes_cached"] == be.allocator_stats()["bytes_cached"]
+
+    # in place and out= ops allocate nothing, the allocating form exactly its result
+    count = be.memory_stats()["allocations"]
+    a.add_(b)
+    be.add(a, b, out=b)
+    a.exp(out=b)
+    assert be.memory_stats()["allocations"] == count
+    a + b
+    assert be.memory_stats()["allocations"] == count + 1
+
+    del b
+    assert be.memory_stats()["live_bytes"] == base["live_bytes"] + 4000
+    be.reset_peak_stats()
+    assert be.memory_stats()["peak_live_bytes"] == be.memory_stats()["live_bytes"]
+    assert be.allocator_stats()["peak_bytes_in_use"] == be.allocator_stats()["bytes_in_use"]
+
+def test_allocation_tagging_names_ops():
+    a = be.NDArray(np.ones((64, 32), dtype=np.float32))
+    try:
+        be.set_allocation_tagging(True)
+        c = a.transpose([1, 0]) @ a
+        big = a.reshape([32, 64]).astype("float64")
+        top = be.live_allocations(top=2)
+        assert [t["op"] for t in top] == ["astype", "matmul"]
+        assert top[0]["dtype"] == "float64" and top[0]["elements"] == 2048 and top[0]["bytes"] == 2048 * 8
+        assert "astype" in be.memory_summary(top=5)
+        del big
+        assert [t["op"] for t in be.live_allocations()] == ["matmul"]
+    finally:
+        be.set_allocation_tagging(False)
+    assert be.live_allocations() == []
+    assert "tagging is off" in be.memory_summary()
+
+def test_profile_records_ops(tmp_path):
+    a = be.NDArray(np.ones((64, 32), dtype=np.float32))
+    b = be.NDArray(np.ones((32, 16), dtype=np.float32))
+    a @ b  # outside the session, not recorded
+    with be.profile() as p:
+        c = a @ b
+        (c + 1.0).exp().sum([1])
+        a.transpose([1, 0]).reshape([2048])
+    ops = [e["op"] for e in p.events]
+    assert ops == ["matmul", "scalar_add", "exp", "sum", "make_compact"]
+
+    mm = p.events[0]
+    assert [i["shape"] for i in mm["inputs"]] == [[64, 32], [32, 16]]
+    assert mm["inputs"][0]["dtype"] == "float32"
+    assert mm["output_bytes"] == 64 * 16 * 4
+    assert p.events[-1]["inputs"][0]["strides"] == [1, 32]
+    assert all(e["duration_ns"] >= e["self_ns"] >= 0 and e["depth"] == 0 for e in p.events)
+
+    summary = p.summary(group_by_inputs=False)
+    assert sorted(s["op"] for s in summary) == sorted(ops)
+    assert "matmul" in p.table() and "float32[64, 32]" in p.table()
+
+    path = tmp_path / "trace.json"
+    p.export_chrome_trace(str(path))
+    trace = json.loads(path.read_text())["traceEvents"]
+    assert [t["name"] for t in trace] == ops
+    assert all(t["ph"] == "X" and t["dur"] >= 0 for t in trace)
+
+    # ops nested in other ops count towards the caller's total but not its self time
+    with be.profile() as p:
+        a.astype("bfloat16").sum([0])
+    outer = [e for e in p.events if e["depth"] == 0 and e["op"] == "sum"][0]
+    inner = [e for e in p.events if e["depth"] == 1]
+    assert inner and outer["self_ns"] <= outer["duration_ns"] - sum(e["duration_ns"] for e in inner)
+
+    with be.profile():
+        with pytest.raises(RuntimeError):
+            with be.profile():
+                pass
+
 
 # NDArray tests
 
+def test_wraps_numpy_without_copy():
+    x_np = np.arange(24, dtype=np.float32).reshape(4, 6)
+    view = be.NDArray(x_np[:, 1::2])
+    npt.assert_array_equal(np.array(view), x_np[:, 1::2])
+    x_np[0, 1] = -1.0
+    assert np.array(view)[0, 0] == -1.0
+    # writes go through to the numpy memory, which outlives the numpy name
+    view += 1.0
+    del x_np
+    npt.assert_array_equal(np.array(view)[0], [0.0, 4.0, 6.0])
+
+    src = np.arange(6, dtype=np.float32)[::-1]
+    copied = be.NDArray(src, copy=True)
+    src[0] = 100.0
+    npt.assert_array_equal(np.array(copied), np.arange(6)[::-1])
+    with pytest.raises(ValueError):
+        be.NDArray(src)
+    with pytest.raises(TypeError):
+        be.NDArray(np.zeros(3))
+
+    # the export is held while the array lives, so the source can't reallocate under it
+    buf = array.array("f", [1.0, 2.0, 3.0])
+    wrapped = be.NDArray(buf)
+    with pytest.raises(BufferError):
+        buf.append(4.0)
+    npt.assert_array_equal(np.array(wrapped), [1.0, 2.0, 3.0])
+    del wrapped
+    buf.append(4.0)
+
+
+def test_dtypes_and_astype():
+    x_np = np.linspace(-3, 3, 24, dtype=np.float32).reshape(4, 6)
+    x = be.NDArray(x_np)
+
+    ids = be.NDArrayInt64(np.array([[3, 1, 4], [1, 5, 9]], dtype=np.int64))
+    assert ids.dtype == "int64"
+    npt.assert_array_equal(np.array(ids.sum([1])), [8, 15])
+    npt.assert_array_equal(np.array(x.astype("int32")), x_np.astype(np.int32))
+    npt.assert_allclose(np.array(x.astype("float64") @ x.astype("float64").transpose([1, 0])), x_np @ x_np.T, rtol=1e-5)
+    with pytest.raises(ValueError):
+        ids.exp()
+
+    # integer division truncates and checks its divisors, scalars are never truncated to fit
+    npt.assert_array_equal(np.array(ids / 2), [[1, 0, 2], [0, 2, 4]])
+    npt.assert_array_equal(np.array(ids + 2.0), [[5, 3, 6], [3, 7, 11]])
+    with pytest.raises(ValueError):
+        ids / 0
+    with pytest.raises(ValueError):
+        ids / be.NDArrayInt64(np.array([1, 0, 1], dtype=np.int64))
+    with pytest.raises(ValueError):
+        ids / 0.5
+    with pytest.raises(ValueError):
+        ids + 2.7
+    with pytest.raises(ValueError):
+        be.NDArrayUInt8(np.zeros(3, dtype=np.uint8)) + 256
+
+    # 16 bit storage rounds each element, reductions and matmul accumulate in float
+    for name, eps in (("bfloat16", 2**-8), ("float16", 2**-11)):
+        h = x.astype(name)
+        assert h.dtype == name
+        npt.assert_allclose(np.array(h.astype("float32")), x_np, rtol=eps, atol=1e-7)
+        npt.assert_allclose(np.array((h @ h.transpose([1, 0])).astype("float32")), x_np @ x_np.T, rtol=8 * eps, atol=8 * eps)
+        npt.assert_allclose(np.array(h.sum([0, 1]).astype("float32")), [x_np.sum()], atol=1e-2)
+    npt.assert_array_equal(np.array(be.NDArrayFloat16(x_np.astype(np.float16))), x_np.astype(np.float16))
+    with pytest.raises(ValueError):
+        x.astype("complex64")
+
+
+def test_int8_qmatmul_against_float_matmul():
+    rng = np.random.default_rng(0)
+    x_np = rng.standard_normal((3, 37, 300), dtype=np.float32)
+    w_np = rng.standard_normal((300, 70), dtype=np.float32)
+    b_np = rng.standard_normal(70, dtype=np.float32)
+    ref = x_np @ w_np + b_np
+
+    # per output channel scales, dequantization is off by at most half a step
+    w_q, w_s = be.quantize_per_channel(be.NDArray(w_np), axis=1)
+    assert w_q.dtype == "int8"
+    npt.assert_allclose(np.array(w_s), np.abs(w_np).max(axis=0) / 127, rtol=1e-6)
+    assert np.all(np.abs(np.array(be.dequantize(w_q, w_s, axis=1)) - w_np) <= 0.5 * np.array(w_s) + 1e-7)
+
+    def rel_err(a, b):
+        return np.linalg.norm(np.array(a) - b) / np.linalg.norm(b)
+
+    out = be.qmatmul(be.NDArray(x_np), w_q, w_s, bias=be.NDArray(b_np))
+    assert rel_err(out, ref) < 0.02
+
+    # int8 activations with per row scales, float or requantized int8 output
+    x_q, x_s = be.quantize_per_channel(be.NDArray(x_np.reshape(-1, 300)), axis=0)
+    out_f = np.array(be.qmatmul(x_q, w_q, w_s, x_scales=x_s, bias=be.NDArray(b_np)))
+    exact = np.array(x_q).astype(np.float64) @ np.array(w_q) * np.array(x_s)[:, None] * np.array(w_s) + b_np
+    npt.assert_allclose(out_f, exact, rtol=1e-5, atol=1e-4)
+    out_q = be.qmatmul(x_q, w_q, w_s, x_scales=x_s, bias=be.NDArray(b_np), out_scale=0.25)
+    assert out_q.dtype == "int8"
+    assert np.abs(np.array(out_q) - np.clip(np.round(out_f / 0.25), -127, 127)).max() <= 1
+
+    with pytest.raises(ValueError):
+        be.qmatmul(be.NDArray(x_np), w_q, be.NDArray(np.ones(3, dtype=np.float32)))
+
+
+def conv2d_reference(x, w, b, stride, padding, dilation, groups):
+    # NCHW direct convolution in float64, one strided window slice per kernel tap
+    n, c, h, wd = x.shape
+    k, cg, kh, kw = w.shape
+    (sh, sw), (ph, pw), (dh, dw) = stride, padding, dilation
+    xp = np.pad(x.astype(np.float64), ((0, 0), (0, 0), (ph, ph), (pw, pw)))
+    oh = (h + 2 * ph - dh * (kh - 1) - 1) // sh + 1
+    ow = (wd + 2 * pw - dw * (kw - 1) - 1) // sw + 1
+    out = np.zeros((n, k, oh, ow)) + b[None, :, None, None]
+    kg = k // groups
+    for g in range(groups):
+        xg = xp[:, g * cg:(g + 1) * cg]
+        wg = w[g * kg:(g + 1) * kg]
+        for i in range(kh):
+            for j in range(kw):
+                win = xg[:, :, i * dh:i * dh + sh * (oh - 1) + 1:sh, j * dw:j * dw + sw * (ow - 1) + 1:sw]
+                out[:, g * kg:(g + 1) * kg] += np.einsum("nchw,kc->nkhw", win, wg[:, :, i, j])
+    return out
+
+
+@pytest.mark.parametrize("x_shape, w_shape, stride, padding, dilation, groups", [
+    ((2, 3, 9, 11), (4, 3, 3, 3), (1, 1), (1, 1), (1, 1), 1),
+    ((1, 4, 10, 8), (6, 2, 3, 2), (2, 1), (0, 1), (1, 2), 2),
+    ((2, 5, 6, 6), (7, 5, 1, 1), (1, 1), (0, 0), (1, 1), 1),
+    ((2, 8, 7, 9), (8, 1, 3, 3), (2, 2), (1, 1), (1, 1), 8),
+    ((1, 64, 40, 200), (8, 64, 3, 3), (1, 1), (1, 1), (1, 1), 1),
+])
+@pytest.mark.parametrize("layout", ["NCHW", "NHWC"])
+def test_conv2d_forward_and_gradients(x_shape, w_shape, stride, padding, dilation, groups, layout):
+    rng = np.random.default_rng(0)
+    x = rng.standard_normal(x_shape, dtype=np.float32)
+    w = rng.standard_normal(w_shape, dtype=np.float32)
+    b = rng.standard_normal(w_shape[0], dtype=np.float32)
+    ref = conv2d_reference(x, w, b, stride, padding, dilation, groups)
+    args = dict(stride=stride, padding=padding, dilation=dilation, groups=groups, layout=layout)
+
+    # NHWC arrays are the NCHW ones transposed, the weights keep their layout
+    to_layout = (lambda a: np.ascontiguousarray(a.transpose(0, 2, 3, 1))) if layout == "NHWC" else (lambda a: a)
+    x_l = to_layout(x)
+    out = np.array(be.conv2d(be.NDArray(x_l), be.NDArray(w), bias=be.NDArray(b), **args))
+    npt.assert_allclose(out, to_layout(ref), rtol=1e-4, atol=1e-4)
+
+    # gradients are the adjoints of the forward pass: <conv(x, w), g> = <x, dx(g)> = <w, dw(g)>
+    g = rng.standard_normal(out.shape, dtype=np.float32)
+    dx = np.array(be.conv2d_backward_input(be.NDArray(g), be.NDArray(w), list(x_l.shape), **args))
+    dw = np.array(be.conv2d_backward_weight(be.NDArray(g), be.NDArray(x_l), list(w.shape), **args))
+    assert dx.shape == x_l.shape and dw.shape == w.shape
+    inner = np.sum((out - to_layout(np.broadcast_to(b[None, :, None, None], ref.shape))) * g, dtype=np.float64)
+    npt.assert_allclose(np.sum(x_l * dx, dtype=np.float64), inner, rtol=1e-4)
+    npt.assert_allclose(np.sum(w * dw, dtype=np.float64), inner, rtol=1e-4)
+
+
+def test_conv1d_matches_conv2d_and_validates():
+    rng = np.random.default_rng(1)
+    x = rng.standard_normal((2, 4, 17), dtype=np.float32)
+    w = rng.standard_normal((6, 2, 3), dtype=np.float32)
+    out = np.array(be.conv1d(be.NDArray(x), be.NDArray(w), stride=2, padding=1, dilation=2, groups=2))
+    ref = conv2d_reference(x[:, :, None], w[:, :, None], np.zeros(6), (1, 2), (0, 1), (1, 2), 2)[:, :, 0]
+    npt.assert_allclose(out, ref, rtol=1e-4, atol=1e-4)
+    out_nlc = be.conv1d(be.NDArray(np.ascontiguousarray(x.transpose(0, 2, 1))), be.NDArray(w), stride=2, padding=1,
+                        dilation=2, groups=2, layout="NLC")
+    npt.assert_allclose(np.array(out_nlc), ref.transpose(0, 2, 1), rtol=1e-4, atol=1e-4)
+
+    with pytest.raises(ValueError):
+        be.conv2d(be.NDArray(np.ones((1, 3, 4, 4), dtype=np.float32)), be.NDArray(np.ones((2, 2, 3, 3), dtype=np.float32)))
+    with pytest.raises(ValueError):
+        be.conv2d(be.NDArray(np.ones((1, 1, 2, 2), dtype=np.float32)), be.NDArray(np.ones((1, 1, 3, 3), dtype=np.float32)))
+    with pytest.raises(ValueError):
+        be.conv1d(be.NDArray(x), be.NDArray(w), groups=2, layout="NHWC")
+
+
+def pool2d_reference(x, k, s, p, ceil_mode, count_include_pad):
+    # NCHW max and average pooling in float64, window by window
+    n, c, h, w = x.shape
+
+    def out_size(size):
+        span = size + 2 * p - k
+        out = (-(-span // s) if ceil_mode else span // s) + 1
+        return out - 1 if ceil_mode and (out - 1) * s >= size + p else out
+
+    oh, ow = out_size(h), out_size(w)
+    mx = np.empty((n, c, oh, ow))
+    idx = np.empty((n, c, oh, ow), dtype=np.int64)
+    avg = np.empty((n, c, oh, ow))
+    for i in range(oh):
+        for j in range(ow):
+            h0, w0 = i * s - p, j * s - p
+            h1, w1 = min(h0 + k, h + p), min(w0 + k, w + p)
+            win = x[:, :, max(h0, 0):min(h1, h), max(w0, 0):min(w1, w)].reshape(n, c, -1)
+            flat = win.argmax(axis=2)
+            mx[:, :, i, j] = win.max(axis=2)
+            ww = min(w1, w) - max(w0, 0)
+            idx[:, :, i, j] = (max(h0, 0) + flat // ww) * w + max(w0, 0) + flat % ww
+            count = (h1 - h0) * (w1 - w0) if count_include_pad else win.shape[2]
+            avg[:, :, i, j] = win.sum(axis=2, dtype=np.float64) / count
+    return mx, idx, avg
+
+
+@pytest.mark.parametrize("shape, k, s, p, ceil_mode", [
+    ((2, 3, 9, 11), 3, 2, 1, False),
+    ((2, 3, 9, 11), 3, 2, 1, True),
+    ((1, 70, 8, 8), 2, 2, 0, False),
+    ((2, 5, 7, 6), 3, 1, 1, True),
+])
+@pytest.mark.parametrize("layout", ["NCHW", "NHWC"])
+def test_pool2d_forward_and_backward(shape, k, s, p, ceil_mode, layout):
+    rng = np.random.default_rng(0)
+    x = rng.standard_normal(shape, dtype=np.float32)
+    to_layout = (lambda a: np.ascontiguousarray(a.transpose(0, 2, 3, 1))) if layout == "NHWC" else (lambda a: a)
+    x_l = be.NDArray(to_layout(x))
+    args = dict(stride=s, padding=p, ceil_mode=ceil_mode, layout=layout)
+
+    for include_pad in (True, False):
+        mx, idx, avg = pool2d_reference(x, k, s, p, ceil_mode, include_pad)
+        out = be.avg_pool2d(x_l, k, count_include_pad=include_pad, **args)
+        npt.assert_allclose(np.array(out), to_layout(avg), rtol=1e-5, atol=1e-6)
+        # the average's gradient is its adjoint
+        g = rng.standard_normal(out.shape, dtype=np.float32)
+        dx = np.array(be.avg_pool2d_backward(be.NDArray(g), list(x_l.shape), k, count_include_pad=include_pad, **args))
+        npt.assert_allclose(np.sum(to_layout(x) * dx, dtype=np.float64), np.sum(np.array(out) * g, dtype=np.float64), rtol=1e-4)
+
+    out, indices = be.max_pool2d(x_l, k, return_indices=True, **args)
+    npt.assert_array_equal(np.array(out), to_layout(mx))
+    npt.assert_array_equal(np.array(indices), to_layout(idx))
+    npt.assert_array_equal(np.array(be.max_pool2d(x_l, k, **args)), to_layout(mx))
+
+    # backward scatters the gradient to the recorded positions
+    g = rng.standard_normal(idx.shape, dtype=np.float32)
+    ref = np.zeros(x.shape)
+    nn, cc = np.meshgrid(np.arange(shape[0]), np.arange(shape[1]), indexing="ij")
+    for i in range(idx.shape[2]):
+        for j in range(idx.shape[3]):
+            np.add.at(ref, (nn, cc, idx[:, :, i, j] // shape[3], idx[:, :, i, j] % shape[3]), g[:, :, i, j])
+    dx = be.max_pool2d_backward(be.NDArray(to_layout(g)), indices, list(x_l.shape), layout=layout)
+    npt.assert_allclose(np.array(dx), to_layout(ref), rtol=1e-6, atol=1e-6)
+
+
+@pytest.mark.parametrize("layout", ["NCHW", "NHWC"])
+def test_adaptive_avg_pool2d(layout):
+    rng = np.random.default_rng(2)
+    x = rng.standard_normal((2, 5, 7, 10), dtype=np.float32)
+    to_layout = (lambda a: np.ascontiguousarray(a.transpose(0, 2, 3, 1))) if layout == "NHWC" else (lambda a: a)
+    for oh, ow in [(1, 1), (3, 4), (7, 10), (9, 12)]:
+        ref = np.empty((2, 5, oh, ow))
+        for i in range(oh):
+            for j in range(ow):
+                h0, h1 = i * 7 // oh, -(-(i + 1) * 7 // oh)
+                w0, w1 = j * 10 // ow, -(-(j + 1) * 10 // ow)
+                ref[:, :, i, j] = x[:, :, h0:h1, w0:w1].mean(axis=(2, 3))
+        out = be.adaptive_avg_pool2d(be.NDArray(to_layout(x)), (oh, ow), layout=layout)
+        npt.assert_allclose(np.array(out), to_layout(ref), rtol=1e-5, atol=1e-6)
+        g = rng.standard_normal(out.shape, dtype=np.float32)
+        dx = np.array(be.adaptive_avg_pool2d_backward(be.NDArray(g), list(to_layout(x).shape), layout=layout))
+        npt.assert_allclose(np.sum(to_layout(x) * dx, dtype=np.float64), np.sum(np.array(out) * g, dtype=np.float64), rtol=1e-4)
+
+    with pytest.raises(ValueError):
+        be.max_pool2d(be.NDArray(x), 2, padding=2)
+
+
 def test_creates_2d_array():
     # Setup ndarray object 
     data = [1.0,2.0,3.0,4.0]
@@ -33,6 +405,12 @@ def test_creates_2d_array():
     
     npt.assert_allclose(actual, expected)
 
+def test_empty_array_is_writable():
+    arr = be.NDArray.empty([3, 4])
+    assert np.array(arr).shape == (3, 4)
+    arr[:, :] = 2.0
+    npt.assert_allclose(np.array(arr + 1.0), np.full((3, 4), 3.0))
+
 SHAPE_CASES = [
     ([6], [2,3]),
     ([2,3], [6]),
@@ -94,6 +472,28 @@ def test_compaction_after_transpose():
 
     npt.assert_allclose(np.array(compacted), expected)
 
+PERMUTED_COMPACT_CASES = [
+    ((67, 45), (1, 0), None),
+    ((3, 40, 33), (0, 2, 1), None),
+    ((2, 9, 16, 24), (0, 2, 3, 1), None),  # NCHW -> NHWC
+    ((2, 5, 30, 8), (0, 1, 3, 2), (slice(None), slice(1, 4), slice(2, 29), slice(None))),
+    ((50, 70), (1, 0), (slice(3, 41), slice(5, 66))),
+]
+
+
+@pytest.mark.parametrize("shape, axes, index", PERMUTED_COMPACT_CASES)
+@pytest.mark.parametrize("cls, dtype", [(be.NDArray, np.float32), (be.NDArrayFloat64, np.float64), (be.NDArrayUInt8, np.uint8)])
+def test_make_compact_permuted_views(shape, axes, index, cls, dtype):
+    # transposed views are copied with blocked transposes, including ragged edges and offsets
+    x_np = (np.arange(np.prod(shape)) % 251).astype(dtype).reshape(shape)
+    view = cls(x_np).transpose(list(axes))
+    expected = x_np.transpose(axes)
+    if index is not None:
+        view = view[index]
+        expected = expected[index]
+    npt.assert_array_equal(np.array(view.make_compact()), expected)
+
+
 def test_reshape_after_transpose():
 
     data = [1.0, 2.0, 3.0, 4.0, 5.0, 6.0]
@@ -241,3 +641,460 @@ def test_matmul(mat_a_shape, mat_b_shape):
     expected = np.array(a_data).reshape(mat_a_shape) @ np.array(b_data).reshape(mat_b_shape)
 
     npt.assert_allclose(np.array(result),expected)
+
+
+STRIDED_EWISE_CASES = [
+    # contiguous, transposed, broadcast and sliced operands
+    (lambda x: x, lambda y: y),
+    (lambda x: x.transpose([1, 0, 2]), lambda y: y.transpose([1, 0, 2])),
+    (lambda x: x, lambda y: y[:, 0:1, :]),
+    (lambda x: x[:, ::2, :], lambda y: y[:, 1::2, :]),
+    (lambda x: x[1], lambda y: y[0, 2, :]),
+]
+
+@pytest.mark.parametrize("view_a, view_b", STRIDED_EWISE_CASES)
+def test_ewise_ops_on_strided_views(view_a, view_b):
+    a_np = np.arange(2 * 4 * 3, dtype=np.float32).reshape(2, 4, 3)
+    b_np = np.arange(2 * 4 * 3, dtype=np.float32).reshape(2, 4, 3) * 0.5 + 1
+
+    a = view_a(be.NDArray(a_np.flatten().tolist(), [2, 4, 3]))
+    b = view_b(be.NDArray(b_np.flatten().tolist(), [2, 4, 3]))
+    a_exp, b_exp = view_a(a_np), view_b(b_np)
+
+    npt.assert_allclose(np.array(a + b), a_exp + b_exp)
+    npt.assert_allclose(np.array(a * b), a_exp * b_exp)
+    npt.assert_allclose(np.array(a - 2.0), a_exp - 2.0)
+    npt.assert_allclose(np.array(a.exp()), np.exp(a_exp), rtol=1e-6)
+    npt.assert_allclose(np.array(a.make_compact()), a_exp)
+    npt.assert_allclose(np.array(a.sum([0])), a_exp.sum(axis=0), rtol=1e-6)
+
+
+REDUCTION_LAYOUT_CASES = [
+    # (shape, transpose axes, reduced axes) covering the inner/outer/full strategies and views
+    ([300, 500], [0, 1], [1]),
+    ([300, 500], [0, 1], [0]),
+    ([300, 500], [1, 0], [0, 1]),
+    ([6, 40, 7, 30], [2, 0, 3, 1], [0, 2]),
+    ([6, 40, 7, 30], [0, 1, 2, 3], [1, 3]),
+    ([5, 1, 3], [0, 1, 2], [1]),
+]
+
+@pytest.mark.parametrize("shape, perm, axes", REDUCTION_LAYOUT_CASES)
+def test_reductions_over_layouts(shape, perm, axes):
+    rng = np.random.default_rng(7)
+    a_np = rng.standard_normal(shape).astype(np.float32)
+    a = be.NDArray(a_np.flatten().tolist(), shape).transpose(perm)
+    a_exp = a_np.transpose(perm)
+
+    original = be.get_num_threads()
+    try:
+        results = []
+        for threads in (1, 3):
+            be.set_num_threads(threads)
+            results.append([np.array(a.sum(axes)), np.array(a.max(axes)), np.array(a.min(axes))])
+    finally:
+        be.set_num_threads(original)
+
+    # the summation order doesn't depend on the thread count
+    for x, y in zip(results[0], results[1]):
+        npt.assert_array_equal(x, y)
+    ax = tuple(axes)
+    npt.assert_allclose(results[0][0], a_exp.astype(np.float64).sum(axis=ax), rtol=1e-5, atol=1e-4)
+    npt.assert_array_equal(results[0][1], a_exp.max(axis=ax))
+    npt.assert_array_equal(results[0][2], a_exp.min(axis=ax))
+
+def test_sum_is_accurate_on_long_axes():
+    # a naive float accumulator stops growing at 2**24
+    n = (1 << 24) + 4096
+    a = be.NDArray([1.0] * n, [n])
+    assert np.array(a.sum([0]))[0] == n
+
+    with pytest.raises(ValueError):
+        a.sum([1])
+
+
+@pytest.mark.parametrize("perm, axis", [([0, 1, 2], -1), ([0, 1, 2], 1), ([2, 0, 1], 0), ([1, 2, 0], 2)])
+def test_softmax_family(perm, axis):
+    rng = np.random.default_rng(8)
+    x_np = (rng.standard_normal((4, 300, 6)) * 30).astype(np.float32)
+    x = be.NDArray(x_np.flatten().tolist(), [4, 300, 6]).transpose(perm)
+    x_exp = x_np.transpose(perm).astype(np.float64)
+
+    m = x_exp.max(axis=axis, keepdims=True)
+    lse = m + np.log(np.exp(x_exp - m).sum(axis=axis, keepdims=True))
+    npt.assert_allclose(np.array(x.softmax(axis)), np.exp(x_exp - lse), rtol=1e-5, atol=1e-7)
+    npt.assert_allclose(np.array(x.log_softmax(axis=axis)), x_exp - lse, rtol=1e-5, atol=1e-4)
+    ax = axis % 3
+    npt.assert_allclose(np.array(x.logsumexp([ax], keepdims=True)), lse, rtol=1e-6)
+    npt.assert_allclose(np.array(x.logsumexp([0, 2])), np.log(np.exp(x_exp - x_exp.max()).sum(axis=(0, 2))) + x_exp.max(), rtol=1e-5)
+
+def test_softmax_extreme_values():
+    x = be.NDArray([1e30, 1e30, -np.inf, 0.0], [2, 2])
+    npt.assert_allclose(np.array(x.softmax()), [[0.5, 0.5], [0.0, 1.0]])
+    npt.assert_allclose(np.array(x.logsumexp([1])), [1e30, 0.0])
+    with pytest.raises(ValueError):
+        x.softmax(2)
+
+
+@pytest.mark.parametrize("shape, perm, axes", REDUCTION_LAYOUT_CASES)
+def test_moments_over_layouts(shape, perm, axes):
+    rng = np.random.default_rng(0)
+    # a large mean over a unit spread, where sum(x^2) - n * mean^2 loses every digit
+    x_np = (1e4 + rng.standard_normal(shape)).astype(np.float32)
+    x = be.NDArray(x_np.flatten().tolist(), shape).transpose(list(perm))
+    ref = x_np.astype(np.float64).transpose(perm)
+
+    mean, var = x.mean_var(axes, correction=1, keepdims=True)
+    npt.assert_allclose(np.array(mean), ref.mean(axis=tuple(axes), keepdims=True), rtol=1e-6)
+    npt.assert_allclose(np.array(var), ref.var(axis=tuple(axes), ddof=1, keepdims=True), rtol=1e-4)
+    # a full reduction gives shape (1,) rather than numpy's scalar
+    npt.assert_allclose(np.array(x.mean(axes)).ravel(), ref.mean(axis=tuple(axes)).ravel(), rtol=1e-6)
+    npt.assert_allclose(np.array(x.std(axes)).ravel(), ref.std(axis=tuple(axes)).ravel(), rtol=1e-4)
+
+
+@pytest.mark.parametrize("perm", [(0, 1, 2), (2, 0, 1)])
+@pytest.mark.parametrize("axis", [0, 1, -1])
+def test_argmax_argmin_topk(perm, axis):
+    rng = np.random.default_rng(0)
+    # small integers so there are plenty of ties
+    x_np = rng.integers(-20, 20, size=(5, 6, 1100)).astype(np.float32)
+    x = be.NDArray(x_np.flatten().tolist(), [5, 6, 1100]).transpose(list(perm))
+    ref = x_np.transpose(perm)
+
+    npt.assert_array_equal(np.array(x.argmax(axis)), ref.argmax(axis))
+    npt.assert_array_equal(np.array(x.argmin(axis, keepdims=True)), np.expand_dims(ref.argmin(axis), axis))
+
+    # stable sort puts equal values in index order, as topk does
+    order = np.argsort(-ref, axis=axis, kind="stable")
+    values, indices = x.topk(4, axis)
+    npt.assert_array_equal(np.array(indices), np.take(order, range(4), axis=axis))
+    npt.assert_array_equal(np.array(values), np.take_along_axis(ref, np.array(indices), axis=axis))
+
+    values, indices = x.topk(3, axis, largest=False, sorted=False)
+    smallest = np.sort(np.take(np.argsort(ref, axis=axis, kind="stable"), range(3), axis=axis), axis=axis)
+    npt.assert_array_equal(np.array(indices), smallest)
+    with pytest.raises(ValueError):
+        x.topk(ref.shape[axis] + 1, axis)
+
+
+# Shapes that cross the gemm micro/macro tile edges and the K blocking
+BLOCKED_MATMUL_CASES = [
+    ([70, 130], [130, 45]),
+    ([13, 300], [300, 33]),
+    ([3, 40, 33], [33, 50]),
+    ([1, 600], [600, 1]),
+]
+
+@pytest.mark.parametrize("mat_a_shape, mat_b_shape", BLOCKED_MATMUL_CASES)
+def test_matmul_blocked_shapes(mat_a_shape, mat_b_shape):
+    rng = np.random.default_rng(0)
+    a_np = rng.standard_normal(mat_a_shape).astype(np.float32)
+    b_np = rng.standard_normal(mat_b_shape).astype(np.float32)
+
+    a = be.NDArray(a_np.flatten().tolist(), mat_a_shape)
+    b = be.NDArray(b_np.flatten().tolist(), mat_b_shape)
+
+    npt.assert_allclose(np.array(a @ b), a_np @ b_np, rtol=1e-4, atol=1e-4)
+
+
+def test_num_threads_roundtrip():
+    original = be.get_num_threads()
+    try:
+        be.set_num_threads(3)
+        assert be.get_num_threads() == 3
+    finally:
+        be.set_num_threads(original)
+
+
+@pytest.mark.parametrize("threads", [1, 2, 4])
+def test_kernels_match_across_thread_counts(threads):
+    original = be.get_num_threads()
+    rng = np.random.default_rng(1)
+    a_np = rng.standard_normal((256, 300)).astype(np.float32)
+    b_np = rng.standard_normal((300, 200)).astype(np.float32)
+    try:
+        be.set_num_threads(threads)
+        a = be.NDArray(a_np.flatten().tolist(), [256, 300])
+        b = be.NDArray(b_np.flatten().tolist(), [300, 200])
+
+        npt.assert_allclose(np.array(a.transpose([1, 0]).make_compact()), a_np.T)
+        npt.assert_allclose(np.array((a * 2.0).exp()), np.exp(a_np * 2.0), rtol=1e-5)
+        npt.assert_allclose(np.array(a.sum([1])), a_np.sum(axis=1), rtol=1e-4, atol=1e-4)
+        npt.assert_allclose(np.array(a @ b), a_np @ b_np, rtol=1e-4, atol=1e-4)
+    finally:
+        be.set_num_threads(original)
+
+
+BATCHED_MATMUL_CASES = [
+    ([16, 4, 32, 16], [16, 4, 16, 32]),   # many small attention style matrices
+    ([2, 200, 96], [2, 96, 150]),         # few large matrices
+    ([3, 1, 40, 24], [1, 5, 24, 50]),     # broadcast batch dims
+]
+
+@pytest.mark.parametrize("mat_a_shape, mat_b_shape", BATCHED_MATMUL_CASES)
+def test_batched_matmul_bit_identical_across_threads(mat_a_shape, mat_b_shape):
+    rng = np.random.default_rng(2)
+    a_np = rng.standard_normal(mat_a_shape).astype(np.float32)
+    b_np = rng.standard_normal(mat_b_shape).astype(np.float32)
+    a = be.NDArray(a_np.flatten().tolist(), mat_a_shape)
+    b = be.NDArray(b_np.flatten().tolist(), mat_b_shape)
+
+    original = be.get_num_threads()
+    try:
+        be.set_num_threads(1)
+        serial = np.array(a @ b)
+        for threads in [2, 5, 8]:
+            be.set_num_threads(threads)
+            assert np.array_equal(np.array(a @ b), serial)
+    finally:
+        be.set_num_threads(original)
+
+    npt.assert_allclose(serial, a_np @ b_np, rtol=1e-4, atol=1e-4)
+
+
+@pytest.mark.parametrize("cls, dtype", [(be.NDArray, np.float32), (be.NDArrayFloat64, np.float64), (be.NDArrayInt32, np.int32)])
+def test_matmul_strided_operands(cls, dtype):
+    # transposed, sliced and broadcast operands are read in place, results match numpy
+    rng = np.random.default_rng(3)
+    def arr(*shape):
+        return rng.integers(-4, 5, size=shape).astype(dtype)
+
+    x, w = arr(37, 300), arr(70, 300)
+    npt.assert_array_equal(np.array(cls(x) @ cls(w).transpose([1, 0])), x @ w.T)
+    a = arr(300, 37)
+    npt.assert_array_equal(np.array(cls(a).transpose([1, 0]) @ cls(w).transpose([1, 0])), a.T @ w.T)
+    q, k = arr(2, 4, 33, 16), arr(2, 4, 45, 16)
+    npt.assert_array_equal(np.array(cls(q) @ cls(k).transpose([0, 1, 3, 2])), q @ k.transpose(0, 1, 3, 2))
+    big, b = arr(3, 50, 200), arr(64, 200)
+    npt.assert_array_equal(np.array(cls(big)[:, 2:49:2, 5:69] @ cls(b)[:, ::3]), big[:, 2:49:2, 5:69] @ b[:, ::3])
+    c, row = arr(8, 4), arr(1, 130)  # stride 0 rows of B
+    npt.assert_array_equal(np.array(cls(c) @ cls(row).broadcast([4, 130])), c @ np.broadcast_to(row, (4, 130)))
+
+
+FOLDED_MATMUL_CASES = [
+    ((4, 33, 64), (64, 50), None),        # activations @ shared weights, batch folds into M
+    ((2, 3, 17, 64), (50, 64), (1, 0)),   # ... with W.T
+    ((33, 64), (64, 4, 50), (1, 0, 2)),   # a shared instead, per batch GEMMs
+    ((1, 64), (64, 4, 50), (1, 0, 2)),
+    ((33, 64), (4, 64, 50), None),
+]
+
+
+@pytest.mark.parametrize("a_shape, b_shape, b_axes", FOLDED_MATMUL_CASES)
+def test_matmul_broadcast_batch_folding(a_shape, b_shape, b_axes):
+    rng = np.random.default_rng(4)
+    a_np = rng.standard_normal(a_shape).astype(np.float32)
+    b_np = rng.standard_normal(b_shape).astype(np.float32)
+    b = be.NDArray(b_np)
+    if b_axes is not None:
+        b, b_np = b.transpose(list(b_axes)), b_np.transpose(b_axes)
+    npt.assert_allclose(np.array(be.NDArray(a_np) @ b), a_np @ b_np, rtol=1e-4, atol=1e-4)
+
+
+# Documented max errors of the SIMD float kernels, in ulp of the float32 result
+MATH_ULP_BOUNDS = {"exp": 1.5, "log": 1.0, "sin": 2.0, "cos": 2.0, "tanh": 1.5}
+
+def _ulp_error(got, ref64):
+    ref32 = ref64.astype(np.float32)
+    finite = np.isfinite(ref32) & np.isfinite(got)
+    err = np.abs(got[finite].astype(np.float64) - ref64[finite])
+    return err / np.spacing(np.abs(ref32[finite])).astype(np.float64), err
+
+@pytest.mark.parametrize("isa", be.available_isas())
+@pytest.mark.parametrize("fn", sorted(MATH_ULP_BOUNDS))
+def test_simd_math_accuracy_full_range(isa, fn):
+    # every 4099th float bit pattern, covering subnormals, infs and nans of both signs
+    x_np = np.arange(0, 2**32, 4099, dtype=np.uint64).astype(np.uint32).view(np.float32)
+    x = be.NDArray(x_np.tolist(), [x_np.size])
+
+    original = be.get_math_isa()
+    try:
+        be.set_math_isa(isa)
+        got = np.array(getattr(x, fn)())
+    finally:
+        be.set_math_isa(original)
+
+    with np.errstate(all="ignore"):
+        ref = getattr(np, fn)(x_np.astype(np.float64))
+    npt.assert_array_equal(np.isnan(got), np.isnan(ref.astype(np.float32)))
+    ulps, err = _ulp_error(got, ref)
+    if fn in ("sin", "cos"):
+        ulps = np.where(err < 1e-8, 0.0, ulps)  # absolute error near zeros of the result
+    assert ulps.max() <= MATH_ULP_BOUNDS[fn]
+
+@pytest.mark.parametrize("isa", be.available_isas())
+def test_simd_pow_accuracy(isa):
+    rng = np.random.default_rng(3)
+    base_np = np.exp(rng.uniform(-20, 20, 50000)).astype(np.float32)
+    base_np[::7] *= -1
+    exp_np = rng.uniform(-4, 4, 50000).astype(np.float32)
+    exp_np[::7] = np.round(exp_np[::7])  # negative bases need integer exponents
+    base = be.NDArray(base_np.tolist(), [base_np.size])
+    expo = be.NDArray(exp_np.tolist(), [exp_np.size])
+
+    original = be.get_math_isa()
+    try:
+        be.set_math_isa(isa)
+        got = np.array(base ** expo)
+        got_scalar = np.array(base ** 2.5)
+    finally:
+        be.set_math_isa(original)
+
+    with np.errstate(all="ignore"):
+        ref = np.power(base_np.astype(np.float64), exp_np.astype(np.float64))
+        ref_scalar = np.power(base_np.astype(np.float64), 2.5)
+    for g, r in [(got, ref), (got_scalar, ref_scalar)]:
+        npt.assert_array_equal(np.isnan(g), np.isnan(r.astype(np.float32)))
+        assert _ulp_error(g, r)[0].max() <= 1.0
+
+def test_set_math_isa_rejects_unknown():
+    with pytest.raises(ValueError):
+        be.set_math_isa("neon")
+
+
+def test_inplace_operators_write_through_view():
+    rng = np.random.default_rng(4)
+    a_np = rng.standard_normal((6, 8)).astype(np.float32)
+    b_np = rng.standard_normal((8,)).astype(np.float32)
+    a = be.NDArray(a_np.flatten().tolist(), [6, 8])
+    b = be.NDArray(b_np.tolist(), [8])
+    alias = a
+
+    a += b
+    a *= 2.0
+    a -= 1.0
+    a /= b
+    assert a is alias
+    npt.assert_allclose(np.array(a), ((a_np + b_np) * 2.0 - 1.0) / b_np, rtol=1e-5)
+
+    col = a[:, 2]  # view, in place ops modify the parent
+    col.exp_()
+    expected = ((a_np + b_np) * 2.0 - 1.0) / b_np
+    expected[:, 2] = np.exp(expected[:, 2])
+    npt.assert_allclose(np.array(a), expected, rtol=1e-5)
+
+    with pytest.raises(ValueError):
+        b += a  # result shape (6, 8) doesn't fit b
+
+def test_out_parameter_strided_and_aliased():
+    rng = np.random.default_rng(5)
+    x_np = rng.standard_normal((5, 7)).astype(np.float32)
+    x = be.NDArray(x_np.flatten().tolist(), [5, 7])
+
+    out = be.NDArray([0.0] * 35, [7, 5]).transpose([1, 0])
+    res = x.tanh(out=out)
+    assert res is out
+    npt.assert_allclose(np.array(out), np.tanh(x_np), rtol=1e-5, atol=1e-6)
+
+    be.multiply(x, x, out=out)
+    npt.assert_allclose(np.array(out), x_np * x_np, rtol=1e-6)
+
+    # overlapping input and output views of the same storage
+    v_np = np.arange(10, dtype=np.float32)
+    v = be.NDArray(v_np.tolist(), [10])
+    be.add(v[0:9], 1.0, out=v[1:10])
+    expected = v_np.copy()
+    expected[1:] = v_np[:-1] + 1.0
+    npt.assert_allclose(np.array(v), expected)
+
+    sq = be.NDArray(x_np[:, :5].flatten().tolist(), [5, 5])
+    be.add(sq, sq.transpose([1, 0]), out=sq)
+    npt.assert_allclose(np.array(sq), x_np[:, :5] + x_np[:, :5].T, rtol=1e-6)
+
+    # a broadcast output would have many elements write the same address
+    row = be.NDArray([0.0] * 7, [1, 7]).broadcast([5, 7])
+    with pytest.raises(ValueError):
+        x.tanh(out=row)
+    with pytest.raises(ValueError):
+        be.add(x, x, out=row)
+    with pytest.raises(ValueError):
+        row.exp_()
+
+def test_lazy_expression_matches_eager():
+    rng = np.random.default_rng(6)
+    a_np = rng.uniform(0.1, 2.0, (40, 30)).astype(np.float32)
+    b_np = rng.uniform(0.1, 2.0, (30, 40)).astype(np.float32).T
+    c_np = rng.uniform(0.1, 2.0, (30,)).astype(np.float32)
+    a = be.NDArray(a_np.flatten().tolist(), [40, 30])
+    b = be.NDArray(b_np.T.flatten().tolist(), [30, 40]).transpose([1, 0])
+    c = be.NDArray(c_np.tolist(), [30])
+
+    lazy = (a.lazy() * b + c).tanh() * 0.5
+    assert isinstance(lazy, be.LazyArray)
+    assert lazy.shape == [40, 30]
+    eager = (a * b + c).tanh() * 0.5
+    npt.assert_array_equal(np.array(lazy.eval()), np.array(eager))
+    npt.assert_allclose(np.array(lazy), np.tanh(a_np * b_np + c_np) * 0.5, rtol=1e-5, atol=1e-6)
+
+    # shared subexpressions, reversed scalars and pow
+    sq = a.lazy() * a
+    expr = 1.0 - (sq - b.exp()) / 2.0 + sq ** b
+    expected = 1.0 - (a_np * a_np - np.exp(b_np)) / 2.0 + (a_np * a_np) ** b_np
+    npt.assert_allclose(np.array(expr), expected, rtol=1e-4)
+
+    # reductions and matmul evaluate first
+    npt.assert_allclose(np.array(lazy.sum([1])), np.array(eager.sum([1])), rtol=1e-5)
+    bt = b.transpose([1, 0])
+    npt.assert_allclose(np.array(lazy @ bt), np.array(eager @ bt), rtol=1e-4)
+
+    # eval into an existing view, including the view the expression reads
+    out = be.NDArray([0.0] * 1200, [30, 40]).transpose([1, 0])
+    assert lazy.eval(out=out) is out
+    npt.assert_array_equal(np.array(out), np.array(eager))
+    (a.lazy() * 2.0 + a.sqrt()).eval(out=a)
+    npt.assert_allclose(np.array(a), a_np * 2.0 + np.sqrt(a_np), rtol=1e-6)
+
+    with pytest.raises(ValueError):
+        a.lazy() + be.NDArray([1.0] * 7, [7])
+
+@pytest.mark.parametrize("density", [0.0, 0.05, 0.5])
+def test_sparse_matches_dense(density):
+    rng = np.random.default_rng(7)
+    a_np = rng.standard_normal((50, 40)).astype(np.float32)
+    a_np[rng.random((50, 40)) >= density] = 0
+    b_np = rng.standard_normal((40, 24)).astype(np.float32)
+    a = be.NDArray(a_np)
+
+    s = be.SparseNDArray.from_dense(a)
+    assert s.format == "csr" and s.shape == [50, 40] and s.nnz == np.count_nonzero(a_np)
+    npt.assert_array_equal(np.array(s.to_dense()), a_np)
+    coo = be.SparseNDArray.from_dense(a, format="coo")
+    npt.assert_array_equal(np.array(coo.row), np.nonzero(a_np)[0])
+    npt.assert_array_equal(np.array(coo.to_csr().indptr), np.array(s.indptr))
+
+    npt.assert_allclose(np.array(s @ be.NDArray(b_np)), a_np @ b_np, rtol=1e-4, atol=1e-5)
+    npt.assert_allclose(np.array(be.spmm(coo, be.NDArray(b_np.T.copy()).transpose([1, 0]))), a_np @ b_np,
+                        rtol=1e-4, atol=1e-5)
+    npt.assert_allclose(np.array(s.sum(axis=1)), a_np.sum(axis=1), rtol=1e-5, atol=1e-6)
+    npt.assert_allclose(np.array(s.sum(axis=0)), a_np.sum(axis=0), rtol=1e-5, atol=1e-6)
+
+    d_np = rng.standard_normal((50, 40)).astype(np.float32)
+    npt.assert_array_equal(np.array((s * be.NDArray(d_np)).to_dense()), a_np * d_np)
+    row_np = d_np[0].copy()
+    npt.assert_array_equal(np.array(s.multiply(be.NDArray(row_np))), a_np * row_np)
+
+def test_sparse_from_indices():
+    idx = lambda v: be.NDArrayInt64(np.array(v, dtype=np.int64))
+    vals = lambda v: be.NDArray(np.array(v, dtype=np.float32))
+    # coo duplicates add up, to_csr sorts them by row and column
+    coo = be.SparseNDArray.coo([3, 4], idx([2, 0, 2, 0, 2]), idx([1, 3, 1, 0, 0]), vals([1, 2, 3, 4, 5]))
+    expected = np.array([[4, 0, 0, 2], [0, 0, 0, 0], [5, 4, 0, 0]], dtype=np.float32)
+    npt.assert_array_equal(np.array(coo), expected)
+    csr = coo.to_csr()
+    assert csr.nnz == 4
+    npt.assert_array_equal(np.array(csr.indptr), [0, 2, 2, 4])
+    npt.assert_array_equal(np.array(csr.indices), [0, 3, 0, 1])
+    npt.assert_array_equal(np.array(csr.values), [4, 2, 5, 4])
+
+    csr = be.SparseNDArray.csr([2, 3], idx([0, 1, 2]), idx([2, 0]), vals([1, 2]))
+    npt.assert_array_equal(np.array(csr), [[0, 0, 1], [2, 0, 0]])
+    with pytest.raises(ValueError):
+        be.SparseNDArray.csr([2, 3], idx([0, 2, 2]), idx([2, 1]), vals([1, 2]))
+    with pytest.raises(ValueError):
+        be.SparseNDArray.csr([2, 3], idx([0, 1000, 2]), idx([2, 0]), vals([1, 2]))
+    with pytest.raises(ValueError):
+        be.SparseNDArray.coo([2, 3], idx([2]), idx([0]), vals([1]))
+    with pytest.raises(ValueError):
+        be.SparseNDArray.from_dense(be.NDArray(np.ones((2, 3, 4), dtype=np.float32)))
+    with pytest.raises(ValueError):
+        csr @ be.NDArray(np.ones((2, 5), dtype=np.float32))